@@ -6,11 +6,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #define MAX_TOKENS 1024
-#define MAX_ARGS 6
+#define MAX_ARGS 64
+#define MAX_REG_ARGS 6 // passed in registers, the rest go on the stack
 #define MAX_VARS 64
-#define MAX_STRING_LITERALS 64
+#define MAX_COLD_BLOCKS 64
+#define MAX_FORMAT_PARTS 32
+#define CSE_MAX_VALUES 1024
+#define MAX_UNROLL_FACTOR 32
+#define REGION_CHUNK_SIZE (65536 - 16) // bytes of data per chunk, so chunks take 64k with their header
+#define REGION_MAX_BITS 48 // regionalloc fails for sizes that take more bits, nothing that big can be allocated
 
 typedef int8_t  s8;
 typedef int16_t s16;
@@ -22,7 +30,7 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
-typedef u32 stack_loc;
+typedef u32 stack_loc; // offset below rbp in bytes
 
 typedef enum {
 	TOKEN_NONE,
@@ -44,32 +52,157 @@ typedef enum {
 	TOKEN_OPEN_BRACE,
 	TOKEN_CLOSE_BRACE,
 	TOKEN_SEMICOLON,
-	TOKEN_KEYWORD_VAR,
+	TOKEN_KEYWORD_TYPE,
 	TOKEN_KEYWORD_FUNC,
 	TOKEN_KEYWORD_IF,
 	TOKEN_KEYWORD_RETURN,
 	TOKEN_KEYWORD_WHILE,
+	TOKEN_KEYWORD_EXTERN,
+	TOKEN_KEYWORD_SWITCH,
+	TOKEN_KEYWORD_CASE,
+	TOKEN_KEYWORD_DEFAULT,
+	TOKEN_KEYWORD_PARALLEL,
+	TOKEN_KEYWORD_YIELD,
 	TOKEN_ASSIGN,
 	TOKEN_COMMA,
+	TOKEN_OPEN_BRACKET,
+	TOKEN_CLOSE_BRACKET,
+	TOKEN_AMPERSAND,
 	TOKEN_EOF,
 } Token_Type;
 
+// symbols with fixed ids, interned before anything else, see intern.c
+typedef enum {
+	SYM_NONE,
+	SYM_INT,
+	SYM_I8,
+	SYM_I16,
+	SYM_I32,
+	SYM_I64,
+	SYM_U8,
+	SYM_U16,
+	SYM_U32,
+	SYM_U64,
+	SYM_FUNC,
+	SYM_IF,
+	SYM_RETURN,
+	SYM_WHILE,
+	SYM_EXTERN,
+	SYM_SWITCH,
+	SYM_CASE,
+	SYM_DEFAULT,
+	SYM_PARALLEL,
+	SYM_YIELD,
+	SYM_MAIN,
+	SYM_ALLOC,
+	// builtins emitted inline, the ones up to SYM_ROTR only compute a value
+	SYM_MIN,
+	SYM_MAX,
+	SYM_ABS,
+	SYM_POPCNT,
+	SYM_LZCNT,
+	SYM_TZCNT,
+	SYM_BSWAP,
+	SYM_ROTL,
+	SYM_ROTR,
+	SYM_RDTSC,
+	SYM_PREFETCH,
+	SYM_PAUSE,
+	SYM_ATOMICLOAD,
+	SYM_ATOMICSTORE,
+	SYM_ATOMICADD,
+	SYM_ATOMICXCHG,
+	SYM_ATOMICCAS,
+	SYM_FENCE,
+	SYM_REGION,
+	SYM_REGIONALLOC,
+	SYM_REGIONRESET,
+	SYM_REGIONFREE,
+	SYM_NEXT,
+	// memory orders, the last argument of the atomic builtins
+	SYM_RELAXED,
+	SYM_ACQUIRE,
+	SYM_RELEASE,
+	SYM_ACQREL,
+	SYM_SEQCST,
+	NUM_BUILTIN_SYMBOLS,
+} Builtin_Symbol;
+
+typedef struct {
+	char* str; // null-terminated copy
+	u32 len;
+	u64 hash; // FNV-1a of the text
+} Symbol;
+
+typedef struct {
+	Symbol** symbols; // indexed by id
+	u32 num_symbols;
+	u32 symbols_capacity;
+
+	u32* slots; // ids by hash, open addressing, SYM_NONE if empty
+	u32 capacity;
+} Intern_Table;
+
 typedef struct {
 	Token_Type type;
 	const char* str; // not null-terminated!
 	u32 len;
+	u32 line; // starting at 1
+	u32 column;
+	u32 symbol; // interned text of identifiers and string literals, SYM_NONE for other tokens
 } Token;
 
+#define TOKEN_BATCH_SIZE 256
+#define PARSE_WINDOW 4
+
+typedef struct {
+	Token tokens[TOKEN_BATCH_SIZE];
+	u32 count;
+} Token_Batch;
+
+// bounded queue between two threads, push blocks while it's full and pop while it's empty
+typedef struct {
+	u8* items;
+	u32 item_size;
+	u32 capacity;
+	u32 head;
+	u32 count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} Queue;
+
 typedef struct {
 	char* program;
 
 	// todo: dynalloc
 	Token* tokens;
-	u32 num_tokens;
+	u32 num_tokens; // with --stream, the number of tokens taken from the queue so far
 
 	u32 pos;
+
+	// with --stream tokens come from the lexer thread in batches, only the last few are kept for lookahead
+	Queue* token_queue;
+	Token_Batch batch;
+	u32 batch_pos;
+	Token window[PARSE_WINDOW];
+	bool stream_done;
+
+	bool yielded; // the function being parsed has a yield, which makes it a generator
 } Parse_State;
 
+typedef struct Arena_Chunk {
+	struct Arena_Chunk* next;
+	u32 used;
+	u32 size;
+} Arena_Chunk;
+
+// memory for AST nodes, freed all at once
+typedef struct {
+	Arena_Chunk* chunks; // the one being filled first
+} Arena;
+
 typedef enum {
 	OP_ADD,
 	OP_SUB,
@@ -83,6 +216,15 @@ typedef enum {
 	OP_LESS_THAN_EQUAL,
 } Binary_Operation;
 
+// in the order of their names in Builtin_Symbol
+typedef enum {
+	ORDER_RELAXED,
+	ORDER_ACQUIRE,
+	ORDER_RELEASE,
+	ORDER_ACQ_REL,
+	ORDER_SEQ_CST,
+} Memory_Order;
+
 typedef enum {
 	AST_PROGRAM,
 	AST_INT_LITERAL,
@@ -97,14 +239,46 @@ typedef enum {
 	AST_IF,
 	AST_WHILE,
 	AST_RETURN,
+	AST_INDEX,
+	AST_DEREF,
+	AST_ADDR_OF,
+	AST_STORE,
+	AST_SWITCH,
+	AST_PARALLEL,
+	AST_YIELD,
 } AST_Type;
 
+typedef enum {
+	TYPE_VOID, // only used behind pointers
+	TYPE_I8,
+	TYPE_I16,
+	TYPE_I32,
+	TYPE_I64,
+	TYPE_U8,
+	TYPE_U16,
+	TYPE_U32,
+	TYPE_U64,
+} Base_Type;
+
+typedef struct {
+	Base_Type base;
+	u32 pointers; // levels of indirection, u8** has 2
+} Data_Type;
+
+// every node starts with these three fields.
+// data_type is filled in by the semantic pass, it is the type of the value of an expression,
+// the type of the declared variable for AST_VAR_DECL and void for other statements.
+// line is the source line the node starts on, 0 for nodes made up by the compiler.
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 } AST_Node;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	AST_Node** defs;
 	u32 defs_capacity;
 	u32 num_defs;
@@ -112,16 +286,22 @@ typedef struct {
 
 typedef struct {
 	AST_Type type;
-	u32 value;
+	Data_Type data_type;
+	u32 line;
+	u64 value;
 } AST_Number;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	Token token;
 } AST_String;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	Binary_Operation op;
 	AST_Node* left;
 	AST_Node* right;
@@ -129,6 +309,8 @@ typedef struct {
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	AST_Node** statements;
 	u32 statements_capacity;
 	u32 num_statements;
@@ -136,70 +318,612 @@ typedef struct {
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	Token name;
 	AST_Node* assign;
+	u32 array_length; // 0 if not an array, arrays are typed as a pointer to their first element
+	bool address_taken; // set by sema
+
+	stack_loc location; // set by the emitter
 } AST_Var_Decl;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	Token name;
+	AST_Var_Decl* decl; // resolved by the semantic pass
 } AST_Var;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	Token lhs;
 	AST_Node* rhs;
+	AST_Var_Decl* decl; // resolved by the semantic pass
 } AST_Assign;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	Token name;
-	Token args[MAX_ARGS];
+	AST_Var_Decl** args;
 	u32 num_args;
-	AST_Node* body;
+	Data_Type return_type;
+	AST_Node* body; // NULL for extern declarations
+
+	bool is_pure; // set by fold_constants, only integer locals and calls to other pure functions
+	bool is_generator; // the body yields, calls return a handle to its frame, see emit_generator_decl
+	u32 profile_id; // entry counter
 } AST_Func_Decl;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	Token name;
-	AST_Node* args[MAX_ARGS];
+	AST_Node** args;
 	u32 num_args;
+	AST_Func_Decl* decl; // resolved by the semantic pass, NULL for builtins and external functions
+	Memory_Order order; // of the atomic builtins, set by the semantic pass
+
+	u32 profile_id; // call edge counter, only for calls with a decl
+	bool inline_call; // set from the profile
 } AST_Func_Call;
 
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	AST_Node* condition;
 	AST_Node* body;
+
+	u32 profile_id; // counter for reaching the statement, the one after it counts executions of the body
+
+	// while loops, see unroll.c
+	u32 unroll; // body copies per iteration of the unrolled loop, 0 if it isn't unrolled
+	bool unroll_full; // the loop is replaced by unroll copies of its body
 } AST_Conditional;
 
+// return and yield, the expr of a return is NULL in generators
 typedef struct {
 	AST_Type type;
+	Data_Type data_type;
+	u32 line;
 	AST_Node* expr;
 } AST_Return;
 
+// base[index]
 typedef struct {
-	Token token;
-	stack_loc location;
-} Variable;
+	AST_Type type;
+	Data_Type data_type;
+	u32 line;
+	AST_Node* base;
+	AST_Node* index;
+} AST_Index;
+
+// used for both *expr and &expr
+typedef struct {
+	AST_Type type;
+	Data_Type data_type;
+	u32 line;
+	AST_Node* expr;
+} AST_Unary;
+
+// assignment through a pointer, target is an AST_INDEX or AST_DEREF
+typedef struct {
+	AST_Type type;
+	Data_Type data_type;
+	u32 line;
+	AST_Node* target;
+	AST_Node* rhs;
+} AST_Store;
+
+typedef struct {
+	u64 value; // normalized to the type of the switch value by the semantic pass
+	u32 body; // index into bodies
+} Switch_Case;
+
+// switch (value) { case 1, 2 { ... } default { ... } }, there is no falling through to the next case
+typedef struct {
+	AST_Type type;
+	Data_Type data_type;
+	u32 line;
+	AST_Node* value;
+	Switch_Case* cases; // sorted by value by the semantic pass
+	u32 num_cases;
+	u32 cases_capacity;
+	AST_Node** bodies;
+	u32 num_bodies;
+	u32 bodies_capacity;
+	AST_Node* default_body; // NULL if there is none
+} AST_Switch;
+
+// parallel (int i = first; i < end; chunk) { ... }, the iterations are spread over threads, see runtime.c
+typedef struct {
+	AST_Type type;
+	Data_Type data_type;
+	u32 line;
+	AST_Var_Decl* index; // assign is the first index
+	AST_Node* end;
+	AST_Node* chunk; // iterations handed out at a time, NULL to let the runtime pick
+	AST_Node* body;
+} AST_Parallel;
+
+#define FLAT_NONE UINT32_MAX
+
+// the final AST in pre-order, as parallel arrays indexed by node, see flat.c
+typedef struct {
+	u32 num_nodes;
+	u32 capacity;
+
+	AST_Type* kinds;
+	Data_Type* data_types;
+	u32* lines;
+	u32* depths;
+	u32* ends; // one past the last node of the subtree
+	u32* operands;
+	u32* extras;
+	AST_Node** nodes; // the node an entry was made from
+
+	// side tables for operands
+	u64* values;
+	u32 num_values;
+	u32 values_capacity;
+	Token* tokens;
+	u32 num_tokens;
+	u32 tokens_capacity;
+} Flat_AST;
+
+typedef struct {
+	// functions by the symbol of their name
+	AST_Func_Decl** funcs;
+	u32 funcs_capacity;
+
+	AST_Func_Decl* func;
+
+	// variables in scope, innermost last
+	AST_Var_Decl* vars[MAX_VARS];
+	u32 num_vars;
+	u32 scope_start;
+
+	// in the body of a parallel loop, the first shared_vars variables are read-only
+	bool in_parallel;
+	u32 shared_vars;
+} Sema_State;
+
+typedef struct {
+	u32 steps_left; // budget for the current compile-time evaluation
+	u32 depth;
+} Fold_State;
+
+// bytecode of the interpreter, see vm.c
+typedef enum {
+	VM_LOADI,
+	VM_MOV,
+	VM_ADD,
+	VM_SUB,
+	VM_MUL,
+	VM_DIVS,
+	VM_DIVU,
+	VM_MINS,
+	VM_MINU,
+	VM_MAXS,
+	VM_MAXU,
+	VM_ABS,
+	VM_POPCNT, // imm: the width of the operand in bits, for the bit builtins
+	VM_LZCNT,
+	VM_TZCNT,
+	VM_BSWAP,
+	VM_ROTL,
+	VM_ROTR,
+	VM_RDTSC,
+	VM_ADDI,
+	VM_SEXT8,
+	VM_SEXT16,
+	VM_SEXT32,
+	VM_ZEXT8,
+	VM_ZEXT16,
+	VM_ZEXT32,
+	VM_EQ,
+	VM_NE,
+	VM_LTS,
+	VM_LES,
+	VM_GTS,
+	VM_GES,
+	VM_LTU,
+	VM_LEU,
+	VM_GTU,
+	VM_GEU,
+	VM_JMP,
+	VM_JZ,
+	VM_JNZ,
+	VM_JEQ,
+	VM_JNE,
+	VM_JLTS,
+	VM_JLES,
+	VM_JGTS,
+	VM_JGES,
+	VM_JLTU,
+	VM_JLEU,
+	VM_JGTU,
+	VM_JGEU,
+	VM_LOAD8S,
+	VM_LOAD8U,
+	VM_LOAD16S,
+	VM_LOAD16U,
+	VM_LOAD32S,
+	VM_LOAD32U,
+	VM_LOAD64,
+	VM_STORE8,
+	VM_STORE16,
+	VM_STORE32,
+	VM_STORE64,
+	VM_LEA,
+	VM_PTRDIFF,
+	VM_FRAME,
+	VM_CALL,
+	VM_PRINTF,
+	VM_ALLOC,
+	VM_FREE,
+	VM_REGION,
+	VM_REGION_ALLOC,
+	VM_REGION_RESET,
+	VM_REGION_FREE,
+	VM_GEN_NEW,
+	VM_GEN_NEXT,
+	VM_YIELD,
+	VM_GEN_DONE,
+	VM_EXIT,
+	VM_RET,
+	NUM_VM_OPS,
+} VM_Op;
+
+typedef struct {
+	const void* handler; // where the interpreter jumps to run it, filled in before the first run
+	u16 op;
+	u16 a, b, c; // registers
+	u64 imm;
+} VM_Instr;
+
+typedef struct {
+	AST_Func_Decl* decl;
+	VM_Instr* code;
+	u32 num_code;
+	u32 code_capacity;
+	u32 num_regs;
+	u32 frame_size; // bytes for arrays and variables whose address is taken
+
+	// counted with --interpret-profile
+	u64 calls;
+	u64 instructions;
+	u64 nanoseconds; // not counting the functions it calls
+} VM_Func;
+
+typedef struct {
+	AST_Var_Decl* decl;
+	bool in_memory; // at offset in the frame memory, otherwise in reg
+	u32 reg;
+	u32 offset;
+} VM_Var;
 
 typedef struct {
-	Variable vars[MAX_VARS];
+	VM_Func* funcs; // one per function definition
+	u32 num_funcs;
+
+	// function being compiled
+	VM_Func* func;
+	VM_Var* vars; // in scope, innermost last
 	u32 num_vars;
+	u32 vars_capacity;
+	AST_Var_Decl** address_taken;
+	u32 num_address_taken;
+	u32 address_taken_capacity;
+	u32 next_reg; // temporaries are allocated above the variables in scope
+	u32 frame_reg; // holds the address of the frame memory
+
+	// string literals as c strings, by symbol
+	char** strings;
+	u32 strings_capacity;
+
+	u32 printf_symbol;
+	u32 exit_symbol;
+	u32 free_symbol;
+
+	u64 op_counts[NUM_VM_OPS];
+} VM_State;
+
+typedef struct {
+	u64 key; // 0 if the slot is empty
+	char* text;
+	u32 length;
+} Cache_Entry;
+
+// emitted code of single functions, see cache.c
+typedef struct {
+	Cache_Entry* entries; // open addressing, NULL unless running as a compile server
+	u32 capacity;
+	u32 count;
+
+	int pipe_fd; // where a child compiling a request sends new entries to, -1 otherwise
+} Output_Cache;
+
+typedef struct {
+	u64 source_hash;
+	u32 num_counters;
+
+	u64* counts; // NULL unless a profile was loaded
+	u64 max_count;
+} Profile_State;
+
+// variables are packed at the top of the frame (growing down from rbp),
+// 8 byte temporaries at the bottom (growing up from rsp)
+typedef struct {
 	stack_loc alloc;
+	stack_loc temp_alloc;
+	u32 frame_size;
 } Local_Context;
 
+// an expression whose value is still held in a temporary, see cse.c
+typedef struct {
+	AST_Node* expr;
+	u64 hash;
+	stack_loc location;
+	bool reads_memory;
+	bool killed; // something it reads was written since
+} CSE_Value;
+
+typedef struct {
+	CSE_Value values[CSE_MAX_VALUES]; // innermost scope last
+	u32 num_values;
+	u32 floor; // the values below are from another frame, see cse_enter_frame
+} CSE_State;
+
+// if body moved behind the end of the function
+typedef struct {
+	AST_Node* body;
+	u32 label;
+	u32 return_label;
+	u32 profile_id;
+} Cold_Block;
+
+// a piece of a printf format, see emit_printf
+typedef enum {
+	FORMAT_TEXT,
+	FORMAT_SIGNED,
+	FORMAT_UNSIGNED,
+	FORMAT_HEX,
+	FORMAT_CHAR,
+	FORMAT_STRING,
+} Format_Kind;
+
+typedef struct {
+	Format_Kind kind;
+	u32 offset; // of the text in the format string
+	u32 length;
+	bool wide; // 64 bit value, l or ll
+} Format_Part;
+
+// optimizations counted per function by --stats, see stats.c
+typedef enum {
+	STAT_VECTORIZED,
+	STAT_UNROLLED,
+	STAT_UNROLLED_FULLY,
+	STAT_ROTATED,
+	STAT_IF_CONVERTED,
+	STAT_COLD_BLOCK,
+	STAT_CSE_REUSE,
+	STAT_INLINED,
+	STAT_PRINTF,
+	STAT_JUMP_TABLE,
+	STAT_BIT_TEST,
+	NUM_STATS,
+} Stat_Kind;
+
+typedef enum {
+	INSTR_LOAD,
+	INSTR_STORE,
+	INSTR_ARITHMETIC,
+	INSTR_BRANCH,
+	INSTR_CALL,
+	INSTR_OTHER,
+	NUM_INSTR_CLASSES,
+} Instr_Class;
+
+typedef struct {
+	const char* name; // in the source, the function itself is gone by the end with --stream
+	u32 name_length;
+	u32 frame_size; // bytes below rbp, the upper bound from get_required_stack_size
+	u32 var_bytes; // used by variables and arguments
+	u32 temps; // 8 byte temporaries used
+	u32 labels;
+	u32 instructions[NUM_INSTR_CLASSES];
+	u32 counts[NUM_STATS];
+} Func_Stats;
+
+typedef struct {
+	Func_Stats* funcs;
+	u32 num_funcs;
+	u32 capacity;
+	u32 counts[NUM_STATS]; // of the function being emitted
+} Stats_State;
+
 typedef struct {
 	FILE* file;
+	const Flat_AST* flat;
 	Local_Context context;
 	u32 label;
+	AST_Func_Decl* current_func;
+
+	Cold_Block cold_blocks[MAX_COLD_BLOCKS];
+	u32 num_cold_blocks;
+
+	// set while emitting the body of an inlined call, returns store to inline_result and jump to the exit label
+	AST_Func_Decl* inline_func;
+	stack_loc inline_result;
+	u32 inline_exit_label;
 
-	Token string_literals[MAX_STRING_LITERALS];
-	u32 num_string_literals;
+	// string literals used in the file, by symbol
+	u32* strings;
+	u32 num_strings;
+	u32 strings_capacity;
+	bool* string_seen;
+	u32 string_seen_capacity;
+
+	// bodies of the current function's parallel loops, written out behind it
+	FILE* tasks;
+	char* tasks_text;
+	size_t tasks_length;
+	u32 num_tasks;
+	bool uses_parallel; // the file needs the runtime for parallel loops
+
+	u32 printf_symbol;
+	bool uses_format; // the file has printf calls specialized to their format
+	bool uses_regions;
+	bool uses_generators;
+
+	bool has_runtime;
+	const char* source_path;
+	u32 line; // last source line given to nasm
 } Emit_State;
 
+typedef enum {
+	IF_CONVERT_AUTO, // when the body is cheap and the profile (if any) doesn't say the branch is predictable
+	IF_CONVERT_ALWAYS,
+	IF_CONVERT_NEVER,
+} If_Convert_Mode;
+
+typedef enum {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON,
+} Stats_Format;
+
+typedef enum {
+	ARCH_SSE2,
+	ARCH_AVX2,
+} Target_Arch;
+
+typedef struct {
+	Target_Arch arch;
+	bool vectorize;
+	If_Convert_Mode if_convert; // turn ifs that only assign a variable into cmov
+	bool cse; // reuse the values of identical expressions, see cse.c
+	bool specialize_printf; // format literal printf formats at compile time, see emit_printf
+	u32 unroll_factor; // body copies per iteration of partially unrolled loops, 0 to not unroll at all
+	bool const_eval;
+	u32 const_eval_steps; // max nodes evaluated per call folded at compile time
+
+	bool debug_info;
+	bool static_runtime; // link without libc, using the runtime from runtime.c
+
+	bool instrument;
+	const char* instrument_path; // where the instrumented program writes its profile
+	const char* profile_use; // NULL if not optimizing with a profile
+
+	const char* output_path; // NULL for the default, output.asm or one file per source file
+	bool stream; // compile one function at a time, see stream.c
+	bool watch; // compile again whenever a source file changes, see watch.c
+	bool interpret; // run the program in the bytecode interpreter instead, see vm.c
+	bool interpret_profile; // print instruction counts and times when it's done
+	Stats_Format stats; // report what the code of every function looks like, see stats.c
+} Options;
+
+extern Options options;
+extern Emit_State emitter;
+
 void error();
+typedef void (*Token_Sink)(Token* token, void* data);
 void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens);
+void lex_into(const char* input, u32 input_length, Token_Sink add, void* data);
 AST_Node* parse(char* program, Token* tokens, u32 num_tokens);
-void emit(AST_Node* root, const char* path);
-void print_node(AST_Node* node, int depth);
-bool compare_token(Token* token, const char* str);
+void* ast_alloc(u32 size);
+void set_ast_arena(Arena* arena);
+void free_arena(Arena* arena);
+void begin_stream_parse(Queue* token_queue);
+AST_Func_Decl* parse_next_func();
+void emit(const Flat_AST* flat, const char* source_path, const char* path);
+void emit_begin(const char* source_path, const char* path, bool has_runtime);
+void emit_flat(const Flat_AST* flat);
+void emit_end();
+void flatten(AST_Node* root, Flat_AST* flat);
+void free_flat(Flat_AST* flat);
+u32 flat_find_def(const Flat_AST* flat, AST_Node* def);
+void print_flat(const Flat_AST* flat);
+u32 intern(const char* str, u32 len);
+const Symbol* get_symbol(u32 id);
+u32 num_symbols();
+
+void analyze(AST_Node* root);
+void reset_analysis();
+void declare_func(AST_Func_Decl* func);
+void analyze_func(AST_Func_Decl* func);
+void fold_constants(AST_Node* root);
+void prepare_profile(AST_Node* root, const char* source, u32 source_length);
+bool profile_branch_is_cold(AST_Conditional* if_stmt);
+bool profile_branch_is_predictable(AST_Conditional* if_stmt);
+bool profile_loop_is_hot(AST_Conditional* while_stmt);
+bool profile_loop_is_short(AST_Conditional* while_stmt);
+void emit_profile_counter(u32 id);
+void emit_profile_setup();
+void emit_profile_runtime();
+void emit_static_runtime();
+void emit_parallel_runtime();
+void emit_format_runtime();
+void emit_region_runtime();
+void emit_generator_runtime();
+void stats_count(Stat_Kind kind);
+void stats_add_func(AST_Func_Decl* func, const char* text, u32 length);
+void print_stats(const char* source_path);
+
+void queue_init(Queue* queue, u32 item_size, u32 capacity);
+void queue_free(Queue* queue);
+void queue_push(Queue* queue, const void* item);
+void queue_pop(Queue* queue, void* item);
+void compile_stream(const char* source_path, const char* output_path);
+int interpret(AST_Node* root);
+
+int compile(int argc, char* argv[]);
+void compile_file(const char* source_path, const char* output_path);
+int watch(const char** source_paths, const char** output_paths, u32 num_sources);
+int run_server(const char* socket_path);
+int run_client(const char* socket_path, int argc, char* argv[]);
+void cache_init();
+bool cache_enabled();
+u64 hash_function(AST_Func_Decl* func);
+const Cache_Entry* cache_lookup(u64 key);
+void cache_add(u64 key, const char* text, u32 length);
+void cache_set_pipe(int fd);
+void cache_send(u64 key, const char* text, u32 length);
+u32 cache_receive(const char* data, u32 length);
+u32 type_size(Data_Type type);
+u32 element_size(Data_Type pointer_type);
+bool type_is_signed(Data_Type type);
+bool type_is_pointer(Data_Type type);
+bool is_builtin(AST_Func_Call* call);
+bool is_pure_builtin(AST_Func_Call* call);
+u64 normalize_value(u64 value, Data_Type type);
+Data_Type arithmetic_type(Data_Type a, Data_Type b);
+void print_type(Data_Type type);
+
+stack_loc emit_node(AST_Node* node);
+void emit_load(const char* reg, Data_Type type, const char* address_format, ...);
+void emit_store_value(const char* reg, Data_Type type, const char* address_format, ...);
+bool emit_vectorized_while(AST_Conditional* while_stmt);
+void plan_unrolling(AST_Node* root);
+bool emit_unrolled_while(AST_Conditional* while_stmt, bool* needs_loop);
+
+void cse_reset();
+u32 cse_enter();
+void cse_leave(u32 mark);
+u32 cse_enter_frame();
+void cse_leave_frame(u32 floor);
+stack_loc cse_find(AST_Node* node);
+stack_loc cse_add(AST_Node* node, stack_loc location);
+void cse_kill_var(AST_Var_Decl* decl);
+void cse_kill_memory();
+void cse_kill_call(AST_Func_Call* call);
+void cse_kill_writes(AST_Node* node);
@@ -0,0 +1,344 @@
+#include "all.h"
+
+#include <unistd.h>
+
+// Per function output cache, used by the compile server.
+//
+// The key is a hash of everything the emitted code of a function depends on: its AST after the semantic pass
+// and folding, inlined callees, profile decisions and the options affecting code generation. Labels are local to
+// each function and string literals are labelled by their text, so cached text can be pasted into any output file
+// as is.
+//
+// The server process owns the cache. Requests are compiled in forked children which see the cache as it was
+// when they started, and send the functions they emitted back to the server through a pipe.
+
+#define CACHE_CAPACITY 4096
+
+static Output_Cache cache = {
+	.pipe_fd = -1,
+};
+
+typedef struct {
+	u64 hash;
+
+	// variables are identified by the order they're declared in, that's what decides their stack location
+	AST_Var_Decl** decls;
+	u32 num_decls;
+	u32 decls_capacity;
+} Hash_State;
+
+static void hash_bytes(Hash_State* state, const void* data, u32 length) {
+	// FNV-1a
+	const u8* bytes = data;
+	for (u32 i = 0; i < length; i++) {
+		state->hash ^= bytes[i];
+		state->hash *= 0x100000001b3;
+	}
+}
+
+static void hash_u64(Hash_State* state, u64 value) {
+	hash_bytes(state, &value, sizeof(value));
+}
+
+static void hash_token(Hash_State* state, Token token) {
+	hash_u64(state, token.len);
+	hash_bytes(state, token.str, token.len);
+}
+
+static void hash_type(Hash_State* state, Data_Type type) {
+	hash_u64(state, type.base);
+	hash_u64(state, type.pointers);
+}
+
+static void hash_decl_ref(Hash_State* state, AST_Var_Decl* decl) {
+	for (u32 i = 0; i < state->num_decls; i++) {
+		if (state->decls[i] == decl) {
+			hash_u64(state, i);
+			return;
+		}
+	}
+
+	// declared outside this function, can't happen after the semantic pass
+	hash_u64(state, UINT64_MAX);
+}
+
+static void add_decl(Hash_State* state, AST_Var_Decl* decl) {
+	if (state->num_decls >= state->decls_capacity) {
+		state->decls_capacity = state->decls_capacity == 0 ? 32 : state->decls_capacity * 2;
+		state->decls = realloc(state->decls, state->decls_capacity * sizeof(AST_Var_Decl*));
+	}
+	state->decls[state->num_decls++] = decl;
+}
+
+static void hash_node(Hash_State* state, AST_Node* node) {
+	if (node == NULL) {
+		hash_u64(state, UINT64_MAX);
+		return;
+	}
+
+	hash_u64(state, node->type);
+	hash_type(state, node->data_type);
+	if (options.debug_info) {
+		hash_u64(state, node->line);
+	}
+
+	switch (node->type) {
+		case AST_INT_LITERAL:
+			hash_u64(state, ((AST_Number*) node)->value);
+			break;
+		case AST_STR_LITERAL:
+			hash_token(state, ((AST_String*) node)->token);
+			break;
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			hash_u64(state, op->op);
+			hash_node(state, op->left);
+			hash_node(state, op->right);
+			break;
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			hash_u64(state, block->num_statements);
+			for (u32 i = 0; i < block->num_statements; i++) {
+				hash_node(state, block->statements[i]);
+			}
+			break;
+		}
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+			add_decl(state, decl);
+			hash_u64(state, decl->array_length);
+			hash_node(state, decl->assign);
+			break;
+		}
+		case AST_VAR:
+			hash_decl_ref(state, ((AST_Var*) node)->decl);
+			break;
+		case AST_ASSIGN: {
+			AST_Assign* assign = (AST_Assign*) node;
+			hash_decl_ref(state, assign->decl);
+			hash_node(state, assign->rhs);
+			break;
+		}
+		case AST_FUNC_DECL: {
+			AST_Func_Decl* func = (AST_Func_Decl*) node;
+			hash_token(state, func->name);
+			hash_type(state, func->return_type);
+			hash_u64(state, func->num_args);
+			for (u32 i = 0; i < func->num_args; i++) {
+				add_decl(state, func->args[i]);
+				hash_type(state, func->args[i]->data_type);
+			}
+			if (options.instrument) {
+				hash_u64(state, func->profile_id);
+			}
+			hash_node(state, func->body);
+			break;
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			hash_token(state, call->name);
+			hash_u64(state, call->num_args);
+			for (u32 i = 0; i < call->num_args; i++) {
+				hash_node(state, call->args[i]);
+			}
+			hash_u64(state, call->order);
+
+			// what the code around the call relies on about the callee, cse keeps values across pure calls
+			hash_u64(state, call->decl != NULL);
+			if (call->decl != NULL) {
+				hash_u64(state, call->decl->body != NULL);
+				hash_u64(state, call->decl->is_pure);
+				hash_u64(state, call->decl->is_generator);
+			}
+			if (call->decl != NULL && options.instrument) {
+				hash_u64(state, call->profile_id);
+			}
+
+			// the callee's body ends up in this function
+			hash_u64(state, call->inline_call);
+			if (call->inline_call) {
+				hash_node(state, (AST_Node*) call->decl);
+			}
+			break;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			if (options.instrument) {
+				hash_u64(state, cond->profile_id);
+			}
+			if (node->type == AST_IF) {
+				hash_u64(state, profile_branch_is_cold(cond));
+				hash_u64(state, profile_branch_is_predictable(cond));
+			} else {
+				hash_u64(state, profile_loop_is_hot(cond));
+				hash_u64(state, profile_loop_is_short(cond));
+				hash_u64(state, cond->unroll);
+				hash_u64(state, cond->unroll_full);
+			}
+			hash_node(state, cond->condition);
+			hash_node(state, cond->body);
+			break;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			hash_node(state, switch_stmt->value);
+			hash_u64(state, switch_stmt->num_cases);
+			for (u32 i = 0; i < switch_stmt->num_cases; i++) {
+				hash_u64(state, switch_stmt->cases[i].value);
+				hash_u64(state, switch_stmt->cases[i].body);
+			}
+			hash_u64(state, switch_stmt->num_bodies);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				hash_node(state, switch_stmt->bodies[i]);
+			}
+			hash_node(state, switch_stmt->default_body);
+			break;
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			hash_node(state, (AST_Node*) parallel->index);
+			hash_node(state, parallel->end);
+			hash_node(state, parallel->chunk);
+			hash_node(state, parallel->body);
+			break;
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			hash_node(state, ((AST_Return*) node)->expr);
+			break;
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			hash_node(state, index->base);
+			hash_node(state, index->index);
+			break;
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			hash_node(state, ((AST_Unary*) node)->expr);
+			break;
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			hash_node(state, store->target);
+			hash_node(state, store->rhs);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+u64 hash_function(AST_Func_Decl* func) {
+	Hash_State state = {
+		.hash = 0xcbf29ce484222325,
+	};
+
+	hash_u64(&state, options.arch);
+	hash_u64(&state, options.vectorize);
+	hash_u64(&state, options.if_convert);
+	hash_u64(&state, options.cse);
+	hash_u64(&state, options.specialize_printf);
+	hash_u64(&state, options.instrument);
+	hash_u64(&state, options.debug_info);
+	if (options.debug_info) {
+		hash_bytes(&state, emitter.source_path, strlen(emitter.source_path));
+	}
+
+	hash_node(&state, (AST_Node*) func);
+	free(state.decls);
+
+	// 0 marks empty slots
+	return state.hash == 0 ? 1 : state.hash;
+}
+
+void cache_init() {
+	cache.entries = calloc(CACHE_CAPACITY, sizeof(Cache_Entry));
+	cache.capacity = CACHE_CAPACITY;
+	cache.count = 0;
+}
+
+bool cache_enabled() {
+	return cache.entries != NULL;
+}
+
+const Cache_Entry* cache_lookup(u64 key) {
+	if (cache.entries == NULL)
+		return NULL;
+
+	for (u32 i = key % cache.capacity;; i = (i + 1) % cache.capacity) {
+		if (cache.entries[i].key == key)
+			return &cache.entries[i];
+		if (cache.entries[i].key == 0)
+			return NULL;
+	}
+}
+
+// called on the server
+void cache_add(u64 key, const char* text, u32 length) {
+	if (cache_lookup(key) != NULL)
+		return;
+
+	// start over instead of evicting single entries
+	if ((cache.count + 1) * 4 > cache.capacity * 3) {
+		for (u32 i = 0; i < cache.capacity; i++) {
+			free(cache.entries[i].text);
+		}
+		memset(cache.entries, 0, cache.capacity * sizeof(Cache_Entry));
+		cache.count = 0;
+	}
+
+	u32 i = key % cache.capacity;
+	while (cache.entries[i].key != 0) {
+		i = (i + 1) % cache.capacity;
+	}
+
+	cache.entries[i].key = key;
+	cache.entries[i].text = malloc(length);
+	cache.entries[i].length = length;
+	memcpy(cache.entries[i].text, text, length);
+	cache.count++;
+}
+
+void cache_set_pipe(int fd) {
+	cache.pipe_fd = fd;
+}
+
+// called in a child compiling a request, entries are sent as key, length, text
+void cache_send(u64 key, const char* text, u32 length) {
+	if (cache.pipe_fd < 0)
+		return;
+
+	char header[12];
+	memcpy(header, &key, 8);
+	memcpy(header + 8, &length, 4);
+
+	// the server reads whole entries only, a failed write just loses this one
+	if (write(cache.pipe_fd, header, sizeof(header)) == sizeof(header)) {
+		u32 written = 0;
+		while (written < length) {
+			ssize_t result = write(cache.pipe_fd, text + written, length - written);
+			if (result <= 0)
+				break;
+			written += result;
+		}
+	}
+}
+
+// adds the complete entries at the start of data to the cache, returns the number of bytes used
+u32 cache_receive(const char* data, u32 length) {
+	u32 pos = 0;
+	while (length - pos >= 12) {
+		u64 key;
+		u32 text_length;
+		memcpy(&key, data + pos, 8);
+		memcpy(&text_length, data + pos + 8, 4);
+
+		if (length - pos - 12 < text_length)
+			break;
+
+		cache_add(key, data + pos + 12, text_length);
+		pos += 12 + text_length;
+	}
+	return pos;
+}
@@ -0,0 +1,382 @@
+#include "all.h"
+
+// Common subexpression elimination, done while emitting a function.
+//
+// Every expression the emitter computes gets its own temporary, which isn't reused for anything else in the
+// function. So once an expression has been computed, an identical one later on can use that temporary instead, as
+// long as the first computation dominates the second and nothing it read was written in between.
+// Dominance follows the structure of the AST: a value computed in a block is available for the rest of the block
+// and the statements nested in it, but not after the if, loop or switch body it was computed in.
+//
+// Writes kill values. Assigning a variable kills everything that reads it, stores and calls to functions that
+// aren't pure kill everything that reads memory (loads, and variables whose address is taken). A loop kills
+// everything it writes before it's entered, since its condition and body run again afterwards.
+// Cold if bodies are emitted behind the function, far from the values around them, so they start out empty.
+// The body of a parallel loop is emitted in the middle of its function but runs in a frame of its own, so the values
+// of the function are hidden while it's emitted and come back afterwards.
+
+static CSE_State cse = {0};
+
+static bool is_candidate(AST_Node* node);
+
+// whether the value of a node only depends on variables and memory, so computing it again gives the same result
+static bool is_value(AST_Node* node) {
+	switch (node->type) {
+		case AST_INT_LITERAL:
+		case AST_STR_LITERAL:
+		case AST_VAR:
+			return true;
+		case AST_ADDR_OF:
+			return is_value(((AST_Unary*) node)->expr);
+		default:
+			return is_candidate(node);
+	}
+}
+
+static bool is_candidate(AST_Node* node) {
+	switch (node->type) {
+		case AST_VAR:
+			// 64 bit variables are used in place anyway
+			return type_size(node->data_type) < 8;
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return is_value(op->left) && is_value(op->right);
+		}
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			return is_value(index->base) && is_value(index->index);
+		}
+		case AST_DEREF:
+			return is_value(((AST_Unary*) node)->expr);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			if (!is_pure_builtin(call))
+				return false;
+
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (!is_value(call->args[i]))
+					return false;
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+static u64 hash_value(AST_Node* node) {
+	u64 hash = node->type * 0x9e3779b97f4a7c15;
+
+	switch (node->type) {
+		case AST_INT_LITERAL:
+			hash ^= ((AST_Number*) node)->value;
+			break;
+		case AST_STR_LITERAL:
+			hash ^= ((AST_String*) node)->token.symbol;
+			break;
+		case AST_VAR:
+			hash ^= (u64) (uintptr_t) ((AST_Var*) node)->decl;
+			break;
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			hash ^= op->op + hash_value(op->left) * 31 + hash_value(op->right) * 961;
+			break;
+		}
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			hash ^= hash_value(index->base) * 31 + hash_value(index->index) * 961;
+			break;
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			hash ^= hash_value(((AST_Unary*) node)->expr) * 31;
+			break;
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			hash ^= call->name.symbol;
+			for (u32 i = 0; i < call->num_args; i++) {
+				hash = hash * 31 + hash_value(call->args[i]);
+			}
+			break;
+		}
+		default:
+			break;
+	}
+
+	return hash * 0xff51afd7ed558ccd;
+}
+
+static bool same_value(AST_Node* a, AST_Node* b) {
+	if (a->type != b->type || a->data_type.base != b->data_type.base || a->data_type.pointers != b->data_type.pointers)
+		return false;
+
+	switch (a->type) {
+		case AST_INT_LITERAL:
+			return ((AST_Number*) a)->value == ((AST_Number*) b)->value;
+		case AST_STR_LITERAL:
+			return ((AST_String*) a)->token.symbol == ((AST_String*) b)->token.symbol;
+		case AST_VAR:
+			return ((AST_Var*) a)->decl == ((AST_Var*) b)->decl;
+		case AST_BIN_OP: {
+			AST_Binary_Op* left = (AST_Binary_Op*) a;
+			AST_Binary_Op* right = (AST_Binary_Op*) b;
+			return left->op == right->op && same_value(left->left, right->left) && same_value(left->right, right->right);
+		}
+		case AST_INDEX: {
+			AST_Index* left = (AST_Index*) a;
+			AST_Index* right = (AST_Index*) b;
+			return same_value(left->base, right->base) && same_value(left->index, right->index);
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			return same_value(((AST_Unary*) a)->expr, ((AST_Unary*) b)->expr);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* left = (AST_Func_Call*) a;
+			AST_Func_Call* right = (AST_Func_Call*) b;
+			if (left->name.symbol != right->name.symbol || left->num_args != right->num_args)
+				return false;
+
+			for (u32 i = 0; i < left->num_args; i++) {
+				if (!same_value(left->args[i], right->args[i]))
+					return false;
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+static bool reads_var(AST_Node* node, AST_Var_Decl* decl) {
+	switch (node->type) {
+		case AST_VAR:
+			return ((AST_Var*) node)->decl == decl;
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return reads_var(op->left, decl) || reads_var(op->right, decl);
+		}
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			return reads_var(index->base, decl) || reads_var(index->index, decl);
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			return reads_var(((AST_Unary*) node)->expr, decl);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (reads_var(call->args[i], decl))
+					return true;
+			}
+			return false;
+		}
+		default:
+			return false;
+	}
+}
+
+static bool reads_memory(AST_Node* node) {
+	switch (node->type) {
+		case AST_VAR:
+			return ((AST_Var*) node)->decl->address_taken;
+		case AST_INDEX:
+		case AST_DEREF:
+			return true;
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return reads_memory(op->left) || reads_memory(op->right);
+		}
+		case AST_ADDR_OF: {
+			// the address of a variable doesn't read it
+			AST_Node* expr = ((AST_Unary*) node)->expr;
+			return expr->type != AST_VAR && reads_memory(expr);
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (reads_memory(call->args[i]))
+					return true;
+			}
+			return false;
+		}
+		default:
+			return false;
+	}
+}
+
+// whether a call can write memory, pure functions don't touch it at all
+static bool call_writes_memory(AST_Func_Call* call) {
+	// atomics also keep other accesses from moving across them, the region builtins write the region
+	if (is_builtin(call))
+		return call->name.symbol >= SYM_ATOMICLOAD;
+	return call->decl == NULL || !call->decl->is_pure;
+}
+
+void cse_reset() {
+	cse.num_values = cse.floor;
+}
+
+u32 cse_enter() {
+	return cse.num_values;
+}
+
+// forgets the values computed since the matching cse_enter
+void cse_leave(u32 mark) {
+	cse.num_values = mark;
+}
+
+// hides the values computed so far from code emitted for another frame, returns what to pass to cse_leave_frame
+u32 cse_enter_frame() {
+	u32 floor = cse.floor;
+	cse.floor = cse.num_values;
+	return floor;
+}
+
+// forgets the values of the other frame and brings back the hidden ones
+void cse_leave_frame(u32 floor) {
+	cse.num_values = cse.floor;
+	cse.floor = floor;
+}
+
+// the temporary holding the value of an identical expression computed before, 0 if there's none
+stack_loc cse_find(AST_Node* node) {
+	if (!options.cse || !is_candidate(node))
+		return 0;
+
+	u64 hash = hash_value(node);
+	for (u32 i = cse.num_values; i > cse.floor; i--) {
+		CSE_Value* value = &cse.values[i - 1];
+		if (!value->killed && value->hash == hash && same_value(value->expr, node))
+			return value->location;
+	}
+	return 0;
+}
+
+stack_loc cse_add(AST_Node* node, stack_loc location) {
+	if (!options.cse || cse.num_values >= CSE_MAX_VALUES || !is_candidate(node))
+		return location;
+
+	CSE_Value* value = &cse.values[cse.num_values++];
+	value->expr = node;
+	value->hash = hash_value(node);
+	value->location = location;
+	value->reads_memory = reads_memory(node);
+	value->killed = false;
+	return location;
+}
+
+void cse_kill_var(AST_Var_Decl* decl) {
+	for (u32 i = 0; i < cse.num_values; i++) {
+		if (reads_var(cse.values[i].expr, decl)) {
+			cse.values[i].killed = true;
+		}
+	}
+
+	// the variable's memory can be read through pointers too
+	if (decl->address_taken) {
+		cse_kill_memory();
+	}
+}
+
+void cse_kill_memory() {
+	for (u32 i = 0; i < cse.num_values; i++) {
+		if (cse.values[i].reads_memory) {
+			cse.values[i].killed = true;
+		}
+	}
+}
+
+void cse_kill_call(AST_Func_Call* call) {
+	if (call_writes_memory(call)) {
+		cse_kill_memory();
+	}
+}
+
+// kills everything a subtree might write, before it's run again or from somewhere else
+void cse_kill_writes(AST_Node* node) {
+	if (node == NULL || cse.num_values == 0)
+		return;
+
+	switch (node->type) {
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			cse_kill_writes(op->left);
+			cse_kill_writes(op->right);
+			break;
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				cse_kill_writes(block->statements[i]);
+			}
+			break;
+		}
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+			cse_kill_writes(decl->assign);
+			cse_kill_var(decl);
+			break;
+		}
+		case AST_ASSIGN: {
+			AST_Assign* assign = (AST_Assign*) node;
+			cse_kill_writes(assign->rhs);
+			cse_kill_var(assign->decl);
+			break;
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			for (u32 i = 0; i < call->num_args; i++) {
+				cse_kill_writes(call->args[i]);
+			}
+			cse_kill_call(call);
+			break;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			cse_kill_writes(cond->condition);
+			cse_kill_writes(cond->body);
+			break;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			cse_kill_writes(switch_stmt->value);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				cse_kill_writes(switch_stmt->bodies[i]);
+			}
+			cse_kill_writes(switch_stmt->default_body);
+			break;
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			cse_kill_writes((AST_Node*) parallel->index);
+			cse_kill_writes(parallel->end);
+			cse_kill_writes(parallel->chunk);
+			cse_kill_writes(parallel->body);
+			break;
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			cse_kill_writes(((AST_Return*) node)->expr);
+			break;
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			cse_kill_writes(index->base);
+			cse_kill_writes(index->index);
+			break;
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			cse_kill_writes(((AST_Unary*) node)->expr);
+			break;
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			cse_kill_writes(store->target);
+			cse_kill_writes(store->rhs);
+			cse_kill_memory();
+			break;
+		}
+		default:
+			break;
+	}
+}
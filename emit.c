@@ -1,132 +1,263 @@
 #include "all.h"
 
-stack_loc emit_node(AST_Node* node);
+#include <stdarg.h>
 
-static Emit_State emitter = {0};
+#define IF_CONVERT_MAX_NODES 8 // the most nodes a right hand side can have to be computed unconditionally
 
-static const char* sysv_call_regs[MAX_ARGS] = {
+Emit_State emitter = {0};
+
+static const char* sysv_call_regs[MAX_REG_ARGS] = {
 	"rdi", "rsi", "rdx", "rcx", "r8", "r9"
 };
 
-static u32 get_required_stack_size(AST_Node* node) {
-	switch (node->type) {
-		case AST_VAR:
-			return 0;
-		case AST_INT_LITERAL:
-		case AST_STR_LITERAL:
-			return 1;
-		case AST_FUNC_CALL: {
-			AST_Func_Call* call = (AST_Func_Call*) node;
-			u32 sum = 1; // 1 for return value
-			for (u32 i = 0; i < call->num_args; i++) {
-				sum += get_required_stack_size(call->args[i]);
-			}
-			return sum;
-		}
-		case AST_BIN_OP: {
-			AST_Binary_Op* op = (AST_Binary_Op*) node;
-			stack_loc left = get_required_stack_size(op->left);
-			stack_loc right = get_required_stack_size(op->right);
-			return 1 + left + right;
-		}
-        case AST_BLOCK: {
-			AST_Block* block = (AST_Block*) node;
-            u32 sum = 0;
-            for (u32 i = 0; i < block->num_statements; i++) {
-			    sum += get_required_stack_size(block->statements[i]);
-			}
-			return sum;
-		}
-		case AST_FUNC_DECL: {
-			AST_Func_Decl* decl = (AST_Func_Decl*) node;
-			return decl->num_args + get_required_stack_size(decl->body);
-		}
-		case AST_RETURN: {
-			AST_Return* ret = (AST_Return*) node;
-			return get_required_stack_size(ret->expr);
-		}
-		case AST_WHILE:
-		case AST_IF: {
-			AST_Conditional* cond = (AST_Conditional*) node;
-			return get_required_stack_size(cond->condition) + get_required_stack_size(cond->body);
-		}
-		case AST_ASSIGN: {
-			AST_Assign* assign = (AST_Assign*) node;
-			return get_required_stack_size(assign->rhs);
+static const char* sized_registers[][4] = {
+	{ "al", "ax", "eax", "rax" },
+	{ "cl", "cx", "ecx", "rcx" },
+	{ "dl", "dx", "edx", "rdx" },
+	{ "dil", "di", "edi", "rdi" },
+	{ "sil", "si", "esi", "rsi" },
+	{ "r8b", "r8w", "r8d", "r8" },
+	{ "r9b", "r9w", "r9d", "r9" },
+};
+
+// returns the name of the low size bytes of a 64 bit register
+static const char* sized_register(const char* reg, u32 size) {
+	u32 index = size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3;
+
+	for (u32 i = 0; i < sizeof(sized_registers) / sizeof(sized_registers[0]); i++) {
+		if (strcmp(sized_registers[i][3], reg) == 0)
+			return sized_registers[i][index];
+	}
+
+	printf("sized_register: unknown register %s\n", reg);
+	error();
+	return NULL;
+}
+
+static const char* size_keyword(u32 size) {
+	switch (size) {
+		case 1:
+			return "byte";
+		case 2:
+			return "word";
+		case 4:
+			return "dword";
+		default:
+			return "qword";
+	}
+}
+
+static u32 log2_size(u32 size) {
+	return size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3;
+}
+
+// loads a value of the given type into a 64 bit register, sign or zero extending it
+void emit_load(const char* reg, Data_Type type, const char* address_format, ...) {
+	char address[64];
+	va_list args;
+	va_start(args, address_format);
+	vsnprintf(address, sizeof(address), address_format, args);
+	va_end(args);
+
+	u32 size = type_size(type);
+	bool is_signed = type_is_signed(type);
+
+	if (size == 8) {
+		fprintf(emitter.file, "	mov %s, qword %s\n", reg, address);
+	} else if (size == 4 && !is_signed) {
+		// writing the 32 bit register clears the upper half
+		fprintf(emitter.file, "	mov %s, dword %s\n", sized_register(reg, 4), address);
+	} else if (size == 4) {
+		fprintf(emitter.file, "	movsxd %s, dword %s\n", reg, address);
+	} else if (is_signed) {
+		fprintf(emitter.file, "	movsx %s, %s %s\n", reg, size_keyword(size), address);
+	} else {
+		fprintf(emitter.file, "	movzx %s, %s %s\n", sized_register(reg, 4), size_keyword(size), address);
+	}
+}
+
+// stores the low part of a 64 bit register that fits the given type
+void emit_store_value(const char* reg, Data_Type type, const char* address_format, ...) {
+	char address[64];
+	va_list args;
+	va_start(args, address_format);
+	vsnprintf(address, sizeof(address), address_format, args);
+	va_end(args);
+
+	u32 size = type_size(type);
+	fprintf(emitter.file, "	mov %s %s, %s\n", size_keyword(size), address, sized_register(reg, size));
+}
+
+// truncates a 64 bit register to the given type and extends it back
+static void emit_normalize(const char* reg, Data_Type type) {
+	u32 size = type_size(type);
+	if (size == 8)
+		return;
+
+	const char* part = sized_register(reg, size);
+	if (size == 4) {
+		if (type_is_signed(type)) {
+			fprintf(emitter.file, "	movsxd %s, %s\n", reg, part);
+		} else {
+			fprintf(emitter.file, "	mov %s, %s\n", part, part);
 		}
-		case AST_VAR_DECL: {
-			AST_Var_Decl* var = (AST_Var_Decl*) node;
-			u32 sum = 1;
-			if (var->assign != NULL) {
-				sum += get_required_stack_size(var->assign);
+	} else if (type_is_signed(type)) {
+		fprintf(emitter.file, "	movsx %s, %s\n", reg, part);
+	} else {
+		fprintf(emitter.file, "	movzx %s, %s\n", sized_register(reg, 4), part);
+	}
+}
+
+// maps the following instructions to the node's source line in the debug info
+static void emit_line(AST_Node* node) {
+	if (!options.debug_info || node->line == 0 || node->line == emitter.line)
+		return;
+
+	emitter.line = node->line;
+	fprintf(emitter.file, "%%line %u+0 %s\n", node->line, emitter.source_path);
+}
+
+// stack space needed by a variable, including worst case alignment padding
+static u32 get_var_stack_size(Data_Type data_type, u32 array_length) {
+	if (array_length > 0) {
+		// pointer to the elements, then the elements themselves
+		return 8 + array_length * element_size(data_type) + 15;
+	}
+
+	u32 size = type_size(data_type);
+	return size + size - 1;
+}
+
+// in bytes
+// sums up what every node of the subtree of node index needs, front to back over the flattened AST.
+// some nodes don't use a temporary in every position, those are skipped where their parent is handled
+static u32 get_required_stack_size(u32 index) {
+	const Flat_AST* flat = emitter.flat;
+	u32 sum = 0;
+
+	for (u32 i = index; i < flat->ends[index]; i++) {
+		switch (flat->kinds[i]) {
+			case AST_VAR:
+				// 64 bit variables are used in place, smaller ones are extended into a temporary
+				sum += type_size(flat->data_types[i]) < 8 ? 8 : 0;
+				break;
+			case AST_INT_LITERAL:
+			case AST_STR_LITERAL:
+			case AST_BIN_OP:
+			case AST_INDEX:
+			case AST_DEREF:
+				sum += 8;
+				break;
+			case AST_FUNC_CALL:
+				sum += 8; // for return value
+				// the callee's arguments, variables and temporaries live in this frame
+				if (flat->extras[i] != FLAT_NONE) {
+					sum += get_required_stack_size(flat->extras[i]);
+				}
+				break;
+			case AST_ADDR_OF: {
+				sum += 8;
+				// taking the address of an element doesn't load it, only the base and index are evaluated
+				u32 child = i + 1;
+				i = flat->kinds[child] == AST_INDEX ? child : flat->ends[child] - 1;
+				break;
 			}
-			return sum;
+			case AST_STORE:
+				// the target isn't loaded either, continue with its operands
+				i++;
+				break;
+			case AST_VAR_DECL:
+				sum += get_var_stack_size(flat->data_types[i], flat->extras[i]);
+				break;
+			case AST_PARALLEL:
+				sum += 8; // iterations left in the task
+				break;
+			case AST_WHILE:
+				// the copies of an unrolled body, on top of the one of the regular loop
+				if (flat->extras[i] > 0) {
+					sum += flat->extras[i] * get_required_stack_size(flat->ends[i + 1]);
+				}
+				break;
+			case AST_BLOCK:
+			case AST_FUNC_DECL:
+			case AST_RETURN:
+			case AST_YIELD:
+			case AST_IF:
+			case AST_SWITCH:
+			case AST_ASSIGN:
+				break;
+			default:
+				printf("get_required_stack_size: unhandled node type %u\n", flat->kinds[i]);
+				error();
 		}
-        default:
-            printf("get_required_stack_size: unhandled node type %u\n", node->type);
-	        error();
 	}
 
-	return 0;
+	return sum;
+}
+
+static void check_frame_overflow() {
+	if (emitter.context.alloc + emitter.context.temp_alloc > emitter.context.frame_size) {
+		printf("emit error: stack frame overflow\n");
+		error();
+	}
 }
 
-// fixme: return * 8?
+// allocates an 8 byte temporary
 stack_loc allocate_stack() {
-	return emitter.context.alloc++;
+	stack_loc location = emitter.context.frame_size - emitter.context.temp_alloc;
+	emitter.context.temp_alloc += 8;
+	check_frame_overflow();
+	return location;
+}
+
+// allocates space for a variable, align has to be a power of two
+static stack_loc allocate_var(u32 size, u32 align) {
+	stack_loc location = emitter.context.alloc + size;
+	location = (location + align - 1) & ~(align - 1);
+	emitter.context.alloc = location;
+	check_frame_overflow();
+	return location;
 }
 
 stack_loc emit_number(AST_Number* number) {
 	stack_loc location = allocate_stack();
 	fprintf(emitter.file, "	; integer literal\n");
-	fprintf(emitter.file, "	mov qword [rbp - %u], %u\n", location * 8, number->value);
+
+	// immediates are sign extended from 32 bits
+	if (number->value <= INT32_MAX) {
+		fprintf(emitter.file, "	mov qword [rbp - %u], %" PRIu64 "\n", location, number->value);
+	} else {
+		fprintf(emitter.file, "	mov rax, %" PRIu64 "\n", number->value);
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+	}
 	return location;
 }
 
 stack_loc emit_string(AST_String* str) {
-	u32 string_no = emitter.num_string_literals++;
-	emitter.string_literals[string_no] = str->token;
-
 	stack_loc location = allocate_stack();
 	fprintf(emitter.file, "	; string literal\n");
-	fprintf(emitter.file, "	mov qword [rbp - %u], _str%u\n", location * 8, string_no);
+	fprintf(emitter.file, "	mov qword [rbp - %u], _str_%016" PRIx64 "\n", location, get_symbol(str->token.symbol)->hash);
 	return location;
 }
 
-Variable* find_var_by_name(Token* name) {
-	Variable* found = NULL;
-
-	for (u32 i = 0; i < emitter.context.num_vars; i++) {
-		const Token* token = &emitter.context.vars[i].token;
-
-		if (token->len != name->len)
-			continue;
-
-		if (strncmp(token->str, name->str, token->len) == 0) {
-			found = &emitter.context.vars[i];
-		}
-	}
-
-	return found;
-}
-
 stack_loc emit_var(AST_Var* var) {
-	Variable* found = find_var_by_name(&var->name);
-
-	if (found == NULL) {
-		printf("emit_var: variable not found!\n");
-		error();
-	}
-
 	fprintf(emitter.file, "	; var reference\n");
 
-	return found->location;
+	if (type_size(var->data_type) == 8)
+		return var->decl->location;
+
+	stack_loc location = allocate_stack();
+	emit_load("rax", var->data_type, "[rbp - %u]", var->decl->location);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+	return location;
 }
 
 stack_loc emit_binary_op(AST_Binary_Op* op, stack_loc left, stack_loc right) {
 	stack_loc location = allocate_stack();
 	fprintf(emitter.file, "	; binary op\n");
 
-	// todo: clean this up
+	Data_Type left_type = op->left->data_type;
+	Data_Type right_type = op->right->data_type;
 
 	// handle comparisons
 	if (op->op == OP_EQUALS ||
@@ -135,119 +266,755 @@ stack_loc emit_binary_op(AST_Binary_Op* op, stack_loc left, stack_loc right) {
 		op->op == OP_LESS_THAN_EQUAL ||
 		op->op == OP_GREATER_THAN ||
 		op->op == OP_GREATER_THAN_EQUAL) {
+		// convert both sides to the common type, e.g. an i32 -1 compares equal to u32 4294967295
+		Data_Type common = arithmetic_type(left_type, right_type);
+		bool is_signed = type_is_signed(common);
+
 		fprintf(emitter.file, "	xor rax, rax\n");
-		fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", left * 8);
-		fprintf(emitter.file, "	cmp rcx, qword [rbp - %u]\n", right * 8);
+		fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", left);
+		fprintf(emitter.file, "	mov rdx, qword [rbp - %u]\n", right);
+		emit_normalize("rcx", common);
+		emit_normalize("rdx", common);
+		fprintf(emitter.file, "	cmp rcx, rdx\n");
 		if (op->op == OP_EQUALS)
 			fprintf(emitter.file, "	sete al\n");
 		if (op->op == OP_NOT_EQUALS)
 			fprintf(emitter.file, "	setne al\n");
 		if (op->op == OP_LESS_THAN)
-			fprintf(emitter.file, "	setl al\n");
+			fprintf(emitter.file, "	%s al\n", is_signed ? "setl" : "setb");
 		if (op->op == OP_LESS_THAN_EQUAL)
-			fprintf(emitter.file, "	setle al\n");
+			fprintf(emitter.file, "	%s al\n", is_signed ? "setle" : "setbe");
 		if (op->op == OP_GREATER_THAN)
-			fprintf(emitter.file, "	setg al\n");
+			fprintf(emitter.file, "	%s al\n", is_signed ? "setg" : "seta");
 		if (op->op == OP_GREATER_THAN_EQUAL)
-			fprintf(emitter.file, "	setge al\n");
+			fprintf(emitter.file, "	%s al\n", is_signed ? "setge" : "setae");
 		
-		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location * 8);
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+		return location;
+	}
+
+	// pointer arithmetic, scaled by the element size
+	bool left_pointer = type_is_pointer(left_type);
+	bool right_pointer = type_is_pointer(right_type);
+	if (left_pointer && right_pointer) {
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", left);
+		fprintf(emitter.file, "	sub rax, qword [rbp - %u]\n", right);
+		fprintf(emitter.file, "	sar rax, %u\n", log2_size(element_size(left_type)));
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+		return location;
+	} else if (left_pointer || right_pointer) {
+		u32 shift = log2_size(element_size(op->data_type));
+		stack_loc pointer = left_pointer ? left : right;
+		stack_loc offset = left_pointer ? right : left;
+
+		fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", offset);
+		if (shift > 0) {
+			fprintf(emitter.file, "	shl rcx, %u\n", shift);
+		}
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", pointer);
+		fprintf(emitter.file, "	%s rax, rcx\n", op->op == OP_ADD ? "add" : "sub");
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
 		return location;
 	}
 
-	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", left * 8);
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", left);
 	switch (op->op) {
 		case OP_ADD:
 		case OP_SUB:
-			fprintf(emitter.file, "	%s rax, qword [rbp - %u]\n", op->op == OP_ADD ? "add" : "sub", right * 8);
+			fprintf(emitter.file, "	%s rax, qword [rbp - %u]\n", op->op == OP_ADD ? "add" : "sub", right);
 			break;
 		case OP_MUL:
-			fprintf(emitter.file, "	mul qword [rbp - %u]\n", right * 8);
+			fprintf(emitter.file, "	imul rax, qword [rbp - %u]\n", right);
+			break;
+		case OP_DIV:
+			// unlike the other operations the result depends on more than the low bits of the operands
+			fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", right);
+			emit_normalize("rax", op->data_type);
+			emit_normalize("rcx", op->data_type);
+
+			// rdx:rax / rcx
+			if (type_is_signed(op->data_type)) {
+				fprintf(emitter.file, "	cqo\n");
+				fprintf(emitter.file, "	idiv rcx\n");
+			} else {
+				fprintf(emitter.file, "	xor edx, edx\n");
+				fprintf(emitter.file, "	div rcx\n");
+			}
 			break;
-
-			// div freezes?
 		default:
 			printf("emit_binary_op: unhandled operator\n");
 			error();
 	}
-	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location * 8);
+	emit_normalize("rax", op->data_type);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
 	return location;
 }
 
 void emit_var_decl(AST_Var_Decl* decl) {
-	stack_loc location = allocate_stack();
-
-	Variable var = {
-		.location = location,
-		.token = decl->name,
-	};
-
-	// check for duplicate var names
-	// todo: do this in the tree instead?
-	for (u32 i = 0; i < MAX_VARS; i++) {
-		const Token* other = &emitter.context.vars[i].token;
-		if (var.token.len == other->len) {
-			if (strncmp(var.token.str, other->str, var.token.len) == 0) {
-				printf("error: %.*s is already defined\n", var.token.len, var.token.str);
-				error();
-			}
-		}
+	if (decl->array_length > 0) {
+		decl->location = allocate_var(8, 8);
+
+		stack_loc first = allocate_var(decl->array_length * element_size(decl->data_type), 16);
+		fprintf(emitter.file, "	; stack array\n");
+		fprintf(emitter.file, "	lea rax, [rbp - %u]\n", first);
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", decl->location);
+		cse_kill_var(decl);
+		return;
 	}
 
-	emitter.context.vars[emitter.context.num_vars++] = var;
+	u32 size = type_size(decl->data_type);
+	decl->location = allocate_var(size, size);
 
 	if (decl->assign != NULL) {
 		u32 assign_loc = emit_node(decl->assign);
-		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", assign_loc * 8);
-		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location * 8);
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", assign_loc);
+		emit_store_value("rax", decl->data_type, "[rbp - %u]", decl->location);
 	}
+	cse_kill_var(decl);
 }
 
 void emit_assign(AST_Assign* assign, stack_loc rhs_loc) {
-	Variable* var = find_var_by_name(&assign->lhs);
+	fprintf(emitter.file, "	; assign\n");
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", rhs_loc);
+	emit_store_value("rax", assign->decl->data_type, "[rbp - %u]", assign->decl->location);
+	cse_kill_var(assign->decl);
+}
 
-	if (var == NULL) {
-		printf("emit_assign: variable not found!\n");
-		error();
+// whether an expression can be computed even if the program wouldn't, so no loads, calls or division
+static bool is_speculatable(AST_Node* node, u32* budget) {
+	if (*budget == 0)
+		return false;
+	(*budget)--;
+
+	switch (node->type) {
+		case AST_INT_LITERAL:
+		case AST_VAR:
+			return true;
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return op->op != OP_DIV && is_speculatable(op->left, budget) && is_speculatable(op->right, budget);
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			if (!is_pure_builtin(call))
+				return false;
+
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (!is_speculatable(call->args[i], budget))
+					return false;
+			}
+			return true;
+		}
+		default:
+			return false;
 	}
+}
 
-	fprintf(emitter.file, "	; assign\n");
-	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", rhs_loc * 8);
-	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", var->location * 8);
+// the assignment of an if that only assigns a variable, if it should be done with a cmov instead of a branch
+static AST_Assign* get_if_conversion(AST_Conditional* if_stmt) {
+	// the instrumented build has to count the branch
+	if (options.if_convert == IF_CONVERT_NEVER || options.instrument)
+		return NULL;
+
+	AST_Node* body = if_stmt->body;
+	if (body->type == AST_BLOCK && ((AST_Block*) body)->num_statements == 1) {
+		body = ((AST_Block*) body)->statements[0];
+	}
+	if (body->type != AST_ASSIGN)
+		return NULL;
+
+	u32 budget = UINT32_MAX;
+	if (options.if_convert == IF_CONVERT_AUTO) {
+		if (profile_branch_is_predictable(if_stmt))
+			return NULL;
+		budget = IF_CONVERT_MAX_NODES;
+	}
+
+	AST_Assign* assign = (AST_Assign*) body;
+	return is_speculatable(assign->rhs, &budget) ? assign : NULL;
 }
 
 void emit_if(AST_Conditional* if_stmt) {
+	emit_profile_counter(if_stmt->profile_id);
 	stack_loc result_loc = emit_node(if_stmt->condition);
+
+	AST_Assign* assign = get_if_conversion(if_stmt);
+	if (assign != NULL) {
+		stats_count(STAT_IF_CONVERTED);
+		stack_loc rhs_loc = emit_node(assign->rhs);
+		fprintf(emitter.file, "	; if statement, conditional move\n");
+		emit_load("rax", assign->decl->data_type, "[rbp - %u]", assign->decl->location);
+		fprintf(emitter.file, "	cmp qword [rbp - %u], 0\n", result_loc);
+		fprintf(emitter.file, "	cmovne rax, qword [rbp - %u]\n", rhs_loc);
+		emit_store_value("rax", assign->decl->data_type, "[rbp - %u]", assign->decl->location);
+		cse_kill_var(assign->decl);
+		return;
+	}
 	
 	u32 label = emitter.label++;
 
+	// keep the hot path falling through, the body is emitted after the function and jumps back
+	if (profile_branch_is_cold(if_stmt) && emitter.inline_func == NULL && emitter.num_cold_blocks < MAX_COLD_BLOCKS) {
+		stats_count(STAT_COLD_BLOCK);
+		Cold_Block* cold = &emitter.cold_blocks[emitter.num_cold_blocks++];
+		cold->body = if_stmt->body;
+		cold->label = emitter.label++;
+		cold->return_label = label;
+		cold->profile_id = if_stmt->profile_id + 1;
+		cse_kill_writes(if_stmt->body);
+
+		fprintf(emitter.file, "	; if statement, cold body\n");
+		fprintf(emitter.file, "	cmp qword [rbp - %u], 0\n", result_loc);
+		fprintf(emitter.file, "	jne .label%u\n", cold->label);
+		fprintf(emitter.file, ".label%u:\n", label);
+		return;
+	}
+
 	fprintf(emitter.file, "	; if statement\n");
-	fprintf(emitter.file, "	cmp qword [rbp - %u], 0\n", result_loc * 8);
-	fprintf(emitter.file, "	je _label%u\n", label);
+	fprintf(emitter.file, "	cmp qword [rbp - %u], 0\n", result_loc);
+	fprintf(emitter.file, "	je .label%u\n", label);
 
+	u32 values = cse_enter();
+	emit_profile_counter(if_stmt->profile_id + 1);
 	emit_node(if_stmt->body);
+	cse_leave(values);
 
-	fprintf(emitter.file, "_label%u:\n", label);
+	fprintf(emitter.file, ".label%u:\n", label);
+}
+
+// remembers the string literals of flat, every distinct one is emitted once at the end of the file.
+// they're labelled by the hash of their text, so the code of a function doesn't depend on the rest of the file
+static void add_string_literals(const Flat_AST* flat) {
+	for (u32 i = 0; i < flat->num_nodes; i++) {
+		if (flat->kinds[i] != AST_STR_LITERAL)
+			continue;
+
+		u32 symbol = flat->tokens[flat->operands[i]].symbol;
+		if (symbol >= emitter.string_seen_capacity) {
+			u32 capacity = num_symbols();
+			emitter.string_seen = realloc(emitter.string_seen, capacity * sizeof(bool));
+			memset(emitter.string_seen + emitter.string_seen_capacity, 0, (capacity - emitter.string_seen_capacity) * sizeof(bool));
+			emitter.string_seen_capacity = capacity;
+		}
+
+		if (emitter.string_seen[symbol])
+			continue;
+		emitter.string_seen[symbol] = true;
+
+		if (emitter.num_strings >= emitter.strings_capacity) {
+			emitter.strings_capacity = emitter.strings_capacity == 0 ? 64 : emitter.strings_capacity * 2;
+			emitter.strings = realloc(emitter.strings, emitter.strings_capacity * sizeof(u32));
+		}
+		emitter.strings[emitter.num_strings++] = symbol;
+	}
+}
+
+static void emit_string_literals() {
+	if (emitter.num_strings == 0)
+		return;
+
+	fprintf(emitter.file, "section .rodata\n");
+	for (u32 i = 0; i < emitter.num_strings; i++) {
+		const Symbol* text = get_symbol(emitter.strings[i]);
+		fprintf(emitter.file, "_str_%016" PRIx64 ": db ", text->hash);
+
+		// convert to nasm string
+		u32 pos = 1; // skip first "
+		while (pos < text->len - 1) {
+			if (text->str[pos] == '\\') {
+				if (pos + 1 >= text->len - 1 || text->str[pos + 1] != 'n') {
+					printf("emit error: invalid escape character");
+					error();
+				}
+
+				fprintf(emitter.file, "10, ");
+				pos += 2;
+				continue;
+			}
+
+			fprintf(emitter.file, "%u, ", (u32)text->str[pos]);
+			pos++;
+		}
+		fprintf(emitter.file, "0\n");
+	}
+	fprintf(emitter.file, "section .text\n");
+}
+
+// the ones from first on
+static void emit_cold_blocks(u32 first) {
+	// cold blocks can contain more cold blocks
+	for (u32 i = first; i < emitter.num_cold_blocks; i++) {
+		Cold_Block cold = emitter.cold_blocks[i];
+
+		fprintf(emitter.file, ".label%u:\n", cold.label);
+		cse_reset();
+		emit_profile_counter(cold.profile_id);
+		emit_node(cold.body);
+		fprintf(emitter.file, "	jmp .label%u\n", cold.return_label);
+	}
+	emitter.num_cold_blocks = first;
 }
 
 void emit_while(AST_Conditional* while_stmt) {
+	emit_profile_counter(while_stmt->profile_id);
+
+	// values from before the loop are only valid inside it if the loop doesn't change them.
+	// the condition runs right before the loop exits, so its values stay available after it
+	cse_kill_writes((AST_Node*) while_stmt);
+
+	// try to emit a vector or an unrolled version first, the scalar loop below then handles the remainder.
+	// a fully unrolled loop needs none
+	bool vectorized = false;
+	bool needs_loop = true;
+	if (!while_stmt->unroll_full && options.vectorize && !profile_loop_is_short(while_stmt)) {
+		vectorized = emit_vectorized_while(while_stmt);
+	}
+	if (vectorized) {
+		stats_count(STAT_VECTORIZED);
+	} else if (emit_unrolled_while(while_stmt, &needs_loop)) {
+		stats_count(needs_loop ? STAT_UNROLLED : STAT_UNROLLED_FULLY);
+	}
+	if (!needs_loop)
+		return;
+
 	u32 loop_label = emitter.label++;
 	u32 exit_label = emitter.label++;
 
+	// hot loops are rotated so each iteration only takes one branch
+	if (profile_loop_is_hot(while_stmt)) {
+		stats_count(STAT_ROTATED);
+		u32 condition_label = exit_label;
+		fprintf(emitter.file, "	; while statement, rotated\n");
+		fprintf(emitter.file, "	jmp .label%u\n", condition_label);
+		fprintf(emitter.file, "	align 16\n");
+		fprintf(emitter.file, ".label%u:\n", loop_label);
+		u32 values = cse_enter();
+		emit_profile_counter(while_stmt->profile_id + 1);
+		emit_node(while_stmt->body);
+		cse_leave(values);
+		fprintf(emitter.file, ".label%u:\n", condition_label);
+		stack_loc result_loc = emit_node(while_stmt->condition);
+		fprintf(emitter.file, "	cmp qword [rbp - %u], 0\n", result_loc);
+		fprintf(emitter.file, "	jne .label%u\n", loop_label);
+		return;
+	}
+
 	fprintf(emitter.file, "	; while statement\n");
-	fprintf(emitter.file, "_label%u:\n", loop_label);
+	fprintf(emitter.file, ".label%u:\n", loop_label);
 	stack_loc result_loc = emit_node(while_stmt->condition);
-	fprintf(emitter.file, "	cmp qword [rbp - %u], 0\n", result_loc * 8);
-	fprintf(emitter.file, "	je _label%u\n", exit_label);
+	fprintf(emitter.file, "	cmp qword [rbp - %u], 0\n", result_loc);
+	fprintf(emitter.file, "	je .label%u\n", exit_label);
+	u32 values = cse_enter();
+	emit_profile_counter(while_stmt->profile_id + 1);
 	emit_node(while_stmt->body);
-	fprintf(emitter.file, "	jmp _label%u\n", loop_label);
-	fprintf(emitter.file, "_label%u:\n", exit_label);
+	cse_leave(values);
+	fprintf(emitter.file, "	jmp .label%u\n", loop_label);
+	fprintf(emitter.file, ".label%u:\n", exit_label);
+}
+
+// the body of a parallel loop as a function the runtime calls for each chunk of the range, see runtime.c.
+// it has the same frame layout as the enclosing function and starts by copying the variables declared so far from
+// there, so the body is emitted just like in place. sema makes sure it only reads them, arrays and memory behind
+// pointers are shared.
+static void emit_parallel_task(AST_Parallel* parallel, u32 task, u32 vars_size) {
+	AST_Func_Decl* func = emitter.current_func;
+	AST_Var_Decl* index = parallel->index;
+	u32 first_cold_block = emitter.num_cold_blocks;
+	u32 loop_label = emitter.label++;
+	emitter.line = 0;
+
+	// (enclosing frame, first index, number of iterations)
+	fprintf(emitter.file, "_parallel_%.*s_%u:\n", func->name.len, func->name.str, task);
+	fprintf(emitter.file, "	push rbp\n");
+	fprintf(emitter.file, "	mov rbp, rsp\n");
+	fprintf(emitter.file, "	sub rsp, %u\n", emitter.context.frame_size);
+	fprintf(emitter.file, "	mov r8, rsi\n");
+	fprintf(emitter.file, "	mov r9, rdx\n");
+	if (vars_size > 0) {
+		u32 size = (vars_size + 7) & ~7;
+		fprintf(emitter.file, "	lea rsi, [rdi - %u]\n", size);
+		fprintf(emitter.file, "	lea rdi, [rbp - %u]\n", size);
+		fprintf(emitter.file, "	mov ecx, %u\n", size / 8);
+		fprintf(emitter.file, "	rep movsq\n");
+	}
+	emit_store_value("r8", index->data_type, "[rbp - %u]", index->location);
+	stack_loc left_loc = allocate_stack();
+	fprintf(emitter.file, "	mov qword [rbp - %u], r9\n", left_loc);
+
+	fprintf(emitter.file, ".label%u:\n", loop_label);
+	cse_reset();
+	emit_node(parallel->body);
+	emit_load("rax", index->data_type, "[rbp - %u]", index->location);
+	fprintf(emitter.file, "	add rax, 1\n");
+	emit_store_value("rax", index->data_type, "[rbp - %u]", index->location);
+	fprintf(emitter.file, "	dec qword [rbp - %u]\n", left_loc);
+	fprintf(emitter.file, "	jnz .label%u\n", loop_label);
+	fprintf(emitter.file, "	mov rsp, rbp\n");
+	fprintf(emitter.file, "	pop rbp\n");
+	fprintf(emitter.file, "	ret\n");
+	emit_cold_blocks(first_cold_block);
+}
+
+void emit_parallel(AST_Parallel* parallel) {
+	AST_Var_Decl* index = parallel->index;
+	emit_var_decl(index);
+	stack_loc end_loc = emit_node(parallel->end);
+	stack_loc chunk_loc = parallel->chunk != NULL ? emit_node(parallel->chunk) : 0;
+	u32 task = emitter.num_tasks++;
+	u32 vars_size = emitter.context.alloc;
+	u32 skip_label = emitter.label++;
+
+	// the task is emitted now, while the variables are where the body expects them, and written out behind the
+	// function. it can't use the values of this frame's temporaries, and this frame can't use the task's
+	u32 floor = cse_enter_frame();
+	FILE* file = emitter.file;
+	char* text;
+	size_t length;
+	emitter.file = open_memstream(&text, &length);
+	emit_parallel_task(parallel, task, vars_size);
+	cse_leave_frame(floor);
+	fclose(emitter.file);
+	emitter.file = file;
+	emitter.line = 0;
+
+	if (emitter.tasks == NULL) {
+		emitter.tasks = open_memstream(&emitter.tasks_text, &emitter.tasks_length);
+	}
+	fwrite(text, 1, length, emitter.tasks);
+	free(text);
+
+	// nothing to do unless first < end
+	fprintf(emitter.file, "	; parallel loop\n");
+	emit_load("rdx", index->data_type, "[rbp - %u]", index->location);
+	fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", end_loc);
+	emit_normalize("rcx", index->data_type);
+	fprintf(emitter.file, "	cmp rdx, rcx\n");
+	fprintf(emitter.file, "	%s .label%u\n", type_is_signed(index->data_type) ? "jge" : "jae", skip_label);
+	fprintf(emitter.file, "	sub rcx, rdx\n");
+	fprintf(emitter.file, "	mov rdi, _parallel_%.*s_%u\n", emitter.current_func->name.len, emitter.current_func->name.str, task);
+	fprintf(emitter.file, "	mov rsi, rbp\n");
+	if (parallel->chunk != NULL) {
+		fprintf(emitter.file, "	mov r8, qword [rbp - %u]\n", chunk_loc);
+	} else {
+		fprintf(emitter.file, "	xor r8d, r8d\n");
+	}
+	fprintf(emitter.file, "	call _parallel_for\n");
+	// the other threads wrote shared memory
+	cse_kill_memory();
+	fprintf(emitter.file, ".label%u:\n", skip_label);
+}
+
+// writes out the bodies of the current function's parallel loops
+static void emit_tasks() {
+	if (emitter.tasks == NULL)
+		return;
+
+	fclose(emitter.tasks);
+	fwrite(emitter.tasks_text, 1, emitter.tasks_length, emitter.file);
+	free(emitter.tasks_text);
+	emitter.tasks = NULL;
+	emitter.tasks_text = NULL;
+	emitter.tasks_length = 0;
+}
+
+// a switch is lowered by first splitting its sorted cases into clusters, each as long as still fits one of:
+//   one bit test per body, when a few bodies share values that are close together
+//   a jump table, when the values are dense
+// cases that fit in none are clusters of their own. then it compares against the first case of the middle cluster
+// and lowers both halves the same way, until a single cluster or only a few cases are left, which are compared one
+// by one. splitting at clusters keeps dense runs together, like 0 to 5 next to a lone 100.
+#define SWITCH_MAX_BIT_TESTS 3
+#define SWITCH_MIN_TABLE_CASES 4
+#define SWITCH_MAX_TABLE_SPREAD 3 // table entries per case
+#define SWITCH_MAX_COMPARES 3
+
+typedef enum {
+	CASES_COMPARES,
+	CASES_BIT_TESTS,
+	CASES_JUMP_TABLE,
+} Case_Lowering;
+
+// compares rax to a case value, which only fits in an immediate if it's a sign extended 32 bit value
+static void emit_compare_case(u64 value) {
+	if ((s64) value == (s32) value) {
+		fprintf(emitter.file, "	cmp rax, %" PRId64 "\n", (s64) value);
+	} else {
+		fprintf(emitter.file, "	mov rdx, %" PRIu64 "\n", value);
+		fprintf(emitter.file, "	cmp rax, rdx\n");
+	}
+}
+
+// rcx = rax - low, jumps to the default unless that's at most spread
+static void emit_case_offset(u64 low, u64 spread, u32 default_label) {
+	fprintf(emitter.file, "	mov rcx, rax\n");
+	if ((s64) low == (s32) low) {
+		if (low != 0)
+			fprintf(emitter.file, "	sub rcx, %" PRId64 "\n", (s64) low);
+	} else {
+		fprintf(emitter.file, "	mov rdx, %" PRIu64 "\n", low);
+		fprintf(emitter.file, "	sub rcx, rdx\n");
+	}
+	fprintf(emitter.file, "	cmp rcx, %" PRIu64 "\n", spread);
+	fprintf(emitter.file, "	ja .label%u\n", default_label);
+}
+
+// how count cases starting at first are best lowered, fills in their distinct bodies in order of appearance for bit
+// tests, counting one more than the limit if there are too many
+static Case_Lowering choose_case_lowering(AST_Switch* switch_stmt, u32 first, u32 count, u32* bodies, u32* num_bodies) {
+	Switch_Case* cases = switch_stmt->cases + first;
+	u64 spread = cases[count - 1].value - cases[0].value; // the cases are sorted in the order of the value's type
+
+	// bit tests only cover 64 values, which also keeps looking for clusters quick
+	*num_bodies = SWITCH_MAX_BIT_TESTS + 1;
+	if (spread < 64) {
+		*num_bodies = 0;
+	}
+	for (u32 i = 0; i < count && *num_bodies <= SWITCH_MAX_BIT_TESTS; i++) {
+		u32 j = 0;
+		while (j < *num_bodies && bodies[j] != cases[i].body) {
+			j++;
+		}
+		if (j < *num_bodies)
+			continue;
+		if (*num_bodies < SWITCH_MAX_BIT_TESTS)
+			bodies[*num_bodies] = cases[i].body;
+		(*num_bodies)++;
+	}
+
+	if (spread < 64 && *num_bodies <= SWITCH_MAX_BIT_TESTS && *num_bodies < count && count > SWITCH_MAX_COMPARES)
+		return CASES_BIT_TESTS;
+	if (count >= SWITCH_MIN_TABLE_CASES && spread < (u64) count * SWITCH_MAX_TABLE_SPREAD)
+		return CASES_JUMP_TABLE;
+	return CASES_COMPARES;
+}
+
+// jumps to the body of the case matching rax among count cases starting at first, or to the default
+static void emit_case_range(AST_Switch* switch_stmt, u32 first, u32 count, u32 body_label, u32 default_label) {
+	Switch_Case* cases = switch_stmt->cases + first;
+	u64 low = cases[0].value;
+	u64 spread = cases[count - 1].value - low;
+
+	u32 bodies[SWITCH_MAX_BIT_TESTS];
+	u32 num_bodies;
+	Case_Lowering lowering = choose_case_lowering(switch_stmt, first, count, bodies, &num_bodies);
+
+	if (lowering == CASES_BIT_TESTS) {
+		stats_count(STAT_BIT_TEST);
+		fprintf(emitter.file, "	; switch, bit tests\n");
+		emit_case_offset(low, spread, default_label);
+		for (u32 i = 0; i < num_bodies; i++) {
+			u64 mask = 0;
+			for (u32 j = 0; j < count; j++) {
+				if (cases[j].body == bodies[i])
+					mask |= (u64) 1 << (cases[j].value - low);
+			}
+			fprintf(emitter.file, "	mov rdx, %" PRIu64 "\n", mask);
+			fprintf(emitter.file, "	bt rdx, rcx\n");
+			fprintf(emitter.file, "	jc .label%u\n", body_label + bodies[i]);
+		}
+		fprintf(emitter.file, "	jmp .label%u\n", default_label);
+		return;
+	}
+
+	if (lowering == CASES_JUMP_TABLE) {
+		u32 table_label = emitter.label++;
+		stats_count(STAT_JUMP_TABLE);
+		fprintf(emitter.file, "	; switch, jump table\n");
+		emit_case_offset(low, spread, default_label);
+		fprintf(emitter.file, "	lea rdx, [rel .label%u]\n", table_label);
+		fprintf(emitter.file, "	jmp qword [rdx + rcx * 8]\n");
+
+		// absolute addresses, like the rest of the output this needs a non-pie link
+		fprintf(emitter.file, "section .rodata\n");
+		fprintf(emitter.file, "	align 8\n");
+		fprintf(emitter.file, ".label%u:\n", table_label);
+		u32 next = 0;
+		for (u64 offset = 0; offset <= spread; offset++) {
+			u32 target = default_label;
+			if (cases[next].value - low == offset) {
+				target = body_label + cases[next].body;
+				next++;
+			}
+			fprintf(emitter.file, "	dq .label%u\n", target);
+		}
+		fprintf(emitter.file, "section .text\n");
+		return;
+	}
+
+	fprintf(emitter.file, "	; switch, compares\n");
+	for (u32 i = 0; i < count; i++) {
+		emit_compare_case(cases[i].value);
+		fprintf(emitter.file, "	je .label%u\n", body_label + cases[i].body);
+	}
+	fprintf(emitter.file, "	jmp .label%u\n", default_label);
+}
+
+// splits the cases into clusters, each taking the most cases from its start on that still fit a bit test or a jump
+// table, or just its first case. starts gets the first case of every cluster and the number of cases after them
+static u32 find_case_clusters(AST_Switch* switch_stmt, u32* starts) {
+	u32 num_clusters = 0;
+	u32 bodies[SWITCH_MAX_BIT_TESTS];
+	u32 num_bodies;
+
+	for (u32 first = 0; first < switch_stmt->num_cases;) {
+		// a longer range can be denser again, so every length is tried
+		u32 count = 1;
+		for (u32 length = 2; first + length <= switch_stmt->num_cases; length++) {
+			if (choose_case_lowering(switch_stmt, first, length, bodies, &num_bodies) != CASES_COMPARES)
+				count = length;
+		}
+		starts[num_clusters++] = first;
+		first += count;
+	}
+	starts[num_clusters] = switch_stmt->num_cases;
+	return num_clusters;
+}
+
+// jumps to the body of the case matching rax among the count clusters from first on, or to the default
+static void emit_case_clusters(AST_Switch* switch_stmt, u32* starts, u32 first, u32 count, u32 body_label, u32 default_label) {
+	u32 num_cases = starts[first + count] - starts[first];
+	if (count == 1 || num_cases <= SWITCH_MAX_COMPARES) {
+		emit_case_range(switch_stmt, starts[first], num_cases, body_label, default_label);
+		return;
+	}
+
+	u32 half = count / 2;
+	u32 lower_label = emitter.label++;
+	fprintf(emitter.file, "	; switch, split at the middle cluster\n");
+	emit_compare_case(switch_stmt->cases[starts[first + half]].value);
+	fprintf(emitter.file, "	%s .label%u\n", type_is_signed(switch_stmt->value->data_type) ? "jl" : "jb", lower_label);
+	emit_case_clusters(switch_stmt, starts, first + half, count - half, body_label, default_label);
+	fprintf(emitter.file, ".label%u:\n", lower_label);
+	emit_case_clusters(switch_stmt, starts, first, half, body_label, default_label);
+}
+
+void emit_switch(AST_Switch* switch_stmt) {
+	stack_loc value_loc = emit_node(switch_stmt->value);
+
+	u32 body_label = emitter.label;
+	emitter.label += switch_stmt->num_bodies;
+	u32 default_label = emitter.label++;
+	u32 end_label = emitter.label++;
+
+	fprintf(emitter.file, "	; switch statement\n");
+	if (switch_stmt->num_cases > 0) {
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", value_loc);
+		u32* starts = malloc((switch_stmt->num_cases + 1) * sizeof(u32));
+		u32 num_clusters = find_case_clusters(switch_stmt, starts);
+		emit_case_clusters(switch_stmt, starts, 0, num_clusters, body_label, default_label);
+		free(starts);
+	}
+
+	for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+		fprintf(emitter.file, ".label%u:\n", body_label + i);
+		u32 values = cse_enter();
+		emit_node(switch_stmt->bodies[i]);
+		cse_leave(values);
+		fprintf(emitter.file, "	jmp .label%u\n", end_label);
+	}
+
+	fprintf(emitter.file, ".label%u:\n", default_label);
+	if (switch_stmt->default_body != NULL) {
+		u32 values = cse_enter();
+		emit_node(switch_stmt->default_body);
+		cse_leave(values);
+	}
+	fprintf(emitter.file, ".label%u:\n", end_label);
+}
+
+// a generator keeps its frame in a heap block instead of on the stack, so it can stop at a yield and go on from there
+// later. the block starts with a header of four quadwords: the value yielded last, where to resume, the rbp of the
+// frame and padding, then the frame follows, with rbp right at its end. calling the generator only makes the block,
+// next calls _gen_resume (see runtime.c), which jumps back into the body with rbp pointing into the block while rsp
+// stays on the caller's stack. yield and the end of the body return from there like a function would.
+static stack_loc generator_header(u32 offset) {
+	return emitter.context.frame_size + 32 - offset;
+}
+
+// the resume address of a finished generator is _gen_done, which returns 0 again
+static void emit_generator_finish() {
+	fprintf(emitter.file, "	; generator finished\n");
+	fprintf(emitter.file, "	lea rcx, [rel _gen_done]\n");
+	fprintf(emitter.file, "	mov qword [rbp - %u], rcx\n", generator_header(8));
+	fprintf(emitter.file, "	xor eax, eax\n");
+	fprintf(emitter.file, "	pop rbp\n");
+	fprintf(emitter.file, "	ret\n");
+}
+
+static void emit_generator_decl(AST_Func_Decl* node) {
+	u32 start_label = emitter.label++;
+	u32 block_size = emitter.context.frame_size + 32;
+	emitter.uses_generators = true;
+
+	// the function makes the block and copies the arguments into it
+	fprintf(emitter.file, "global %.*s:function (_end_%.*s - %.*s)\n", node->name.len, node->name.str, node->name.len, node->name.str, node->name.len, node->name.str);
+	fprintf(emitter.file, "%.*s:\n", node->name.len, node->name.str);
+	fprintf(emitter.file, "	push rbp\n");
+	fprintf(emitter.file, "	mov rbp, rsp\n");
+	u32 reg_args = node->num_args < MAX_REG_ARGS ? node->num_args : MAX_REG_ARGS;
+	if (reg_args > 0) {
+		fprintf(emitter.file, "	sub rsp, %u\n", (reg_args * 8 + 15) & ~15);
+	}
+	for (u32 i = 0; i < reg_args; i++) {
+		fprintf(emitter.file, "	mov qword [rbp - %u], %s\n", (i + 1) * 8, sysv_call_regs[i]);
+	}
+	fprintf(emitter.file, "	mov edi, %u\n", block_size);
+	fprintf(emitter.file, "	call malloc\n");
+	fprintf(emitter.file, "	mov qword [rax], 0\n");
+	fprintf(emitter.file, "	lea rcx, [rel .label%u]\n", start_label);
+	fprintf(emitter.file, "	mov qword [rax + 8], rcx\n");
+	fprintf(emitter.file, "	lea rcx, [rax + %u]\n", block_size);
+	fprintf(emitter.file, "	mov qword [rax + 16], rcx\n");
+	for (u32 i = 0; i < node->num_args; i++) {
+		AST_Var_Decl* arg = node->args[i];
+		u32 size = type_size(arg->data_type);
+		arg->location = allocate_var(size, size);
+		if (i < MAX_REG_ARGS) {
+			fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", (i + 1) * 8);
+		} else {
+			fprintf(emitter.file, "	mov rcx, qword [rbp + %u]\n", 16 + (i - MAX_REG_ARGS) * 8);
+		}
+		emit_store_value("rcx", arg->data_type, "[rax + %u]", block_size - arg->location);
+	}
+	fprintf(emitter.file, "	mov rsp, rbp\n");
+	fprintf(emitter.file, "	pop rbp\n");
+	fprintf(emitter.file, "	ret\n");
+
+	// the body, entered from _gen_resume
+	fprintf(emitter.file, ".label%u:\n", start_label);
+	emit_profile_counter(node->profile_id);
+	emit_node(node->body);
+	emit_generator_finish();
+
+	emit_cold_blocks(0);
+	emit_tasks();
+	fprintf(emitter.file, "_end_%.*s:\n", node->name.len, node->name.str);
+}
+
+// stores the value where *g reads it and returns 1 from next, which resumes after it
+static void emit_yield(AST_Return* yield) {
+	u32 resume_label = emitter.label++;
+	stack_loc value_loc = emit_node(yield->expr);
+
+	fprintf(emitter.file, "	; yield\n");
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", value_loc);
+	emit_normalize("rax", emitter.current_func->return_type);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", generator_header(0));
+	fprintf(emitter.file, "	lea rax, [rel .label%u]\n", resume_label);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", generator_header(8));
+	fprintf(emitter.file, "	mov eax, 1\n");
+	fprintf(emitter.file, "	pop rbp\n");
+	fprintf(emitter.file, "	ret\n");
+	fprintf(emitter.file, ".label%u:\n", resume_label);
+
+	// the caller ran in between, like during a call
+	cse_kill_memory();
 }
 
 void emit_func_decl(AST_Func_Decl* node) {
 	// calculate ahead of time, how much stack space this function is gonna need to allocate
 	// for variables, arguments and temporary values.
-	u32 required_stack_alloc = get_required_stack_size((AST_Node*) node) * 8;
+	u32 required_stack_alloc = get_required_stack_size(flat_find_def(emitter.flat, (AST_Node*) node));
 
 	// align the stack to 16 bytes
 	// (sysv amd64 abi requires this)
@@ -256,34 +1023,47 @@ void emit_func_decl(AST_Func_Decl* node) {
 		required_stack_alloc += 16;
 	}
 
-	// reset the context, clear any previous local variables etc.
+	// reset the context
+	// labels are local to the function (nasm local labels are scoped to the function's label)
 	memset(&emitter.context, 0, sizeof(Local_Context));
-	emitter.context.alloc = 1; // start at ebp - 8
+	emitter.context.frame_size = required_stack_alloc;
+	emitter.current_func = node;
+	emitter.label = 0;
+	emitter.line = 0;
+	emitter.num_tasks = 0;
+	cse_reset();
+	emit_line((AST_Node*) node);
+
+	if (node->is_generator) {
+		emit_generator_decl(node);
+		return;
+	}
 
 	// function prologue
-	fprintf(emitter.file, "global %.*s\n", node->name.len, node->name.str);
+	// typed and sized so profilers attribute everything up to the end label to this function
+	fprintf(emitter.file, "global %.*s:function (_end_%.*s - %.*s)\n", node->name.len, node->name.str, node->name.len, node->name.str, node->name.len, node->name.str);
 	fprintf(emitter.file, "%.*s:\n", node->name.len, node->name.str);
 	fprintf(emitter.file, "	push rbp\n");
 	fprintf(emitter.file, "	mov rbp, rsp\n");
 	fprintf(emitter.file, "	sub rsp, %u\n", required_stack_alloc);
 
-	// put arguments passed in registers into stack space (for now)
-	Variable* arg_vars[MAX_ARGS];
+	// copy arguments from registers into stack (for now), and the ones passed on the stack into the frame
 	for (u32 i = 0; i < node->num_args; i++) {
-		Variable* var = &emitter.context.vars[emitter.context.num_vars++];
-		var->location = allocate_stack();
-		var->token = node->args[i];
-		arg_vars[i] = var;
-	}
-
-	// copy arguments from registers into stack
-	for (u32 i = 0; i < node->num_args; i++) {
-		fprintf(emitter.file, "	mov qword [rbp - %u], %s\n", arg_vars[i]->location * 8, sysv_call_regs[i]);
+		AST_Var_Decl* arg = node->args[i];
+		u32 size = type_size(arg->data_type);
+		arg->location = allocate_var(size, size);
+		if (i < MAX_REG_ARGS) {
+			emit_store_value(sysv_call_regs[i], arg->data_type, "[rbp - %u]", arg->location);
+		} else {
+			// above the return address and the saved rbp, in order
+			fprintf(emitter.file, "	mov rax, qword [rbp + %u]\n", 16 + (i - MAX_REG_ARGS) * 8);
+			emit_store_value("rax", arg->data_type, "[rbp - %u]", arg->location);
+		}
 	}
 
-	if (node->num_args > MAX_ARGS) {
-		printf("emit_func_decl error: too many args\n");
-		error();
+	emit_profile_counter(node->profile_id);
+	if (node->name.symbol == SYM_MAIN) {
+		emit_profile_setup();
 	}
 
 	// emit the function body
@@ -293,11 +1073,589 @@ void emit_func_decl(AST_Func_Decl* node) {
 	fprintf(emitter.file, "	mov rsp, rbp\n");
 	fprintf(emitter.file, "	pop rbp\n");
 	fprintf(emitter.file, "	ret\n");
+
+	emit_cold_blocks(0);
+	emit_tasks();
+	fprintf(emitter.file, "_end_%.*s:\n", node->name.len, node->name.str);
 }
 
-stack_loc emit_func_call(AST_Func_Call* call) {
-	// todo: keep track of declared funcs
+// texts up to this long are copied into the buffer, longer ones are written straight from the string literal
+#define FORMAT_MAX_COPY 64
+
+// the text of a string literal like it ends up in memory, without the terminating 0
+static char* decode_string(const Symbol* symbol, u32* length) {
+	char* text = malloc(symbol->len);
+	*length = 0;
+
+	// the only escape is \n, checked when the literal is emitted
+	for (u32 pos = 1; pos < symbol->len - 1; pos++) {
+		if (symbol->str[pos] == '\\') {
+			text[(*length)++] = '\n';
+			pos++;
+		} else {
+			text[(*length)++] = symbol->str[pos];
+		}
+	}
+	return text;
+}
+
+// cuts the format of a printf call into parts, false if the call needs the real printf.
+// that's the case for formats that aren't literals, conversions other than %d %i %u %x %c %s and %%, flags, widths
+// and precisions, and formats that don't take exactly the arguments the call has
+static bool parse_format(AST_Func_Call* call, const char* text, u32 length, Format_Part* parts, u32* num_parts) {
+	u32 num_values = 0;
+	*num_parts = 0;
+
+	for (u32 i = 0; i < length;) {
+		if (*num_parts >= MAX_FORMAT_PARTS)
+			return false;
+
+		Format_Part* part = &parts[(*num_parts)++];
+		part->offset = i;
+		part->wide = false;
+
+		if (text[i] != '%') {
+			while (i < length && text[i] != '%') {
+				i++;
+			}
+			part->kind = FORMAT_TEXT;
+			part->length = i - part->offset;
+			continue;
+		}
+
+		i++;
+		u32 longs = 0;
+		while (i < length && text[i] == 'l') {
+			longs++;
+			i++;
+		}
+		if (i >= length || longs > 2)
+			return false;
+
+		switch (text[i]) {
+			case '%':
+				if (longs > 0)
+					return false;
+				part->kind = FORMAT_TEXT;
+				part->offset = i++;
+				part->length = 1;
+				continue;
+			case 'd':
+			case 'i':
+				part->kind = FORMAT_SIGNED;
+				break;
+			case 'u':
+				part->kind = FORMAT_UNSIGNED;
+				break;
+			case 'x':
+				part->kind = FORMAT_HEX;
+				break;
+			case 'c':
+				part->kind = FORMAT_CHAR;
+				break;
+			case 's':
+				part->kind = FORMAT_STRING;
+				break;
+			default:
+				return false;
+		}
+
+		// wide chars and strings
+		if (longs > 0 && (part->kind == FORMAT_CHAR || part->kind == FORMAT_STRING))
+			return false;
+
+		part->wide = longs > 0;
+		num_values++;
+		i++;
+	}
+
+	return num_values == call->num_args - 1;
+}
+
+// the decoded format of a printf call that can be specialized, NULL if it can't
+static char* get_format(AST_Func_Call* call, Format_Part* parts, u32* num_parts) {
+	if (!options.specialize_printf || call->decl != NULL || call->name.symbol != emitter.printf_symbol)
+		return NULL;
+	if (call->num_args == 0 || call->args[0]->type != AST_STR_LITERAL)
+		return NULL;
+
+	u32 length;
+	char* text = decode_string(get_symbol(((AST_String*) call->args[0])->token.symbol), &length);
+	if (!parse_format(call, text, length, parts, num_parts)) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+// reuses the code of functions the compile server has seen before
+static void emit_cached_func_decl(AST_Func_Decl* node) {
+	// code from the cache needs the runtime too
+	u32 def = flat_find_def(emitter.flat, (AST_Node*) node);
+	for (u32 i = def; i < emitter.flat->ends[def]; i++) {
+		if (emitter.flat->kinds[i] == AST_PARALLEL) {
+			emitter.uses_parallel = true;
+		}
+		if (emitter.flat->kinds[i] == AST_YIELD) {
+			emitter.uses_generators = true;
+		}
+
+		Format_Part parts[MAX_FORMAT_PARTS];
+		u32 num_parts;
+		if (emitter.flat->kinds[i] == AST_FUNC_CALL) {
+			AST_Func_Call* call = (AST_Func_Call*) emitter.flat->nodes[i];
+			if (is_builtin(call) && call->name.symbol >= SYM_REGION && call->name.symbol <= SYM_REGIONFREE) {
+				emitter.uses_regions = true;
+			}
+			if (is_builtin(call) && call->name.symbol == SYM_NEXT) {
+				emitter.uses_generators = true;
+			}
+
+			char* format = get_format(call, parts, &num_parts);
+			if (format != NULL) {
+				emitter.uses_format = true;
+				free(format);
+			}
+		}
+	}
+
+	if (!cache_enabled() && options.stats == STATS_NONE) {
+		emit_func_decl(node);
+		return;
+	}
+
+	// the statistics are taken while emitting, cached code would have none
+	u64 key = 0;
+	if (cache_enabled()) {
+		key = hash_function(node);
+		const Cache_Entry* entry = cache_lookup(key);
+		if (entry != NULL && options.stats == STATS_NONE) {
+			fwrite(entry->text, 1, entry->length, emitter.file);
+			return;
+		}
+	}
+
+	// emit into memory to be able to send it to the server and count its instructions
+	FILE* file = emitter.file;
+	char* text;
+	size_t length;
+	emitter.file = open_memstream(&text, &length);
+	emit_func_decl(node);
+	fclose(emitter.file);
+	emitter.file = file;
+
+	fwrite(text, 1, length, emitter.file);
+	if (options.stats != STATS_NONE) {
+		stats_add_func(node, text, length);
+	}
+	if (cache_enabled()) {
+		cache_send(key, text, length);
+	}
+	free(text);
+}
+
+// emits the callee's body in place, with the arguments copied into its parameters
+static void emit_inlined_call(AST_Func_Call* call, stack_loc* arg_locs, stack_loc result_loc) {
+	AST_Func_Decl* func = call->decl;
+	fprintf(emitter.file, "	; inlined call to %.*s\n", func->name.len, func->name.str);
+
+	for (u32 i = 0; i < func->num_args; i++) {
+		AST_Var_Decl* arg = func->args[i];
+		u32 size = type_size(arg->data_type);
+		arg->location = allocate_var(size, size);
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[i]);
+		emit_store_value("rax", arg->data_type, "[rbp - %u]", arg->location);
+		cse_kill_var(arg);
+	}
+	emit_profile_counter(func->profile_id);
+
+	emitter.inline_func = func;
+	emitter.inline_result = result_loc;
+	emitter.inline_exit_label = emitter.label++;
+
+	// returns jump to the exit, so values computed in the body don't dominate the code after it
+	u32 values = cse_enter();
+	emit_node(func->body);
+	cse_leave(values);
+	fprintf(emitter.file, ".label%u:\n", emitter.inline_exit_label);
+
+	emitter.inline_func = NULL;
+}
+
+// zero-extends the low size bytes of a register, so the bit builtins only see the bits of their argument's type
+static void emit_zero_extend(const char* reg, u32 size) {
+	if (size == 8)
+		return;
+
+	if (size == 4) {
+		fprintf(emitter.file, "	mov %s, %s\n", sized_register(reg, 4), sized_register(reg, 4));
+	} else {
+		fprintf(emitter.file, "	movzx %s, %s\n", sized_register(reg, 4), sized_register(reg, size));
+	}
+}
+
+// popcnt, lzcnt and tzcnt, with the instructions when the target has them and the classic sequences otherwise
+static void emit_bit_count(u32 symbol, u32 bits) {
+	// haswell and later, which -march=avx2 targets, all have popcnt, lzcnt and tzcnt
+	bool native = options.arch == ARCH_AVX2;
+
+	if (symbol == SYM_POPCNT) {
+		if (native) {
+			fprintf(emitter.file, "	popcnt rax, rax\n");
+			return;
+		}
+		// sums of bit pairs, nibbles and bytes
+		fprintf(emitter.file, "	mov rcx, rax\n");
+		fprintf(emitter.file, "	shr rcx, 1\n");
+		fprintf(emitter.file, "	mov rdx, 0x5555555555555555\n");
+		fprintf(emitter.file, "	and rcx, rdx\n");
+		fprintf(emitter.file, "	sub rax, rcx\n");
+		fprintf(emitter.file, "	mov rdx, 0x3333333333333333\n");
+		fprintf(emitter.file, "	mov rcx, rax\n");
+		fprintf(emitter.file, "	shr rcx, 2\n");
+		fprintf(emitter.file, "	and rax, rdx\n");
+		fprintf(emitter.file, "	and rcx, rdx\n");
+		fprintf(emitter.file, "	add rax, rcx\n");
+		fprintf(emitter.file, "	mov rcx, rax\n");
+		fprintf(emitter.file, "	shr rcx, 4\n");
+		fprintf(emitter.file, "	add rax, rcx\n");
+		fprintf(emitter.file, "	mov rdx, 0x0f0f0f0f0f0f0f0f\n");
+		fprintf(emitter.file, "	and rax, rdx\n");
+		fprintf(emitter.file, "	mov rdx, 0x0101010101010101\n");
+		fprintf(emitter.file, "	imul rax, rdx\n");
+		fprintf(emitter.file, "	shr rax, 56\n");
+	} else if (symbol == SYM_LZCNT) {
+		if (native) {
+			fprintf(emitter.file, "	lzcnt rax, rax\n");
+			if (bits < 64) {
+				fprintf(emitter.file, "	sub rax, %u\n", 64 - bits);
+			}
+			return;
+		}
+		// bsr leaves the destination alone for 0, which counts as index -1
+		fprintf(emitter.file, "	mov rcx, -1\n");
+		fprintf(emitter.file, "	bsr rax, rax\n");
+		fprintf(emitter.file, "	cmovz rax, rcx\n");
+		fprintf(emitter.file, "	neg rax\n");
+		fprintf(emitter.file, "	add rax, %u\n", bits - 1);
+	} else if (native) {
+		// a bit past the type's top one makes 0 count as the type's width
+		if (bits < 64) {
+			fprintf(emitter.file, "	bts rax, %u\n", bits);
+		}
+		fprintf(emitter.file, "	tzcnt rax, rax\n");
+	} else {
+		fprintf(emitter.file, "	mov ecx, %u\n", bits);
+		fprintf(emitter.file, "	bsf rax, rax\n");
+		fprintf(emitter.file, "	cmovz rax, rcx\n");
+	}
+}
+
+// plain loads and stores are atomic on x64 as long as they're aligned, and already acquire and release.
+// read-modify-writes need the lock prefix (implied by xchg), which also makes them full barriers
+static void emit_atomic(AST_Func_Call* call, stack_loc* arg_locs, stack_loc result_loc) {
+	Data_Type type = call->args[0]->data_type;
+	type.pointers--;
+	u32 size = type_size(type);
+	u32 symbol = call->name.symbol;
+
+	fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", arg_locs[0]);
+	if (symbol == SYM_ATOMICLOAD) {
+		emit_load("rax", type, "[rcx]");
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+		return;
+	}
+
+	if (symbol == SYM_ATOMICSTORE) {
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[1]);
+		if (call->order == ORDER_SEQ_CST) {
+			// keeps later loads from moving ahead of the store
+			fprintf(emitter.file, "	xchg %s [rcx], %s\n", size_keyword(size), sized_register("rax", size));
+		} else {
+			emit_store_value("rax", type, "[rcx]");
+		}
+		return;
+	}
+
+	if (symbol == SYM_ATOMICCAS) {
+		// compares with rax, which ends up holding the old value either way
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[1]);
+		fprintf(emitter.file, "	mov rdx, qword [rbp - %u]\n", arg_locs[2]);
+		fprintf(emitter.file, "	lock cmpxchg %s [rcx], %s\n", size_keyword(size), sized_register("rdx", size));
+	} else {
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[1]);
+		fprintf(emitter.file, "	%s %s [rcx], %s\n", symbol == SYM_ATOMICADD ? "lock xadd" : "xchg",
+			size_keyword(size), sized_register("rax", size));
+	}
+	emit_normalize("rax", type);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+}
+
+// bumps the region's pointer if the allocation fits into its chunk, otherwise calls the runtime for a new one
+static void emit_region_alloc(stack_loc* arg_locs, stack_loc result_loc) {
+	u32 refill = emitter.label++;
+	u32 done = emitter.label++;
+
+	fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", arg_locs[0]);
+	fprintf(emitter.file, "	mov rsi, qword [rbp - %u]\n", arg_locs[1]);
+	// sizes bigger than a chunk are left to the refill before rounding them up could wrap around
+	fprintf(emitter.file, "	cmp rsi, %u\n", REGION_CHUNK_SIZE);
+	fprintf(emitter.file, "	ja .label%u\n", refill);
+	// rounded up to 16, and 0 to 16 too so every allocation gets memory of its own
+	fprintf(emitter.file, "	cmp rsi, 1\n");
+	fprintf(emitter.file, "	adc rsi, 15\n");
+	fprintf(emitter.file, "	and rsi, -16\n");
+	fprintf(emitter.file, "	mov rax, qword [rcx]\n");
+	fprintf(emitter.file, "	lea rdx, [rax + rsi]\n");
+	fprintf(emitter.file, "	cmp rdx, qword [rcx + 8]\n");
+	fprintf(emitter.file, "	ja .label%u\n", refill);
+	fprintf(emitter.file, "	mov qword [rcx], rdx\n");
+	fprintf(emitter.file, "	jmp .label%u\n", done);
+	fprintf(emitter.file, ".label%u:\n", refill);
+	fprintf(emitter.file, "	mov rdi, rcx\n");
+	fprintf(emitter.file, "	call _region_refill\n");
+	fprintf(emitter.file, ".label%u:\n", done);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+}
+
+// builtins that are a few instructions inline instead of a call
+static void emit_builtin(AST_Func_Call* call, stack_loc* arg_locs, stack_loc result_loc) {
+	Data_Type type = call->data_type;
+	bool is_signed = type_is_signed(type);
+	u32 symbol = call->name.symbol;
+	fprintf(emitter.file, "	; %.*s\n", call->name.len, call->name.str);
+
+	switch (symbol) {
+		case SYM_RDTSC:
+			fprintf(emitter.file, "	rdtsc\n");
+			fprintf(emitter.file, "	shl rdx, 32\n");
+			fprintf(emitter.file, "	or rax, rdx\n");
+			fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+			return;
+		case SYM_PREFETCH:
+			fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[0]);
+			fprintf(emitter.file, "	prefetcht0 [rax]\n");
+			return;
+		case SYM_PAUSE:
+			fprintf(emitter.file, "	pause\n");
+			return;
+		case SYM_FENCE:
+			// x64 only lets loads move ahead of earlier stores, which just the sequentially consistent fence forbids
+			if (call->order == ORDER_SEQ_CST) {
+				fprintf(emitter.file, "	mfence\n");
+			}
+			return;
+		case SYM_ATOMICLOAD:
+		case SYM_ATOMICSTORE:
+		case SYM_ATOMICADD:
+		case SYM_ATOMICXCHG:
+		case SYM_ATOMICCAS:
+			emit_atomic(call, arg_locs, result_loc);
+			return;
+		case SYM_REGION:
+			emitter.uses_regions = true;
+			fprintf(emitter.file, "	call _region_new\n");
+			fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+			return;
+		case SYM_REGIONALLOC:
+			emitter.uses_regions = true;
+			emit_region_alloc(arg_locs, result_loc);
+			return;
+		case SYM_REGIONRESET:
+		case SYM_REGIONFREE:
+			emitter.uses_regions = true;
+			fprintf(emitter.file, "	mov rdi, qword [rbp - %u]\n", arg_locs[0]);
+			fprintf(emitter.file, "	call %s\n", symbol == SYM_REGIONRESET ? "_region_reset" : "_region_free");
+			return;
+		case SYM_NEXT:
+			emitter.uses_generators = true;
+			fprintf(emitter.file, "	mov rdi, qword [rbp - %u]\n", arg_locs[0]);
+			fprintf(emitter.file, "	call _gen_resume\n");
+			fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+			return;
+		case SYM_POPCNT:
+		case SYM_LZCNT:
+		case SYM_TZCNT:
+		case SYM_BSWAP:
+		case SYM_ROTL:
+		case SYM_ROTR: {
+			u32 size = type_size(call->args[0]->data_type);
+			fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[0]);
+			emit_zero_extend("rax", size);
+
+			if (symbol == SYM_BSWAP) {
+				if (size == 8 || size == 4) {
+					fprintf(emitter.file, "	bswap %s\n", sized_register("rax", size));
+				} else if (size == 2) {
+					fprintf(emitter.file, "	rol ax, 8\n");
+				}
+				emit_normalize("rax", type);
+			} else if (symbol == SYM_ROTL || symbol == SYM_ROTR) {
+				// the count is masked like the shifts, which is the same as taking it modulo the width
+				fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", arg_locs[1]);
+				fprintf(emitter.file, "	%s %s, cl\n", symbol == SYM_ROTL ? "rol" : "ror", sized_register("rax", size));
+				emit_normalize("rax", type);
+			} else {
+				emit_bit_count(symbol, size * 8);
+			}
+			fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+			return;
+		}
+		default:
+			break;
+	}
+
+	// min, max and abs, without a branch
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[0]);
+	emit_normalize("rax", type);
+
+	if (symbol == SYM_ABS) {
+		if (is_signed) {
+			// the most negative value stays negative, like in C
+			fprintf(emitter.file, "	mov rcx, rax\n");
+			fprintf(emitter.file, "	neg rcx\n");
+			fprintf(emitter.file, "	cmovns rax, rcx\n");
+			emit_normalize("rax", type);
+		}
+	} else {
+		fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", arg_locs[1]);
+		emit_normalize("rcx", type);
+		fprintf(emitter.file, "	cmp rax, rcx\n");
+		if (symbol == SYM_MIN) {
+			fprintf(emitter.file, "	%s rax, rcx\n", is_signed ? "cmovg" : "cmova");
+		} else {
+			fprintf(emitter.file, "	%s rax, rcx\n", is_signed ? "cmovl" : "cmovb");
+		}
+	}
 
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
+}
+
+// whether a part is written on its own instead of going through the buffer
+static bool is_written_directly(Format_Part* part) {
+	return part->kind == FORMAT_STRING || (part->kind == FORMAT_TEXT && part->length > FORMAT_MAX_COPY);
+}
+
+static void emit_format_flush(stack_loc result_loc) {
+	fprintf(emitter.file, "	mov rsi, rsp\n");
+	fprintf(emitter.file, "	call _fmt_write\n");
+	fprintf(emitter.file, "	add qword [rbp - %u], rax\n", result_loc);
+}
+
+// printf with a literal format, formatted by code specialized to it instead of parsing the format at runtime.
+// the parts are formatted into a buffer on the stack, which is written with a single fwrite, so the output stays in
+// order with the rest of stdio. strings and long texts are written on their own, after what's in the buffer
+static bool emit_printf(AST_Func_Call* call, stack_loc* arg_locs, stack_loc result_loc) {
+	Format_Part parts[MAX_FORMAT_PARTS];
+	u32 num_parts;
+	char* text = get_format(call, parts, &num_parts);
+	if (text == NULL)
+		return false;
+
+	emitter.uses_format = true;
+	stats_count(STAT_PRINTF);
+	const Symbol* format = get_symbol(((AST_String*) call->args[0])->token.symbol);
+
+	// the most any run of buffered parts can take, texts are copied 8 bytes at a time too
+	u32 buffer_size = 0;
+	u32 run_size = 0;
+	for (u32 i = 0; i < num_parts; i++) {
+		Format_Part* part = &parts[i];
+		if (is_written_directly(part)) {
+			run_size = 0;
+			continue;
+		}
+
+		switch (part->kind) {
+			case FORMAT_TEXT:
+				run_size += part->length;
+				break;
+			case FORMAT_CHAR:
+				run_size += 1;
+				break;
+			default:
+				// the digits are copied 24 bytes at a time
+				run_size += 24;
+				break;
+		}
+		if (run_size + 8 > buffer_size) {
+			buffer_size = run_size + 8;
+		}
+	}
+	buffer_size = (buffer_size + 15) & ~15;
+
+	fprintf(emitter.file, "	; printf specialized to its format\n");
+	fprintf(emitter.file, "	mov qword [rbp - %u], 0\n", result_loc);
+	if (buffer_size > 0) {
+		fprintf(emitter.file, "	sub rsp, %u\n", buffer_size);
+	}
+	fprintf(emitter.file, "	mov rdi, rsp\n");
+
+	bool buffered = false;
+	u32 value = 1;
+	for (u32 i = 0; i < num_parts; i++) {
+		Format_Part* part = &parts[i];
+		if (is_written_directly(part) && buffered) {
+			emit_format_flush(result_loc);
+			buffered = false;
+		}
+
+		switch (part->kind) {
+			case FORMAT_TEXT:
+				if (part->length > FORMAT_MAX_COPY) {
+					fprintf(emitter.file, "	mov rsi, _str_%016" PRIx64 " + %u\n", format->hash, part->offset);
+					fprintf(emitter.file, "	lea rdi, [rsi + %u]\n", part->length);
+					fprintf(emitter.file, "	call _fmt_write\n");
+					fprintf(emitter.file, "	add qword [rbp - %u], rax\n", result_loc);
+					fprintf(emitter.file, "	mov rdi, rsp\n");
+					continue;
+				}
+
+				for (u32 j = 0; j < part->length; j += 8) {
+					u64 bytes = 0;
+					memcpy(&bytes, text + part->offset + j, part->length - j < 8 ? part->length - j : 8);
+					fprintf(emitter.file, "	mov rax, 0x%" PRIx64 "\n", bytes);
+					fprintf(emitter.file, "	mov qword [rdi + %u], rax\n", j);
+				}
+				fprintf(emitter.file, "	add rdi, %u\n", part->length);
+				break;
+			case FORMAT_SIGNED:
+			case FORMAT_UNSIGNED:
+			case FORMAT_HEX:
+				// without l only the low 32 bits are passed, like for the real printf
+				fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[value++]);
+				if (!part->wide) {
+					fprintf(emitter.file, part->kind == FORMAT_SIGNED ? "	movsxd rax, eax\n" : "	mov eax, eax\n");
+				}
+				fprintf(emitter.file, "	call %s\n", part->kind == FORMAT_SIGNED ? "_fmt_signed" : part->kind == FORMAT_UNSIGNED ? "_fmt_unsigned" : "_fmt_hex");
+				break;
+			case FORMAT_CHAR:
+				fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", arg_locs[value++]);
+				fprintf(emitter.file, "	mov byte [rdi], al\n");
+				fprintf(emitter.file, "	inc rdi\n");
+				break;
+			case FORMAT_STRING:
+				fprintf(emitter.file, "	mov rsi, qword [rbp - %u]\n", arg_locs[value++]);
+				fprintf(emitter.file, "	call _fmt_string\n");
+				fprintf(emitter.file, "	add qword [rbp - %u], rax\n", result_loc);
+				fprintf(emitter.file, "	mov rdi, rsp\n");
+				continue;
+		}
+		buffered = true;
+	}
+
+	if (buffered) {
+		emit_format_flush(result_loc);
+	}
+	if (buffer_size > 0) {
+		fprintf(emitter.file, "	add rsp, %u\n", buffer_size);
+	}
+
+	free(text);
+	return true;
+}
+
+stack_loc emit_func_call(AST_Func_Call* call) {
 	stack_loc result_loc = allocate_stack();
 
 	// emit code for evaluating the arguments
@@ -306,33 +1664,172 @@ stack_loc emit_func_call(AST_Func_Call* call) {
 		locs[i] = emit_node(call->args[i]);
 	}
 
-	if (call->num_args > MAX_ARGS) {
-		printf("emit_func_call error: too many args\n");
-		error();
+	if (call->decl != NULL) {
+		emit_profile_counter(call->profile_id);
+	}
+
+	if (call->inline_call) {
+		stats_count(STAT_INLINED);
+		emit_inlined_call(call, locs, result_loc);
+		return result_loc;
+	}
+
+	if (is_builtin(call)) {
+		emit_builtin(call, locs, result_loc);
+		cse_kill_call(call);
+		return result_loc;
+	}
+
+	if (emit_printf(call, locs, result_loc)) {
+		cse_kill_call(call);
+		return result_loc;
+	}
+
+	// arguments past the registers are pushed last to first, with padding below them if that keeps the stack aligned
+	u32 stack_args = call->num_args > MAX_REG_ARGS ? call->num_args - MAX_REG_ARGS : 0;
+	u32 stack_size = (stack_args * 8 + 15) & ~15;
+	if (stack_size > stack_args * 8) {
+		fprintf(emitter.file, "	sub rsp, 8\n");
+	}
+	for (u32 i = call->num_args; i > MAX_REG_ARGS; i--) {
+		fprintf(emitter.file, "	push qword [rbp - %u]\n", locs[i - 1]);
 	}
 
 	// copy arguments from stack into registers
-	for (u32 i = 0; i < call->num_args; i++) {
-		fprintf(emitter.file, "	mov %s, qword [rbp - %u]\n", sysv_call_regs[i], locs[i] * 8);
+	for (u32 i = 0; i < call->num_args && i < MAX_REG_ARGS; i++) {
+		fprintf(emitter.file, "	mov %s, qword [rbp - %u]\n", sysv_call_regs[i], locs[i]);
 	}
 	
-	fprintf(emitter.file, "	call %.*s\n", call->name.len, call->name.str);
+	// builtins that map onto libc
+	if (call->name.symbol == SYM_ALLOC) {
+		fprintf(emitter.file, "	call malloc\n");
+	} else {
+		fprintf(emitter.file, "	call %.*s\n", call->name.len, call->name.str);
+	}
+	if (stack_size > 0) {
+		fprintf(emitter.file, "	add rsp, %u\n", stack_size);
+	}
+	cse_kill_call(call);
 	// move return value into temporary
-	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc * 8);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", result_loc);
 	return result_loc;
 }
 
+stack_loc emit_index(AST_Index* index) {
+	stack_loc base_loc = emit_node(index->base);
+	stack_loc index_loc = emit_node(index->index);
+	stack_loc location = allocate_stack();
+	u32 size = type_size(index->data_type);
+
+	fprintf(emitter.file, "	; index\n");
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", base_loc);
+	fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", index_loc);
+	emit_load("rax", index->data_type, "[rax + rcx * %u]", size);
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+	return location;
+}
+
+stack_loc emit_deref(AST_Unary* deref) {
+	stack_loc pointer_loc = emit_node(deref->expr);
+	stack_loc location = allocate_stack();
+
+	fprintf(emitter.file, "	; deref\n");
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", pointer_loc);
+	emit_load("rax", deref->data_type, "[rax]");
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+	return location;
+}
+
+stack_loc emit_addr_of(AST_Unary* addr) {
+	if (addr->expr->type == AST_VAR) {
+		AST_Var* var = (AST_Var*) addr->expr;
+		stack_loc location = allocate_stack();
+		fprintf(emitter.file, "	; address of\n");
+		fprintf(emitter.file, "	lea rax, [rbp - %u]\n", var->decl->location);
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+		return location;
+	}
+
+	AST_Index* index = (AST_Index*) addr->expr;
+	stack_loc base_loc = emit_node(index->base);
+	stack_loc index_loc = emit_node(index->index);
+	stack_loc location = allocate_stack();
+
+	fprintf(emitter.file, "	; address of element\n");
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", base_loc);
+	fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", index_loc);
+	fprintf(emitter.file, "	lea rax, [rax + rcx * %u]\n", type_size(index->data_type));
+	fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", location);
+	return location;
+}
+
+void emit_store(AST_Store* store) {
+	Data_Type type = store->target->data_type;
+
+	if (store->target->type == AST_INDEX) {
+		AST_Index* index = (AST_Index*) store->target;
+		stack_loc base_loc = emit_node(index->base);
+		stack_loc index_loc = emit_node(index->index);
+		stack_loc rhs_loc = emit_node(store->rhs);
+
+		fprintf(emitter.file, "	; store element\n");
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", base_loc);
+		fprintf(emitter.file, "	mov rcx, qword [rbp - %u]\n", index_loc);
+		fprintf(emitter.file, "	mov rdx, qword [rbp - %u]\n", rhs_loc);
+		emit_store_value("rdx", type, "[rax + rcx * %u]", type_size(type));
+		cse_kill_memory();
+		return;
+	}
+
+	AST_Unary* deref = (AST_Unary*) store->target;
+	stack_loc pointer_loc = emit_node(deref->expr);
+	stack_loc rhs_loc = emit_node(store->rhs);
+
+	fprintf(emitter.file, "	; store through pointer\n");
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", pointer_loc);
+	fprintf(emitter.file, "	mov rdx, qword [rbp - %u]\n", rhs_loc);
+	emit_store_value("rdx", type, "[rax]");
+	cse_kill_memory();
+}
+
 void emit_return(AST_Return* ret) {
+	// only generators return without a value
+	if (ret->expr == NULL) {
+		emit_generator_finish();
+		return;
+	}
+
 	stack_loc result_loc = emit_node(ret->expr);
 
 	fprintf(emitter.file, "	; return\n");
-	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", result_loc * 8);
+	fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", result_loc);
+
+	if (emitter.inline_func != NULL) {
+		emit_normalize("rax", emitter.inline_func->return_type);
+		fprintf(emitter.file, "	mov qword [rbp - %u], rax\n", emitter.inline_result);
+		fprintf(emitter.file, "	jmp .label%u\n", emitter.inline_exit_label);
+		return;
+	}
+
+	emit_normalize("rax", emitter.current_func->return_type);
 	fprintf(emitter.file, "	mov rsp, rbp\n");
 	fprintf(emitter.file, "	pop rbp\n");
 	fprintf(emitter.file, "	ret\n");
 }
 
 stack_loc emit_node(AST_Node* node) {
+	// functions start their line info from scratch, so their code doesn't depend on what came before
+	if (node->type != AST_FUNC_DECL) {
+		emit_line(node);
+	}
+
+	// an identical expression computed before might still hold the value
+	stack_loc known = cse_find(node);
+	if (known != 0) {
+		stats_count(STAT_CSE_REUSE);
+		return known;
+	}
+
 	switch (node->type) {
 		case AST_PROGRAM: {
 			AST_Program* program = (AST_Program*) node;
@@ -349,7 +1846,7 @@ stack_loc emit_node(AST_Node* node) {
 			AST_Binary_Op* op = (AST_Binary_Op*) node;
 			stack_loc left = emit_node(op->left);
 			stack_loc right = emit_node(op->right);
-			return emit_binary_op(op, left, right);
+			return cse_add(node, emit_binary_op(op, left, right));
 		}
         case AST_BLOCK: {
 			AST_Block* block = (AST_Block*) node;
@@ -362,7 +1859,7 @@ stack_loc emit_node(AST_Node* node) {
 			emit_var_decl((AST_Var_Decl*) node);
 			return 0;
 		case AST_VAR:
-			return emit_var((AST_Var*) node);
+			return cse_add(node, emit_var((AST_Var*) node));
 		case AST_ASSIGN: {
 			AST_Assign* assign = (AST_Assign*) node;
 			stack_loc rhs_loc = emit_node(assign->rhs);
@@ -370,11 +1867,16 @@ stack_loc emit_node(AST_Node* node) {
 			return 0;
 		}
 		case AST_FUNC_DECL: {
-			emit_func_decl((AST_Func_Decl*) node);
+			AST_Func_Decl* func = (AST_Func_Decl*) node;
+			if (func->body == NULL) {
+				fprintf(emitter.file, "extern %.*s\n", func->name.len, func->name.str);
+				return 0;
+			}
+			emit_cached_func_decl(func);
 			return 0;
 		}
 		case AST_FUNC_CALL: {
-			return emit_func_call((AST_Func_Call*) node);
+			return cse_add(node, emit_func_call((AST_Func_Call*) node));
 		}
 		case AST_IF: {
 			emit_if((AST_Conditional*) node);
@@ -384,9 +1886,27 @@ stack_loc emit_node(AST_Node* node) {
 			emit_while((AST_Conditional*) node);
 			return 0;
 		}
+		case AST_SWITCH:
+			emit_switch((AST_Switch*) node);
+			return 0;
+		case AST_PARALLEL:
+			emit_parallel((AST_Parallel*) node);
+			return 0;
 		case AST_RETURN:
 			emit_return((AST_Return*) node);
 			return 0;
+		case AST_YIELD:
+			emit_yield((AST_Return*) node);
+			return 0;
+		case AST_INDEX:
+			return cse_add(node, emit_index((AST_Index*) node));
+		case AST_DEREF:
+			return cse_add(node, emit_deref((AST_Unary*) node));
+		case AST_ADDR_OF:
+			return emit_addr_of((AST_Unary*) node);
+		case AST_STORE:
+			emit_store((AST_Store*) node);
+			return 0;
         default:
         	printf("emit_node: unhandled node type %u\n", node->type);
 	        error();
@@ -395,8 +1915,12 @@ stack_loc emit_node(AST_Node* node) {
 	return 0;
 }
 
-void emit(AST_Node* root, const char* path) {
+// starts an output file. with has_runtime it defines the functions of the static runtime instead of using libc
+void emit_begin(const char* source_path, const char* path, bool has_runtime) {
 	memset(&emitter, 0, sizeof(Emit_State));
+	emitter.source_path = source_path;
+	emitter.has_runtime = has_runtime;
+	emitter.printf_symbol = intern("printf", 6);
 
 	emitter.file = fopen(path, "w");
 	if (emitter.file == NULL) {
@@ -405,36 +1929,58 @@ void emit(AST_Node* root, const char* path) {
 	}
 
 	fprintf(emitter.file, "section .text\n");
-	fprintf(emitter.file, "extern exit ; temporary solution\n");
-	fprintf(emitter.file, "extern printf ; temporary solution\n");
-	emit_node(root);
-
-	fprintf(emitter.file, "section .rodata\n");
-	// emit all string literals
-	for (u32 i = 0; i < emitter.num_string_literals; i++) {
-		const Token* token = &emitter.string_literals[i];
+	if (!has_runtime) {
+		fprintf(emitter.file, "extern exit ; temporary solution\n");
+		fprintf(emitter.file, "extern printf ; temporary solution\n");
+		fprintf(emitter.file, "extern malloc\n");
+		fprintf(emitter.file, "extern free\n");
+	}
+}
 
-		fprintf(emitter.file, "_str%u: db ", i);
+// emits the program or, with --stream, a single function
+void emit_flat(const Flat_AST* flat) {
+	emitter.flat = flat;
+	add_string_literals(flat);
+	emit_node(flat->nodes[0]);
+	emitter.flat = NULL;
+}
 
-		// convert to nasm string
-		u32 pos = 1; // skip first "
-		while (pos < token->len - 1) {
-			if (token->str[pos] == '\\') {
-				if (pos + 1 >= token->len - 1 || token->str[pos + 1] != 'n') {
-					printf("emit error: invalid escape character");
-					error();
-				}
+void emit_end() {
+	emit_string_literals();
+	emit_profile_runtime();
+	if (emitter.uses_parallel) {
+		emit_parallel_runtime();
+	}
+	if (emitter.uses_format) {
+		emit_format_runtime();
+	}
+	if (emitter.uses_regions) {
+		emit_region_runtime();
+	}
+	if (emitter.uses_generators) {
+		emit_generator_runtime();
+	}
+	if (emitter.has_runtime) {
+		emit_static_runtime();
+	}
 
-				fprintf(emitter.file, "10, ");
-				pos += 2;
-				continue;
-			}
+	fclose(emitter.file);
+	print_stats(emitter.source_path);
+	free(emitter.strings);
+	free(emitter.string_seen);
+}
 
-			fprintf(emitter.file, "%u, ", (u32)token->str[pos]);
-			pos++;
-		}
-		fprintf(emitter.file, "0\n");
+void emit(const Flat_AST* flat, const char* source_path, const char* path) {
+	// with --static the file defining main carries the runtime, the others use it like they would use libc
+	bool has_runtime = false;
+	AST_Program* program = (AST_Program*) flat->nodes[0];
+	for (u32 i = 0; i < program->num_defs; i++) {
+		AST_Func_Decl* func = (AST_Func_Decl*) program->defs[i];
+		if (options.static_runtime && func->body != NULL && func->name.symbol == SYM_MAIN)
+			has_runtime = true;
 	}
 
-	fclose(emitter.file);
+	emit_begin(source_path, path, has_runtime);
+	emit_flat(flat);
+	emit_end();
 }
@@ -0,0 +1,246 @@
+#include "all.h"
+
+// Flattened copy of the final AST, stored as parallel arrays instead of linked nodes.
+//
+// Nodes are laid out in pre-order, so the subtree of node i is i up to ends[i]. The first child of a node is the
+// one right after it and every other child follows the end of the previous one, in the same order the pointer
+// tree keeps them (left before right, arguments before the body, target before the value...).
+// Passes that only need to look at every node of a subtree, like sizing the stack frame or printing, can walk
+// the arrays front to back instead of chasing pointers.
+//
+// operands and extras hold what a node needs besides its children:
+//   AST_INT_LITERAL  operand: index into values
+//   AST_STR_LITERAL  operand: index into tokens
+//   AST_BIN_OP       operand: the operation
+//   AST_VAR_DECL     operand: name in tokens, extra: array length
+//   AST_VAR          operand: name in tokens
+//   AST_ASSIGN       operand: name in tokens
+//   AST_FUNC_DECL    operand: name in tokens, extra: number of arguments, data_type is the return type
+//   AST_FUNC_CALL    operand: name in tokens, extra: the callee's AST_FUNC_DECL if it's inlined, FLAT_NONE otherwise
+//   AST_WHILE        extra: copies of the body if the loop is unrolled
+//   AST_SWITCH       operand: number of case values, extra: 1 if the last child is the default body
+//   AST_PARALLEL     extra: 1 if there is a chunk size between the end and the body
+
+static void reserve(Flat_AST* flat, u32 count) {
+	if (flat->num_nodes + count <= flat->capacity)
+		return;
+
+	while (flat->num_nodes + count > flat->capacity) {
+		flat->capacity = flat->capacity == 0 ? 256 : flat->capacity * 2;
+	}
+
+	flat->kinds = realloc(flat->kinds, flat->capacity * sizeof(AST_Type));
+	flat->data_types = realloc(flat->data_types, flat->capacity * sizeof(Data_Type));
+	flat->lines = realloc(flat->lines, flat->capacity * sizeof(u32));
+	flat->depths = realloc(flat->depths, flat->capacity * sizeof(u32));
+	flat->ends = realloc(flat->ends, flat->capacity * sizeof(u32));
+	flat->operands = realloc(flat->operands, flat->capacity * sizeof(u32));
+	flat->extras = realloc(flat->extras, flat->capacity * sizeof(u32));
+	flat->nodes = realloc(flat->nodes, flat->capacity * sizeof(AST_Node*));
+}
+
+static u32 add_value(Flat_AST* flat, u64 value) {
+	if (flat->num_values >= flat->values_capacity) {
+		flat->values_capacity = flat->values_capacity == 0 ? 64 : flat->values_capacity * 2;
+		flat->values = realloc(flat->values, flat->values_capacity * sizeof(u64));
+	}
+	flat->values[flat->num_values] = value;
+	return flat->num_values++;
+}
+
+static u32 add_token(Flat_AST* flat, Token token) {
+	if (flat->num_tokens >= flat->tokens_capacity) {
+		flat->tokens_capacity = flat->tokens_capacity == 0 ? 64 : flat->tokens_capacity * 2;
+		flat->tokens = realloc(flat->tokens, flat->tokens_capacity * sizeof(Token));
+	}
+	flat->tokens[flat->num_tokens] = token;
+	return flat->num_tokens++;
+}
+
+static void flatten_node(Flat_AST* flat, AST_Node* node, u32 depth);
+
+static void flatten_children(Flat_AST* flat, AST_Node** children, u32 num_children, u32 depth) {
+	for (u32 i = 0; i < num_children; i++) {
+		flatten_node(flat, children[i], depth);
+	}
+}
+
+static void flatten_node(Flat_AST* flat, AST_Node* node, u32 depth) {
+	reserve(flat, 1);
+
+	u32 index = flat->num_nodes++;
+	flat->kinds[index] = node->type;
+	flat->data_types[index] = node->data_type;
+	flat->lines[index] = node->line;
+	flat->depths[index] = depth;
+	flat->operands[index] = 0;
+	flat->extras[index] = 0;
+	flat->nodes[index] = node;
+
+	switch (node->type) {
+		case AST_PROGRAM: {
+			AST_Program* program = (AST_Program*) node;
+			flatten_children(flat, program->defs, program->num_defs, depth + 1);
+			break;
+		}
+		case AST_INT_LITERAL:
+			flat->operands[index] = add_value(flat, ((AST_Number*) node)->value);
+			break;
+		case AST_STR_LITERAL:
+			flat->operands[index] = add_token(flat, ((AST_String*) node)->token);
+			break;
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			flat->operands[index] = op->op;
+			flatten_node(flat, op->left, depth + 1);
+			flatten_node(flat, op->right, depth + 1);
+			break;
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			flatten_children(flat, block->statements, block->num_statements, depth + 1);
+			break;
+		}
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+			flat->operands[index] = add_token(flat, decl->name);
+			flat->extras[index] = decl->array_length;
+			if (decl->assign != NULL) {
+				flatten_node(flat, decl->assign, depth + 1);
+			}
+			break;
+		}
+		case AST_VAR:
+			flat->operands[index] = add_token(flat, ((AST_Var*) node)->name);
+			break;
+		case AST_ASSIGN: {
+			AST_Assign* assign = (AST_Assign*) node;
+			flat->operands[index] = add_token(flat, assign->lhs);
+			flatten_node(flat, assign->rhs, depth + 1);
+			break;
+		}
+		case AST_FUNC_DECL: {
+			AST_Func_Decl* func = (AST_Func_Decl*) node;
+			flat->data_types[index] = func->return_type;
+			flat->operands[index] = add_token(flat, func->name);
+			flat->extras[index] = func->num_args;
+			flatten_children(flat, (AST_Node**) func->args, func->num_args, depth + 1);
+			if (func->body != NULL) {
+				flatten_node(flat, func->body, depth + 1);
+			}
+			break;
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			flat->operands[index] = add_token(flat, call->name);
+			flat->extras[index] = FLAT_NONE; // resolved once all functions are flattened
+			flatten_children(flat, call->args, call->num_args, depth + 1);
+			break;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			if (node->type == AST_WHILE) {
+				flat->extras[index] = cond->unroll;
+			}
+			flatten_node(flat, cond->condition, depth + 1);
+			flatten_node(flat, cond->body, depth + 1);
+			break;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			flat->operands[index] = switch_stmt->num_cases;
+			flatten_node(flat, switch_stmt->value, depth + 1);
+			flatten_children(flat, switch_stmt->bodies, switch_stmt->num_bodies, depth + 1);
+			if (switch_stmt->default_body != NULL) {
+				flat->extras[index] = 1;
+				flatten_node(flat, switch_stmt->default_body, depth + 1);
+			}
+			break;
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			flatten_node(flat, (AST_Node*) parallel->index, depth + 1);
+			flatten_node(flat, parallel->end, depth + 1);
+			if (parallel->chunk != NULL) {
+				flat->extras[index] = 1;
+				flatten_node(flat, parallel->chunk, depth + 1);
+			}
+			flatten_node(flat, parallel->body, depth + 1);
+			break;
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			// a generator returns without a value
+			if (((AST_Return*) node)->expr != NULL) {
+				flatten_node(flat, ((AST_Return*) node)->expr, depth + 1);
+			}
+			break;
+		case AST_INDEX: {
+			AST_Index* index_node = (AST_Index*) node;
+			flatten_node(flat, index_node->base, depth + 1);
+			flatten_node(flat, index_node->index, depth + 1);
+			break;
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			flatten_node(flat, ((AST_Unary*) node)->expr, depth + 1);
+			break;
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			flatten_node(flat, store->target, depth + 1);
+			flatten_node(flat, store->rhs, depth + 1);
+			break;
+		}
+		default:
+			printf("flatten: unhandled node type %u\n", node->type);
+			error();
+	}
+
+	flat->ends[index] = flat->num_nodes;
+}
+
+void flatten(AST_Node* root, Flat_AST* flat) {
+	memset(flat, 0, sizeof(Flat_AST));
+	flatten_node(flat, root, 0);
+
+	// inlined callees can be defined after their callers
+	for (u32 i = 0; i < flat->num_nodes; i++) {
+		if (flat->kinds[i] != AST_FUNC_CALL)
+			continue;
+
+		AST_Func_Call* call = (AST_Func_Call*) flat->nodes[i];
+		if (call->inline_call) {
+			flat->extras[i] = flat_find_def(flat, (AST_Node*) call->decl);
+		}
+	}
+}
+
+void free_flat(Flat_AST* flat) {
+	free(flat->kinds);
+	free(flat->data_types);
+	free(flat->lines);
+	free(flat->depths);
+	free(flat->ends);
+	free(flat->operands);
+	free(flat->extras);
+	free(flat->nodes);
+	free(flat->values);
+	free(flat->tokens);
+	memset(flat, 0, sizeof(Flat_AST));
+}
+
+// index of a top level definition, or of the root if only a single function was flattened
+u32 flat_find_def(const Flat_AST* flat, AST_Node* def) {
+	if (flat->nodes[0] == def)
+		return 0;
+
+	for (u32 i = 1; i < flat->ends[0]; i = flat->ends[i]) {
+		if (flat->nodes[i] == def)
+			return i;
+	}
+
+	printf("flat_find_def: not a definition of this program\n");
+	error();
+	return FLAT_NONE;
+}
@@ -0,0 +1,631 @@
+#include "all.h"
+
+// Constant folding and compile-time evaluation of pure functions.
+//
+// A function is pure if it only works on integer locals and only calls other
+// pure functions, so it has no side effects and can't touch memory.
+// Calls to pure functions with constant arguments are run through a small
+// tree walking interpreter and replaced by their result. The interpreter gives
+// up when it runs out of steps, recurses too deep, or hits something that
+// would behave differently at runtime (division by zero, falling off the end
+// of a function), in which case the call is left alone.
+
+#define MAX_EVAL_DEPTH 128
+
+typedef struct {
+	AST_Var_Decl* decl;
+	u64 value;
+} Eval_Var;
+
+typedef struct {
+	Eval_Var vars[MAX_VARS];
+	u32 num_vars;
+
+	bool returned;
+	u64 return_value;
+} Eval_Frame;
+
+static Fold_State fold = {0};
+
+static bool is_integer_type(Data_Type type) {
+	return !type_is_pointer(type);
+}
+
+// checks a function body for anything that isn't integer arithmetic on locals or a call to another function
+static bool is_locally_pure(AST_Node* node) {
+	if (node == NULL)
+		return true;
+
+	switch (node->type) {
+		case AST_INT_LITERAL:
+			return true;
+		case AST_VAR:
+			return is_integer_type(node->data_type);
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return is_integer_type(op->left->data_type) && is_integer_type(op->right->data_type) &&
+				is_locally_pure(op->left) && is_locally_pure(op->right);
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				if (!is_locally_pure(block->statements[i]))
+					return false;
+			}
+			return true;
+		}
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+			return decl->array_length == 0 && is_integer_type(decl->data_type) && is_locally_pure(decl->assign);
+		}
+		case AST_ASSIGN:
+			return is_locally_pure(((AST_Assign*) node)->rhs);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			if (call->decl == NULL && !is_pure_builtin(call))
+				return false;
+
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (!is_locally_pure(call->args[i]))
+					return false;
+			}
+			return true;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			return is_locally_pure(cond->condition) && is_locally_pure(cond->body);
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				if (!is_locally_pure(switch_stmt->bodies[i]))
+					return false;
+			}
+			return is_locally_pure(switch_stmt->value) && is_locally_pure(switch_stmt->default_body);
+		}
+		case AST_RETURN:
+			return is_locally_pure(((AST_Return*) node)->expr);
+		default:
+			return false;
+	}
+}
+
+static bool calls_impure(AST_Node* node) {
+	if (node == NULL)
+		return false;
+
+	switch (node->type) {
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return calls_impure(op->left) || calls_impure(op->right);
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				if (calls_impure(block->statements[i]))
+					return true;
+			}
+			return false;
+		}
+		case AST_VAR_DECL:
+			return calls_impure(((AST_Var_Decl*) node)->assign);
+		case AST_ASSIGN:
+			return calls_impure(((AST_Assign*) node)->rhs);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			if (call->decl != NULL && !call->decl->is_pure)
+				return true;
+
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (calls_impure(call->args[i]))
+					return true;
+			}
+			return false;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			return calls_impure(cond->condition) || calls_impure(cond->body);
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				if (calls_impure(switch_stmt->bodies[i]))
+					return true;
+			}
+			return calls_impure(switch_stmt->value) || calls_impure(switch_stmt->default_body);
+		}
+		case AST_RETURN:
+			return calls_impure(((AST_Return*) node)->expr);
+		default:
+			return false;
+	}
+}
+
+// sets is_pure on every function
+static void find_pure_functions(AST_Program* program) {
+	for (u32 i = 0; i < program->num_defs; i++) {
+		AST_Func_Decl* func = (AST_Func_Decl*) program->defs[i];
+
+		func->is_pure = func->body != NULL && is_integer_type(func->return_type) && is_locally_pure(func->body);
+		for (u32 j = 0; j < func->num_args; j++) {
+			if (!is_integer_type(func->args[j]->data_type))
+				func->is_pure = false;
+		}
+	}
+
+	// a function calling an impure function is impure too, repeat until nothing changes
+	bool changed = true;
+	while (changed) {
+		changed = false;
+
+		for (u32 i = 0; i < program->num_defs; i++) {
+			AST_Func_Decl* func = (AST_Func_Decl*) program->defs[i];
+			if (func->is_pure && calls_impure(func->body)) {
+				func->is_pure = false;
+				changed = true;
+			}
+		}
+	}
+}
+
+static Eval_Var* find_eval_var(Eval_Frame* frame, AST_Var_Decl* decl) {
+	for (u32 i = 0; i < frame->num_vars; i++) {
+		if (frame->vars[i].decl == decl)
+			return &frame->vars[i];
+	}
+	return NULL;
+}
+
+static bool set_eval_var(Eval_Frame* frame, AST_Var_Decl* decl, u64 value) {
+	Eval_Var* var = find_eval_var(frame, decl);
+	if (var == NULL) {
+		if (frame->num_vars >= MAX_VARS)
+			return false;
+		var = &frame->vars[frame->num_vars++];
+		var->decl = decl;
+	}
+
+	var->value = normalize_value(value, decl->data_type);
+	return true;
+}
+
+static bool use_step() {
+	if (fold.steps_left == 0)
+		return false;
+
+	fold.steps_left--;
+	return true;
+}
+
+static bool eval_call(AST_Func_Decl* func, u64* args, u64* result);
+
+static bool eval_binary_op(Binary_Operation op, Data_Type left_type, Data_Type right_type, Data_Type result_type, u64 left, u64 right, u64* result) {
+	if (op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV) {
+		switch (op) {
+			case OP_ADD:
+				*result = left + right;
+				break;
+			case OP_SUB:
+				*result = left - right;
+				break;
+			case OP_MUL:
+				*result = left * right;
+				break;
+			default: {
+				left = normalize_value(left, result_type);
+				right = normalize_value(right, result_type);
+
+				// these trap at runtime
+				if (right == 0)
+					return false;
+				if (type_is_signed(result_type) && (s64) left == INT64_MIN && (s64) right == -1)
+					return false;
+
+				*result = type_is_signed(result_type) ? (u64) ((s64) left / (s64) right) : left / right;
+				break;
+			}
+		}
+
+		*result = normalize_value(*result, result_type);
+		return true;
+	}
+
+	Data_Type common = arithmetic_type(left_type, right_type);
+	left = normalize_value(left, common);
+	right = normalize_value(right, common);
+	bool is_signed = type_is_signed(common);
+
+	switch (op) {
+		case OP_EQUALS:
+			*result = left == right;
+			break;
+		case OP_NOT_EQUALS:
+			*result = left != right;
+			break;
+		case OP_LESS_THAN:
+			*result = is_signed ? (s64) left < (s64) right : left < right;
+			break;
+		case OP_LESS_THAN_EQUAL:
+			*result = is_signed ? (s64) left <= (s64) right : left <= right;
+			break;
+		case OP_GREATER_THAN:
+			*result = is_signed ? (s64) left > (s64) right : left > right;
+			break;
+		default:
+			*result = is_signed ? (s64) left >= (s64) right : left >= right;
+			break;
+	}
+	return true;
+}
+
+static bool eval_builtin(AST_Func_Call* call, u64* args, u64* result) {
+	if (!is_pure_builtin(call))
+		return false;
+
+	Data_Type type = call->data_type;
+	bool is_signed = type_is_signed(type);
+	u64 value = normalize_value(args[0], type);
+
+	// the bit builtins work on the bits of their argument's type
+	Data_Type arg_type = call->args[0]->data_type;
+	u32 bits = type_size(arg_type) * 8;
+	u64 mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+	u64 arg_bits = normalize_value(args[0], arg_type) & mask;
+
+	switch (call->name.symbol) {
+		case SYM_ABS:
+			*result = is_signed && (s64) value < 0 ? normalize_value(-value, type) : value;
+			return true;
+		case SYM_POPCNT:
+			*result = __builtin_popcountll(arg_bits);
+			return true;
+		case SYM_LZCNT:
+			*result = arg_bits == 0 ? bits : (u64) __builtin_clzll(arg_bits) - (64 - bits);
+			return true;
+		case SYM_TZCNT:
+			*result = arg_bits == 0 ? bits : (u64) __builtin_ctzll(arg_bits);
+			return true;
+		case SYM_BSWAP:
+			*result = normalize_value(__builtin_bswap64(arg_bits) >> (64 - bits), type);
+			return true;
+		case SYM_ROTL:
+		case SYM_ROTR: {
+			u32 amount = args[1] % bits;
+			if (call->name.symbol == SYM_ROTR) {
+				amount = (bits - amount) % bits;
+			}
+			u64 rotated = amount == 0 ? arg_bits : (arg_bits << amount | arg_bits >> (bits - amount)) & mask;
+			*result = normalize_value(rotated, type);
+			return true;
+		}
+		default:
+			break;
+	}
+
+	u64 other = normalize_value(args[1], type);
+	bool less = is_signed ? (s64) other < (s64) value : other < value;
+	if (call->name.symbol == SYM_MIN) {
+		*result = less ? other : value;
+	} else {
+		*result = less ? value : other;
+	}
+	return true;
+}
+
+static bool eval_expr(Eval_Frame* frame, AST_Node* node, u64* result) {
+	if (!use_step())
+		return false;
+
+	switch (node->type) {
+		case AST_INT_LITERAL:
+			*result = ((AST_Number*) node)->value;
+			return true;
+		case AST_VAR: {
+			Eval_Var* var = find_eval_var(frame, ((AST_Var*) node)->decl);
+			if (var == NULL)
+				return false;
+			*result = var->value;
+			return true;
+		}
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			u64 left, right;
+			if (!eval_expr(frame, op->left, &left) || !eval_expr(frame, op->right, &right))
+				return false;
+			return eval_binary_op(op->op, op->left->data_type, op->right->data_type, op->data_type, left, right, result);
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			u64 args[MAX_ARGS];
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (!eval_expr(frame, call->args[i], &args[i]))
+					return false;
+			}
+			if (call->decl == NULL)
+				return eval_builtin(call, args, result);
+			return eval_call(call->decl, args, result);
+		}
+		default:
+			return false;
+	}
+}
+
+static bool exec_statement(Eval_Frame* frame, AST_Node* node) {
+	if (!use_step())
+		return false;
+
+	switch (node->type) {
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements && !frame->returned; i++) {
+				if (!exec_statement(frame, block->statements[i]))
+					return false;
+			}
+			return true;
+		}
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+
+			// uninitialized variables keep whatever was in their slot, reading one fails unless it was set before
+			if (decl->assign == NULL)
+				return true;
+
+			u64 value;
+			return eval_expr(frame, decl->assign, &value) && set_eval_var(frame, decl, value);
+		}
+		case AST_ASSIGN: {
+			AST_Assign* assign = (AST_Assign*) node;
+			u64 value;
+			return eval_expr(frame, assign->rhs, &value) && set_eval_var(frame, assign->decl, value);
+		}
+		case AST_IF: {
+			AST_Conditional* if_stmt = (AST_Conditional*) node;
+			u64 condition;
+			if (!eval_expr(frame, if_stmt->condition, &condition))
+				return false;
+			return condition == 0 || exec_statement(frame, if_stmt->body);
+		}
+		case AST_WHILE: {
+			AST_Conditional* while_stmt = (AST_Conditional*) node;
+			for (;;) {
+				u64 condition;
+				if (!eval_expr(frame, while_stmt->condition, &condition))
+					return false;
+				if (condition == 0 || frame->returned)
+					return true;
+				if (!exec_statement(frame, while_stmt->body))
+					return false;
+				if (frame->returned)
+					return true;
+			}
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			u64 value;
+			if (!eval_expr(frame, switch_stmt->value, &value))
+				return false;
+
+			for (u32 i = 0; i < switch_stmt->num_cases; i++) {
+				if (switch_stmt->cases[i].value == value)
+					return exec_statement(frame, switch_stmt->bodies[switch_stmt->cases[i].body]);
+			}
+			return switch_stmt->default_body == NULL || exec_statement(frame, switch_stmt->default_body);
+		}
+		case AST_RETURN: {
+			u64 value;
+			if (!eval_expr(frame, ((AST_Return*) node)->expr, &value))
+				return false;
+			frame->returned = true;
+			frame->return_value = value;
+			return true;
+		}
+		default: {
+			// expression statement
+			u64 ignored;
+			return eval_expr(frame, node, &ignored);
+		}
+	}
+}
+
+static bool eval_call(AST_Func_Decl* func, u64* args, u64* result) {
+	if (!func->is_pure || fold.depth >= MAX_EVAL_DEPTH)
+		return false;
+
+	Eval_Frame* frame = calloc(1, sizeof(Eval_Frame));
+	for (u32 i = 0; i < func->num_args; i++) {
+		set_eval_var(frame, func->args[i], args[i]);
+	}
+
+	fold.depth++;
+	bool ok = exec_statement(frame, func->body) && frame->returned;
+	fold.depth--;
+
+	if (ok) {
+		*result = normalize_value(frame->return_value, func->return_type);
+	}
+
+	free(frame);
+	return ok;
+}
+
+// makes a literal to replace node with
+static AST_Node* make_literal(AST_Node* node, u64 value) {
+	AST_Number* number = ast_alloc(sizeof(AST_Number));
+	number->type = AST_INT_LITERAL;
+	number->data_type = node->data_type;
+	number->line = node->line;
+	number->value = value;
+	return (AST_Node*) number;
+}
+
+static bool is_literal(AST_Node* node) {
+	return node->type == AST_INT_LITERAL;
+}
+
+static void fold_node(AST_Node** slot);
+
+static void fold_children(AST_Node* node) {
+	switch (node->type) {
+		case AST_PROGRAM: {
+			AST_Program* program = (AST_Program*) node;
+			for (u32 i = 0; i < program->num_defs; i++) {
+				fold_node(&program->defs[i]);
+			}
+			break;
+		}
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			fold_node(&op->left);
+			fold_node(&op->right);
+			break;
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				fold_node(&block->statements[i]);
+			}
+			break;
+		}
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+			if (decl->assign != NULL) {
+				fold_node(&decl->assign);
+			}
+			break;
+		}
+		case AST_ASSIGN:
+			fold_node(&((AST_Assign*) node)->rhs);
+			break;
+		case AST_FUNC_DECL: {
+			AST_Func_Decl* func = (AST_Func_Decl*) node;
+			if (func->body != NULL) {
+				fold_node(&func->body);
+			}
+			break;
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			for (u32 i = 0; i < call->num_args; i++) {
+				fold_node(&call->args[i]);
+			}
+			break;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			fold_node(&cond->condition);
+			fold_node(&cond->body);
+			break;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			fold_node(&switch_stmt->value);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				fold_node(&switch_stmt->bodies[i]);
+			}
+			if (switch_stmt->default_body != NULL) {
+				fold_node(&switch_stmt->default_body);
+			}
+			break;
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			fold_node(&parallel->index->assign);
+			fold_node(&parallel->end);
+			if (parallel->chunk != NULL) {
+				fold_node(&parallel->chunk);
+			}
+			fold_node(&parallel->body);
+			break;
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			if (((AST_Return*) node)->expr != NULL) {
+				fold_node(&((AST_Return*) node)->expr);
+			}
+			break;
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			fold_node(&index->base);
+			fold_node(&index->index);
+			break;
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			fold_node(&((AST_Unary*) node)->expr);
+			break;
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			fold_node(&store->target);
+			fold_node(&store->rhs);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static void fold_node(AST_Node** slot) {
+	AST_Node* node = *slot;
+	fold_children(node);
+
+	u64 result;
+	fold.steps_left = options.const_eval_steps;
+
+	if (node->type == AST_BIN_OP) {
+		AST_Binary_Op* op = (AST_Binary_Op*) node;
+		if (!is_literal(op->left) || !is_literal(op->right))
+			return;
+
+		if (!is_integer_type(op->left->data_type) || !is_integer_type(op->right->data_type))
+			return;
+
+		u64 left = ((AST_Number*) op->left)->value;
+		u64 right = ((AST_Number*) op->right)->value;
+		if (eval_binary_op(op->op, op->left->data_type, op->right->data_type, op->data_type, left, right, &result)) {
+			*slot = make_literal(node, result);
+		}
+		return;
+	}
+
+	if (node->type == AST_FUNC_CALL) {
+		AST_Func_Call* call = (AST_Func_Call*) node;
+		u64 args[MAX_ARGS];
+		if (is_pure_builtin(call)) {
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (!is_literal(call->args[i]))
+					return;
+				args[i] = ((AST_Number*) call->args[i])->value;
+			}
+
+			eval_builtin(call, args, &result);
+			*slot = make_literal(node, result);
+			return;
+		}
+
+		if (call->decl == NULL || !call->decl->is_pure)
+			return;
+
+		for (u32 i = 0; i < call->num_args; i++) {
+			if (!is_literal(call->args[i]))
+				return;
+			args[i] = normalize_value(((AST_Number*) call->args[i])->value, call->decl->args[i]->data_type);
+		}
+
+		if (eval_call(call->decl, args, &result)) {
+			*slot = make_literal(node, result);
+		}
+	}
+}
+
+void fold_constants(AST_Node* root) {
+	memset(&fold, 0, sizeof(Fold_State));
+
+	find_pure_functions((AST_Program*) root);
+
+	if (options.const_eval) {
+		fold_node(&root);
+	}
+}
@@ -0,0 +1,165 @@
+#include "all.h"
+
+#include <pthread.h>
+
+// Symbol table for identifiers and string literals.
+//
+// The lexer interns the text of every identifier and string literal, so equal names share an id and later passes
+// compare ids instead of bytes. Keywords, type names and the names the compiler treats specially are interned
+// first, in the order of Builtin_Symbol, so their ids are known constants.
+// The text is copied, symbols stay valid after the source they came from is freed.
+// With --stream the lexer interns on its own thread while the emitter looks symbols up, so the table is locked.
+
+static Intern_Table table = {0};
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* builtin_names[NUM_BUILTIN_SYMBOLS] = {
+	[SYM_INT] = "int",
+	[SYM_I8] = "i8",
+	[SYM_I16] = "i16",
+	[SYM_I32] = "i32",
+	[SYM_I64] = "i64",
+	[SYM_U8] = "u8",
+	[SYM_U16] = "u16",
+	[SYM_U32] = "u32",
+	[SYM_U64] = "u64",
+	[SYM_FUNC] = "func",
+	[SYM_IF] = "if",
+	[SYM_RETURN] = "return",
+	[SYM_WHILE] = "while",
+	[SYM_EXTERN] = "extern",
+	[SYM_SWITCH] = "switch",
+	[SYM_CASE] = "case",
+	[SYM_DEFAULT] = "default",
+	[SYM_PARALLEL] = "parallel",
+	[SYM_YIELD] = "yield",
+	[SYM_MAIN] = "main",
+	[SYM_ALLOC] = "alloc",
+	[SYM_MIN] = "min",
+	[SYM_MAX] = "max",
+	[SYM_ABS] = "abs",
+	[SYM_POPCNT] = "popcnt",
+	[SYM_LZCNT] = "lzcnt",
+	[SYM_TZCNT] = "tzcnt",
+	[SYM_BSWAP] = "bswap",
+	[SYM_ROTL] = "rotl",
+	[SYM_ROTR] = "rotr",
+	[SYM_RDTSC] = "rdtsc",
+	[SYM_PREFETCH] = "prefetch",
+	[SYM_PAUSE] = "pause",
+	[SYM_ATOMICLOAD] = "atomicload",
+	[SYM_ATOMICSTORE] = "atomicstore",
+	[SYM_ATOMICADD] = "atomicadd",
+	[SYM_ATOMICXCHG] = "atomicxchg",
+	[SYM_ATOMICCAS] = "atomiccas",
+	[SYM_FENCE] = "fence",
+	[SYM_REGION] = "region",
+	[SYM_REGIONALLOC] = "regionalloc",
+	[SYM_REGIONRESET] = "regionreset",
+	[SYM_REGIONFREE] = "regionfree",
+	[SYM_NEXT] = "next",
+	[SYM_RELAXED] = "relaxed",
+	[SYM_ACQUIRE] = "acquire",
+	[SYM_RELEASE] = "release",
+	[SYM_ACQREL] = "acqrel",
+	[SYM_SEQCST] = "seqcst",
+};
+
+static u64 hash_text(const char* str, u32 len) {
+	// FNV-1a
+	u64 hash = 0xcbf29ce484222325;
+	for (u32 i = 0; i < len; i++) {
+		hash ^= (u8) str[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static void insert_slot(u32 id) {
+	u32 i = table.symbols[id]->hash % table.capacity;
+	while (table.slots[i] != SYM_NONE) {
+		i = (i + 1) % table.capacity;
+	}
+	table.slots[i] = id;
+}
+
+static void grow_slots() {
+	free(table.slots);
+	table.capacity = table.capacity == 0 ? 256 : table.capacity * 2;
+	table.slots = calloc(table.capacity, sizeof(u32));
+
+	for (u32 id = 1; id < table.num_symbols; id++) {
+		insert_slot(id);
+	}
+}
+
+static u32 add_symbol(const char* str, u32 len, u64 hash) {
+	if (table.num_symbols >= table.symbols_capacity) {
+		table.symbols_capacity = table.symbols_capacity == 0 ? 256 : table.symbols_capacity * 2;
+		table.symbols = realloc(table.symbols, table.symbols_capacity * sizeof(Symbol*));
+	}
+
+	// allocated one by one so they don't move when the table grows
+	Symbol* symbol = malloc(sizeof(Symbol));
+	table.symbols[table.num_symbols] = symbol;
+	symbol->str = malloc(len + 1);
+	memcpy(symbol->str, str, len);
+	symbol->str[len] = 0;
+	symbol->len = len;
+	symbol->hash = hash;
+
+	u32 id = table.num_symbols++;
+	if (table.num_symbols * 4 > table.capacity * 3) {
+		grow_slots();
+	} else {
+		insert_slot(id);
+	}
+	return id;
+}
+
+static void init_table() {
+	// id 0 is SYM_NONE
+	add_symbol("", 0, 0);
+	for (u32 id = 1; id < NUM_BUILTIN_SYMBOLS; id++) {
+		const char* name = builtin_names[id];
+		add_symbol(name, strlen(name), hash_text(name, strlen(name)));
+	}
+}
+
+u32 intern(const char* str, u32 len) {
+	u64 hash = hash_text(str, len);
+
+	pthread_mutex_lock(&table_lock);
+	if (table.num_symbols == 0) {
+		init_table();
+	}
+
+	u32 id = SYM_NONE;
+	for (u32 i = hash % table.capacity; table.slots[i] != SYM_NONE; i = (i + 1) % table.capacity) {
+		Symbol* symbol = table.symbols[table.slots[i]];
+		if (symbol->hash == hash && symbol->len == len && memcmp(symbol->str, str, len) == 0) {
+			id = table.slots[i];
+			break;
+		}
+	}
+
+	if (id == SYM_NONE) {
+		id = add_symbol(str, len, hash);
+	}
+	pthread_mutex_unlock(&table_lock);
+	return id;
+}
+
+const Symbol* get_symbol(u32 id) {
+	pthread_mutex_lock(&table_lock);
+	const Symbol* symbol = table.symbols[id];
+	pthread_mutex_unlock(&table_lock);
+	return symbol;
+}
+
+u32 num_symbols() {
+	pthread_mutex_lock(&table_lock);
+	u32 count = table.num_symbols;
+	pthread_mutex_unlock(&table_lock);
+	return count;
+}
@@ -1,24 +1,46 @@
 #include "all.h"
 
-static void add_token(Token* tokens, u32* num_tokens, Token* token_to_add) {
-	tokens[(*num_tokens)++] = *token_to_add;
-	if (*num_tokens >= MAX_TOKENS) {
+typedef struct {
+	Token* tokens;
+	u32* num_tokens;
+} Token_Array;
+
+static void add_token(Token* token, void* data) {
+	Token_Array* array = data;
+	array->tokens[(*array->num_tokens)++] = *token;
+	if (*array->num_tokens >= MAX_TOKENS) {
 		printf("too many tokens!\n");
 		error();
 	}
 }
 
 void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens) {
+	*num_tokens = 0;
+
+	Token_Array array = {
+		.tokens = tokens,
+		.num_tokens = num_tokens,
+	};
+	lex_into(input, input_length, add_token, &array);
+}
+
+// passes every token to add, ends with TOKEN_EOF
+void lex_into(const char* input, u32 input_length, Token_Sink add, void* data) {
 	u32 pos = 0;
 	u32 token_start = 0;
 	u32 token_type = 0;
-	*num_tokens = 0;
+	u32 line = 1;
+	u32 line_start = 0;
 
 	while (pos < input_length) {
 		char ch = input[pos];
 		
 		// ignore certain chars
 		if (isspace(ch)) {
+			if (ch == '\n') {
+				line++;
+				line_start = pos + 1;
+			}
 			pos++;
 			token_start = pos;
 			continue;
@@ -26,7 +48,7 @@ void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens) {
 
 		// ignore comments
 		if (ch == '/' && input[pos + 1] == '/') {
-			while (input[pos] != '\n') {
+			while (pos < input_length && input[pos] != '\n') {
 				pos++;
 			}
 			token_start = pos;
@@ -48,6 +70,10 @@ void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens) {
 			token_type = TOKEN_STR_LIT;
 			pos++;
 			while (input[pos] != '"') {
+				if (pos >= input_length) {
+					printf("error at %u:%u: unterminated string literal\n", line, token_start - line_start + 1);
+					error();
+				}
 				pos++;
 			}
 		} else if (ch == '+') {
@@ -77,6 +103,12 @@ void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens) {
 			token_type = TOKEN_CLOSE_BRACE;
 		} else if (ch == ',') {
 			token_type = TOKEN_COMMA;
+		} else if (ch == '[') {
+			token_type = TOKEN_OPEN_BRACKET;
+		} else if (ch == ']') {
+			token_type = TOKEN_CLOSE_BRACKET;
+		} else if (ch == '&') {
+			token_type = TOKEN_AMPERSAND;
 		} else if (ch == '<') {
 			token_type = TOKEN_LESS_THAN;
 			if (input[pos + 1] == '=') {
@@ -95,7 +127,7 @@ void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens) {
 				pos++;
 			}
 		} else {
-			printf("unknown token type at %u: %u\n", pos, (u32)ch);
+			printf("unknown token type at %u:%u: %u\n", line, pos - line_start + 1, (u32)ch);
 			error();
 		}
 
@@ -105,23 +137,41 @@ void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens) {
 			.type = token_type,
 			.str = input + token_start,
 			.len = pos - token_start,
+			.line = line,
+			.column = token_start - line_start + 1,
 		};
 		
+		if (token_type == TOKEN_IDENT || token_type == TOKEN_STR_LIT) {
+			token.symbol = intern(token.str, token.len);
+		}
+
 		if (token_type == TOKEN_IDENT) {
-			if (compare_token(&token, "int")) { // fixme: more types
-				token.type = TOKEN_KEYWORD_VAR;
-			} else if (compare_token(&token, "func")) {
+			if (token.symbol >= SYM_INT && token.symbol <= SYM_U64) {
+				token.type = TOKEN_KEYWORD_TYPE;
+			} else if (token.symbol == SYM_FUNC) {
 				token.type = TOKEN_KEYWORD_FUNC;
-			} else if (compare_token(&token, "if")) {
+			} else if (token.symbol == SYM_IF) {
 				token.type = TOKEN_KEYWORD_IF;
-			} else if (compare_token(&token, "return")) {
+			} else if (token.symbol == SYM_RETURN) {
 				token.type = TOKEN_KEYWORD_RETURN;
-			} else if (compare_token(&token, "while")) {
+			} else if (token.symbol == SYM_WHILE) {
 				token.type = TOKEN_KEYWORD_WHILE;
+			} else if (token.symbol == SYM_EXTERN) {
+				token.type = TOKEN_KEYWORD_EXTERN;
+			} else if (token.symbol == SYM_SWITCH) {
+				token.type = TOKEN_KEYWORD_SWITCH;
+			} else if (token.symbol == SYM_CASE) {
+				token.type = TOKEN_KEYWORD_CASE;
+			} else if (token.symbol == SYM_DEFAULT) {
+				token.type = TOKEN_KEYWORD_DEFAULT;
+			} else if (token.symbol == SYM_PARALLEL) {
+				token.type = TOKEN_KEYWORD_PARALLEL;
+			} else if (token.symbol == SYM_YIELD) {
+				token.type = TOKEN_KEYWORD_YIELD;
 			}
 		}
 
-		add_token(tokens, num_tokens, &token);
+		add(&token, data);
 
 		token_start = pos;
 	}
@@ -130,6 +180,7 @@ void lex(const char* input, u32 input_length, Token* tokens, u32* num_tokens) {
 	// fixme: is this necessary?
 	Token token = {
 		.type = TOKEN_EOF,
+		.line = line,
 	};
-	add_token(tokens, num_tokens, &token);
+	add(&token, data);
 }
@@ -1,27 +1,81 @@
 #include "all.h"
 
-int main(int argc, char* argv[]) {
-	if (argc <= 1) {
-		printf("usage: compiler <source file>\n");
-		error();
-	}
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+Options options = {
+	.arch = ARCH_SSE2,
+	.vectorize = true,
+	.if_convert = IF_CONVERT_AUTO,
+	.cse = true,
+	.specialize_printf = true,
+	.unroll_factor = 4,
+	.const_eval = true,
+	.const_eval_steps = 100000,
+	.instrument_path = "profile.data",
+};
+
+#define DEFAULT_SOCKET_PATH "/tmp/tsp-compiler.sock"
 
-	FILE* file = fopen(argv[1], "rb");
+static void usage() {
+	printf("usage: compiler [options] <source files>\n");
+	printf("       compiler --server[=<socket>]\n");
+	printf("       compiler --connect[=<socket>] [options] <source files>\n");
+	printf("options:\n");
+	printf("  -o <file>           output file for a single source file (default: output.asm)\n");
+	printf("                      with several source files every one is written next to it, foo.tsp to foo.asm\n");
+	printf("  -j <n>              compile up to n source files in parallel\n");
+	printf("  --watch             compile, then again every time a source file is saved, until killed\n");
+	printf("  --stream            compile one function at a time in a pipeline of threads, for huge source files\n");
+	printf("  --interpret         run the program in a bytecode interpreter instead, without nasm or a linker\n");
+	printf("  --interpret-profile like --interpret, then print instruction counts and time per function\n");
+	printf("  -march=<sse2|avx2>  instruction set for vectorized loops and bit counts (default: sse2)\n");
+	printf("  -fno-vectorize      don't vectorize loops\n");
+	printf("  -fif-convert        use a conditional move for every if that only assigns a variable something cheap\n");
+	printf("  -fno-if-convert     always branch\n");
+	printf("  -fno-cse            compute every expression again instead of reusing an identical one\n");
+	printf("  -fno-specialize-printf  call printf for every format instead of formatting literal ones inline\n");
+	printf("  -funroll=<n>        body copies per iteration of partially unrolled loops (default: 4, 1 to only unroll fully)\n");
+	printf("  -fno-unroll         don't unroll loops\n");
+	printf("  -g                  emit source line info (assemble with nasm -g -F dwarf)\n");
+	printf("  --static            include a minimal runtime instead of using libc (link with ld)\n");
+	printf("  -fno-const-eval     don't evaluate calls to pure functions at compile time\n");
+	printf("  -fconst-eval-steps=<n>  evaluation budget per call (default: 100000)\n");
+	printf("  --instrument[=<file>]   count executed code, written to <file> at exit (default: profile.data)\n");
+	printf("  --profile-use[=<file>]  optimize using a profile written by an instrumented build\n");
+	printf("  --stats[=json]      report frame size, instructions by class and optimizations per function on stderr\n");
+	error();
+}
+
+static char* read_source(const char* source_path, u32* file_size) {
+	FILE* file = fopen(source_path, "rb");
 	if (file == NULL) {
-		perror("");
+		perror(source_path);
 		error();
 	}
 
 	fseek(file, 0, SEEK_END);
-	u32 file_size = ftell(file);
+	*file_size = ftell(file);
 	fseek(file, 0, SEEK_SET);
 
-	char* file_contents = malloc(file_size + 1);
+	char* file_contents = malloc(*file_size + 1);
 
-	fread(file_contents, 1, file_size, file);
-	file_contents[file_size] = 0;
+	fread(file_contents, 1, *file_size, file);
+	file_contents[*file_size] = 0;
 
 	fclose(file);
+	return file_contents;
+}
+
+void compile_file(const char* source_path, const char* output_path) {
+	if (options.stream) {
+		compile_stream(source_path, output_path);
+		return;
+	}
+
+	u32 file_size;
+	char* file_contents = read_source(source_path, &file_size);
 
 	Token tokens[MAX_TOKENS];
 	u32 num_tokens;
@@ -33,12 +87,266 @@ int main(int argc, char* argv[]) {
 	// }
 	
 	AST_Node* expr = parse(file_contents, tokens, num_tokens);
-	print_node(expr, 0);
+	analyze(expr);
+	fold_constants(expr);
+	prepare_profile(expr, file_contents, file_size);
+	plan_unrolling(expr);
+
+	Flat_AST flat;
+	flatten(expr, &flat);
+	print_flat(&flat);
 
-	emit(expr, "output.asm");
+	emit(&flat, source_path, output_path);
 
+	free_flat(&flat);
 	free(file_contents);
-	return 0;
+}
+
+// --interpret, returns the exit status of the program
+static int interpret_file(const char* source_path) {
+	u32 file_size;
+	char* file_contents = read_source(source_path, &file_size);
+
+	Token tokens[MAX_TOKENS];
+	u32 num_tokens;
+	lex(file_contents, file_size, tokens, &num_tokens);
+
+	AST_Node* expr = parse(file_contents, tokens, num_tokens);
+	analyze(expr);
+	fold_constants(expr);
+
+	int status = interpret(expr);
+	free(file_contents);
+	return status;
+}
+
+// foo.tsp -> foo.asm
+static char* default_output_path(const char* source_path) {
+	u32 length = strlen(source_path);
+	if (length > 4 && strcmp(source_path + length - 4, ".tsp") == 0)
+		length -= 4;
+
+	char* path = malloc(length + 5);
+	memcpy(path, source_path, length);
+	strcpy(path + length, ".asm");
+	return path;
+}
+
+// every file is compiled in its own process, which is what keeps a compile error in one file from taking
+// down the others. returns 1 if any of them failed
+static int compile_parallel(const char** source_paths, const char** output_paths, u32 num_sources, u32 jobs) {
+	u32 next = 0;
+	u32 running = 0;
+	int result = 0;
+
+	while (next < num_sources || running > 0) {
+		if (next < num_sources && running < jobs) {
+			// the children share stdout, don't let them repeat what's still buffered
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				error();
+			}
+			if (pid == 0) {
+				compile_file(source_paths[next], output_paths[next]);
+				fflush(stdout);
+				exit(0);
+			}
+			next++;
+			running++;
+			continue;
+		}
+
+		int status;
+		if (wait(&status) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			error();
+		}
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			result = 1;
+	}
+
+	return result;
+}
+
+// one invocation of the compiler, with the arguments of the command line
+int compile(int argc, char* argv[]) {
+	const char** source_paths = malloc(argc * sizeof(char*));
+	u32 num_sources = 0;
+	u32 jobs = 0;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+
+		if (strcmp(arg, "-march=sse2") == 0) {
+			options.arch = ARCH_SSE2;
+		} else if (strcmp(arg, "-march=avx2") == 0) {
+			options.arch = ARCH_AVX2;
+		} else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+			options.output_path = argv[++i];
+		} else if (strcmp(arg, "-j") == 0 && i + 1 < argc) {
+			jobs = strtoul(argv[++i], NULL, 10);
+		} else if (strncmp(arg, "-j", 2) == 0 && arg[2] != 0) {
+			jobs = strtoul(arg + 2, NULL, 10);
+		} else if (strcmp(arg, "--watch") == 0) {
+			options.watch = true;
+		} else if (strcmp(arg, "--stream") == 0) {
+			options.stream = true;
+		} else if (strcmp(arg, "--interpret") == 0) {
+			options.interpret = true;
+		} else if (strcmp(arg, "--interpret-profile") == 0) {
+			options.interpret = true;
+			options.interpret_profile = true;
+		} else if (strcmp(arg, "-fno-vectorize") == 0) {
+			options.vectorize = false;
+		} else if (strcmp(arg, "-fif-convert") == 0) {
+			options.if_convert = IF_CONVERT_ALWAYS;
+		} else if (strcmp(arg, "-fno-if-convert") == 0) {
+			options.if_convert = IF_CONVERT_NEVER;
+		} else if (strcmp(arg, "-fno-cse") == 0) {
+			options.cse = false;
+		} else if (strcmp(arg, "-fno-specialize-printf") == 0) {
+			options.specialize_printf = false;
+		} else if (strncmp(arg, "-funroll=", 9) == 0) {
+			options.unroll_factor = strtoul(arg + 9, NULL, 10);
+			if (options.unroll_factor < 1 || options.unroll_factor > MAX_UNROLL_FACTOR) {
+				printf("-funroll takes a factor from 1 to %u\n", MAX_UNROLL_FACTOR);
+				error();
+			}
+		} else if (strcmp(arg, "-fno-unroll") == 0) {
+			options.unroll_factor = 0;
+		} else if (strcmp(arg, "-g") == 0) {
+			options.debug_info = true;
+		} else if (strcmp(arg, "--static") == 0) {
+			options.static_runtime = true;
+		} else if (strcmp(arg, "-fno-const-eval") == 0) {
+			options.const_eval = false;
+		} else if (strncmp(arg, "-fconst-eval-steps=", 19) == 0) {
+			options.const_eval_steps = strtoul(arg + 19, NULL, 10);
+		} else if (strcmp(arg, "--instrument") == 0) {
+			options.instrument = true;
+		} else if (strncmp(arg, "--instrument=", 13) == 0) {
+			options.instrument = true;
+			options.instrument_path = arg + 13;
+		} else if (strcmp(arg, "--profile-use") == 0) {
+			options.profile_use = "profile.data";
+		} else if (strncmp(arg, "--profile-use=", 14) == 0) {
+			options.profile_use = arg + 14;
+		} else if (strcmp(arg, "--stats") == 0) {
+			options.stats = STATS_TEXT;
+		} else if (strcmp(arg, "--stats=json") == 0) {
+			options.stats = STATS_JSON;
+		} else if (arg[0] == '-') {
+			usage();
+		} else {
+			source_paths[num_sources++] = arg;
+		}
+	}
+
+	if (num_sources == 0) {
+		usage();
+	}
+
+	if (options.static_runtime && options.instrument) {
+		printf("--instrument writes the profile using libc, it can't be used with --static\n");
+		error();
+	}
+
+	// the profile covers the whole program at once
+	if (options.stream && (options.instrument || options.profile_use != NULL)) {
+		printf("--instrument and --profile-use can't be used with --stream\n");
+		error();
+	}
+
+	// the server would keep the request open forever
+	if (options.watch && cache_enabled()) {
+		printf("--watch can't be used with --connect\n");
+		error();
+	}
+
+	if (options.interpret) {
+		if (num_sources > 1 || options.output_path != NULL || options.stream || options.instrument || options.profile_use != NULL || options.stats != STATS_NONE || options.watch) {
+			printf("--interpret runs a single source file, it can't be used with -o, --stream, --instrument, --profile-use, --stats or --watch\n");
+			error();
+		}
+
+		int status = interpret_file(source_paths[0]);
+		free(source_paths);
+		return status;
+	}
+
+	if (num_sources == 1) {
+		const char* output_path = options.output_path != NULL ? options.output_path : "output.asm";
+		int result = 0;
+		if (options.watch) {
+			result = watch(source_paths, &output_path, 1);
+		} else {
+			compile_file(source_paths[0], output_path);
+		}
+		free(source_paths);
+		return result;
+	}
+
+	if (options.output_path != NULL) {
+		printf("-o can only be used with a single source file\n");
+		error();
+	}
+
+	// the profile covers a single source file
+	if (options.instrument || options.profile_use != NULL) {
+		printf("--instrument and --profile-use can only be used with a single source file\n");
+		error();
+	}
+
+	const char** output_paths = malloc(num_sources * sizeof(char*));
+	for (u32 i = 0; i < num_sources; i++) {
+		output_paths[i] = default_output_path(source_paths[i]);
+	}
+
+	int result = 0;
+	if (options.watch) {
+		result = watch(source_paths, output_paths, num_sources);
+	} else if (jobs > 1) {
+		result = compile_parallel(source_paths, output_paths, num_sources, jobs);
+	} else {
+		// a compile error ends the process, like it does for a single file
+		for (u32 i = 0; i < num_sources; i++) {
+			compile_file(source_paths[i], output_paths[i]);
+		}
+	}
+
+	for (u32 i = 0; i < num_sources; i++) {
+		free((char*) output_paths[i]);
+	}
+	free(output_paths);
+	free(source_paths);
+	return result;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+		return run_server(DEFAULT_SOCKET_PATH);
+	}
+	if (argc >= 2 && strncmp(argv[1], "--server=", 9) == 0) {
+		return run_server(argv[1] + 9);
+	}
+
+	if (argc >= 2 && (strcmp(argv[1], "--connect") == 0 || strncmp(argv[1], "--connect=", 10) == 0)) {
+		const char* socket_path = argv[1][9] == '=' ? argv[1] + 10 : DEFAULT_SOCKET_PATH;
+		int status = run_client(socket_path, argc - 2, argv + 2);
+		if (status >= 0)
+			return status;
+
+		// no server running, compile in this process instead
+		argv[1] = argv[0];
+		return compile(argc - 1, argv + 1);
+	}
+
+	return compile(argc, argv);
 }
 
 void error() {
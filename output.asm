@@ -0,0 +1,520 @@
+section .text
+global main:function (_end_main - main)
+main:
+	push rbp
+	mov rbp, rsp
+	sub rsp, 176
+	; integer literal
+	mov qword [rbp - 176], 3
+	mov rax, qword [rbp - 176]
+	mov qword [rbp - 8], rax
+	; integer literal
+	mov qword [rbp - 168], 4
+	mov rax, qword [rbp - 168]
+	mov qword [rbp - 16], rax
+	; integer literal
+	mov qword [rbp - 152], 800
+	mov rdi, qword [rbp - 152]
+	call malloc
+	mov qword [rbp - 160], rax
+	mov rax, qword [rbp - 160]
+	mov qword [rbp - 24], rax
+	; integer literal
+	mov qword [rbp - 144], 0
+	mov rax, qword [rbp - 144]
+	mov qword [rbp - 32], rax
+	; integer literal
+	mov qword [rbp - 136], 100
+	; parallel loop
+	mov rdx, qword [rbp - 32]
+	mov rcx, qword [rbp - 136]
+	cmp rdx, rcx
+	jge .label0
+	sub rcx, rdx
+	mov rdi, _parallel_main_0
+	mov rsi, rbp
+	xor r8d, r8d
+	call _parallel_for
+.label0:
+	; var reference
+	; var reference
+	; binary op
+	mov rax, qword [rbp - 8]
+	imul rax, qword [rbp - 16]
+	mov qword [rbp - 112], rax
+	mov rax, qword [rbp - 112]
+	mov qword [rbp - 40], rax
+	; string literal
+	mov qword [rbp - 96], _str_f65b36f60a5915e8
+	; var reference
+	; printf specialized to its format
+	mov qword [rbp - 104], 0
+	sub rsp, 48
+	mov rdi, rsp
+	mov rax, qword [rbp - 40]
+	movsxd rax, eax
+	call _fmt_signed
+	mov rax, 0xa
+	mov qword [rdi + 0], rax
+	add rdi, 1
+	mov rsi, rsp
+	call _fmt_write
+	add qword [rbp - 104], rax
+	add rsp, 48
+	; integer literal
+	mov qword [rbp - 88], 0
+	; return
+	mov rax, qword [rbp - 88]
+	mov rsp, rbp
+	pop rbp
+	ret
+	mov rsp, rbp
+	pop rbp
+	ret
+_parallel_main_0:
+	push rbp
+	mov rbp, rsp
+	sub rsp, 176
+	mov r8, rsi
+	mov r9, rdx
+	lea rsi, [rdi - 32]
+	lea rdi, [rbp - 32]
+	mov ecx, 4
+	rep movsq
+	mov qword [rbp - 32], r8
+	mov qword [rbp - 128], r9
+.label1:
+	; var reference
+	; var reference
+	; var reference
+	; var reference
+	; binary op
+	mov rax, qword [rbp - 8]
+	imul rax, qword [rbp - 16]
+	mov qword [rbp - 120], rax
+	; store element
+	mov rax, qword [rbp - 24]
+	mov rcx, qword [rbp - 32]
+	mov rdx, qword [rbp - 120]
+	mov qword [rax + rcx * 8], rdx
+	mov rax, qword [rbp - 32]
+	add rax, 1
+	mov qword [rbp - 32], rax
+	dec qword [rbp - 128]
+	jnz .label1
+	mov rsp, rbp
+	pop rbp
+	ret
+_end_main:
+section .rodata
+_str_f65b36f60a5915e8: db 37, 100, 10, 0
+section .text
+; runtime for parallel loops
+section .text
+_parallel_for:
+	push rbp
+	mov rbp, rsp
+	mov rax, rdi
+	mov rdi, rsi
+	mov rsi, rdx
+	mov rdx, rcx
+	call rax
+	pop rbp
+	ret
+; runtime for specialized printf calls
+section .text
+_fmt_signed:
+	test rax, rax
+	jns _fmt_unsigned
+	mov byte [rdi], 45 ; '-'
+	inc rdi
+	neg rax
+_fmt_unsigned:
+	mov rsi, rsp
+_fmt_unsigned_loop:
+	; divides by 10 with a multiplication by its inverse
+	mov rcx, rax
+	mov rdx, 0xcccccccccccccccd
+	mul rdx
+	shr rdx, 3
+	lea rax, [rdx + rdx * 4]
+	add rax, rax
+	sub rcx, rax
+	add ecx, 48 ; '0'
+	dec rsi
+	mov byte [rsi], cl
+	mov rax, rdx
+	test rax, rax
+	jnz _fmt_unsigned_loop
+	jmp _fmt_digits
+_fmt_hex:
+	mov rsi, rsp
+_fmt_hex_loop:
+	mov ecx, eax
+	and ecx, 15
+	movzx ecx, byte [_fmt_hex_digits + rcx]
+	dec rsi
+	mov byte [rsi], cl
+	shr rax, 4
+	jnz _fmt_hex_loop
+; copies the digits from rsi up to rsp into the buffer, always 24 bytes which is quicker than just the digits
+_fmt_digits:
+	mov rcx, rsp
+	sub rcx, rsi
+	mov rax, qword [rsi]
+	mov qword [rdi], rax
+	mov rax, qword [rsi + 8]
+	mov qword [rdi + 8], rax
+	mov rax, qword [rsi + 16]
+	mov qword [rdi + 16], rax
+	add rdi, rcx
+	ret
+_fmt_string:
+	test rsi, rsi
+	jnz _fmt_string_start
+	mov rsi, _fmt_null
+_fmt_string_start:
+	mov rdi, rsi
+_fmt_string_loop:
+	cmp byte [rdi], 0
+	je _fmt_write
+	inc rdi
+	jmp _fmt_string_loop
+_fmt_write:
+	mov rdx, rdi
+	sub rdx, rsi
+	push rdx
+	mov rdi, rsi
+	mov esi, 1
+	mov rcx, qword [stdout]
+	call fwrite
+	pop rax
+	ret
+section .rodata
+_fmt_hex_digits: db 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 97, 98, 99, 100, 101, 102
+_fmt_null: db 40, 110, 117, 108, 108, 41, 0 ; (null)
+section .text
+; runtime for static executables
+section .text
+global _start
+_start:
+	xor ebp, ebp
+	mov rdi, qword [rsp] ; argc
+	lea rsi, [rsp + 8] ; argv
+	and rsp, -16
+	call main
+	mov rdi, rax
+	call exit
+
+global exit:function (_rt_exit_end - exit)
+exit:
+	push rdi
+	call _rt_flush
+	pop rdi
+	mov eax, 231 ; exit_group
+	syscall
+_rt_exit_end:
+
+; writes out the buffer, only clobbers rax
+_rt_flush:
+	push rdi
+	push rsi
+	push rdx
+	push rcx
+	push r11
+	mov rsi, _rt_out
+	mov rdx, qword [_rt_out_len]
+_rt_flush_loop:
+	test rdx, rdx
+	jz _rt_flush_done
+	mov eax, 1 ; write
+	mov edi, 1 ; stdout
+	syscall
+	test rax, rax
+	jle _rt_flush_done ; nowhere to write to, drop the output
+	add rsi, rax
+	sub rdx, rax
+	jmp _rt_flush_loop
+_rt_flush_done:
+	mov qword [_rt_out_len], 0
+	pop r11
+	pop rcx
+	pop rdx
+	pop rsi
+	pop rdi
+	ret
+
+; appends the char in dil to the buffer, only clobbers rax
+_rt_putc:
+	mov rax, qword [_rt_out_len]
+	cmp rax, 4096
+	jb _rt_putc_store
+	call _rt_flush
+	xor eax, eax
+_rt_putc_store:
+	mov byte [_rt_out + rax], dil
+	inc rax
+	mov qword [_rt_out_len], rax
+	inc qword [_rt_out_total]
+	ret
+
+; prints rax as an unsigned decimal number
+_rt_print_dec:
+	push rbx
+	sub rsp, 32
+	lea rbx, [rsp + 32]
+	mov rsi, rbx
+	mov ecx, 10
+_rt_print_dec_loop:
+	xor edx, edx
+	div rcx
+	add edx, 48 ; '0'
+	dec rsi
+	mov byte [rsi], dl
+	test rax, rax
+	jnz _rt_print_dec_loop
+	jmp _rt_print_digits
+
+; prints rax as a hexadecimal number
+_rt_print_hex:
+	push rbx
+	sub rsp, 32
+	lea rbx, [rsp + 32]
+	mov rsi, rbx
+_rt_print_hex_loop:
+	mov edx, eax
+	and edx, 15
+	movzx edx, byte [_rt_hex_digits + rdx]
+	dec rsi
+	mov byte [rsi], dl
+	shr rax, 4
+	jnz _rt_print_hex_loop
+
+; prints the digits from rsi up to rbx, then returns from _rt_print_dec or _rt_print_hex
+_rt_print_digits:
+	cmp rsi, rbx
+	je _rt_print_digits_done
+	movzx edi, byte [rsi]
+	call _rt_putc
+	inc rsi
+	jmp _rt_print_digits
+_rt_print_digits_done:
+	add rsp, 32
+	pop rbx
+	ret
+
+; loads the next variadic argument of printf into rax
+_rt_next_arg:
+	mov rax, qword [r12]
+	add r12, 8
+	cmp r12, rbp
+	jne _rt_next_arg_done
+	add r12, 16 ; skip the saved rbp and return address, continue with the stack arguments
+_rt_next_arg_done:
+	ret
+
+global printf:function (_rt_printf_end - printf)
+printf:
+	push rbp
+	mov rbp, rsp
+	; register arguments in order below rbp, followed by the ones on the stack
+	push r9
+	push r8
+	push rcx
+	push rdx
+	push rsi
+	push rbx
+	push r12
+	push r13
+	push r14
+	mov rbx, rdi ; format
+	lea r12, [rbp - 40] ; next argument
+	mov r14, qword [_rt_out_total]
+_rt_printf_loop:
+	movzx edi, byte [rbx]
+	inc rbx
+	test edi, edi
+	jz _rt_printf_done
+	cmp edi, 37 ; '%'
+	je _rt_printf_spec
+	call _rt_putc
+	jmp _rt_printf_loop
+_rt_printf_spec:
+	xor r13d, r13d ; set for 64 bit values
+_rt_printf_length:
+	movzx edi, byte [rbx]
+	inc rbx
+	cmp edi, 108 ; 'l'
+	jne _rt_printf_conversion
+	mov r13d, 1
+	jmp _rt_printf_length
+_rt_printf_conversion:
+	cmp edi, 100 ; 'd'
+	je _rt_printf_signed
+	cmp edi, 105 ; 'i'
+	je _rt_printf_signed
+	cmp edi, 117 ; 'u'
+	je _rt_printf_unsigned
+	cmp edi, 120 ; 'x'
+	je _rt_printf_hex
+	cmp edi, 112 ; 'p'
+	je _rt_printf_pointer
+	cmp edi, 99 ; 'c'
+	je _rt_printf_char
+	cmp edi, 115 ; 's'
+	je _rt_printf_string
+	test edi, edi
+	jz _rt_printf_done
+	; %% and unknown conversions are printed as is
+	push rdi
+	mov edi, 37
+	cmp qword [rsp], 37
+	je _rt_printf_unknown
+	call _rt_putc
+_rt_printf_unknown:
+	pop rdi
+	call _rt_putc
+	jmp _rt_printf_loop
+_rt_printf_signed:
+	call _rt_next_arg
+	test r13d, r13d
+	jnz _rt_printf_signed_64
+	movsxd rax, eax
+_rt_printf_signed_64:
+	test rax, rax
+	jns _rt_printf_decimal
+	push rax
+	mov edi, 45 ; '-'
+	call _rt_putc
+	pop rax
+	neg rax
+	jmp _rt_printf_decimal
+_rt_printf_unsigned:
+	call _rt_next_arg
+	test r13d, r13d
+	jnz _rt_printf_decimal
+	mov eax, eax
+_rt_printf_decimal:
+	call _rt_print_dec
+	jmp _rt_printf_loop
+_rt_printf_hex:
+	call _rt_next_arg
+	test r13d, r13d
+	jnz _rt_printf_hex_64
+	mov eax, eax
+_rt_printf_hex_64:
+	call _rt_print_hex
+	jmp _rt_printf_loop
+_rt_printf_pointer:
+	mov edi, 48 ; '0'
+	call _rt_putc
+	mov edi, 120 ; 'x'
+	call _rt_putc
+	call _rt_next_arg
+	call _rt_print_hex
+	jmp _rt_printf_loop
+_rt_printf_char:
+	call _rt_next_arg
+	mov edi, eax
+	call _rt_putc
+	jmp _rt_printf_loop
+_rt_printf_string:
+	call _rt_next_arg
+	mov rsi, rax
+	test rsi, rsi
+	jnz _rt_printf_string_loop
+	mov rsi, _rt_null
+_rt_printf_string_loop:
+	movzx edi, byte [rsi]
+	test edi, edi
+	jz _rt_printf_loop
+	call _rt_putc
+	inc rsi
+	jmp _rt_printf_string_loop
+_rt_printf_done:
+	mov rax, qword [_rt_out_total]
+	sub rax, r14
+	pop r14
+	pop r13
+	pop r12
+	pop rbx
+	mov rsp, rbp
+	pop rbp
+	ret
+_rt_printf_end:
+
+global fwrite:function (_rt_fwrite_end - fwrite)
+fwrite:
+	push rdx
+	imul rdx, rsi
+	mov rsi, rdi
+_rt_fwrite_loop:
+	test rdx, rdx
+	jz _rt_fwrite_done
+	movzx edi, byte [rsi]
+	call _rt_putc
+	inc rsi
+	dec rdx
+	jmp _rt_fwrite_loop
+_rt_fwrite_done:
+	pop rax
+	ret
+_rt_fwrite_end:
+
+global malloc:function (_rt_malloc_end - malloc)
+malloc:
+	; round up to 16 bytes
+	add rdi, 15
+	and rdi, -16
+	mov rax, qword [_rt_heap_ptr]
+	lea rdx, [rax + rdi]
+	cmp rdx, qword [_rt_heap_end]
+	jbe _rt_malloc_done
+	; map a new chunk, the rest of the old one is wasted
+	push rdi
+	mov rsi, rdi
+	cmp rsi, 1048576
+	jae _rt_malloc_map
+	mov esi, 1048576
+_rt_malloc_map:
+	push rsi
+	mov eax, 9 ; mmap
+	xor edi, edi
+	mov edx, 3 ; PROT_READ | PROT_WRITE
+	mov r10d, 34 ; MAP_PRIVATE | MAP_ANONYMOUS
+	mov r8, -1
+	xor r9d, r9d
+	syscall
+	pop rsi
+	pop rdi
+	cmp rax, -4096
+	ja _rt_malloc_fail
+	lea rdx, [rax + rsi]
+	mov qword [_rt_heap_end], rdx
+	lea rdx, [rax + rdi]
+_rt_malloc_done:
+	mov qword [_rt_heap_ptr], rdx
+	ret
+_rt_malloc_fail:
+	xor eax, eax
+	ret
+_rt_malloc_end:
+
+global free:function (_rt_free_end - free)
+free:
+	ret
+_rt_free_end:
+
+section .rodata
+_rt_hex_digits: db 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 97, 98, 99, 100, 101, 102
+_rt_null: db 40, 110, 117, 108, 108, 41, 0 ; (null)
+
+section .bss
+alignb 8
+global stdout:data 8
+stdout: resq 1 ; only there to be passed to fwrite
+_rt_out_len: resq 1
+_rt_out_total: resq 1 ; chars printed so far, for the return value of printf
+_rt_heap_ptr: resq 1
+_rt_heap_end: resq 1
+_rt_out: resb 4096
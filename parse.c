@@ -1,6 +1,9 @@
 #include "all.h"
 
+#include <errno.h>
+
 AST_Node* parse_primary();
+AST_Node* parse_postfix(AST_Node* expr);
 AST_Node* parse_infix(u32 min_precedence);
 AST_Node* parse_expr();
 AST_Node* parse_statement();
@@ -8,6 +11,45 @@ AST_Node* parse_block();
 
 Parse_State parser = {0};
 
+#define AST_CHUNK_SIZE (64 * 1024)
+
+// nodes are allocated from big chunks, so a tree ends up mostly contiguous in memory and in parse order.
+// normally they live until the process exits, with --stream every function gets its own arena which is freed
+// once the function is emitted. the arena is per thread, the parser fills one while the emitter works on another
+static Arena default_arena = {0};
+static _Thread_local Arena* current_arena = NULL;
+
+void set_ast_arena(Arena* arena) {
+	current_arena = arena;
+}
+
+void* ast_alloc(u32 size) {
+	Arena* arena = current_arena != NULL ? current_arena : &default_arena;
+	size = (size + 7) & ~7;
+
+	Arena_Chunk* chunk = arena->chunks;
+	if (chunk == NULL || chunk->used + size > chunk->size) {
+		u32 chunk_size = size > AST_CHUNK_SIZE ? size : AST_CHUNK_SIZE;
+		chunk = malloc(sizeof(Arena_Chunk) + chunk_size);
+		chunk->next = arena->chunks;
+		chunk->used = 0;
+		chunk->size = chunk_size;
+		arena->chunks = chunk;
+	}
+
+	void* result = (u8*) (chunk + 1) + chunk->used;
+	chunk->used += size;
+	return result;
+}
+
+void free_arena(Arena* arena) {
+	while (arena->chunks != NULL) {
+		Arena_Chunk* next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+}
+
 static u32 get_precedence(Token_Type token_type) {
 	switch (token_type) {
 		case TOKEN_IS_EQUAL:
@@ -81,30 +123,140 @@ static Binary_Operation token_to_binary_op(Token_Type token_type) {
 	return 0;
 }
 
+// takes the next token from the lexer thread
+static void fetch_token() {
+	if (parser.batch_pos == parser.batch.count) {
+		queue_pop(parser.token_queue, &parser.batch);
+		parser.batch_pos = 0;
+	}
+
+	Token token = parser.batch.tokens[parser.batch_pos++];
+	parser.window[parser.num_tokens % PARSE_WINDOW] = token;
+	parser.num_tokens++;
+
+	// the lexer doesn't send anything after it
+	if (token.type == TOKEN_EOF) {
+		parser.stream_done = true;
+	}
+}
+
+// NULL past the end
+static Token* token_at(u32 index) {
+	if (parser.token_queue == NULL)
+		return index < parser.num_tokens ? &parser.tokens[index] : NULL;
+
+	while (index >= parser.num_tokens && !parser.stream_done) {
+		fetch_token();
+	}
+	return index < parser.num_tokens ? &parser.window[index % PARSE_WINDOW] : NULL;
+}
+
 static Token eat(Token_Type expected_token_type) {
-	if (parser.tokens[parser.pos].type != expected_token_type) {
-		printf("error at %u:\n", parser.pos);
-		printf("	expected %u, got %u!\n", expected_token_type, parser.tokens[parser.pos].type);
+	Token* token = token_at(parser.pos);
+	if (token->type != expected_token_type) {
+		printf("error at %u:%u:\n", token->line, token->column);
+		printf("	expected %u, got %u!\n", expected_token_type, token->type);
 		error();
 	}
 
-	return parser.tokens[parser.pos++];
+	parser.pos++;
+	return *token;
+}
+
+// line of the last eaten token
+static u32 last_line() {
+	return token_at(parser.pos - 1)->line;
 }
 
 static Token peek(u32 offset) {
-	if (parser.pos + offset >= parser.num_tokens) {
-		Token token = {0};
-		return token;
+	Token* token = token_at(parser.pos + offset);
+	if (token == NULL) {
+		Token none = {0};
+		return none;
 	}
 	
-	return parser.tokens[parser.pos + offset];
+	return *token;
+}
+
+static u64 parse_int_literal(Token token) {
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "%.*s", token.len, token.str);
+
+	errno = 0;
+	u64 value = strtoull(buffer, NULL, 10);
+	if (errno == ERANGE) {
+		printf("error at %u:%u: integer literal %s is too large\n", token.line, token.column, buffer);
+		error();
+	}
+
+	return value;
+}
+
+static Data_Type parse_type() {
+	Token name = eat(TOKEN_KEYWORD_TYPE);
+	Data_Type type = {0};
+
+	switch (name.symbol) {
+		case SYM_INT:
+		case SYM_I64:
+			type.base = TYPE_I64;
+			break;
+		case SYM_I8:
+			type.base = TYPE_I8;
+			break;
+		case SYM_I16:
+			type.base = TYPE_I16;
+			break;
+		case SYM_I32:
+			type.base = TYPE_I32;
+			break;
+		case SYM_U8:
+			type.base = TYPE_U8;
+			break;
+		case SYM_U16:
+			type.base = TYPE_U16;
+			break;
+		case SYM_U32:
+			type.base = TYPE_U32;
+			break;
+		default:
+			type.base = TYPE_U64;
+			break;
+	}
+
+	while (peek(0).type == TOKEN_MUL) {
+		eat(TOKEN_MUL);
+		type.pointers++;
+	}
+
+	return type;
+}
+
+// <type> <name>, used for local variables and arguments
+static AST_Var_Decl* parse_var_decl() {
+	AST_Var_Decl* decl = ast_alloc(sizeof(AST_Var_Decl));
+	decl->type = AST_VAR_DECL;
+	decl->line = peek(0).line;
+	decl->data_type = parse_type();
+	decl->name = eat(TOKEN_IDENT);
+	decl->assign = NULL;
+	decl->array_length = 0;
+	decl->address_taken = false;
+	decl->location = 0;
+	return decl;
 }
 
 AST_Node* parse_func_call() {
-	AST_Func_Call* call = malloc(sizeof(AST_Func_Call));
+	AST_Node* args[MAX_ARGS];
+
+	AST_Func_Call* call = ast_alloc(sizeof(AST_Func_Call));
 	call->type = AST_FUNC_CALL;
+	call->line = peek(0).line;
 	call->name = eat(TOKEN_IDENT);
 	call->num_args = 0;
+	call->decl = NULL;
+	call->order = ORDER_SEQ_CST;
+	call->inline_call = false;
 
 	eat(TOKEN_OPEN_PAREN);
 
@@ -115,7 +267,7 @@ AST_Node* parse_func_call() {
 				error();
 			}
 			
-			call->args[call->num_args++] = parse_expr();
+			args[call->num_args++] = parse_expr();
 
 			if (peek(0).type == TOKEN_CLOSE_PAREN)
 				break;
@@ -125,33 +277,71 @@ AST_Node* parse_func_call() {
 	}
 
 	eat(TOKEN_CLOSE_PAREN);
+
+	call->args = ast_alloc(call->num_args * sizeof(AST_Node*));
+	memcpy(call->args, args, call->num_args * sizeof(AST_Node*));
 	return (AST_Node*) call;
 }
 
+AST_Node* parse_postfix(AST_Node* expr) {
+	while (peek(0).type == TOKEN_OPEN_BRACKET) {
+		eat(TOKEN_OPEN_BRACKET);
+
+		AST_Index* index = ast_alloc(sizeof(AST_Index));
+		index->type = AST_INDEX;
+		index->line = expr->line;
+		index->base = expr;
+		index->index = parse_expr();
+		eat(TOKEN_CLOSE_BRACKET);
+
+		expr = (AST_Node*) index;
+	}
+
+	return expr;
+}
+
 AST_Node* parse_primary() {
 	Token token = peek(0);
 
+	if (token.type == TOKEN_MUL || token.type == TOKEN_AMPERSAND) {
+		eat(token.type);
+
+		AST_Unary* unary = ast_alloc(sizeof(AST_Unary));
+		unary->type = token.type == TOKEN_MUL ? AST_DEREF : AST_ADDR_OF;
+		unary->line = token.line;
+		unary->expr = parse_primary();
+
+		if (unary->type == AST_ADDR_OF && unary->expr->type != AST_VAR && unary->expr->type != AST_INDEX) {
+			printf("error at %u:%u: can only take the address of a variable or an element\n", peek(0).line, peek(0).column);
+			error();
+		}
+		return (AST_Node*) unary;
+	}
+
     if (token.type == TOKEN_OPEN_PAREN) {
         eat(TOKEN_OPEN_PAREN);
         AST_Node* expr = parse_expr();
         eat(TOKEN_CLOSE_PAREN);
-        return expr;
+        return parse_postfix(expr);
     }
 
 	if (token.type == TOKEN_IDENT && peek(1).type == TOKEN_OPEN_PAREN) {
-		return parse_func_call();
+		return parse_postfix(parse_func_call());
 	}
 
 	if (token.type == TOKEN_IDENT) {
-		AST_Var* var = malloc(sizeof(AST_Var));
+		AST_Var* var = ast_alloc(sizeof(AST_Var));
 		var->type = AST_VAR;
+		var->line = peek(0).line;
 		var->name = eat(TOKEN_IDENT);
-		return (AST_Node*) var;
+		var->decl = NULL;
+		return parse_postfix((AST_Node*) var);
 	}
 
 	if (token.type == TOKEN_STR_LIT) {
-		AST_String* str = malloc(sizeof(AST_String));
+		AST_String* str = ast_alloc(sizeof(AST_String));
 		str->type = AST_STR_LITERAL;
+		str->line = peek(0).line;
 		str->token = eat(TOKEN_STR_LIT);
 		return (AST_Node*) str;
 	}
@@ -159,14 +349,10 @@ AST_Node* parse_primary() {
 	// assume integer literal
 	eat(TOKEN_INT_LIT);
 
-	char buffer[256];
-	snprintf(buffer, sizeof(buffer), "%.*s", token.len, token.str);
-
-	int num = atoi(buffer);
-
-	AST_Number* node = malloc(sizeof(AST_Number));
+	AST_Number* node = ast_alloc(sizeof(AST_Number));
 	node->type = AST_INT_LITERAL;
-	node->value = num;
+	node->line = token.line;
+	node->value = parse_int_literal(token);
 	return (AST_Node*) node;
 }
 
@@ -187,8 +373,9 @@ AST_Node* parse_infix(u32 min_precedence) {
 		// todo: right associativity?
 		AST_Node* rhs = parse_infix(precedence + 1);
 
-		AST_Binary_Op* node = malloc(sizeof(AST_Binary_Op));
+		AST_Binary_Op* node = ast_alloc(sizeof(AST_Binary_Op));
 		node->type = AST_BIN_OP;
+		node->line = result->line;
 		node->left = result;
 		node->right = rhs;
 		node->op = token_to_binary_op(op.type);
@@ -202,6 +389,116 @@ AST_Node* parse_expr() {
 	return parse_infix(0);
 }
 
+// switch (<expr>) { case <n>[, <n>...] { <body> } ... [default { <body> }] }
+AST_Node* parse_switch() {
+	eat(TOKEN_KEYWORD_SWITCH);
+
+	AST_Switch* node = ast_alloc(sizeof(AST_Switch));
+	node->type = AST_SWITCH;
+	node->line = last_line();
+	node->num_cases = 0;
+	node->cases_capacity = 8;
+	node->cases = ast_alloc(node->cases_capacity * sizeof(Switch_Case));
+	node->num_bodies = 0;
+	node->bodies_capacity = 8;
+	node->bodies = ast_alloc(node->bodies_capacity * sizeof(AST_Node*));
+	node->default_body = NULL;
+
+	eat(TOKEN_OPEN_PAREN);
+	node->value = parse_expr();
+	eat(TOKEN_CLOSE_PAREN);
+	eat(TOKEN_OPEN_BRACE);
+
+	while (peek(0).type != TOKEN_EOF && peek(0).type != TOKEN_CLOSE_BRACE) {
+		if (peek(0).type == TOKEN_KEYWORD_DEFAULT) {
+			Token token = eat(TOKEN_KEYWORD_DEFAULT);
+			if (node->default_body != NULL) {
+				printf("error at %u:%u: more than one default in a switch\n", token.line, token.column);
+				error();
+			}
+
+			eat(TOKEN_OPEN_BRACE);
+			node->default_body = parse_block();
+			eat(TOKEN_CLOSE_BRACE);
+			continue;
+		}
+
+		eat(TOKEN_KEYWORD_CASE);
+		for (;;) {
+			// there's no unary minus, but case labels have to be literals
+			bool negative = false;
+			if (peek(0).type == TOKEN_SUB) {
+				eat(TOKEN_SUB);
+				negative = true;
+			}
+			u64 value = parse_int_literal(eat(TOKEN_INT_LIT));
+
+			if (node->num_cases >= node->cases_capacity) {
+				Switch_Case* cases = ast_alloc(node->cases_capacity * 2 * sizeof(Switch_Case));
+				memcpy(cases, node->cases, node->cases_capacity * sizeof(Switch_Case));
+				node->cases = cases;
+				node->cases_capacity *= 2;
+			}
+			node->cases[node->num_cases++] = (Switch_Case) {
+				.value = negative ? -value : value,
+				.body = node->num_bodies,
+			};
+
+			if (peek(0).type != TOKEN_COMMA)
+				break;
+			eat(TOKEN_COMMA);
+		}
+
+		if (node->num_bodies >= node->bodies_capacity) {
+			AST_Node** bodies = ast_alloc(node->bodies_capacity * 2 * sizeof(AST_Node*));
+			memcpy(bodies, node->bodies, node->bodies_capacity * sizeof(AST_Node*));
+			node->bodies = bodies;
+			node->bodies_capacity *= 2;
+		}
+
+		eat(TOKEN_OPEN_BRACE);
+		node->bodies[node->num_bodies++] = parse_block();
+		eat(TOKEN_CLOSE_BRACE);
+	}
+
+	eat(TOKEN_CLOSE_BRACE);
+	return (AST_Node*) node;
+}
+
+// parallel (<type> <index> = <first>; <index> < <end>[; <chunk>]) <body>
+AST_Node* parse_parallel() {
+	eat(TOKEN_KEYWORD_PARALLEL);
+
+	AST_Parallel* node = ast_alloc(sizeof(AST_Parallel));
+	node->type = AST_PARALLEL;
+	node->line = last_line();
+
+	eat(TOKEN_OPEN_PAREN);
+	node->index = parse_var_decl();
+	eat(TOKEN_ASSIGN);
+	node->index->assign = parse_expr();
+	eat(TOKEN_SEMICOLON);
+
+	// the condition only names the bound, the index always counts up by one
+	Token name = eat(TOKEN_IDENT);
+	if (name.symbol != node->index->name.symbol) {
+		printf("error at %u:%u: a parallel loop has to compare its index\n", name.line, name.column);
+		error();
+	}
+	eat(TOKEN_LESS_THAN);
+	node->end = parse_expr();
+
+	node->chunk = NULL;
+	if (peek(0).type == TOKEN_SEMICOLON) {
+		eat(TOKEN_SEMICOLON);
+		node->chunk = parse_expr();
+	}
+	eat(TOKEN_CLOSE_PAREN);
+
+	node->body = parse_statement();
+	return (AST_Node*) node;
+}
+
 AST_Node* parse_statement() {
 	if (peek(0).type == TOKEN_OPEN_BRACE) {
 		eat(TOKEN_OPEN_BRACE);
@@ -210,13 +507,25 @@ AST_Node* parse_statement() {
 		return block;
 	}
 
-	if (peek(0).type == TOKEN_KEYWORD_VAR) {
-		eat(TOKEN_KEYWORD_VAR);
+	if (peek(0).type == TOKEN_KEYWORD_TYPE) {
+		AST_Var_Decl* decl = parse_var_decl();
 
-		AST_Var_Decl* decl = malloc(sizeof(AST_Var_Decl));
-		decl->type = AST_VAR_DECL;
-		decl->name = eat(TOKEN_IDENT);
-		decl->assign = NULL;
+		// stack array, the variable itself holds a pointer to the first element
+		if (peek(0).type == TOKEN_OPEN_BRACKET) {
+			eat(TOKEN_OPEN_BRACKET);
+			Token length = eat(TOKEN_INT_LIT);
+			eat(TOKEN_CLOSE_BRACKET);
+
+			decl->array_length = parse_int_literal(length);
+			if (decl->array_length == 0) {
+				printf("error at %u:%u: invalid array length\n", peek(0).line, peek(0).column);
+				error();
+			}
+
+			decl->data_type.pointers++;
+			eat(TOKEN_SEMICOLON);
+			return (AST_Node*) decl;
+		}
 
 		if (peek(0).type == TOKEN_ASSIGN) {
 			eat(TOKEN_ASSIGN);
@@ -231,8 +540,9 @@ AST_Node* parse_statement() {
 	if (peek(0).type == TOKEN_KEYWORD_IF) {
 		eat(TOKEN_KEYWORD_IF);
 
-		AST_Conditional* if_stmt = malloc(sizeof(AST_Conditional));
+		AST_Conditional* if_stmt = ast_alloc(sizeof(AST_Conditional));
 		if_stmt->type = AST_IF;
+		if_stmt->line = last_line();
 		
 		eat(TOKEN_OPEN_PAREN);
 		if_stmt->condition = parse_expr();
@@ -245,8 +555,9 @@ AST_Node* parse_statement() {
 	if (peek(0).type == TOKEN_KEYWORD_WHILE) {
 		eat(TOKEN_KEYWORD_WHILE);
 
-		AST_Conditional* while_stmt = malloc(sizeof(AST_Conditional));
+		AST_Conditional* while_stmt = ast_alloc(sizeof(AST_Conditional));
 		while_stmt->type = AST_WHILE;
+		while_stmt->line = last_line();
 		
 		eat(TOKEN_OPEN_PAREN);
 		while_stmt->condition = parse_expr();
@@ -256,22 +567,48 @@ AST_Node* parse_statement() {
 		return (AST_Node*) while_stmt;
 	}
 
+	if (peek(0).type == TOKEN_KEYWORD_SWITCH) {
+		return parse_switch();
+	}
+
+	if (peek(0).type == TOKEN_KEYWORD_PARALLEL) {
+		return parse_parallel();
+	}
+
 	if (peek(0).type == TOKEN_KEYWORD_RETURN) {
 		eat(TOKEN_KEYWORD_RETURN);
 
-		AST_Return* ret = malloc(sizeof(AST_Return));
+		AST_Return* ret = ast_alloc(sizeof(AST_Return));
 		ret->type = AST_RETURN;
-		ret->expr = parse_expr();
+		ret->line = last_line();
+		// generators end without a value, sema checks which kind of function it is
+		ret->expr = peek(0).type == TOKEN_SEMICOLON ? NULL : parse_expr();
 
 		eat(TOKEN_SEMICOLON);
 		return (AST_Node*) ret;
 	}
 
+	// a function that yields is a generator
+	if (peek(0).type == TOKEN_KEYWORD_YIELD) {
+		eat(TOKEN_KEYWORD_YIELD);
+
+		AST_Return* yield = ast_alloc(sizeof(AST_Return));
+		yield->type = AST_YIELD;
+		yield->line = last_line();
+		yield->expr = parse_expr();
+		parser.yielded = true;
+
+		eat(TOKEN_SEMICOLON);
+		return (AST_Node*) yield;
+	}
+
 	// todo: assignment as a binary operator instead?
 	if (peek(1).type == TOKEN_ASSIGN) {
-		AST_Assign* assign = malloc(sizeof(AST_Assign));
+		AST_Assign* assign = ast_alloc(sizeof(AST_Assign));
 		assign->type = AST_ASSIGN;
+		assign->line = peek(0).line;
 		assign->lhs = eat(TOKEN_IDENT);
+		assign->decl = NULL;
 		eat(TOKEN_ASSIGN);
 		assign->rhs = parse_expr();
 		eat(TOKEN_SEMICOLON);
@@ -279,22 +616,44 @@ AST_Node* parse_statement() {
 	}
 
 	AST_Node* expr = parse_expr();
+
+	// assignment to an element or through a pointer
+	if (peek(0).type == TOKEN_ASSIGN) {
+		if (expr->type != AST_INDEX && expr->type != AST_DEREF) {
+			printf("error at %u:%u: invalid assignment target\n", peek(0).line, peek(0).column);
+			error();
+		}
+
+		eat(TOKEN_ASSIGN);
+
+		AST_Store* store = ast_alloc(sizeof(AST_Store));
+		store->type = AST_STORE;
+		store->line = expr->line;
+		store->target = expr;
+		store->rhs = parse_expr();
+		expr = (AST_Node*) store;
+	}
+
 	eat(TOKEN_SEMICOLON);
 	return expr;
 }
 
 AST_Node* parse_block() {
-	AST_Block* block = malloc(sizeof(AST_Block));
+	AST_Block* block = ast_alloc(sizeof(AST_Block));
 	block->type = AST_BLOCK;
+	block->line = peek(0).line;
 	block->num_statements = 0;
-	block->statements_capacity = 32;
-	block->statements = malloc(block->statements_capacity * sizeof(AST_Node*));
+	block->statements_capacity = 8;
+	block->statements = ast_alloc(block->statements_capacity * sizeof(AST_Node*));
 
 	while (peek(0).type != TOKEN_EOF && peek(0).type != TOKEN_CLOSE_BRACE) {
 		AST_Node* statement = parse_statement();
 		if (block->num_statements >= block->statements_capacity) {
+			// the old array stays in the arena until it's freed
+			AST_Node** statements = ast_alloc(block->statements_capacity * 2 * sizeof(AST_Node*));
+			memcpy(statements, block->statements, block->statements_capacity * sizeof(AST_Node*));
+			block->statements = statements;
 			block->statements_capacity *= 2;
-			block->statements = realloc(block->statements, block->statements_capacity * sizeof(AST_Node*));
 		}
 
 		block->statements[block->num_statements++] = statement;
@@ -303,13 +662,25 @@ AST_Node* parse_block() {
 	return (AST_Node*) block;
 }
 
+// func <name>(<args>) [type] { <body> } or extern func <name>(<args>) [type]; for functions defined in another file
 AST_Node* parse_func_decl() {
+	bool is_extern = false;
+	if (peek(0).type == TOKEN_KEYWORD_EXTERN) {
+		eat(TOKEN_KEYWORD_EXTERN);
+		is_extern = true;
+	}
+
 	eat(TOKEN_KEYWORD_FUNC);
 
-	AST_Func_Decl* decl = malloc(sizeof(AST_Func_Decl));
+	AST_Var_Decl* args[MAX_ARGS];
+
+	AST_Func_Decl* decl = ast_alloc(sizeof(AST_Func_Decl));
 	decl->type = AST_FUNC_DECL;
+	decl->line = last_line();
 	decl->name = eat(TOKEN_IDENT);
 	decl->num_args = 0;
+	decl->is_pure = false;
+	decl->is_generator = false;
 
 	eat(TOKEN_OPEN_PAREN);
 
@@ -320,8 +691,7 @@ AST_Node* parse_func_decl() {
 				error();
 			}
 			
-			eat(TOKEN_KEYWORD_VAR);
-			decl->args[decl->num_args++] = eat(TOKEN_IDENT);
+			args[decl->num_args++] = parse_var_decl();
 
 			if (peek(0).type == TOKEN_CLOSE_PAREN)
 				break;
@@ -332,8 +702,25 @@ AST_Node* parse_func_decl() {
 
 	eat(TOKEN_CLOSE_PAREN);
 
+	decl->args = ast_alloc(decl->num_args * sizeof(AST_Var_Decl*));
+	memcpy(decl->args, args, decl->num_args * sizeof(AST_Var_Decl*));
+
+	// optional return type, defaults to int
+	decl->return_type = (Data_Type) { .base = TYPE_I64 };
+	if (peek(0).type == TOKEN_KEYWORD_TYPE) {
+		decl->return_type = parse_type();
+	}
+
+	if (is_extern) {
+		eat(TOKEN_SEMICOLON);
+		decl->body = NULL;
+		return (AST_Node*) decl;
+	}
+
 	eat(TOKEN_OPEN_BRACE);
+	parser.yielded = false;
 	decl->body = parse_block();
+	decl->is_generator = parser.yielded;
 	eat(TOKEN_CLOSE_BRACE);
 
 	return (AST_Node*) decl;
@@ -345,8 +732,9 @@ AST_Node* parse(char* input_text, Token* tokens, u32 num_tokens) {
 	parser.tokens = tokens;
 	parser.num_tokens = num_tokens;
 
-	AST_Program* program = malloc(sizeof(AST_Program));
+	AST_Program* program = ast_alloc(sizeof(AST_Program));
 	program->type = AST_PROGRAM;
+	program->line = peek(0).line;
 	program->num_defs = 0;
 	program->defs_capacity = 32;
 	program->defs = malloc(program->defs_capacity * sizeof(AST_Node*));
@@ -363,3 +751,17 @@ AST_Node* parse(char* input_text, Token* tokens, u32 num_tokens) {
 
 	return (AST_Node*) program;
 }
+
+// --stream: the tokens come from token_queue, the program is parsed one top level function at a time
+void begin_stream_parse(Queue* token_queue) {
+	memset(&parser, 0, sizeof(Parse_State));
+	parser.token_queue = token_queue;
+}
+
+// NULL at the end of the file
+AST_Func_Decl* parse_next_func() {
+	if (peek(0).type == TOKEN_EOF)
+		return NULL;
+
+	return (AST_Func_Decl*) parse_func_decl();
+}
@@ -0,0 +1,468 @@
+#include "all.h"
+
+// Profile guided optimization.
+//
+// With --instrument every function entry, if statement, while loop and call to a function in the program gets
+// counters that are dumped to a file when the program exits. --profile-use reads that file back and uses the
+// counts to move cold if bodies out of line, to keep predictable branches instead of using cmov, to inline hot calls
+// to small functions and to decide how to lay out and vectorize loops.
+//
+// Counters are numbered in AST order, so the profile only fits the exact source it was recorded with.
+// The file starts with a hash of the source and the number of counters, which are checked on load.
+
+#define HOT_RATIO 100 // code is hot if it ran at least 1/HOT_RATIO as often as the hottest counter
+#define COLD_RATIO 100 // a branch is cold if it's taken less than 1/COLD_RATIO of the time
+#define PREDICTABLE_RATIO 20 // a branch is predictable if it goes the same way all but 1/PREDICTABLE_RATIO of the time
+#define MAX_INLINE_NODES 64
+#define MIN_VECTOR_TRIP_COUNT 16
+
+static Profile_State profile = {0};
+
+static u64 hash_source(const char* source, u32 length) {
+	// FNV-1a
+	u64 hash = 0xcbf29ce484222325;
+	for (u32 i = 0; i < length; i++) {
+		hash ^= (u8) source[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static u32 new_counters(u32 count) {
+	u32 id = profile.num_counters;
+	profile.num_counters += count;
+	return id;
+}
+
+static void assign_counters(AST_Node* node) {
+	if (node == NULL)
+		return;
+
+	switch (node->type) {
+		case AST_PROGRAM: {
+			AST_Program* program = (AST_Program*) node;
+			for (u32 i = 0; i < program->num_defs; i++) {
+				assign_counters(program->defs[i]);
+			}
+			break;
+		}
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			assign_counters(op->left);
+			assign_counters(op->right);
+			break;
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				assign_counters(block->statements[i]);
+			}
+			break;
+		}
+		case AST_VAR_DECL:
+			assign_counters(((AST_Var_Decl*) node)->assign);
+			break;
+		case AST_ASSIGN:
+			assign_counters(((AST_Assign*) node)->rhs);
+			break;
+		case AST_FUNC_DECL: {
+			AST_Func_Decl* func = (AST_Func_Decl*) node;
+			func->profile_id = new_counters(1);
+			assign_counters(func->body);
+			break;
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			for (u32 i = 0; i < call->num_args; i++) {
+				assign_counters(call->args[i]);
+			}
+			if (call->decl != NULL) {
+				call->profile_id = new_counters(1);
+			}
+			break;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			// reached, then body executed
+			AST_Conditional* cond = (AST_Conditional*) node;
+			cond->profile_id = new_counters(2);
+			assign_counters(cond->condition);
+			assign_counters(cond->body);
+			break;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			assign_counters(switch_stmt->value);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				assign_counters(switch_stmt->bodies[i]);
+			}
+			assign_counters(switch_stmt->default_body);
+			break;
+		}
+		case AST_PARALLEL: {
+			// the body's counters are incremented by several threads without locking, so they're only roughly right
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			assign_counters(parallel->index->assign);
+			assign_counters(parallel->end);
+			assign_counters(parallel->chunk);
+			assign_counters(parallel->body);
+			break;
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			assign_counters(((AST_Return*) node)->expr);
+			break;
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			assign_counters(index->base);
+			assign_counters(index->index);
+			break;
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			assign_counters(((AST_Unary*) node)->expr);
+			break;
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			assign_counters(store->target);
+			assign_counters(store->rhs);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static u64 get_count(u32 id) {
+	if (profile.counts == NULL)
+		return 0;
+	return profile.counts[id];
+}
+
+static u32 count_nodes(AST_Node* node, bool* inlinable) {
+	if (node == NULL)
+		return 0;
+
+	switch (node->type) {
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return 1 + count_nodes(op->left, inlinable) + count_nodes(op->right, inlinable);
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			u32 sum = 1;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				sum += count_nodes(block->statements[i], inlinable);
+			}
+			return sum;
+		}
+		case AST_VAR_DECL:
+			return 1 + count_nodes(((AST_Var_Decl*) node)->assign, inlinable);
+		case AST_ASSIGN:
+			return 1 + count_nodes(((AST_Assign*) node)->rhs, inlinable);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			// only leaf functions are inlined, that way inlining can't recurse
+			if (call->decl != NULL)
+				*inlinable = false;
+
+			u32 sum = 1;
+			for (u32 i = 0; i < call->num_args; i++) {
+				sum += count_nodes(call->args[i], inlinable);
+			}
+			return sum;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			return 1 + count_nodes(cond->condition, inlinable) + count_nodes(cond->body, inlinable);
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			u32 sum = 1 + count_nodes(switch_stmt->value, inlinable) + count_nodes(switch_stmt->default_body, inlinable);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				sum += count_nodes(switch_stmt->bodies[i], inlinable);
+			}
+			return sum;
+		}
+		case AST_PARALLEL:
+			// the body is emitted as a function of its own, which needs the caller's frame
+			*inlinable = false;
+			return 1;
+		case AST_RETURN:
+			return 1 + count_nodes(((AST_Return*) node)->expr, inlinable);
+		case AST_YIELD:
+			// the frame a yield saves belongs to the generator
+			*inlinable = false;
+			return 1;
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			return 1 + count_nodes(index->base, inlinable) + count_nodes(index->index, inlinable);
+		}
+		case AST_DEREF:
+			return 1 + count_nodes(((AST_Unary*) node)->expr, inlinable);
+		case AST_ADDR_OF:
+			// the vectorizer looks for address taken variables in the current function only
+			*inlinable = false;
+			return 1;
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			return 1 + count_nodes(store->target, inlinable) + count_nodes(store->rhs, inlinable);
+		}
+		default:
+			return 1;
+	}
+}
+
+static bool should_inline(AST_Func_Call* call) {
+	if (call->decl == NULL || call->decl->body == NULL)
+		return false;
+
+	u64 count = get_count(call->profile_id);
+	if (count == 0 || count * HOT_RATIO < profile.max_count)
+		return false;
+
+	bool inlinable = true;
+	u32 size = count_nodes(call->decl->body, &inlinable);
+	return inlinable && size <= MAX_INLINE_NODES;
+}
+
+// marks hot calls for inlining
+static void plan_inlining(AST_Node* node) {
+	if (node == NULL)
+		return;
+
+	switch (node->type) {
+		case AST_PROGRAM: {
+			AST_Program* program = (AST_Program*) node;
+			for (u32 i = 0; i < program->num_defs; i++) {
+				plan_inlining(program->defs[i]);
+			}
+			break;
+		}
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			plan_inlining(op->left);
+			plan_inlining(op->right);
+			break;
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				plan_inlining(block->statements[i]);
+			}
+			break;
+		}
+		case AST_VAR_DECL:
+			plan_inlining(((AST_Var_Decl*) node)->assign);
+			break;
+		case AST_ASSIGN:
+			plan_inlining(((AST_Assign*) node)->rhs);
+			break;
+		case AST_FUNC_DECL:
+			plan_inlining(((AST_Func_Decl*) node)->body);
+			break;
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			for (u32 i = 0; i < call->num_args; i++) {
+				plan_inlining(call->args[i]);
+			}
+			call->inline_call = should_inline(call);
+			break;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			plan_inlining(cond->condition);
+			plan_inlining(cond->body);
+			break;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			plan_inlining(switch_stmt->value);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				plan_inlining(switch_stmt->bodies[i]);
+			}
+			plan_inlining(switch_stmt->default_body);
+			break;
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			plan_inlining(parallel->index->assign);
+			plan_inlining(parallel->end);
+			plan_inlining(parallel->chunk);
+			plan_inlining(parallel->body);
+			break;
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			plan_inlining(((AST_Return*) node)->expr);
+			break;
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			plan_inlining(index->base);
+			plan_inlining(index->index);
+			break;
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			plan_inlining(((AST_Unary*) node)->expr);
+			break;
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			plan_inlining(store->target);
+			plan_inlining(store->rhs);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static void load_profile(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("can't open profile %s: ", path);
+		fflush(stdout);
+		perror("");
+		error();
+	}
+
+	u64 header[2];
+	if (fread(header, sizeof(u64), 2, file) != 2) {
+		printf("profile %s is truncated\n", path);
+		error();
+	}
+
+	if (header[0] != profile.source_hash || header[1] != profile.num_counters) {
+		printf("profile %s doesn't match the source, ignoring it\n", path);
+		fclose(file);
+		return;
+	}
+
+	profile.counts = calloc(profile.num_counters + 1, sizeof(u64));
+	if (fread(profile.counts, sizeof(u64), profile.num_counters, file) != profile.num_counters) {
+		printf("profile %s is truncated\n", path);
+		error();
+	}
+
+	fclose(file);
+
+	for (u32 i = 0; i < profile.num_counters; i++) {
+		if (profile.counts[i] > profile.max_count)
+			profile.max_count = profile.counts[i];
+	}
+}
+
+void prepare_profile(AST_Node* root, const char* source, u32 source_length) {
+	memset(&profile, 0, sizeof(Profile_State));
+	if (!options.instrument && options.profile_use == NULL)
+		return;
+
+	assign_counters(root);
+	profile.source_hash = hash_source(source, source_length);
+
+	if (options.profile_use != NULL) {
+		load_profile(options.profile_use);
+		plan_inlining(root);
+	}
+}
+
+bool profile_branch_is_cold(AST_Conditional* if_stmt) {
+	if (profile.counts == NULL)
+		return false;
+
+	u64 reached = get_count(if_stmt->profile_id);
+	u64 taken = get_count(if_stmt->profile_id + 1);
+	return reached > 0 && taken * COLD_RATIO < reached;
+}
+
+// if conversion only pays off when the branch would be mispredicted
+bool profile_branch_is_predictable(AST_Conditional* if_stmt) {
+	if (profile.counts == NULL)
+		return false;
+
+	u64 reached = get_count(if_stmt->profile_id);
+	u64 taken = get_count(if_stmt->profile_id + 1);
+	return reached > 0 && (taken * PREDICTABLE_RATIO < reached || (reached - taken) * PREDICTABLE_RATIO < reached);
+}
+
+bool profile_loop_is_hot(AST_Conditional* while_stmt) {
+	if (profile.counts == NULL)
+		return false;
+
+	u64 iterations = get_count(while_stmt->profile_id + 1);
+	return iterations > 0 && iterations * HOT_RATIO >= profile.max_count;
+}
+
+// loops that only run a few iterations at a time aren't worth the overlap checks of the vector version
+bool profile_loop_is_short(AST_Conditional* while_stmt) {
+	if (profile.counts == NULL)
+		return false;
+
+	u64 entered = get_count(while_stmt->profile_id);
+	u64 iterations = get_count(while_stmt->profile_id + 1);
+	return iterations < entered * MIN_VECTOR_TRIP_COUNT;
+}
+
+void emit_profile_counter(u32 id) {
+	if (!options.instrument)
+		return;
+
+	fprintf(emitter.file, "	inc qword [_profile_counters + %u]\n", id * 8);
+}
+
+// registers the function writing the counters to disk, called at the start of main
+void emit_profile_setup() {
+	if (!options.instrument)
+		return;
+
+	fprintf(emitter.file, "	; dump the profile at exit\n");
+	fprintf(emitter.file, "	mov rdi, _profile_dump\n");
+	fprintf(emitter.file, "	call atexit\n");
+}
+
+void emit_profile_runtime() {
+	if (!options.instrument)
+		return;
+
+	fprintf(emitter.file, "extern atexit\n");
+	fprintf(emitter.file, "extern fopen\n");
+	fprintf(emitter.file, "extern fwrite\n");
+	fprintf(emitter.file, "extern fclose\n");
+	fprintf(emitter.file, "_profile_dump:\n");
+	fprintf(emitter.file, "	push rbp\n");
+	fprintf(emitter.file, "	mov rbp, rsp\n");
+	fprintf(emitter.file, "	sub rsp, 16\n");
+	fprintf(emitter.file, "	mov rdi, _profile_path\n");
+	fprintf(emitter.file, "	mov rsi, _profile_mode\n");
+	fprintf(emitter.file, "	call fopen\n");
+	fprintf(emitter.file, "	test rax, rax\n");
+	fprintf(emitter.file, "	jz _profile_dump_done\n");
+	fprintf(emitter.file, "	mov qword [rbp - 8], rax\n");
+	fprintf(emitter.file, "	mov rdi, _profile_header\n");
+	fprintf(emitter.file, "	mov rsi, 8\n");
+	fprintf(emitter.file, "	mov rdx, %u\n", profile.num_counters + 2);
+	fprintf(emitter.file, "	mov rcx, rax\n");
+	fprintf(emitter.file, "	call fwrite\n");
+	fprintf(emitter.file, "	mov rdi, qword [rbp - 8]\n");
+	fprintf(emitter.file, "	call fclose\n");
+	fprintf(emitter.file, "_profile_dump_done:\n");
+	fprintf(emitter.file, "	mov rsp, rbp\n");
+	fprintf(emitter.file, "	pop rbp\n");
+	fprintf(emitter.file, "	ret\n");
+
+	fprintf(emitter.file, "section .rodata\n");
+	fprintf(emitter.file, "_profile_path: db ");
+	for (const char* c = options.instrument_path; *c != 0; c++) {
+		fprintf(emitter.file, "%u, ", (u32) (u8) *c);
+	}
+	fprintf(emitter.file, "0\n");
+	fprintf(emitter.file, "_profile_mode: db 119, 98, 0\n"); // "wb"
+
+	// the header has to come right before the counters, they're written out in one go
+	fprintf(emitter.file, "section .data\n");
+	fprintf(emitter.file, "align 8\n");
+	fprintf(emitter.file, "_profile_header: dq 0x%016" PRIx64 ", %u\n", profile.source_hash, profile.num_counters);
+	fprintf(emitter.file, "_profile_counters: times %u dq 0\n", profile.num_counters + 1);
+}
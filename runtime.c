@@ -0,0 +1,793 @@
+#include "all.h"
+
+// Minimal runtime for --static, replacing the parts of libc generated code uses.
+// Programs are linked with just `ld`, without the dynamic loader or libc startup code.
+//
+// _start calls main and exits with its return value.
+// printf supports %d %i %u %x %p %c %s and %%, with l or ll for 64 bit values,
+// output is buffered and written to stdout when the buffer is full and at exit.
+// fwrite goes to the same buffer whatever the stream is, for the code printf calls are specialized to.
+// malloc hands out 16 byte aligned memory from chunks mapped with mmap, free does nothing.
+
+static const char* static_runtime =
+	"section .text\n"
+	"global _start\n"
+	"_start:\n"
+	"	xor ebp, ebp\n"
+	"	mov rdi, qword [rsp] ; argc\n"
+	"	lea rsi, [rsp + 8] ; argv\n"
+	"	and rsp, -16\n"
+	"	call main\n"
+	"	mov rdi, rax\n"
+	"	call exit\n"
+	"\n"
+	"global exit:function (_rt_exit_end - exit)\n"
+	"exit:\n"
+	"	push rdi\n"
+	"	call _rt_flush\n"
+	"	pop rdi\n"
+	"	mov eax, 231 ; exit_group\n"
+	"	syscall\n"
+	"_rt_exit_end:\n"
+	"\n"
+	"; writes out the buffer, only clobbers rax\n"
+	"_rt_flush:\n"
+	"	push rdi\n"
+	"	push rsi\n"
+	"	push rdx\n"
+	"	push rcx\n"
+	"	push r11\n"
+	"	mov rsi, _rt_out\n"
+	"	mov rdx, qword [_rt_out_len]\n"
+	"_rt_flush_loop:\n"
+	"	test rdx, rdx\n"
+	"	jz _rt_flush_done\n"
+	"	mov eax, 1 ; write\n"
+	"	mov edi, 1 ; stdout\n"
+	"	syscall\n"
+	"	test rax, rax\n"
+	"	jle _rt_flush_done ; nowhere to write to, drop the output\n"
+	"	add rsi, rax\n"
+	"	sub rdx, rax\n"
+	"	jmp _rt_flush_loop\n"
+	"_rt_flush_done:\n"
+	"	mov qword [_rt_out_len], 0\n"
+	"	pop r11\n"
+	"	pop rcx\n"
+	"	pop rdx\n"
+	"	pop rsi\n"
+	"	pop rdi\n"
+	"	ret\n"
+	"\n"
+	"; appends the char in dil to the buffer, only clobbers rax\n"
+	"_rt_putc:\n"
+	"	mov rax, qword [_rt_out_len]\n"
+	"	cmp rax, 4096\n"
+	"	jb _rt_putc_store\n"
+	"	call _rt_flush\n"
+	"	xor eax, eax\n"
+	"_rt_putc_store:\n"
+	"	mov byte [_rt_out + rax], dil\n"
+	"	inc rax\n"
+	"	mov qword [_rt_out_len], rax\n"
+	"	inc qword [_rt_out_total]\n"
+	"	ret\n"
+	"\n"
+	"; prints rax as an unsigned decimal number\n"
+	"_rt_print_dec:\n"
+	"	push rbx\n"
+	"	sub rsp, 32\n"
+	"	lea rbx, [rsp + 32]\n"
+	"	mov rsi, rbx\n"
+	"	mov ecx, 10\n"
+	"_rt_print_dec_loop:\n"
+	"	xor edx, edx\n"
+	"	div rcx\n"
+	"	add edx, 48 ; '0'\n"
+	"	dec rsi\n"
+	"	mov byte [rsi], dl\n"
+	"	test rax, rax\n"
+	"	jnz _rt_print_dec_loop\n"
+	"	jmp _rt_print_digits\n"
+	"\n"
+	"; prints rax as a hexadecimal number\n"
+	"_rt_print_hex:\n"
+	"	push rbx\n"
+	"	sub rsp, 32\n"
+	"	lea rbx, [rsp + 32]\n"
+	"	mov rsi, rbx\n"
+	"_rt_print_hex_loop:\n"
+	"	mov edx, eax\n"
+	"	and edx, 15\n"
+	"	movzx edx, byte [_rt_hex_digits + rdx]\n"
+	"	dec rsi\n"
+	"	mov byte [rsi], dl\n"
+	"	shr rax, 4\n"
+	"	jnz _rt_print_hex_loop\n"
+	"\n"
+	"; prints the digits from rsi up to rbx, then returns from _rt_print_dec or _rt_print_hex\n"
+	"_rt_print_digits:\n"
+	"	cmp rsi, rbx\n"
+	"	je _rt_print_digits_done\n"
+	"	movzx edi, byte [rsi]\n"
+	"	call _rt_putc\n"
+	"	inc rsi\n"
+	"	jmp _rt_print_digits\n"
+	"_rt_print_digits_done:\n"
+	"	add rsp, 32\n"
+	"	pop rbx\n"
+	"	ret\n"
+	"\n"
+	"; loads the next variadic argument of printf into rax\n"
+	"_rt_next_arg:\n"
+	"	mov rax, qword [r12]\n"
+	"	add r12, 8\n"
+	"	cmp r12, rbp\n"
+	"	jne _rt_next_arg_done\n"
+	"	add r12, 16 ; skip the saved rbp and return address, continue with the stack arguments\n"
+	"_rt_next_arg_done:\n"
+	"	ret\n"
+	"\n"
+	"global printf:function (_rt_printf_end - printf)\n"
+	"printf:\n"
+	"	push rbp\n"
+	"	mov rbp, rsp\n"
+	"	; register arguments in order below rbp, followed by the ones on the stack\n"
+	"	push r9\n"
+	"	push r8\n"
+	"	push rcx\n"
+	"	push rdx\n"
+	"	push rsi\n"
+	"	push rbx\n"
+	"	push r12\n"
+	"	push r13\n"
+	"	push r14\n"
+	"	mov rbx, rdi ; format\n"
+	"	lea r12, [rbp - 40] ; next argument\n"
+	"	mov r14, qword [_rt_out_total]\n"
+	"_rt_printf_loop:\n"
+	"	movzx edi, byte [rbx]\n"
+	"	inc rbx\n"
+	"	test edi, edi\n"
+	"	jz _rt_printf_done\n"
+	"	cmp edi, 37 ; '%'\n"
+	"	je _rt_printf_spec\n"
+	"	call _rt_putc\n"
+	"	jmp _rt_printf_loop\n"
+	"_rt_printf_spec:\n"
+	"	xor r13d, r13d ; set for 64 bit values\n"
+	"_rt_printf_length:\n"
+	"	movzx edi, byte [rbx]\n"
+	"	inc rbx\n"
+	"	cmp edi, 108 ; 'l'\n"
+	"	jne _rt_printf_conversion\n"
+	"	mov r13d, 1\n"
+	"	jmp _rt_printf_length\n"
+	"_rt_printf_conversion:\n"
+	"	cmp edi, 100 ; 'd'\n"
+	"	je _rt_printf_signed\n"
+	"	cmp edi, 105 ; 'i'\n"
+	"	je _rt_printf_signed\n"
+	"	cmp edi, 117 ; 'u'\n"
+	"	je _rt_printf_unsigned\n"
+	"	cmp edi, 120 ; 'x'\n"
+	"	je _rt_printf_hex\n"
+	"	cmp edi, 112 ; 'p'\n"
+	"	je _rt_printf_pointer\n"
+	"	cmp edi, 99 ; 'c'\n"
+	"	je _rt_printf_char\n"
+	"	cmp edi, 115 ; 's'\n"
+	"	je _rt_printf_string\n"
+	"	test edi, edi\n"
+	"	jz _rt_printf_done\n"
+	"	; %% and unknown conversions are printed as is\n"
+	"	push rdi\n"
+	"	mov edi, 37\n"
+	"	cmp qword [rsp], 37\n"
+	"	je _rt_printf_unknown\n"
+	"	call _rt_putc\n"
+	"_rt_printf_unknown:\n"
+	"	pop rdi\n"
+	"	call _rt_putc\n"
+	"	jmp _rt_printf_loop\n"
+	"_rt_printf_signed:\n"
+	"	call _rt_next_arg\n"
+	"	test r13d, r13d\n"
+	"	jnz _rt_printf_signed_64\n"
+	"	movsxd rax, eax\n"
+	"_rt_printf_signed_64:\n"
+	"	test rax, rax\n"
+	"	jns _rt_printf_decimal\n"
+	"	push rax\n"
+	"	mov edi, 45 ; '-'\n"
+	"	call _rt_putc\n"
+	"	pop rax\n"
+	"	neg rax\n"
+	"	jmp _rt_printf_decimal\n"
+	"_rt_printf_unsigned:\n"
+	"	call _rt_next_arg\n"
+	"	test r13d, r13d\n"
+	"	jnz _rt_printf_decimal\n"
+	"	mov eax, eax\n"
+	"_rt_printf_decimal:\n"
+	"	call _rt_print_dec\n"
+	"	jmp _rt_printf_loop\n"
+	"_rt_printf_hex:\n"
+	"	call _rt_next_arg\n"
+	"	test r13d, r13d\n"
+	"	jnz _rt_printf_hex_64\n"
+	"	mov eax, eax\n"
+	"_rt_printf_hex_64:\n"
+	"	call _rt_print_hex\n"
+	"	jmp _rt_printf_loop\n"
+	"_rt_printf_pointer:\n"
+	"	mov edi, 48 ; '0'\n"
+	"	call _rt_putc\n"
+	"	mov edi, 120 ; 'x'\n"
+	"	call _rt_putc\n"
+	"	call _rt_next_arg\n"
+	"	call _rt_print_hex\n"
+	"	jmp _rt_printf_loop\n"
+	"_rt_printf_char:\n"
+	"	call _rt_next_arg\n"
+	"	mov edi, eax\n"
+	"	call _rt_putc\n"
+	"	jmp _rt_printf_loop\n"
+	"_rt_printf_string:\n"
+	"	call _rt_next_arg\n"
+	"	mov rsi, rax\n"
+	"	test rsi, rsi\n"
+	"	jnz _rt_printf_string_loop\n"
+	"	mov rsi, _rt_null\n"
+	"_rt_printf_string_loop:\n"
+	"	movzx edi, byte [rsi]\n"
+	"	test edi, edi\n"
+	"	jz _rt_printf_loop\n"
+	"	call _rt_putc\n"
+	"	inc rsi\n"
+	"	jmp _rt_printf_string_loop\n"
+	"_rt_printf_done:\n"
+	"	mov rax, qword [_rt_out_total]\n"
+	"	sub rax, r14\n"
+	"	pop r14\n"
+	"	pop r13\n"
+	"	pop r12\n"
+	"	pop rbx\n"
+	"	mov rsp, rbp\n"
+	"	pop rbp\n"
+	"	ret\n"
+	"_rt_printf_end:\n"
+	"\n"
+	"global fwrite:function (_rt_fwrite_end - fwrite)\n"
+	"fwrite:\n"
+	"	push rdx\n"
+	"	imul rdx, rsi\n"
+	"	mov rsi, rdi\n"
+	"_rt_fwrite_loop:\n"
+	"	test rdx, rdx\n"
+	"	jz _rt_fwrite_done\n"
+	"	movzx edi, byte [rsi]\n"
+	"	call _rt_putc\n"
+	"	inc rsi\n"
+	"	dec rdx\n"
+	"	jmp _rt_fwrite_loop\n"
+	"_rt_fwrite_done:\n"
+	"	pop rax\n"
+	"	ret\n"
+	"_rt_fwrite_end:\n"
+	"\n"
+	"global malloc:function (_rt_malloc_end - malloc)\n"
+	"malloc:\n"
+	"	; round up to 16 bytes\n"
+	"	add rdi, 15\n"
+	"	and rdi, -16\n"
+	"	mov rax, qword [_rt_heap_ptr]\n"
+	"	lea rdx, [rax + rdi]\n"
+	"	cmp rdx, qword [_rt_heap_end]\n"
+	"	jbe _rt_malloc_done\n"
+	"	; map a new chunk, the rest of the old one is wasted\n"
+	"	push rdi\n"
+	"	mov rsi, rdi\n"
+	"	cmp rsi, 1048576\n"
+	"	jae _rt_malloc_map\n"
+	"	mov esi, 1048576\n"
+	"_rt_malloc_map:\n"
+	"	push rsi\n"
+	"	mov eax, 9 ; mmap\n"
+	"	xor edi, edi\n"
+	"	mov edx, 3 ; PROT_READ | PROT_WRITE\n"
+	"	mov r10d, 34 ; MAP_PRIVATE | MAP_ANONYMOUS\n"
+	"	mov r8, -1\n"
+	"	xor r9d, r9d\n"
+	"	syscall\n"
+	"	pop rsi\n"
+	"	pop rdi\n"
+	"	cmp rax, -4096\n"
+	"	ja _rt_malloc_fail\n"
+	"	lea rdx, [rax + rsi]\n"
+	"	mov qword [_rt_heap_end], rdx\n"
+	"	lea rdx, [rax + rdi]\n"
+	"_rt_malloc_done:\n"
+	"	mov qword [_rt_heap_ptr], rdx\n"
+	"	ret\n"
+	"_rt_malloc_fail:\n"
+	"	xor eax, eax\n"
+	"	ret\n"
+	"_rt_malloc_end:\n"
+	"\n"
+	"global free:function (_rt_free_end - free)\n"
+	"free:\n"
+	"	ret\n"
+	"_rt_free_end:\n"
+	"\n"
+	"section .rodata\n"
+	"_rt_hex_digits: db 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 97, 98, 99, 100, 101, 102\n"
+	"_rt_null: db 40, 110, 117, 108, 108, 41, 0 ; (null)\n"
+	"\n"
+	"section .bss\n"
+	"alignb 8\n"
+	"global stdout:data 8\n"
+	"stdout: resq 1 ; only there to be passed to fwrite\n"
+	"_rt_out_len: resq 1\n"
+	"_rt_out_total: resq 1 ; chars printed so far, for the return value of printf\n"
+	"_rt_heap_ptr: resq 1\n"
+	"_rt_heap_end: resq 1\n"
+	"_rt_out: resb 4096\n";
+
+// Runtime for parallel loops, in every file that has one.
+//
+// _parallel_for(task, frame, first, count, chunk) runs task(frame, first + i, n) for chunks of n iterations until
+// all count are done, then returns. The first call starts a thread per online CPU, which wait on a futex for loops.
+// A loop's range is split into a slice per thread. Every thread takes chunks from the front of its own slice and,
+// once that's empty, steals chunks from the other slices in turn, so threads that finish early help the others.
+// The thread that started the loop works too, then spins until the others are done.
+// A loop started from the body of another one runs on the thread that reached it.
+// The static runtime has no threads, there every loop runs on the calling thread.
+
+static const char* parallel_runtime =
+	"section .text\n"
+	"extern sysconf\n"
+	"extern pthread_create\n"
+	"_parallel_for:\n"
+	"	push rbp\n"
+	"	mov rbp, rsp\n"
+	"	push rbx\n"
+	"	push r12\n"
+	"	push r13\n"
+	"	push r14\n"
+	"	push r15\n"
+	"	sub rsp, 8\n"
+	"	mov rbx, rdi\n"
+	"	mov r12, rsi\n"
+	"	mov r13, rdx\n"
+	"	mov r14, rcx\n"
+	"	mov r15, r8\n"
+	"	cmp qword [_par_active], 0\n"
+	"	jne _par_for_serial\n"
+	"	cmp qword [_par_threads], 0\n"
+	"	jne _par_for_started\n"
+	"	call _par_start\n"
+	"_par_for_started:\n"
+	"	cmp qword [_par_threads], 1\n"
+	"	je _par_for_serial\n"
+	"	; without a chunk size, about 8 chunks per thread\n"
+	"	test r15, r15\n"
+	"	jnz _par_for_split\n"
+	"	mov rax, r14\n"
+	"	xor edx, edx\n"
+	"	mov rcx, qword [_par_threads]\n"
+	"	shl rcx, 3\n"
+	"	div rcx\n"
+	"	mov r15, rax\n"
+	"	test r15, r15\n"
+	"	jnz _par_for_split\n"
+	"	mov r15d, 1\n"
+	"_par_for_split:\n"
+	"	mov qword [_par_task], rbx\n"
+	"	mov qword [_par_frame], r12\n"
+	"	mov qword [_par_first], r13\n"
+	"	mov qword [_par_chunk], r15\n"
+	"	; slice i is count / threads iterations, plus one for the first count % threads slices\n"
+	"	mov rax, r14\n"
+	"	xor edx, edx\n"
+	"	div qword [_par_threads]\n"
+	"	xor ecx, ecx\n"
+	"	xor esi, esi\n"
+	"	mov rdi, _par_slices\n"
+	"_par_for_slice:\n"
+	"	mov qword [rdi], rsi ; next\n"
+	"	add rsi, rax\n"
+	"	cmp rcx, rdx\n"
+	"	jae _par_for_slice_end\n"
+	"	inc rsi\n"
+	"_par_for_slice_end:\n"
+	"	mov qword [rdi + 8], rsi ; end\n"
+	"	add rdi, 64\n"
+	"	inc rcx\n"
+	"	cmp rcx, qword [_par_threads]\n"
+	"	jb _par_for_slice\n"
+	"	dec rcx\n"
+	"	mov qword [_par_pending], rcx\n"
+	"	mov qword [_par_active], 1\n"
+	"	; wake up the pool\n"
+	"	lock inc dword [_par_generation]\n"
+	"	mov eax, 202 ; futex\n"
+	"	mov rdi, _par_generation\n"
+	"	mov esi, 129 ; FUTEX_WAKE_PRIVATE\n"
+	"	mov edx, 0x7fffffff\n"
+	"	syscall\n"
+	"	xor edi, edi\n"
+	"	call _par_work\n"
+	"_par_for_wait:\n"
+	"	cmp qword [_par_pending], 0\n"
+	"	je _par_for_done\n"
+	"	pause\n"
+	"	jmp _par_for_wait\n"
+	"_par_for_done:\n"
+	"	mov qword [_par_active], 0\n"
+	"	jmp _par_for_return\n"
+	"_par_for_serial:\n"
+	"	mov rdi, r12\n"
+	"	mov rsi, r13\n"
+	"	mov rdx, r14\n"
+	"	call rbx\n"
+	"_par_for_return:\n"
+	"	add rsp, 8\n"
+	"	pop r15\n"
+	"	pop r14\n"
+	"	pop r13\n"
+	"	pop r12\n"
+	"	pop rbx\n"
+	"	pop rbp\n"
+	"	ret\n"
+	"\n"
+	"; runs chunks of the current loop on thread edi until every slice is empty\n"
+	"_par_work:\n"
+	"	push rbx\n"
+	"	push r12\n"
+	"	push r13\n"
+	"	push r14\n"
+	"	push r15\n"
+	"	mov ebx, edi ; slice\n"
+	"	xor r12d, r12d ; slices tried\n"
+	"_par_work_slice:\n"
+	"	mov r13, rbx\n"
+	"	shl r13, 6\n"
+	"	add r13, _par_slices\n"
+	"_par_work_chunk:\n"
+	"	mov r14, qword [_par_chunk]\n"
+	"	mov rax, r14\n"
+	"	lock xadd qword [r13], rax\n"
+	"	mov rcx, qword [r13 + 8]\n"
+	"	cmp rax, rcx\n"
+	"	jae _par_work_steal\n"
+	"	sub rcx, rax\n"
+	"	cmp r14, rcx\n"
+	"	cmova r14, rcx\n"
+	"	mov rdi, qword [_par_frame]\n"
+	"	mov rsi, qword [_par_first]\n"
+	"	add rsi, rax\n"
+	"	mov rdx, r14\n"
+	"	call qword [_par_task]\n"
+	"	jmp _par_work_chunk\n"
+	"_par_work_steal:\n"
+	"	inc rbx\n"
+	"	cmp rbx, qword [_par_threads]\n"
+	"	jb _par_work_next\n"
+	"	xor ebx, ebx\n"
+	"_par_work_next:\n"
+	"	inc r12\n"
+	"	cmp r12, qword [_par_threads]\n"
+	"	jb _par_work_slice\n"
+	"	pop r15\n"
+	"	pop r14\n"
+	"	pop r13\n"
+	"	pop r12\n"
+	"	pop rbx\n"
+	"	ret\n"
+	"\n"
+	"; thread rdi of the pool\n"
+	"_par_worker:\n"
+	"	push rbx\n"
+	"	push r12\n"
+	"	sub rsp, 8\n"
+	"	mov rbx, rdi\n"
+	"	xor r12d, r12d ; last generation worked on\n"
+	"_par_worker_wait:\n"
+	"	mov eax, dword [_par_generation]\n"
+	"	cmp eax, r12d\n"
+	"	jne _par_worker_run\n"
+	"	mov eax, 202 ; futex\n"
+	"	mov rdi, _par_generation\n"
+	"	mov esi, 128 ; FUTEX_WAIT_PRIVATE\n"
+	"	mov edx, r12d\n"
+	"	xor r10d, r10d\n"
+	"	syscall\n"
+	"	jmp _par_worker_wait\n"
+	"_par_worker_run:\n"
+	"	mov r12d, eax\n"
+	"	mov rdi, rbx\n"
+	"	call _par_work\n"
+	"	lock dec qword [_par_pending]\n"
+	"	jmp _par_worker_wait\n"
+	"\n"
+	"_par_start:\n"
+	"	push rbx\n"
+	"	mov edi, 84 ; _SC_NPROCESSORS_ONLN\n"
+	"	call sysconf\n"
+	"	cmp rax, 1\n"
+	"	jge _par_start_max\n"
+	"	mov eax, 1\n"
+	"_par_start_max:\n"
+	"	mov ecx, 64 ; slices there's room for\n"
+	"	cmp rax, rcx\n"
+	"	cmova rax, rcx\n"
+	"	mov qword [_par_threads], rax\n"
+	"	mov ebx, 1\n"
+	"_par_start_thread:\n"
+	"	cmp rbx, qword [_par_threads]\n"
+	"	jae _par_start_done\n"
+	"	mov rdi, _par_thread_id\n"
+	"	xor esi, esi\n"
+	"	mov rdx, _par_worker\n"
+	"	mov rcx, rbx\n"
+	"	call pthread_create\n"
+	"	test eax, eax\n"
+	"	jnz _par_start_failed\n"
+	"	inc rbx\n"
+	"	jmp _par_start_thread\n"
+	"_par_start_failed:\n"
+	"	; make do with the threads there are\n"
+	"	mov qword [_par_threads], rbx\n"
+	"_par_start_done:\n"
+	"	pop rbx\n"
+	"	ret\n"
+	"\n"
+	"section .bss\n"
+	"alignb 64\n"
+	"_par_slices: resb 64 * 64 ; next and end of every slice, a cache line each\n"
+	"_par_threads: resq 1 ; including the one starting loops, 0 until the pool is started\n"
+	"_par_task: resq 1\n"
+	"_par_frame: resq 1\n"
+	"_par_first: resq 1\n"
+	"_par_chunk: resq 1\n"
+	"_par_active: resq 1\n"
+	"_par_thread_id: resq 1\n"
+	"alignb 64\n"
+	"_par_pending: resq 1 ; threads of the pool still working on the current loop\n"
+	"_par_generation: resd 1 ; futex, incremented for every loop\n"
+	"section .text\n";
+
+static const char* serial_parallel_runtime =
+	"section .text\n"
+	"_parallel_for:\n"
+	"	push rbp\n"
+	"	mov rbp, rsp\n"
+	"	mov rax, rdi\n"
+	"	mov rdi, rsi\n"
+	"	mov rsi, rdx\n"
+	"	mov rdx, rcx\n"
+	"	call rax\n"
+	"	pop rbp\n"
+	"	ret\n";
+
+// Runtime for printf calls specialized to their format, in every file that has one, see emit_printf.
+//
+// The code of a call formats into a buffer on the stack with these, then writes the buffer with fwrite.
+// The number helpers take the value in rax and the position in the buffer in rdi, which they advance. They're leaf
+// functions and keep their digits in the red zone. They write 24 bytes, the buffer has room for that. _fmt_write
+// writes from rsi up to rdi, _fmt_string writes the string at rsi. Both return the number of chars written, and
+// clobber what the C calling convention allows.
+static const char* format_runtime =
+	"section .text\n"
+	"_fmt_signed:\n"
+	"	test rax, rax\n"
+	"	jns _fmt_unsigned\n"
+	"	mov byte [rdi], 45 ; '-'\n"
+	"	inc rdi\n"
+	"	neg rax\n"
+	"_fmt_unsigned:\n"
+	"	mov rsi, rsp\n"
+	"_fmt_unsigned_loop:\n"
+	"	; divides by 10 with a multiplication by its inverse\n"
+	"	mov rcx, rax\n"
+	"	mov rdx, 0xcccccccccccccccd\n"
+	"	mul rdx\n"
+	"	shr rdx, 3\n"
+	"	lea rax, [rdx + rdx * 4]\n"
+	"	add rax, rax\n"
+	"	sub rcx, rax\n"
+	"	add ecx, 48 ; '0'\n"
+	"	dec rsi\n"
+	"	mov byte [rsi], cl\n"
+	"	mov rax, rdx\n"
+	"	test rax, rax\n"
+	"	jnz _fmt_unsigned_loop\n"
+	"	jmp _fmt_digits\n"
+	"_fmt_hex:\n"
+	"	mov rsi, rsp\n"
+	"_fmt_hex_loop:\n"
+	"	mov ecx, eax\n"
+	"	and ecx, 15\n"
+	"	movzx ecx, byte [_fmt_hex_digits + rcx]\n"
+	"	dec rsi\n"
+	"	mov byte [rsi], cl\n"
+	"	shr rax, 4\n"
+	"	jnz _fmt_hex_loop\n"
+	"; copies the digits from rsi up to rsp into the buffer, always 24 bytes which is quicker than just the digits\n"
+	"_fmt_digits:\n"
+	"	mov rcx, rsp\n"
+	"	sub rcx, rsi\n"
+	"	mov rax, qword [rsi]\n"
+	"	mov qword [rdi], rax\n"
+	"	mov rax, qword [rsi + 8]\n"
+	"	mov qword [rdi + 8], rax\n"
+	"	mov rax, qword [rsi + 16]\n"
+	"	mov qword [rdi + 16], rax\n"
+	"	add rdi, rcx\n"
+	"	ret\n"
+	"_fmt_string:\n"
+	"	test rsi, rsi\n"
+	"	jnz _fmt_string_start\n"
+	"	mov rsi, _fmt_null\n"
+	"_fmt_string_start:\n"
+	"	mov rdi, rsi\n"
+	"_fmt_string_loop:\n"
+	"	cmp byte [rdi], 0\n"
+	"	je _fmt_write\n"
+	"	inc rdi\n"
+	"	jmp _fmt_string_loop\n"
+	"_fmt_write:\n"
+	"	mov rdx, rdi\n"
+	"	sub rdx, rsi\n"
+	"	push rdx\n"
+	"	mov rdi, rsi\n"
+	"	mov esi, 1\n"
+	"	mov rcx, qword [stdout]\n"
+	"	call fwrite\n"
+	"	pop rax\n"
+	"	ret\n"
+	"section .rodata\n"
+	"_fmt_hex_digits: db 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 97, 98, 99, 100, 101, 102\n"
+	"_fmt_null: db 40, 110, 117, 108, 108, 41, 0 ; (null)\n"
+	"section .text\n";
+
+// Runtime for regions, in every file that uses them.
+//
+// A region is a header of three quadwords: the next free byte, the end of the chunk being filled, and the list of
+// chunks, newest first. Every chunk starts with the next one and the size of its data. regionalloc is emitted inline
+// and only calls _region_refill when the chunk is full, which starts a new one. Allocations bigger than a chunk get one
+// of their own and leave the chunk being filled alone, sizes of 2^48 and up fail. Chunks come from malloc and go back
+// with free.
+// _region_reset keeps the newest chunk and starts over in it, _region_free releases everything.
+static const char* region_runtime =
+	"section .text\n"
+	"_region_new:\n"
+	"	sub rsp, 8\n"
+	"	mov edi, 24\n"
+	"	call malloc\n"
+	"	test rax, rax\n"
+	"	jz _region_new_done\n"
+	"	xor ecx, ecx\n"
+	"	mov qword [rax], rcx\n"
+	"	mov qword [rax + 8], rcx\n"
+	"	mov qword [rax + 16], rcx\n"
+	"_region_new_done:\n"
+	"	add rsp, 8\n"
+	"	ret\n"
+	"\n"
+	"; rdi: region, rsi: size, rounded up to 16 unless it's bigger than a chunk\n"
+	"_region_refill:\n"
+	"	push rbx\n"
+	"	push r12\n"
+	"	push r13\n"
+	"	mov rbx, rdi\n"
+	"	mov r12, rsi\n"
+	"	xor eax, eax\n"
+	"	shr rsi, 48 ; REGION_MAX_BITS, nothing bigger can be allocated and rounding it up could wrap around\n"
+	"	jnz _region_refill_done\n"
+	"	add r12, 15\n"
+	"	and r12, -16\n"
+	"	mov r13d, 65520 ; data per chunk, 64k with the header\n"
+	"	cmp r12, r13\n"
+	"	cmova r13, r12\n"
+	"	lea rdi, [r13 + 16]\n"
+	"	call malloc\n"
+	"	test rax, rax\n"
+	"	jz _region_refill_done\n"
+	"	mov rcx, qword [rbx + 16]\n"
+	"	mov qword [rax], rcx\n"
+	"	mov qword [rax + 8], r13\n"
+	"	mov qword [rbx + 16], rax\n"
+	"	add rax, 16\n"
+	"	cmp r12, 65520\n"
+	"	ja _region_refill_done\n"
+	"	lea rcx, [rax + r12]\n"
+	"	mov qword [rbx], rcx\n"
+	"	lea rcx, [rax + r13]\n"
+	"	mov qword [rbx + 8], rcx\n"
+	"_region_refill_done:\n"
+	"	pop r13\n"
+	"	pop r12\n"
+	"	pop rbx\n"
+	"	ret\n"
+	"\n"
+	"_region_reset:\n"
+	"	push rbx\n"
+	"	push r12\n"
+	"	sub rsp, 8\n"
+	"	mov rbx, rdi\n"
+	"	mov rax, qword [rbx + 16]\n"
+	"	test rax, rax\n"
+	"	jz _region_done\n"
+	"	mov r12, qword [rax] ; the older chunks\n"
+	"	mov qword [rax], 0\n"
+	"	lea rcx, [rax + 16]\n"
+	"	mov qword [rbx], rcx\n"
+	"	add rcx, qword [rax + 8]\n"
+	"	mov qword [rbx + 8], rcx\n"
+	"	jmp _region_free_chunks\n"
+	"\n"
+	"_region_free:\n"
+	"	push rbx\n"
+	"	push r12\n"
+	"	sub rsp, 8\n"
+	"	mov r12, qword [rdi + 16]\n"
+	"	call free ; the header, only the chunks are used from here on\n"
+	"; frees the chunks from r12 on, then returns from _region_reset or _region_free\n"
+	"_region_free_chunks:\n"
+	"	test r12, r12\n"
+	"	jz _region_done\n"
+	"	mov rdi, r12\n"
+	"	mov r12, qword [r12]\n"
+	"	call free\n"
+	"	jmp _region_free_chunks\n"
+	"_region_done:\n"
+	"	add rsp, 8\n"
+	"	pop r12\n"
+	"	pop rbx\n"
+	"	ret\n";
+
+// Generators, see emit_generator_decl in emit.c. _gen_resume is called by next with the generator's block, it pushes
+// rbp like the body's own prologue would have and jumps to where the body stopped. The body returns 1 at a yield and
+// 0 when it's finished, with the resume address set to _gen_done, so next keeps returning 0 after that.
+static const char* generator_runtime =
+	"section .text\n"
+	"_gen_resume:\n"
+	"	push rbp\n"
+	"	mov rbp, qword [rdi + 16]\n"
+	"	jmp qword [rdi + 8]\n"
+	"\n"
+	"_gen_done:\n"
+	"	xor eax, eax\n"
+	"	pop rbp\n"
+	"	ret\n";
+
+void emit_region_runtime() {
+	fprintf(emitter.file, "; runtime for regions\n");
+	fputs(region_runtime, emitter.file);
+}
+
+void emit_generator_runtime() {
+	fprintf(emitter.file, "; runtime for generators\n");
+	fputs(generator_runtime, emitter.file);
+}
+
+void emit_format_runtime() {
+	fprintf(emitter.file, "; runtime for specialized printf calls\n");
+	if (!emitter.has_runtime) {
+		fprintf(emitter.file, "extern fwrite\n");
+		fprintf(emitter.file, "extern stdout\n");
+	}
+	fputs(format_runtime, emitter.file);
+}
+
+void emit_parallel_runtime() {
+	fprintf(emitter.file, "; runtime for parallel loops\n");
+	fputs(options.static_runtime ? serial_parallel_runtime : parallel_runtime, emitter.file);
+}
+
+void emit_static_runtime() {
+	fprintf(emitter.file, "; runtime for static executables\n");
+	fputs(static_runtime, emitter.file);
+}
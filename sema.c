@@ -0,0 +1,725 @@
+#include "all.h"
+
+// Semantic pass, runs between parsing and emitting.
+// Resolves variables and calls to their declarations, assigns a type to every
+// expression and checks that types are used correctly.
+
+static Sema_State sema = {0};
+
+static const Data_Type type_void = { .base = TYPE_VOID };
+static const Data_Type type_i64 = { .base = TYPE_I64 };
+static const Data_Type type_u64 = { .base = TYPE_U64 };
+static const Data_Type type_string = { .base = TYPE_U8, .pointers = 1 };
+static const Data_Type type_void_pointer = { .base = TYPE_VOID, .pointers = 1 };
+static const Data_Type type_i64_pointer = { .base = TYPE_I64, .pointers = 1 };
+
+u32 type_size(Data_Type type) {
+	if (type.pointers > 0)
+		return 8;
+
+	switch (type.base) {
+		case TYPE_VOID:
+			return 1;
+		case TYPE_I8:
+		case TYPE_U8:
+			return 1;
+		case TYPE_I16:
+		case TYPE_U16:
+			return 2;
+		case TYPE_I32:
+		case TYPE_U32:
+			return 4;
+		default:
+			return 8;
+	}
+}
+
+// size of the values a pointer points to
+u32 element_size(Data_Type pointer_type) {
+	pointer_type.pointers--;
+	return type_size(pointer_type);
+}
+
+bool type_is_signed(Data_Type type) {
+	if (type.pointers > 0)
+		return false;
+
+	return type.base == TYPE_I8 || type.base == TYPE_I16 || type.base == TYPE_I32 || type.base == TYPE_I64;
+}
+
+bool type_is_pointer(Data_Type type) {
+	return type.pointers > 0;
+}
+
+// same representation as the emitted code: truncated to the type and sign or zero extended to 64 bits
+u64 normalize_value(u64 value, Data_Type type) {
+	switch (type_size(type)) {
+		case 1:
+			return type_is_signed(type) ? (u64) (s64) (s8) value : (u64) (u8) value;
+		case 2:
+			return type_is_signed(type) ? (u64) (s64) (s16) value : (u64) (u16) value;
+		case 4:
+			return type_is_signed(type) ? (u64) (s64) (s32) value : (u64) (u32) value;
+		default:
+			return value;
+	}
+}
+
+// a call the emitter turns into a few instructions instead
+bool is_builtin(AST_Func_Call* call) {
+	return call->decl == NULL && call->name.symbol >= SYM_MIN && call->name.symbol <= SYM_NEXT;
+}
+
+// a builtin that only computes a value without branches, like min or popcnt
+bool is_pure_builtin(AST_Func_Call* call) {
+	return call->decl == NULL && call->name.symbol >= SYM_MIN && call->name.symbol <= SYM_ROTR;
+}
+
+static bool types_equal(Data_Type a, Data_Type b) {
+	return a.base == b.base && a.pointers == b.pointers;
+}
+
+static const char* base_type_names[] = {
+	[TYPE_VOID] = "void",
+	[TYPE_I8] = "i8",
+	[TYPE_I16] = "i16",
+	[TYPE_I32] = "i32",
+	[TYPE_I64] = "i64",
+	[TYPE_U8] = "u8",
+	[TYPE_U16] = "u16",
+	[TYPE_U32] = "u32",
+	[TYPE_U64] = "u64",
+};
+
+void print_type(Data_Type type) {
+	printf("%s", base_type_names[type.base]);
+	for (u32 i = 0; i < type.pointers; i++) {
+		putchar('*');
+	}
+}
+
+static void type_error(const char* what, Data_Type expected, Data_Type got) {
+	printf("error in '%.*s': %s, expected ", sema.func->name.len, sema.func->name.str, what);
+	print_type(expected);
+	printf(", got ");
+	print_type(got);
+	printf("\n");
+	error();
+}
+
+static void sema_error(const char* what, Token* name) {
+	printf("error in '%.*s': %s '%.*s'\n", sema.func->name.len, sema.func->name.str, what, name->len, name->str);
+	error();
+}
+
+// the type both operands of an arithmetic operation get converted to, roughly like in c.
+// values are always held sign or zero extended to 64 bits, so this only decides
+// where the result wraps and whether comparisons are signed.
+Data_Type arithmetic_type(Data_Type a, Data_Type b) {
+	// promote small types
+	if (type_size(a) < 4)
+		a.base = TYPE_I32;
+	if (type_size(b) < 4)
+		b.base = TYPE_I32;
+
+	if (a.base == b.base)
+		return a;
+
+	if (type_is_signed(a) == type_is_signed(b))
+		return type_size(a) >= type_size(b) ? a : b;
+
+	Data_Type unsigned_type = type_is_signed(a) ? b : a;
+	Data_Type signed_type = type_is_signed(a) ? a : b;
+	return type_size(unsigned_type) >= type_size(signed_type) ? unsigned_type : signed_type;
+}
+
+static bool is_null_literal(AST_Node* node) {
+	return node->type == AST_INT_LITERAL && ((AST_Number*) node)->value == 0;
+}
+
+// checks if the value of expr can be implicitly converted to the given type
+static void check_conversion(const char* what, Data_Type to, AST_Node* expr) {
+	Data_Type from = expr->data_type;
+
+	// any integer converts to any other integer, truncating if needed
+	if (!type_is_pointer(to) && !type_is_pointer(from))
+		return;
+
+	if (type_is_pointer(to) && is_null_literal(expr))
+		return;
+
+	if (type_is_pointer(to) && type_is_pointer(from)) {
+		if (types_equal(to, from))
+			return;
+
+		// void* converts to any other pointer and back
+		if ((to.pointers == 1 && to.base == TYPE_VOID) || (from.pointers == 1 && from.base == TYPE_VOID))
+			return;
+	}
+
+	type_error(what, to, from);
+}
+
+static void push_var(AST_Var_Decl* decl) {
+	for (u32 i = sema.scope_start; i < sema.num_vars; i++) {
+		if (sema.vars[i]->name.symbol == decl->name.symbol)
+			sema_error("redefinition of", &decl->name);
+	}
+
+	if (sema.num_vars >= MAX_VARS) {
+		printf("error in '%.*s': too many variables\n", sema.func->name.len, sema.func->name.str);
+		error();
+	}
+
+	sema.vars[sema.num_vars++] = decl;
+}
+
+// NULL if there's no variable of that name in scope
+static AST_Var_Decl* lookup_var(Token* name) {
+	// search backwards so inner declarations shadow outer ones
+	for (u32 i = sema.num_vars; i > 0; i--) {
+		if (sema.vars[i - 1]->name.symbol == name->symbol)
+			return sema.vars[i - 1];
+	}
+	return NULL;
+}
+
+static AST_Var_Decl* find_var(Token* name) {
+	AST_Var_Decl* decl = lookup_var(name);
+	if (decl == NULL)
+		sema_error("undefined variable", name);
+	return decl;
+}
+
+// whether a variable is declared outside the parallel loop being checked, or is its index
+static bool is_shared(AST_Var_Decl* decl) {
+	if (!sema.in_parallel)
+		return false;
+
+	for (u32 i = 0; i < sema.shared_vars; i++) {
+		if (sema.vars[i] == decl)
+			return true;
+	}
+	return false;
+}
+
+static AST_Func_Decl* find_func(Token* name) {
+	if (name->symbol >= sema.funcs_capacity)
+		return NULL;
+
+	return sema.funcs[name->symbol];
+}
+
+static Data_Type check_node(AST_Node* node);
+
+static void check_integer(const char* what, AST_Node* node) {
+	if (type_is_pointer(node->data_type))
+		type_error(what, type_i64, node->data_type);
+}
+
+static Data_Type check_binary_op(AST_Binary_Op* op) {
+	Data_Type left = check_node(op->left);
+	Data_Type right = check_node(op->right);
+	bool left_pointer = type_is_pointer(left);
+	bool right_pointer = type_is_pointer(right);
+
+	switch (op->op) {
+		case OP_ADD:
+			if (left_pointer && right_pointer)
+				type_error("cannot add two pointers", left, right);
+			if (left_pointer)
+				return left;
+			if (right_pointer)
+				return right;
+			return arithmetic_type(left, right);
+		case OP_SUB:
+			if (left_pointer && right_pointer) {
+				if (!types_equal(left, right))
+					type_error("subtracting unrelated pointers", left, right);
+				return type_i64;
+			}
+			if (right_pointer)
+				type_error("cannot subtract a pointer from an integer", left, right);
+			if (left_pointer)
+				return left;
+			return arithmetic_type(left, right);
+		case OP_MUL:
+		case OP_DIV:
+			check_integer("arithmetic on a pointer", op->left);
+			check_integer("arithmetic on a pointer", op->right);
+			return arithmetic_type(left, right);
+		default:
+			// comparisons
+			if (left_pointer || right_pointer) {
+				if (left_pointer && right_pointer && !types_equal(left, right))
+					type_error("comparing unrelated pointers", left, right);
+				if (left_pointer && !right_pointer && !is_null_literal(op->right))
+					type_error("comparing a pointer with an integer", left, right);
+				if (right_pointer && !left_pointer && !is_null_literal(op->left))
+					type_error("comparing a pointer with an integer", right, left);
+			}
+			return type_i64;
+	}
+}
+
+static void check_builtin_args(AST_Func_Call* call, u32 count, const char* what) {
+	if (call->num_args != count)
+		sema_error("wrong number of arguments to", &call->name);
+
+	for (u32 i = 0; i < count; i++) {
+		check_integer(what, call->args[i]);
+	}
+}
+
+// the memory order is a name after the other arguments, sequentially consistent if there's none.
+// a variable of the same name is just an argument
+static void take_memory_order(AST_Func_Call* call) {
+	if (call->num_args == 0)
+		return;
+
+	AST_Node* last = call->args[call->num_args - 1];
+	if (last->type != AST_VAR)
+		return;
+
+	AST_Var* var = (AST_Var*) last;
+	u32 symbol = var->name.symbol;
+	if (symbol >= SYM_RELAXED && symbol <= SYM_SEQCST && lookup_var(&var->name) == NULL) {
+		call->order = symbol - SYM_RELAXED;
+		call->num_args--;
+	}
+}
+
+// the type of the value an atomic builtin works on, which its first argument points to
+static Data_Type check_atomic_args(AST_Func_Call* call, u32 count) {
+	if (call->num_args != count)
+		sema_error("wrong number of arguments to", &call->name);
+
+	Data_Type pointer = call->args[0]->data_type;
+	if (!type_is_pointer(pointer) || (pointer.pointers == 1 && pointer.base == TYPE_VOID))
+		type_error("atomics take a pointer to the value", type_i64_pointer, pointer);
+
+	Data_Type type = pointer;
+	type.pointers--;
+	for (u32 i = 1; i < count; i++) {
+		check_conversion("atomic value type mismatch", type, call->args[i]);
+	}
+	return type;
+}
+
+static Data_Type check_builtin(AST_Func_Call* call) {
+	switch (call->name.symbol) {
+		case SYM_MIN:
+		case SYM_MAX:
+			check_builtin_args(call, 2, "min and max take integers");
+			return arithmetic_type(call->args[0]->data_type, call->args[1]->data_type);
+		case SYM_ABS:
+			check_builtin_args(call, 1, "abs takes an integer");
+			return arithmetic_type(call->args[0]->data_type, call->args[0]->data_type);
+		case SYM_POPCNT:
+		case SYM_LZCNT:
+		case SYM_TZCNT:
+			// bits of the argument's type
+			check_builtin_args(call, 1, "bit counts take an integer");
+			return type_i64;
+		case SYM_BSWAP:
+			check_builtin_args(call, 1, "bswap takes an integer");
+			return call->args[0]->data_type;
+		case SYM_ROTL:
+		case SYM_ROTR:
+			check_builtin_args(call, 2, "rotates take integers");
+			return call->args[0]->data_type;
+		case SYM_RDTSC:
+			check_builtin_args(call, 0, NULL);
+			return type_u64;
+		case SYM_PREFETCH:
+			if (call->num_args != 1)
+				sema_error("wrong number of arguments to", &call->name);
+			if (!type_is_pointer(call->args[0]->data_type))
+				type_error("prefetch takes a pointer", type_void_pointer, call->args[0]->data_type);
+			return type_void;
+		case SYM_ATOMICLOAD:
+			// loads only acquire and stores only release
+			if (call->order == ORDER_RELEASE || call->order == ORDER_ACQ_REL)
+				sema_error("invalid memory order for", &call->name);
+			return check_atomic_args(call, 1);
+		case SYM_ATOMICSTORE:
+			if (call->order == ORDER_ACQUIRE || call->order == ORDER_ACQ_REL)
+				sema_error("invalid memory order for", &call->name);
+			check_atomic_args(call, 2);
+			return type_void;
+		case SYM_ATOMICADD:
+		case SYM_ATOMICXCHG:
+			return check_atomic_args(call, 2);
+		case SYM_ATOMICCAS:
+			// the value that was there, the swap happened if it's the expected one
+			return check_atomic_args(call, 3);
+		case SYM_REGION:
+			check_builtin_args(call, 0, NULL);
+			return type_void_pointer;
+		case SYM_REGIONALLOC:
+			if (call->num_args != 2)
+				sema_error("wrong number of arguments to", &call->name);
+			if (!type_is_pointer(call->args[0]->data_type))
+				type_error("regions are pointers", type_void_pointer, call->args[0]->data_type);
+			check_integer("regionalloc takes a size in bytes", call->args[1]);
+			return type_void_pointer;
+		case SYM_REGIONRESET:
+		case SYM_REGIONFREE:
+			if (call->num_args != 1)
+				sema_error("wrong number of arguments to", &call->name);
+			if (!type_is_pointer(call->args[0]->data_type))
+				type_error("regions are pointers", type_void_pointer, call->args[0]->data_type);
+			return type_void;
+		case SYM_NEXT:
+			// whether the generator yielded another value
+			if (call->num_args != 1)
+				sema_error("wrong number of arguments to", &call->name);
+			if (!type_is_pointer(call->args[0]->data_type))
+				type_error("next takes a generator", type_i64_pointer, call->args[0]->data_type);
+			return type_i64;
+		default:
+			check_builtin_args(call, 0, NULL);
+			return type_void;
+	}
+}
+
+static Data_Type check_func_call(AST_Func_Call* call) {
+	bool is_inline_builtin = call->name.symbol >= SYM_MIN && call->name.symbol <= SYM_NEXT && find_func(&call->name) == NULL;
+	if (is_inline_builtin && call->name.symbol >= SYM_ATOMICLOAD && call->name.symbol <= SYM_FENCE) {
+		take_memory_order(call);
+	}
+
+	for (u32 i = 0; i < call->num_args; i++) {
+		check_node(call->args[i]);
+	}
+
+	// builtins
+	if (call->name.symbol == SYM_ALLOC) {
+		if (call->num_args != 1)
+			sema_error("wrong number of arguments to", &call->name);
+		check_integer("alloc takes a size in bytes", call->args[0]);
+		return type_void_pointer;
+	}
+
+	// the inline builtins can still be defined by the program
+	if (is_inline_builtin)
+		return check_builtin(call);
+
+	call->decl = find_func(&call->name);
+
+	// anything else is an external function, we can't check those
+	if (call->decl == NULL)
+		return type_i64;
+
+	if (call->num_args != call->decl->num_args)
+		sema_error("wrong number of arguments to", &call->name);
+
+	for (u32 i = 0; i < call->num_args; i++) {
+		check_conversion("argument type mismatch", call->decl->args[i]->data_type, call->args[i]);
+	}
+
+	// calling a generator makes one, it points to the value it yielded last
+	if (call->decl->is_generator) {
+		Data_Type type = call->decl->return_type;
+		type.pointers++;
+		return type;
+	}
+
+	return call->decl->return_type;
+}
+
+static void check_block(AST_Block* block) {
+	u32 saved_num_vars = sema.num_vars;
+	u32 saved_scope_start = sema.scope_start;
+	sema.scope_start = sema.num_vars;
+
+	for (u32 i = 0; i < block->num_statements; i++) {
+		check_node(block->statements[i]);
+	}
+
+	sema.num_vars = saved_num_vars;
+	sema.scope_start = saved_scope_start;
+}
+
+static int compare_cases_signed(const void* a, const void* b) {
+	s64 left = ((const Switch_Case*) a)->value;
+	s64 right = ((const Switch_Case*) b)->value;
+	return left < right ? -1 : left > right;
+}
+
+static int compare_cases_unsigned(const void* a, const void* b) {
+	u64 left = ((const Switch_Case*) a)->value;
+	u64 right = ((const Switch_Case*) b)->value;
+	return left < right ? -1 : left > right;
+}
+
+// case values are converted to the type of the switch value, then sorted in its order for the emitter
+static void check_switch(AST_Switch* node) {
+	check_node(node->value);
+	check_integer("switch value", node->value);
+
+	Data_Type type = node->value->data_type;
+	bool is_signed = type_is_signed(type);
+	for (u32 i = 0; i < node->num_cases; i++) {
+		node->cases[i].value = normalize_value(node->cases[i].value, type);
+	}
+	qsort(node->cases, node->num_cases, sizeof(Switch_Case), is_signed ? compare_cases_signed : compare_cases_unsigned);
+
+	for (u32 i = 1; i < node->num_cases; i++) {
+		if (node->cases[i].value != node->cases[i - 1].value)
+			continue;
+
+		printf("error in '%.*s': duplicate case ", sema.func->name.len, sema.func->name.str);
+		printf(is_signed ? "%" PRId64 : "%" PRIu64, node->cases[i].value);
+		printf(" in switch on line %u\n", node->line);
+		error();
+	}
+
+	for (u32 i = 0; i < node->num_bodies; i++) {
+		check_node(node->bodies[i]);
+	}
+	if (node->default_body != NULL) {
+		check_node(node->default_body);
+	}
+}
+
+// the body runs on several threads at once, each with a copy of the enclosing function's variables.
+// so it can't change them, only memory they point to
+static void check_parallel(AST_Parallel* parallel) {
+	u32 saved_num_vars = sema.num_vars;
+	u32 saved_scope_start = sema.scope_start;
+	bool saved_in_parallel = sema.in_parallel;
+	u32 saved_shared_vars = sema.shared_vars;
+	sema.scope_start = sema.num_vars;
+
+	check_node((AST_Node*) parallel->index);
+	check_integer("parallel loop index", (AST_Node*) parallel->index);
+	check_node(parallel->end);
+	check_integer("parallel loop bound", parallel->end);
+	if (parallel->chunk != NULL) {
+		check_node(parallel->chunk);
+		check_integer("parallel loop chunk size", parallel->chunk);
+	}
+	if (parallel->index->address_taken)
+		sema_error("a parallel loop can't take the address of", &parallel->index->name);
+
+	sema.in_parallel = true;
+	sema.shared_vars = sema.num_vars;
+	check_node(parallel->body);
+
+	sema.num_vars = saved_num_vars;
+	sema.scope_start = saved_scope_start;
+	sema.in_parallel = saved_in_parallel;
+	sema.shared_vars = saved_shared_vars;
+}
+
+static Data_Type check_node(AST_Node* node) {
+	Data_Type type = type_void;
+
+	switch (node->type) {
+		case AST_INT_LITERAL: {
+			AST_Number* number = (AST_Number*) node;
+			type = number->value > INT64_MAX ? type_u64 : type_i64;
+			break;
+		}
+		case AST_STR_LITERAL:
+			type = type_string;
+			break;
+		case AST_BIN_OP:
+			type = check_binary_op((AST_Binary_Op*) node);
+			break;
+		case AST_BLOCK:
+			check_block((AST_Block*) node);
+			break;
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+			if (decl->data_type.base == TYPE_VOID && decl->data_type.pointers == 0)
+				sema_error("void variable", &decl->name);
+
+			// initializer can't see the variable itself
+			if (decl->assign != NULL) {
+				check_node(decl->assign);
+				check_conversion("initializer type mismatch", decl->data_type, decl->assign);
+			}
+
+			push_var(decl);
+			return decl->data_type;
+		}
+		case AST_VAR: {
+			AST_Var* var = (AST_Var*) node;
+			var->decl = find_var(&var->name);
+			type = var->decl->data_type;
+			break;
+		}
+		case AST_ASSIGN: {
+			AST_Assign* assign = (AST_Assign*) node;
+			assign->decl = find_var(&assign->lhs);
+			if (assign->decl->array_length > 0)
+				sema_error("cannot assign to array", &assign->lhs);
+			if (is_shared(assign->decl))
+				sema_error("a parallel loop can't assign", &assign->lhs);
+
+			check_node(assign->rhs);
+			check_conversion("assignment type mismatch", assign->decl->data_type, assign->rhs);
+			break;
+		}
+		case AST_FUNC_CALL:
+			type = check_func_call((AST_Func_Call*) node);
+			break;
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			check_node(cond->condition);
+			check_node(cond->body);
+			break;
+		}
+		case AST_SWITCH:
+			check_switch((AST_Switch*) node);
+			break;
+		case AST_PARALLEL:
+			check_parallel((AST_Parallel*) node);
+			break;
+		case AST_RETURN: {
+			AST_Return* ret = (AST_Return*) node;
+			if (sema.in_parallel) {
+				printf("error in '%.*s': return in a parallel loop\n", sema.func->name.len, sema.func->name.str);
+				error();
+			}
+			// a generator returns without a value to finish, the values are yielded
+			if (sema.func->is_generator) {
+				if (ret->expr != NULL)
+					sema_error("return with a value in generator", &sema.func->name);
+				break;
+			}
+			if (ret->expr == NULL)
+				sema_error("return without a value in", &sema.func->name);
+			check_node(ret->expr);
+			check_conversion("return type mismatch", sema.func->return_type, ret->expr);
+			break;
+		}
+		case AST_YIELD: {
+			AST_Return* yield = (AST_Return*) node;
+			if (sema.in_parallel) {
+				printf("error in '%.*s': yield in a parallel loop\n", sema.func->name.len, sema.func->name.str);
+				error();
+			}
+			check_node(yield->expr);
+			check_conversion("yield type mismatch", sema.func->return_type, yield->expr);
+			break;
+		}
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			Data_Type base = check_node(index->base);
+			check_node(index->index);
+			check_integer("array index", index->index);
+
+			if (!type_is_pointer(base) || (base.pointers == 1 && base.base == TYPE_VOID))
+				type_error("indexing a non-pointer", type_void_pointer, base);
+
+			type = base;
+			type.pointers--;
+			break;
+		}
+		case AST_DEREF: {
+			AST_Unary* deref = (AST_Unary*) node;
+			Data_Type pointer = check_node(deref->expr);
+
+			if (!type_is_pointer(pointer) || (pointer.pointers == 1 && pointer.base == TYPE_VOID))
+				type_error("dereferencing a non-pointer", type_void_pointer, pointer);
+
+			type = pointer;
+			type.pointers--;
+			break;
+		}
+		case AST_ADDR_OF: {
+			AST_Unary* addr = (AST_Unary*) node;
+			type = check_node(addr->expr);
+			type.pointers++;
+			if (addr->expr->type == AST_VAR) {
+				AST_Var* var = (AST_Var*) addr->expr;
+				if (is_shared(var->decl))
+					sema_error("a parallel loop can't take the address of", &var->name);
+				var->decl->address_taken = true;
+			}
+			break;
+		}
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			Data_Type target = check_node(store->target);
+			check_node(store->rhs);
+			check_conversion("assignment type mismatch", target, store->rhs);
+			break;
+		}
+		default:
+			printf("check_node: unhandled node type %u\n", node->type);
+			error();
+	}
+
+	node->data_type = type;
+	return type;
+}
+
+static void check_func_decl(AST_Func_Decl* func) {
+	sema.func = func;
+	sema.num_vars = 0;
+	sema.scope_start = 0;
+	sema.in_parallel = false;
+	sema.shared_vars = 0;
+
+	for (u32 i = 0; i < func->num_args; i++) {
+		push_var(func->args[i]);
+	}
+
+	if (func->is_generator && func->name.symbol == SYM_MAIN)
+		sema_error("can't yield in", &func->name);
+
+	func->data_type = type_void;
+	if (func->body != NULL) {
+		check_node(func->body);
+	}
+}
+
+void reset_analysis() {
+	free(sema.funcs);
+	memset(&sema, 0, sizeof(Sema_State));
+}
+
+// makes a function visible to calls
+void declare_func(AST_Func_Decl* func) {
+	sema.func = func;
+
+	if (func->name.symbol >= sema.funcs_capacity) {
+		u32 capacity = sema.funcs_capacity == 0 ? 256 : sema.funcs_capacity;
+		while (capacity <= func->name.symbol) {
+			capacity *= 2;
+		}
+		sema.funcs = realloc(sema.funcs, capacity * sizeof(AST_Func_Decl*));
+		memset(sema.funcs + sema.funcs_capacity, 0, (capacity - sema.funcs_capacity) * sizeof(AST_Func_Decl*));
+		sema.funcs_capacity = capacity;
+	}
+
+	if (sema.funcs[func->name.symbol] != NULL)
+		sema_error("redefinition of function", &func->name);
+
+	sema.funcs[func->name.symbol] = func;
+}
+
+// with --stream, functions are checked as they're parsed and calls only see the functions declared before
+void analyze_func(AST_Func_Decl* func) {
+	check_func_decl(func);
+}
+
+void analyze(AST_Node* root) {
+	reset_analysis();
+
+	AST_Program* program = (AST_Program*) root;
+	program->data_type = type_void;
+
+	for (u32 i = 0; i < program->num_defs; i++) {
+		declare_func((AST_Func_Decl*) program->defs[i]);
+	}
+
+	for (u32 i = 0; i < program->num_defs; i++) {
+		check_func_decl((AST_Func_Decl*) program->defs[i]);
+	}
+}
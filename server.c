@@ -0,0 +1,281 @@
+#include "all.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Compile server and client.
+//
+// The server listens on a unix socket. A client sends its working directory and command line arguments as
+// null terminated strings and shuts down its side of the connection. The server forks a child for every
+// request, which compiles it exactly like a normal run with stdout going to the client, so compile errors only
+// end that child. When the child exits the server sends a 0 byte and the exit status, then closes the connection.
+//
+// The children inherit the server's warm output cache (see cache.c) and send the functions they emitted back
+// through a pipe, so the next request can reuse them.
+
+#define MAX_CHILDREN 64
+
+typedef struct {
+	pid_t pid;
+	int connection;
+	int pipe; // cache entries sent by the child
+
+	char* data;
+	u32 length;
+	u32 capacity;
+} Server_Child;
+
+static Server_Child children[MAX_CHILDREN];
+static u32 num_children = 0;
+
+static bool write_all(int fd, const void* data, u32 length) {
+	const char* bytes = data;
+	while (length > 0) {
+		ssize_t result = write(fd, bytes, length);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return false;
+		bytes += result;
+		length -= result;
+	}
+	return true;
+}
+
+// reads until the other side shuts down, the result is null terminated
+static char* read_all(int fd, u32* length) {
+	u32 capacity = 4096;
+	char* data = malloc(capacity);
+	*length = 0;
+
+	for (;;) {
+		if (*length + 1 >= capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+
+		ssize_t result = read(fd, data + *length, capacity - *length - 1);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+		*length += result;
+	}
+
+	data[*length] = 0;
+	return data;
+}
+
+static void init_address(struct sockaddr_un* address, const char* socket_path) {
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+
+	if (strlen(socket_path) >= sizeof(address->sun_path)) {
+		printf("socket path %s is too long\n", socket_path);
+		error();
+	}
+	strcpy(address->sun_path, socket_path);
+}
+
+// runs in the forked child, never returns
+static void serve_request(int connection, int pipe_fd) {
+	u32 length;
+	char* request = read_all(connection, &length);
+
+	// working directory, then the arguments
+	char* args[256];
+	int num_args = 0;
+	args[num_args++] = "compiler";
+	for (u32 pos = 0; pos < length && num_args < 256; pos += strlen(request + pos) + 1) {
+		args[num_args++] = request + pos;
+	}
+
+	dup2(connection, STDOUT_FILENO);
+	dup2(connection, STDERR_FILENO);
+	close(connection);
+
+	if (num_args < 2 || chdir(args[1]) != 0) {
+		printf("compile server: invalid working directory\n");
+		error();
+	}
+
+	// drop the working directory
+	args[1] = args[0];
+
+	cache_set_pipe(pipe_fd);
+	exit(compile(num_args - 1, args + 1));
+}
+
+static void start_child(int listener, int connection) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		close(connection);
+		return;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		close(connection);
+		return;
+	}
+
+	if (pid == 0) {
+		// only keep this request's connection, otherwise other clients wait for this child to exit
+		close(listener);
+		close(fds[0]);
+		for (u32 i = 0; i < num_children; i++) {
+			close(children[i].connection);
+			close(children[i].pipe);
+		}
+		serve_request(connection, fds[1]);
+	}
+
+	close(fds[1]);
+
+	Server_Child* child = &children[num_children++];
+	memset(child, 0, sizeof(Server_Child));
+	child->pid = pid;
+	child->connection = connection;
+	child->pipe = fds[0];
+}
+
+// returns false once the child closed the pipe
+static bool read_child(Server_Child* child) {
+	if (child->capacity - child->length < 4096) {
+		child->capacity = child->capacity == 0 ? 65536 : child->capacity * 2;
+		child->data = realloc(child->data, child->capacity);
+	}
+
+	ssize_t result = read(child->pipe, child->data + child->length, child->capacity - child->length);
+	if (result < 0 && errno == EINTR)
+		return true;
+	if (result <= 0)
+		return false;
+
+	child->length += result;
+
+	u32 used = cache_receive(child->data, child->length);
+	memmove(child->data, child->data + used, child->length - used);
+	child->length -= used;
+	return true;
+}
+
+static void finish_child(u32 index) {
+	Server_Child* child = &children[index];
+
+	int status;
+	while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {}
+
+	char result[2] = { 0, WIFEXITED(status) ? WEXITSTATUS(status) : 1 };
+	write_all(child->connection, result, sizeof(result));
+
+	close(child->connection);
+	close(child->pipe);
+	free(child->data);
+
+	children[index] = children[--num_children];
+}
+
+int run_server(const char* socket_path) {
+	// clients going away shouldn't take down the server
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un address;
+	init_address(&address, socket_path);
+	unlink(socket_path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, MAX_CHILDREN) != 0) {
+		perror(socket_path);
+		error();
+	}
+
+	cache_init();
+	printf("compile server listening on %s\n", socket_path);
+	fflush(stdout);
+
+	for (;;) {
+		struct pollfd fds[MAX_CHILDREN + 1];
+		for (u32 i = 0; i < num_children; i++) {
+			fds[i].fd = children[i].pipe;
+			fds[i].events = POLLIN;
+		}
+
+		// stop accepting while all child slots are taken
+		fds[num_children].fd = num_children < MAX_CHILDREN ? listener : -1;
+		fds[num_children].events = POLLIN;
+
+		u32 num_fds = num_children + 1;
+		if (poll(fds, num_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			error();
+		}
+
+		// backwards, finishing a child moves the last one into its slot
+		for (u32 i = num_fds - 1; i-- > 0;) {
+			if (fds[i].revents != 0 && !read_child(&children[i])) {
+				finish_child(i);
+			}
+		}
+
+		if (fds[num_fds - 1].revents & POLLIN) {
+			int connection = accept(listener, NULL, NULL);
+			if (connection >= 0) {
+				start_child(listener, connection);
+			}
+		}
+	}
+}
+
+// returns the exit status of the compile, or -1 if no server is listening
+int run_client(const char* socket_path, int argc, char* argv[]) {
+	struct sockaddr_un address;
+	init_address(&address, socket_path);
+
+	int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connection < 0)
+		return -1;
+
+	if (connect(connection, (struct sockaddr*) &address, sizeof(address)) != 0) {
+		close(connection);
+		return -1;
+	}
+
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		error();
+	}
+
+	bool sent = write_all(connection, cwd, strlen(cwd) + 1);
+	for (int i = 0; i < argc && sent; i++) {
+		sent = write_all(connection, argv[i], strlen(argv[i]) + 1);
+	}
+	shutdown(connection, SHUT_WR);
+
+	u32 length;
+	char* response = read_all(connection, &length);
+	close(connection);
+
+	if (!sent || length < 2 || response[length - 2] != 0) {
+		printf("lost the connection to the compile server\n");
+		error();
+	}
+
+	fwrite(response, 1, length - 2, stdout);
+	int status = (u8) response[length - 1];
+	free(response);
+	return status;
+}
@@ -0,0 +1,235 @@
+#include "all.h"
+
+// Code statistics per function, for --stats.
+//
+// The emitter counts the optimizations it applies as it goes, and once a function is done its code is read back
+// to count the instructions by class. An instruction with a memory operand is a load or a store depending on
+// whether it writes the memory, lea only computes the address. Other covers moves between registers, push and pop
+// and the instructions that don't compute a value. With --stats=json the report is a JSON object per source
+// file, with every key present even when it's 0, to be diffed between compiler versions.
+
+static Stats_State stats = {0};
+
+static const char* stat_names[NUM_STATS] = {
+	[STAT_VECTORIZED] = "vectorized_loops",
+	[STAT_UNROLLED] = "unrolled_loops",
+	[STAT_UNROLLED_FULLY] = "fully_unrolled_loops",
+	[STAT_ROTATED] = "rotated_loops",
+	[STAT_IF_CONVERTED] = "if_conversions",
+	[STAT_COLD_BLOCK] = "cold_blocks",
+	[STAT_CSE_REUSE] = "cse_reuses",
+	[STAT_INLINED] = "inlined_calls",
+	[STAT_PRINTF] = "specialized_printfs",
+	[STAT_JUMP_TABLE] = "jump_tables",
+	[STAT_BIT_TEST] = "switch_bit_tests",
+};
+
+static const char* instr_class_names[NUM_INSTR_CLASSES] = {
+	[INSTR_LOAD] = "loads",
+	[INSTR_STORE] = "stores",
+	[INSTR_ARITHMETIC] = "arithmetic",
+	[INSTR_BRANCH] = "branches",
+	[INSTR_CALL] = "calls",
+	[INSTR_OTHER] = "other",
+};
+
+void stats_count(Stat_Kind kind) {
+	if (options.stats != STATS_NONE) {
+		stats.counts[kind]++;
+	}
+}
+
+static bool is_word(const char* word, u32 length, const char* expected) {
+	return length == strlen(expected) && memcmp(word, expected, length) == 0;
+}
+
+static bool has_prefix(const char* word, u32 length, const char* prefix) {
+	u32 prefix_length = strlen(prefix);
+	return length >= prefix_length && memcmp(word, prefix, prefix_length) == 0;
+}
+
+// instructions that read their first operand without writing it
+static bool only_reads(const char* mnemonic, u32 length) {
+	return is_word(mnemonic, length, "cmp") || is_word(mnemonic, length, "test") || is_word(mnemonic, length, "bt")
+		|| is_word(mnemonic, length, "push") || is_word(mnemonic, length, "mul") || is_word(mnemonic, length, "imul")
+		|| is_word(mnemonic, length, "div") || is_word(mnemonic, length, "idiv") || has_prefix(mnemonic, length, "prefetch");
+}
+
+static bool computes_nothing(const char* mnemonic, u32 length) {
+	static const char* words[] = {"push", "pop", "xchg", "cqo", "nop", "pause", "rdtsc", "mfence", "syscall"};
+	for (u32 i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+		if (is_word(mnemonic, length, words[i]))
+			return true;
+	}
+	return has_prefix(mnemonic, length, "mov") || has_prefix(mnemonic, length, "vmov");
+}
+
+// the class of the instruction on a line of nasm, or NUM_INSTR_CLASSES for labels, comments and directives
+static Instr_Class classify_line(const char* line, u32 length) {
+	// instructions are indented, labels and global directives aren't
+	if (length == 0 || line[0] != '\t')
+		return NUM_INSTR_CLASSES;
+
+	const char* end = memchr(line, ';', length);
+	if (end == NULL)
+		end = line + length;
+
+	const char* mnemonic = line + 1;
+	u32 mnemonic_length = 0;
+	while (mnemonic + mnemonic_length < end && mnemonic[mnemonic_length] != ' ') {
+		mnemonic_length++;
+	}
+	if (mnemonic_length == 0 || is_word(mnemonic, mnemonic_length, "align") || is_word(mnemonic, mnemonic_length, "dq"))
+		return NUM_INSTR_CLASSES;
+
+	// the prefix doesn't change the class, rep movsq copies memory but has no operand saying so
+	if (is_word(mnemonic, mnemonic_length, "lock") || is_word(mnemonic, mnemonic_length, "rep")) {
+		mnemonic += mnemonic_length + 1;
+		mnemonic_length = 0;
+		while (mnemonic + mnemonic_length < end && mnemonic[mnemonic_length] != ' ') {
+			mnemonic_length++;
+		}
+	}
+
+	if (is_word(mnemonic, mnemonic_length, "call"))
+		return INSTR_CALL;
+	if (mnemonic[0] == 'j' || is_word(mnemonic, mnemonic_length, "ret"))
+		return INSTR_BRANCH;
+	if (is_word(mnemonic, mnemonic_length, "lea"))
+		return INSTR_ARITHMETIC;
+
+	const char* operands = mnemonic + mnemonic_length;
+	const char* memory = memchr(operands, '[', end - operands);
+	if (memory != NULL) {
+		const char* comma = memchr(operands, ',', end - operands);
+		bool is_destination = comma == NULL || memory < comma;
+		return is_destination && !only_reads(mnemonic, mnemonic_length) ? INSTR_STORE : INSTR_LOAD;
+	}
+
+	return computes_nothing(mnemonic, mnemonic_length) ? INSTR_OTHER : INSTR_ARITHMETIC;
+}
+
+// records the function the emitter just finished, text is its code
+void stats_add_func(AST_Func_Decl* func, const char* text, u32 length) {
+	if (stats.num_funcs == stats.capacity) {
+		stats.capacity = stats.capacity == 0 ? 64 : stats.capacity * 2;
+		stats.funcs = realloc(stats.funcs, stats.capacity * sizeof(Func_Stats));
+	}
+
+	Func_Stats* func_stats = &stats.funcs[stats.num_funcs++];
+	memset(func_stats, 0, sizeof(Func_Stats));
+	func_stats->name = func->name.str;
+	func_stats->name_length = func->name.len;
+	func_stats->frame_size = emitter.context.frame_size;
+	func_stats->var_bytes = emitter.context.alloc;
+	func_stats->temps = emitter.context.temp_alloc / 8;
+	func_stats->labels = emitter.label;
+	memcpy(func_stats->counts, stats.counts, sizeof(stats.counts));
+	memset(stats.counts, 0, sizeof(stats.counts));
+
+	const char* line = text;
+	const char* text_end = text + length;
+	while (line < text_end) {
+		const char* newline = memchr(line, '\n', text_end - line);
+		if (newline == NULL)
+			newline = text_end;
+
+		Instr_Class class = classify_line(line, newline - line);
+		if (class != NUM_INSTR_CLASSES) {
+			func_stats->instructions[class]++;
+		}
+		line = newline + 1;
+	}
+}
+
+static void print_json_string(FILE* file, const char* str) {
+	fputc('"', file);
+	for (const char* c = str; *c != 0; c++) {
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', file);
+		}
+		if ((u8) *c < ' ') {
+			fprintf(file, "\\u%04x", *c);
+		} else {
+			fputc(*c, file);
+		}
+	}
+	fputc('"', file);
+}
+
+static void print_stats_json(FILE* file, const char* source_path) {
+	fprintf(file, "{\"file\": ");
+	print_json_string(file, source_path);
+	fprintf(file, ", \"functions\": [");
+	for (u32 i = 0; i < stats.num_funcs; i++) {
+		Func_Stats* func_stats = &stats.funcs[i];
+		fprintf(file, "%s\n  {\"name\": \"%.*s\", \"frame_size\": %u, \"var_bytes\": %u, \"temps\": %u, \"labels\": %u,\n",
+			i > 0 ? "," : "", func_stats->name_length, func_stats->name, func_stats->frame_size, func_stats->var_bytes, func_stats->temps,
+			func_stats->labels);
+
+		fprintf(file, "   \"instructions\": {");
+		for (u32 j = 0; j < NUM_INSTR_CLASSES; j++) {
+			fprintf(file, "%s\"%s\": %u", j > 0 ? ", " : "", instr_class_names[j], func_stats->instructions[j]);
+		}
+		fprintf(file, "},\n   \"optimizations\": {");
+		for (u32 j = 0; j < NUM_STATS; j++) {
+			fprintf(file, "%s\"%s\": %u", j > 0 ? ", " : "", stat_names[j], func_stats->counts[j]);
+		}
+		fprintf(file, "}}");
+	}
+	fprintf(file, "\n]}\n");
+}
+
+static void print_stats_text(FILE* file, const char* source_path) {
+	fprintf(file, "code statistics for %s\n", source_path);
+	fprintf(file, "%-24s %8s %8s %8s %8s", "function", "frame", "vars", "temps", "labels");
+	for (u32 i = 0; i < NUM_INSTR_CLASSES; i++) {
+		fprintf(file, " %10s", instr_class_names[i]);
+	}
+	fprintf(file, "\n");
+
+	for (u32 i = 0; i < stats.num_funcs; i++) {
+		Func_Stats* func_stats = &stats.funcs[i];
+		fprintf(file, "%-24.*s %8u %8u %8u %8u", func_stats->name_length, func_stats->name, func_stats->frame_size,
+			func_stats->var_bytes, func_stats->temps, func_stats->labels);
+		for (u32 j = 0; j < NUM_INSTR_CLASSES; j++) {
+			fprintf(file, " %10u", func_stats->instructions[j]);
+		}
+		fprintf(file, "\n");
+
+		// only the optimizations that were applied
+		bool any = false;
+		for (u32 j = 0; j < NUM_STATS; j++) {
+			if (func_stats->counts[j] == 0)
+				continue;
+			fprintf(file, "%s %s %u", any ? "," : "    optimizations:", stat_names[j], func_stats->counts[j]);
+			any = true;
+		}
+		if (any) {
+			fprintf(file, "\n");
+		}
+	}
+}
+
+// writes the report for the file to stderr in one piece, so files compiled in parallel don't mix their reports
+void print_stats(const char* source_path) {
+	if (options.stats == STATS_NONE)
+		return;
+
+	char* text;
+	size_t length;
+	FILE* file = open_memstream(&text, &length);
+	if (options.stats == STATS_JSON) {
+		print_stats_json(file, source_path);
+	} else {
+		print_stats_text(file, source_path);
+	}
+	fclose(file);
+
+	// after the AST dump when both go to the same place
+	fflush(stdout);
+	fwrite(text, 1, length, stderr);
+	free(text);
+	free(stats.funcs);
+	memset(&stats, 0, sizeof(Stats_State));
+}
@@ -0,0 +1,232 @@
+#include "all.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// --stream: compiles a file one function at a time, for inputs too big to hold as a whole.
+//
+// Three threads form a pipeline connected by bounded queues:
+//   the lexer thread turns the source into batches of tokens,
+//   the parser thread builds the AST of one top level function at a time, each in its own arena,
+//   this thread checks, folds and emits a function, then frees its arena.
+// The source is mapped instead of read, pages the lexer is done with are dropped again. Only the signatures of
+// the functions seen so far are kept, so memory stays proportional to the biggest function.
+//
+// Like in C, calls can only be checked against functions defined (or declared extern) before them, a call to a
+// function defined later in the file is treated like a call to an external one. Compile-time evaluation only
+// sees the function being compiled.
+
+#define TOKEN_QUEUE_BATCHES 16
+#define FUNC_QUEUE_SIZE 4
+#define DROP_PAGES_EVERY (1 << 20)
+
+typedef struct {
+	AST_Func_Decl* func; // NULL at the end of the file
+	Arena* arena;
+} Parsed_Func;
+
+typedef struct {
+	const char* source;
+	u32 source_length;
+
+	Queue tokens;
+	Queue funcs;
+
+	Token_Batch batch; // filled by the lexer thread
+	u32 dropped; // bytes of the source given back to the system
+} Stream;
+
+void queue_init(Queue* queue, u32 item_size, u32 capacity) {
+	queue->items = malloc(item_size * capacity);
+	queue->item_size = item_size;
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+
+void queue_free(Queue* queue) {
+	free(queue->items);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+void queue_push(Queue* queue, const void* item) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+
+	u32 tail = (queue->head + queue->count) % queue->capacity;
+	memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+	queue->count++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_pop(Queue* queue, void* item) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+
+	pthread_cond_signal(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void push_token(Token* token, void* data) {
+	Stream* stream = data;
+	stream->batch.tokens[stream->batch.count++] = *token;
+
+	if (stream->batch.count == TOKEN_BATCH_SIZE || token->type == TOKEN_EOF) {
+		queue_push(&stream->tokens, &stream->batch);
+		stream->batch.count = 0;
+	}
+
+	// tokens still in flight point below this, but the mapping is private and read only,
+	// so dropped pages are just read from the file again if they're touched
+	if (token->str != NULL && token->str - stream->source >= stream->dropped + DROP_PAGES_EVERY) {
+		u32 page_size = sysconf(_SC_PAGESIZE);
+		u32 end = (token->str - stream->source) / page_size * page_size;
+		madvise((void*) stream->source, end, MADV_DONTNEED);
+		stream->dropped = end;
+	}
+}
+
+static void* lexer_thread(void* data) {
+	Stream* stream = data;
+	lex_into(stream->source, stream->source_length, push_token, stream);
+	return NULL;
+}
+
+static void* parser_thread(void* data) {
+	Stream* stream = data;
+	begin_stream_parse(&stream->tokens);
+
+	for (;;) {
+		Parsed_Func parsed = {
+			.arena = calloc(1, sizeof(Arena)),
+		};
+
+		set_ast_arena(parsed.arena);
+		parsed.func = parse_next_func();
+		set_ast_arena(NULL);
+
+		queue_push(&stream->funcs, &parsed);
+		if (parsed.func == NULL)
+			break;
+	}
+
+	return NULL;
+}
+
+// maps the file followed by at least one zero byte, the lexer looks one character ahead
+static const char* map_source(const char* path, u32* length, u32* mapped_length) {
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		perror(path);
+		error();
+	}
+
+	u32 page_size = sysconf(_SC_PAGESIZE);
+	*length = info.st_size;
+	*mapped_length = (*length / page_size + 1) * page_size;
+
+	// zeroed memory, with the file mapped over its start
+	char* source = mmap(NULL, *mapped_length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (source == MAP_FAILED || (*length > 0 && mmap(source, *length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+		perror(path);
+		error();
+	}
+
+	close(fd);
+	return source;
+}
+
+// what calls to a function need after its body is gone
+static AST_Func_Decl* copy_signature(AST_Func_Decl* func) {
+	AST_Func_Decl* signature = malloc(sizeof(AST_Func_Decl));
+	*signature = *func;
+	signature->body = NULL;
+	signature->is_pure = false;
+
+	signature->args = malloc(func->num_args * sizeof(AST_Var_Decl*));
+	for (u32 i = 0; i < func->num_args; i++) {
+		signature->args[i] = malloc(sizeof(AST_Var_Decl));
+		*signature->args[i] = *func->args[i];
+		signature->args[i]->assign = NULL;
+	}
+
+	return signature;
+}
+
+void compile_stream(const char* source_path, const char* output_path) {
+	Stream stream = {0};
+	u32 mapped_length;
+	stream.source = map_source(source_path, &stream.source_length, &mapped_length);
+	queue_init(&stream.tokens, sizeof(Token_Batch), TOKEN_QUEUE_BATCHES);
+	queue_init(&stream.funcs, sizeof(Parsed_Func), FUNC_QUEUE_SIZE);
+
+	pthread_t lexer;
+	pthread_t parser;
+	if (pthread_create(&lexer, NULL, lexer_thread, &stream) != 0 || pthread_create(&parser, NULL, parser_thread, &stream) != 0) {
+		printf("failed to start the --stream threads\n");
+		error();
+	}
+
+	// the profile passes are rejected with --stream, with --static the file is assumed to define main
+	reset_analysis();
+	emit_begin(source_path, output_path, options.static_runtime);
+
+	for (;;) {
+		Parsed_Func parsed;
+		queue_pop(&stream.funcs, &parsed);
+		if (parsed.func == NULL) {
+			free_arena(parsed.arena);
+			free(parsed.arena);
+			break;
+		}
+
+		declare_func(copy_signature(parsed.func));
+		analyze_func(parsed.func);
+
+		// folding allocates its literals in the function's arena too
+		AST_Program program = {
+			.type = AST_PROGRAM,
+			.defs = (AST_Node**) &parsed.func,
+			.num_defs = 1,
+		};
+		set_ast_arena(parsed.arena);
+		fold_constants((AST_Node*) &program);
+		set_ast_arena(NULL);
+		plan_unrolling((AST_Node*) parsed.func);
+
+		Flat_AST flat;
+		flatten((AST_Node*) parsed.func, &flat);
+		print_flat(&flat);
+		emit_flat(&flat);
+
+		free_flat(&flat);
+		free_arena(parsed.arena);
+		free(parsed.arena);
+	}
+
+	pthread_join(lexer, NULL);
+	pthread_join(parser, NULL);
+	emit_end();
+
+	queue_free(&stream.tokens);
+	queue_free(&stream.funcs);
+	munmap((void*) stream.source, mapped_length);
+}
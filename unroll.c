@@ -0,0 +1,429 @@
+#include "all.h"
+
+// Unrolls counted loops of the form
+//
+//     while (i < n) {
+//         ...
+//         i = i + k;
+//     }
+//
+// where only the last statement changes the index i, and the bound n is a literal or a variable the loop doesn't
+// change. Any of <, <=, >, >= and != can be used, as long as the step goes towards the bound.
+//
+// When the last statement before the loop (in the same block) that sets i sets it to a literal and n is a literal too,
+// the number of iterations is known. If it's small, the loop is unrolled fully: the body is emitted once per
+// iteration, without any compares or jumps. Other loops with a short body are unrolled partially, a loop running
+// options.unroll_factor copies of the body per iteration (for as long as that many iterations are left) is emitted in
+// front of the regular loop, which then runs the remaining ones.
+//
+// Every copy of the body needs its own variables and temporaries, so the plan is made before flattening and
+// get_required_stack_size makes room for the copies.
+
+#define UNROLL_MAX_TRIPS 16 // most iterations of a fully unrolled loop
+#define UNROLL_MAX_FULL_NODES 256 // most nodes of all copies of a fully unrolled body
+#define UNROLL_MAX_BODY_NODES 32 // only short bodies are unrolled partially
+#define UNROLL_MAX_STEP 65536
+
+typedef struct {
+	AST_Var_Decl* index;
+	AST_Node* bound; // literal or variable
+	Binary_Operation op;
+	s64 step;
+} Counted_Loop;
+
+static u32 count_nodes(AST_Node* node) {
+	if (node == NULL)
+		return 0;
+
+	switch (node->type) {
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return 1 + count_nodes(op->left) + count_nodes(op->right);
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			u32 count = 1;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				count += count_nodes(block->statements[i]);
+			}
+			return count;
+		}
+		case AST_VAR_DECL:
+			return 1 + count_nodes(((AST_Var_Decl*) node)->assign);
+		case AST_ASSIGN:
+			return 1 + count_nodes(((AST_Assign*) node)->rhs);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			u32 count = 1;
+			for (u32 i = 0; i < call->num_args; i++) {
+				count += count_nodes(call->args[i]);
+			}
+			return count;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			return 1 + count_nodes(cond->condition) + count_nodes(cond->body);
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			u32 count = 1 + count_nodes(switch_stmt->value) + count_nodes(switch_stmt->default_body);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				count += count_nodes(switch_stmt->bodies[i]);
+			}
+			return count;
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			return 1 + count_nodes((AST_Node*) parallel->index) + count_nodes(parallel->end) + count_nodes(parallel->chunk) +
+				count_nodes(parallel->body);
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			return 1 + count_nodes(((AST_Return*) node)->expr);
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			return 1 + count_nodes(index->base) + count_nodes(index->index);
+		}
+		case AST_DEREF:
+		case AST_ADDR_OF:
+			return 1 + count_nodes(((AST_Unary*) node)->expr);
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			return 1 + count_nodes(store->target) + count_nodes(store->rhs);
+		}
+		default:
+			return 1;
+	}
+}
+
+// whether a statement assigns the variable, it can't be changed through a pointer if its address isn't taken
+static bool writes_var(AST_Node* node, AST_Var_Decl* decl) {
+	if (node == NULL)
+		return false;
+
+	switch (node->type) {
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				if (writes_var(block->statements[i], decl))
+					return true;
+			}
+			return false;
+		}
+		case AST_ASSIGN:
+			return ((AST_Assign*) node)->decl == decl;
+		case AST_IF:
+		case AST_WHILE:
+			return writes_var(((AST_Conditional*) node)->body, decl);
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				if (writes_var(switch_stmt->bodies[i], decl))
+					return true;
+			}
+			return writes_var(switch_stmt->default_body, decl);
+		}
+		default:
+			return false;
+	}
+}
+
+// a 32 or 64 bit integer variable that only changes where it's assigned
+static AST_Var_Decl* get_counter_var(AST_Node* node) {
+	if (node->type != AST_VAR)
+		return NULL;
+
+	AST_Var_Decl* decl = ((AST_Var*) node)->decl;
+	u32 size = type_size(decl->data_type);
+	if (decl->array_length > 0 || decl->address_taken || type_is_pointer(decl->data_type) || (size != 4 && size != 8))
+		return NULL;
+	return decl;
+}
+
+static bool is_literal_of(AST_Node* node, Data_Type type) {
+	if (node->type != AST_INT_LITERAL)
+		return false;
+
+	u64 value = ((AST_Number*) node)->value;
+	return normalize_value(value, type) == value;
+}
+
+static bool find_counted_loop(AST_Conditional* while_stmt, Counted_Loop* loop) {
+	if (while_stmt->condition->type != AST_BIN_OP || while_stmt->body->type != AST_BLOCK)
+		return false;
+
+	AST_Binary_Op* condition = (AST_Binary_Op*) while_stmt->condition;
+	loop->op = condition->op;
+	loop->index = get_counter_var(condition->left);
+	loop->bound = condition->right;
+	if (loop->op == OP_EQUALS || loop->index == NULL)
+		return false;
+
+	Data_Type type = loop->index->data_type;
+	if (!is_literal_of(loop->bound, type)) {
+		AST_Var_Decl* bound = get_counter_var(loop->bound);
+		if (bound == NULL || bound == loop->index || bound->data_type.base != type.base || writes_var(while_stmt->body, bound))
+			return false;
+	}
+
+	// the last statement steps the index, nothing else touches it
+	AST_Block* body = (AST_Block*) while_stmt->body;
+	if (body->num_statements == 0)
+		return false;
+
+	AST_Node* last = body->statements[body->num_statements - 1];
+	if (last->type != AST_ASSIGN || ((AST_Assign*) last)->decl != loop->index)
+		return false;
+
+	AST_Node* rhs = ((AST_Assign*) last)->rhs;
+	if (rhs->type != AST_BIN_OP)
+		return false;
+
+	AST_Binary_Op* step = (AST_Binary_Op*) rhs;
+	if (step->op != OP_ADD && step->op != OP_SUB)
+		return false;
+	if (step->left->type != AST_VAR || ((AST_Var*) step->left)->decl != loop->index || step->right->type != AST_INT_LITERAL)
+		return false;
+
+	loop->step = ((AST_Number*) step->right)->value;
+	if (step->op == OP_SUB) {
+		loop->step = -loop->step;
+	}
+	if (loop->step == 0 || loop->step > UNROLL_MAX_STEP || loop->step < -UNROLL_MAX_STEP)
+		return false;
+
+	for (u32 i = 0; i < body->num_statements - 1; i++) {
+		if (writes_var(body->statements[i], loop->index))
+			return false;
+	}
+
+	switch (loop->op) {
+		case OP_LESS_THAN:
+		case OP_LESS_THAN_EQUAL:
+			return loop->step > 0;
+		case OP_GREATER_THAN:
+		case OP_GREATER_THAN_EQUAL:
+			return loop->step < 0;
+		default:
+			return true;
+	}
+}
+
+static bool compare(Binary_Operation op, u64 left, u64 right, bool is_signed) {
+	switch (op) {
+		case OP_NOT_EQUALS:
+			return left != right;
+		case OP_LESS_THAN:
+			return is_signed ? (s64) left < (s64) right : left < right;
+		case OP_LESS_THAN_EQUAL:
+			return is_signed ? (s64) left <= (s64) right : left <= right;
+		case OP_GREATER_THAN:
+			return is_signed ? (s64) left > (s64) right : left > right;
+		default:
+			return is_signed ? (s64) left >= (s64) right : left >= right;
+	}
+}
+
+// the value the statements of a block before position leave in a variable, if it's a literal
+static AST_Number* find_start_value(AST_Block* block, u32 position, AST_Var_Decl* decl) {
+	for (u32 i = position; i > 0; i--) {
+		AST_Node* statement = block->statements[i - 1];
+		AST_Node* value = NULL;
+		if (statement == (AST_Node*) decl) {
+			value = decl->assign;
+		} else if (statement->type == AST_ASSIGN && ((AST_Assign*) statement)->decl == decl) {
+			value = ((AST_Assign*) statement)->rhs;
+		} else if (!writes_var(statement, decl)) {
+			continue;
+		}
+
+		return value != NULL && value->type == AST_INT_LITERAL ? (AST_Number*) value : NULL;
+	}
+	return NULL;
+}
+
+// the iterations of a loop whose index starts at a literal, if there aren't too many
+static bool find_trip_count(Counted_Loop* loop, AST_Block* block, u32 position, u32* trips) {
+	if (block == NULL || loop->bound->type != AST_INT_LITERAL)
+		return false;
+
+	AST_Number* start = find_start_value(block, position, loop->index);
+	if (start == NULL)
+		return false;
+
+	Data_Type type = loop->index->data_type;
+	bool is_signed = type_is_signed(type);
+	u64 value = normalize_value(start->value, type);
+	u64 bound = ((AST_Number*) loop->bound)->value;
+
+	for (*trips = 0; compare(loop->op, value, bound, is_signed); (*trips)++) {
+		if (*trips == UNROLL_MAX_TRIPS)
+			return false;
+		value = normalize_value(value + loop->step, type);
+	}
+	return true;
+}
+
+// block and position locate the loop, block is NULL if it isn't in one
+static void plan_loop(AST_Conditional* while_stmt, AST_Block* block, u32 position) {
+	while_stmt->unroll = 0;
+	while_stmt->unroll_full = false;
+
+	Counted_Loop loop;
+	if (options.unroll_factor == 0 || !find_counted_loop(while_stmt, &loop))
+		return;
+
+	u32 body_nodes = count_nodes(while_stmt->body);
+	u32 trips;
+	if (find_trip_count(&loop, block, position, &trips) && trips * body_nodes <= UNROLL_MAX_FULL_NODES) {
+		while_stmt->unroll = trips;
+		while_stmt->unroll_full = true;
+		return;
+	}
+
+	if (options.unroll_factor < 2 || body_nodes > UNROLL_MAX_BODY_NODES || profile_loop_is_short(while_stmt))
+		return;
+
+	// the distance to the bound is only known exactly when the index can't step over it
+	if (loop.op == OP_NOT_EQUALS && loop.step != 1 && loop.step != -1)
+		return;
+
+	while_stmt->unroll = options.unroll_factor;
+}
+
+static void plan_node(AST_Node* node) {
+	if (node == NULL)
+		return;
+
+	switch (node->type) {
+		case AST_PROGRAM: {
+			AST_Program* program = (AST_Program*) node;
+			for (u32 i = 0; i < program->num_defs; i++) {
+				plan_node(program->defs[i]);
+			}
+			break;
+		}
+		case AST_FUNC_DECL:
+			plan_node(((AST_Func_Decl*) node)->body);
+			break;
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				AST_Node* statement = block->statements[i];
+				plan_node(statement);
+				if (statement->type == AST_WHILE) {
+					plan_loop((AST_Conditional*) statement, block, i);
+				}
+			}
+			break;
+		}
+		case AST_IF:
+			plan_node(((AST_Conditional*) node)->body);
+			break;
+		case AST_WHILE: {
+			AST_Conditional* while_stmt = (AST_Conditional*) node;
+			plan_node(while_stmt->body);
+			plan_loop(while_stmt, NULL, 0); // planned again with the statements before it, if it's in a block
+			break;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				plan_node(switch_stmt->bodies[i]);
+			}
+			plan_node(switch_stmt->default_body);
+			break;
+		}
+		case AST_PARALLEL:
+			plan_node(((AST_Parallel*) node)->body);
+			break;
+		default:
+			break;
+	}
+}
+
+// sets unroll and unroll_full on every while loop
+void plan_unrolling(AST_Node* root) {
+	plan_node(root);
+}
+
+static const char* exit_jump(Binary_Operation op, bool is_signed) {
+	switch (op) {
+		case OP_LESS_THAN:
+			return is_signed ? "jge" : "jae";
+		case OP_LESS_THAN_EQUAL:
+			return is_signed ? "jg" : "ja";
+		case OP_GREATER_THAN:
+			return is_signed ? "jle" : "jbe";
+		default:
+			return is_signed ? "jl" : "jb";
+	}
+}
+
+// emits the unrolled version of a loop, returns whether it did. needs_loop is set to whether the regular loop still
+// has to follow for the iterations that are left
+bool emit_unrolled_while(AST_Conditional* while_stmt, bool* needs_loop) {
+	*needs_loop = true;
+	if (while_stmt->unroll_full) {
+		fprintf(emitter.file, "	; while statement, unrolled %u times\n", while_stmt->unroll);
+		for (u32 i = 0; i < while_stmt->unroll; i++) {
+			emit_profile_counter(while_stmt->profile_id + 1);
+			emit_node(while_stmt->body);
+		}
+		*needs_loop = false;
+		return true;
+	}
+
+	Counted_Loop loop;
+	if (while_stmt->unroll < 2 || !find_counted_loop(while_stmt, &loop))
+		return false;
+
+	Data_Type type = loop.index->data_type;
+	bool is_signed = type_is_signed(type);
+	u64 ahead = (u64) (loop.step < 0 ? -loop.step : loop.step) * (while_stmt->unroll - 1);
+	u32 loop_label = emitter.label++;
+	u32 exit_label = emitter.label++;
+
+	fprintf(emitter.file, "	; while statement, %u iterations at a time\n", while_stmt->unroll);
+	fprintf(emitter.file, ".label%u:\n", loop_label);
+	emit_load("rax", type, "[rbp - %u]", loop.index->location);
+	if (loop.bound->type == AST_INT_LITERAL) {
+		fprintf(emitter.file, "	mov rcx, %" PRIu64 "\n", ((AST_Number*) loop.bound)->value);
+	} else {
+		emit_load("rcx", type, "[rbp - %u]", ((AST_Var*) loop.bound)->decl->location);
+	}
+
+	// the distance to the bound is exact once the index is known to be on the right side of it
+	if (loop.op != OP_NOT_EQUALS) {
+		fprintf(emitter.file, "	cmp rax, rcx\n");
+		fprintf(emitter.file, "	%s .label%u\n", exit_jump(loop.op, is_signed), exit_label);
+	}
+	if (loop.step > 0) {
+		fprintf(emitter.file, "	mov rdx, rcx\n");
+		fprintf(emitter.file, "	sub rdx, rax\n");
+	} else {
+		fprintf(emitter.file, "	mov rdx, rax\n");
+		fprintf(emitter.file, "	sub rdx, rcx\n");
+	}
+	if (loop.op == OP_NOT_EQUALS && type_size(type) == 4) {
+		// the index wraps around at 32 bits
+		fprintf(emitter.file, "	mov edx, edx\n");
+	}
+
+	// all copies run if the last one would
+	bool inclusive = loop.op == OP_LESS_THAN_EQUAL || loop.op == OP_GREATER_THAN_EQUAL;
+	fprintf(emitter.file, "	cmp rdx, %" PRIu64 "\n", ahead);
+	fprintf(emitter.file, "	%s .label%u\n", inclusive ? "jb" : "jbe", exit_label);
+
+	u32 values = cse_enter();
+	for (u32 i = 0; i < while_stmt->unroll; i++) {
+		emit_profile_counter(while_stmt->profile_id + 1);
+		emit_node(while_stmt->body);
+	}
+	cse_leave(values);
+
+	fprintf(emitter.file, "	jmp .label%u\n", loop_label);
+	fprintf(emitter.file, ".label%u:\n", exit_label);
+	return true;
+}
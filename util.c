@@ -1,113 +1,104 @@
 #include "all.h"
 
-void print_node(AST_Node* node, int depth) {
-	for (int i = 0; i < depth * 2; i++) {
-		putchar(' ');
-	}
-
-	switch (node->type) {
-		case AST_PROGRAM: {
-			AST_Program* program = (AST_Program*) node;
-			printf("AST_PROGRAM\n");
-			for (u32 i = 0; i < program->num_defs; i++) {
-				print_node(program->defs[i], depth + 1);
-			}
-			break;
-		}
-		case AST_INT_LITERAL:
-			printf("AST_INT_LITERAL: %d\n", ((AST_Number*)node)->value);
-			break;
-		case AST_STR_LITERAL: {
-			AST_String* str = (AST_String*) node;
-			printf("AST_STR_LITERAL: %.*s\n", str->token.len, str->token.str);
-			break;
-		}
-		case AST_BIN_OP: {
-			AST_Binary_Op* op = (AST_Binary_Op*) node;
-			printf("AST_BIN_OP: %u\n", op->op);
-			print_node(op->left, depth + 1);
-			print_node(op->right, depth + 1);
-			break;
-		}
-		case AST_BLOCK: {
-			AST_Block* block = (AST_Block*) node;
-			printf("AST_BLOCK\n");
-			for (u32 i = 0; i < block->num_statements; i++) {
-				print_node(block->statements[i], depth + 1);
-			}
-			break;
-		}
-		case AST_VAR_DECL: {
-			AST_Var_Decl* decl = (AST_Var_Decl*) node;
-			printf("AST_VAR_DECL: '%.*s'\n", decl->name.len, decl->name.str);
-			if (decl->assign != NULL) {
-				print_node(decl->assign, depth + 1);
-			}
-			break;
-		}
-		case AST_VAR: {
-			AST_Var* var = (AST_Var*) node;
-			printf("AST_VAR: '%.*s'\n", var->name.len, var->name.str);
-			break;
-		}
-		case AST_ASSIGN: {
-			AST_Assign* assign = (AST_Assign*) node;
-			printf("AST_ASSIGN: '%.*s'\n", assign->lhs.len, assign->lhs.str);
-			print_node(assign->rhs, depth + 1);
-			break;
-		}
-		case AST_FUNC_DECL: {
-			AST_Func_Decl* decl = (AST_Func_Decl*) node;
-			printf("AST_FUNC_DECL: '%.*s'\n", decl->name.len, decl->name.str);
-			print_node(decl->body, depth + 1);
-			break;
-		}
-		case AST_IF: {
-			AST_Conditional* if_stmt = (AST_Conditional*) node;
-			printf("AST_IF\n");
-			print_node(if_stmt->condition, depth + 1);
-			print_node(if_stmt->body, depth + 1);
-			break;
-		}
-        case AST_WHILE: {
-			AST_Conditional* while_stmt = (AST_Conditional*) node;
-			printf("AST_WHILE\n");
-			print_node(while_stmt->condition, depth + 1);
-			print_node(while_stmt->body, depth + 1);
-			break;
-		}
-		case AST_FUNC_CALL: {
-			AST_Func_Call* call = (AST_Func_Call*) node;
-			printf("AST_FUNC_CALL\n");
-			for (u32 i = 0; i < call->num_args; i++) {
-				print_node(call->args[i], depth + 1);
-			}
-			break;
-		}
-		case AST_RETURN: {
-			AST_Return* ret = (AST_Return*) node;
-			printf("AST_RETURN\n");
-			print_node(ret->expr, depth + 1);
-			break;
-		}
+static bool flat_has_token(AST_Type kind) {
+	switch (kind) {
+		case AST_STR_LITERAL:
+		case AST_VAR_DECL:
+		case AST_VAR:
+		case AST_ASSIGN:
+		case AST_FUNC_DECL:
+		case AST_FUNC_CALL:
+			return true;
 		default:
-			printf("print_node error: unhandled type %u\n", node->type);
-			error();
+			return false;
 	}
 }
 
-// todo: free_node?
+void print_flat(const Flat_AST* flat) {
+	for (u32 i = 0; i < flat->num_nodes; i++) {
+		for (u32 j = 0; j < flat->depths[i] * 2; j++) {
+			putchar(' ');
+		}
 
-bool compare_token(Token* token, const char* str) {
-	for (u32 i = 0; i < token->len; i++) {
-		if (str[i] == '\0')
-			return false;
-		if (token->str[i] != str[i])
-			return false;
+		// for the nodes that have one
+		const Token* name = flat_has_token(flat->kinds[i]) ? &flat->tokens[flat->operands[i]] : NULL;
+		switch (flat->kinds[i]) {
+			case AST_PROGRAM:
+				printf("AST_PROGRAM\n");
+				break;
+			case AST_INT_LITERAL:
+				printf("AST_INT_LITERAL: %" PRIu64 "\n", flat->values[flat->operands[i]]);
+				break;
+			case AST_STR_LITERAL:
+				printf("AST_STR_LITERAL: %.*s\n", name->len, name->str);
+				break;
+			case AST_BIN_OP:
+				printf("AST_BIN_OP: %u\n", flat->operands[i]);
+				break;
+			case AST_BLOCK:
+				printf("AST_BLOCK\n");
+				break;
+			case AST_VAR_DECL:
+				printf("AST_VAR_DECL: '%.*s' ", name->len, name->str);
+				print_type(flat->data_types[i]);
+				if (flat->extras[i] > 0) {
+					printf(" [%u]", flat->extras[i]);
+				}
+				printf("\n");
+				break;
+			case AST_VAR:
+				printf("AST_VAR: '%.*s'\n", name->len, name->str);
+				break;
+			case AST_ASSIGN:
+				printf("AST_ASSIGN: '%.*s'\n", name->len, name->str);
+				break;
+			case AST_FUNC_DECL: {
+				// the arguments are followed by the body, unless it's extern
+				u32 num_children = 0;
+				for (u32 child = i + 1; child < flat->ends[i]; child = flat->ends[child]) {
+					num_children++;
+				}
+				printf("AST_FUNC_DECL: '%.*s' ", name->len, name->str);
+				print_type(flat->data_types[i]);
+				printf(num_children == flat->extras[i] ? " extern\n" : "\n");
+				break;
+			}
+			case AST_IF:
+				printf("AST_IF\n");
+				break;
+			case AST_WHILE:
+				printf("AST_WHILE\n");
+				break;
+			case AST_SWITCH:
+				printf("AST_SWITCH: %u cases%s\n", flat->operands[i], flat->extras[i] ? ", default" : "");
+				break;
+			case AST_PARALLEL:
+				printf("AST_PARALLEL%s\n", flat->extras[i] ? ": chunked" : "");
+				break;
+			case AST_FUNC_CALL:
+				printf("AST_FUNC_CALL\n");
+				break;
+			case AST_RETURN:
+				printf("AST_RETURN\n");
+				break;
+			case AST_YIELD:
+				printf("AST_YIELD\n");
+				break;
+			case AST_INDEX:
+				printf("AST_INDEX\n");
+				break;
+			case AST_DEREF:
+				printf("AST_DEREF\n");
+				break;
+			case AST_ADDR_OF:
+				printf("AST_ADDR_OF\n");
+				break;
+			case AST_STORE:
+				printf("AST_STORE\n");
+				break;
+			default:
+				printf("print_flat error: unhandled type %u\n", flat->kinds[i]);
+				error();
+		}
 	}
-
-	if (str[token->len] != '\0')
-		return false;
-
-	return true;
 }
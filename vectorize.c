@@ -0,0 +1,438 @@
+#include "all.h"
+
+// Vectorizes simple elementwise loops of the form
+//
+//     while (i < n) {
+//         a[i] = b[i] + c[i] - k;
+//         i = i + 1;
+//     }
+//
+// The vector loop is emitted in front of the regular scalar loop, which then
+// runs the remaining iterations (or all of them, if a runtime check fails).
+// Additions and subtractions wrap at the element size, so doing them on
+// packed elements gives the same result as the scalar loop storing a
+// truncated 64 bit value.
+
+#define NUM_VECTOR_REGS 16
+#define MAX_VECTOR_POINTERS 16
+
+typedef struct {
+	AST_Var_Decl* decl;
+	bool stored;
+} Vector_Pointer;
+
+typedef struct {
+	AST_Var_Decl* index;
+	AST_Node* bound;
+	u32 element_size; // all arrays in the loop have the same element size
+	u32 vector_size;
+	u32 lanes;
+
+	Vector_Pointer pointers[MAX_VECTOR_POINTERS];
+	u32 num_pointers;
+
+	// loop invariant operands, broadcast into registers before the loop.
+	// invariant n lives in register NUM_VECTOR_REGS - 1 - n
+	AST_Node* invariants[NUM_VECTOR_REGS];
+	u32 num_invariants;
+} Vector_Loop;
+
+static bool is_var(AST_Node* node, AST_Var_Decl* decl) {
+	return node->type == AST_VAR && ((AST_Var*) node)->decl == decl;
+}
+
+static bool address_taken(AST_Node* node, AST_Var_Decl* decl) {
+	if (node == NULL)
+		return false;
+
+	switch (node->type) {
+		case AST_ADDR_OF: {
+			AST_Unary* addr = (AST_Unary*) node;
+			return is_var(addr->expr, decl) || address_taken(addr->expr, decl);
+		}
+		case AST_DEREF:
+			return address_taken(((AST_Unary*) node)->expr, decl);
+		case AST_RETURN:
+		case AST_YIELD:
+			return address_taken(((AST_Return*) node)->expr, decl);
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			return address_taken(op->left, decl) || address_taken(op->right, decl);
+		}
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			return address_taken(index->base, decl) || address_taken(index->index, decl);
+		}
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			return address_taken(store->target, decl) || address_taken(store->rhs, decl);
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				if (address_taken(block->statements[i], decl))
+					return true;
+			}
+			return false;
+		}
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			for (u32 i = 0; i < call->num_args; i++) {
+				if (address_taken(call->args[i], decl))
+					return true;
+			}
+			return false;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			return address_taken(cond->condition, decl) || address_taken(cond->body, decl);
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				if (address_taken(switch_stmt->bodies[i], decl))
+					return true;
+			}
+			return address_taken(switch_stmt->value, decl) || address_taken(switch_stmt->default_body, decl);
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			return address_taken(parallel->index->assign, decl) || address_taken(parallel->end, decl) ||
+				address_taken(parallel->chunk, decl) || address_taken(parallel->body, decl);
+		}
+		case AST_VAR_DECL:
+			return address_taken(((AST_Var_Decl*) node)->assign, decl);
+		case AST_ASSIGN:
+			return address_taken(((AST_Assign*) node)->rhs, decl);
+		default:
+			return false;
+	}
+}
+
+// an integer local whose value can't change behind our back
+static bool is_plain_scalar(AST_Var_Decl* decl) {
+	if (type_is_pointer(decl->data_type))
+		return false;
+
+	return !address_taken(emitter.current_func->body, decl);
+}
+
+static bool add_pointer(Vector_Loop* loop, AST_Var_Decl* decl, bool stored) {
+	if (!type_is_pointer(decl->data_type) || address_taken(emitter.current_func->body, decl))
+		return false;
+
+	u32 size = element_size(decl->data_type);
+	if (loop->element_size == 0) {
+		loop->element_size = size;
+	} else if (loop->element_size != size) {
+		return false;
+	}
+
+	for (u32 i = 0; i < loop->num_pointers; i++) {
+		if (loop->pointers[i].decl == decl) {
+			loop->pointers[i].stored |= stored;
+			return true;
+		}
+	}
+
+	if (loop->num_pointers >= MAX_VECTOR_POINTERS)
+		return false;
+
+	loop->pointers[loop->num_pointers].decl = decl;
+	loop->pointers[loop->num_pointers].stored = stored;
+	loop->num_pointers++;
+	return true;
+}
+
+static bool is_invariant_operand(AST_Node* node) {
+	return node->type == AST_VAR || node->type == AST_INT_LITERAL;
+}
+
+static bool same_invariant(AST_Node* a, AST_Node* b) {
+	if (a->type != b->type)
+		return false;
+
+	if (a->type == AST_INT_LITERAL)
+		return ((AST_Number*) a)->value == ((AST_Number*) b)->value;
+
+	return ((AST_Var*) a)->decl == ((AST_Var*) b)->decl;
+}
+
+static s32 find_invariant(Vector_Loop* loop, AST_Node* node) {
+	for (u32 i = 0; i < loop->num_invariants; i++) {
+		if (same_invariant(loop->invariants[i], node))
+			return NUM_VECTOR_REGS - 1 - i;
+	}
+
+	return -1;
+}
+
+// is the element access base[i] with base being a variable?
+static bool is_element_access(Vector_Loop* loop, AST_Node* node) {
+	if (node->type != AST_INDEX)
+		return false;
+
+	AST_Index* index = (AST_Index*) node;
+	return index->base->type == AST_VAR && is_var(index->index, loop->index);
+}
+
+// checks an element expression and returns the number of registers it needs to evaluate, 0 if it can't be vectorized
+static u32 analyze_expr(Vector_Loop* loop, AST_Node* node) {
+	if (is_element_access(loop, node)) {
+		AST_Index* index = (AST_Index*) node;
+		if (!add_pointer(loop, ((AST_Var*) index->base)->decl, false))
+			return 0;
+		return 1;
+	}
+
+	if (is_invariant_operand(node)) {
+		if (node->type == AST_VAR) {
+			AST_Var_Decl* decl = ((AST_Var*) node)->decl;
+			if (decl == loop->index || !is_plain_scalar(decl))
+				return 0;
+		}
+
+		if (find_invariant(loop, node) < 0) {
+			if (loop->num_invariants >= NUM_VECTOR_REGS)
+				return 0;
+			loop->invariants[loop->num_invariants++] = node;
+		}
+		return 1;
+	}
+
+	if (node->type == AST_BIN_OP) {
+		AST_Binary_Op* op = (AST_Binary_Op*) node;
+		if (op->op != OP_ADD && op->op != OP_SUB)
+			return 0;
+
+		u32 left = analyze_expr(loop, op->left);
+		u32 right = analyze_expr(loop, op->right);
+		if (left == 0 || right == 0)
+			return 0;
+
+		// invariants on the right are used straight from their register
+		if (is_invariant_operand(op->right))
+			right = 0;
+
+		return left > right + 1 ? left : right + 1;
+	}
+
+	return 0;
+}
+
+static bool analyze_loop(Vector_Loop* loop, AST_Conditional* while_stmt) {
+	// condition has to be i < n or i != n
+	if (while_stmt->condition->type != AST_BIN_OP)
+		return false;
+
+	AST_Binary_Op* cond = (AST_Binary_Op*) while_stmt->condition;
+	if (cond->op != OP_LESS_THAN && cond->op != OP_NOT_EQUALS)
+		return false;
+
+	if (cond->left->type != AST_VAR || !is_invariant_operand(cond->right))
+		return false;
+
+	loop->index = ((AST_Var*) cond->left)->decl;
+	loop->bound = cond->right;
+
+	// the vector loop compares n - i signed
+	if (!is_plain_scalar(loop->index) || loop->index->data_type.base == TYPE_U64)
+		return false;
+
+	if (loop->bound->type == AST_VAR) {
+		AST_Var_Decl* decl = ((AST_Var*) loop->bound)->decl;
+		if (decl == loop->index || !is_plain_scalar(decl) || decl->data_type.base == TYPE_U64)
+			return false;
+	} else if (((AST_Number*) loop->bound)->value > INT32_MAX) {
+		return false;
+	}
+
+	// body has to be element stores followed by i = i + 1
+	if (while_stmt->body->type != AST_BLOCK)
+		return false;
+
+	AST_Block* body = (AST_Block*) while_stmt->body;
+	if (body->num_statements < 2)
+		return false;
+
+	AST_Node* last = body->statements[body->num_statements - 1];
+	if (last->type != AST_ASSIGN)
+		return false;
+
+	AST_Assign* increment = (AST_Assign*) last;
+	if (increment->decl != loop->index || increment->rhs->type != AST_BIN_OP)
+		return false;
+
+	AST_Binary_Op* step = (AST_Binary_Op*) increment->rhs;
+	if (step->op != OP_ADD || !is_var(step->left, loop->index) ||
+		step->right->type != AST_INT_LITERAL || ((AST_Number*) step->right)->value != 1)
+		return false;
+
+	u32 max_regs = 0;
+	for (u32 i = 0; i < body->num_statements - 1; i++) {
+		AST_Node* statement = body->statements[i];
+		if (statement->type != AST_STORE)
+			return false;
+
+		AST_Store* store = (AST_Store*) statement;
+		if (!is_element_access(loop, store->target))
+			return false;
+
+		if (!add_pointer(loop, ((AST_Var*) ((AST_Index*) store->target)->base)->decl, true))
+			return false;
+
+		u32 regs = analyze_expr(loop, store->rhs);
+		if (regs == 0)
+			return false;
+
+		if (regs > max_regs)
+			max_regs = regs;
+	}
+
+	loop->lanes = loop->vector_size / loop->element_size;
+	return max_regs + loop->num_invariants <= NUM_VECTOR_REGS;
+}
+
+static const char* reg_prefix(Vector_Loop* loop) {
+	return loop->vector_size == 32 ? "ymm" : "xmm";
+}
+
+static const char element_suffixes[] = { [1] = 'b', [2] = 'w', [4] = 'd', [8] = 'q' };
+
+// replicates the low element of rax into all lanes of a register
+static void emit_broadcast(Vector_Loop* loop, AST_Node* node, u32 reg) {
+	if (node->type == AST_INT_LITERAL) {
+		fprintf(emitter.file, "	mov rax, %" PRIu64 "\n", ((AST_Number*) node)->value);
+	} else {
+		AST_Var_Decl* decl = ((AST_Var*) node)->decl;
+		emit_load("rax", decl->data_type, "[rbp - %u]", decl->location);
+	}
+
+	char suffix = element_suffixes[loop->element_size];
+	if (options.arch == ARCH_AVX2) {
+		fprintf(emitter.file, "	vmovq xmm%u, rax\n", reg);
+		fprintf(emitter.file, "	vpbroadcast%c ymm%u, xmm%u\n", suffix, reg, reg);
+		return;
+	}
+
+	// sse2 has no broadcast, fill the low 64 bits by multiplying and duplicate them
+	if (loop->element_size < 8) {
+		u32 bits = loop->element_size * 8;
+		u64 pattern = 0;
+		for (u32 i = 0; i < 64; i += bits) {
+			pattern |= (u64) 1 << i;
+		}
+
+		if (loop->element_size == 4) {
+			fprintf(emitter.file, "	mov eax, eax\n");
+		} else {
+			fprintf(emitter.file, "	movzx eax, %s\n", loop->element_size == 1 ? "al" : "ax");
+		}
+		fprintf(emitter.file, "	mov rdi, %" PRIu64 "\n", pattern);
+		fprintf(emitter.file, "	imul rax, rdi\n");
+	}
+	fprintf(emitter.file, "	movq xmm%u, rax\n", reg);
+	fprintf(emitter.file, "	punpcklqdq xmm%u, xmm%u\n", reg, reg);
+}
+
+static void emit_vector_expr(Vector_Loop* loop, AST_Node* node, u32 reg) {
+	bool avx = options.arch == ARCH_AVX2;
+	const char* r = reg_prefix(loop);
+
+	if (is_element_access(loop, node)) {
+		AST_Index* index = (AST_Index*) node;
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", ((AST_Var*) index->base)->decl->location);
+		fprintf(emitter.file, "	%s %s%u, [rax + rcx * %u]\n", avx ? "vmovdqu" : "movdqu", r, reg, loop->element_size);
+		return;
+	}
+
+	if (is_invariant_operand(node)) {
+		fprintf(emitter.file, "	%s %s%u, %s%u\n", avx ? "vmovdqa" : "movdqa", r, reg, r, find_invariant(loop, node));
+		return;
+	}
+
+	AST_Binary_Op* op = (AST_Binary_Op*) node;
+	emit_vector_expr(loop, op->left, reg);
+
+	u32 operand = reg + 1;
+	if (is_invariant_operand(op->right)) {
+		operand = find_invariant(loop, op->right);
+	} else {
+		emit_vector_expr(loop, op->right, operand);
+	}
+
+	const char* instr = op->op == OP_ADD ? "padd" : "psub";
+	char suffix = element_suffixes[loop->element_size];
+	if (avx) {
+		fprintf(emitter.file, "	v%s%c %s%u, %s%u, %s%u\n", instr, suffix, r, reg, r, reg, r, operand);
+	} else {
+		fprintf(emitter.file, "	%s%c %s%u, %s%u\n", instr, suffix, r, reg, r, operand);
+	}
+}
+
+bool emit_vectorized_while(AST_Conditional* while_stmt) {
+	Vector_Loop loop = {0};
+	loop.vector_size = options.arch == ARCH_AVX2 ? 32 : 16;
+
+	if (!analyze_loop(&loop, while_stmt))
+		return false;
+
+	bool avx = options.arch == ARCH_AVX2;
+	u32 loop_label = emitter.label++;
+	u32 done_label = emitter.label++;
+	u32 skip_label = emitter.label++;
+
+	fprintf(emitter.file, "	; vectorized while statement (%s, %u lanes)\n", avx ? "avx2" : "sse2", loop.lanes);
+	emit_load("rcx", loop.index->data_type, "[rbp - %u]", loop.index->location);
+	if (loop.bound->type == AST_INT_LITERAL) {
+		fprintf(emitter.file, "	mov rdx, %" PRIu64 "\n", ((AST_Number*) loop.bound)->value);
+	} else {
+		AST_Var_Decl* bound = ((AST_Var*) loop.bound)->decl;
+		emit_load("rdx", bound->data_type, "[rbp - %u]", bound->location);
+	}
+
+	// fall back to the scalar loop if a stored array partially overlaps another one
+	for (u32 i = 0; i < loop.num_pointers; i++) {
+		for (u32 j = 0; j < loop.num_pointers; j++) {
+			if (i == j || (!loop.pointers[i].stored && !loop.pointers[j].stored))
+				continue;
+
+			fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", loop.pointers[i].decl->location);
+			fprintf(emitter.file, "	sub rax, qword [rbp - %u]\n", loop.pointers[j].decl->location);
+			fprintf(emitter.file, "	dec rax\n");
+			fprintf(emitter.file, "	cmp rax, %u\n", loop.vector_size - 1);
+			fprintf(emitter.file, "	jb .label%u\n", skip_label);
+		}
+	}
+
+	for (u32 i = 0; i < loop.num_invariants; i++) {
+		emit_broadcast(&loop, loop.invariants[i], NUM_VECTOR_REGS - 1 - i);
+	}
+
+	fprintf(emitter.file, ".label%u:\n", loop_label);
+	fprintf(emitter.file, "	mov rax, rdx\n");
+	fprintf(emitter.file, "	sub rax, rcx\n");
+	fprintf(emitter.file, "	cmp rax, %u\n", loop.lanes);
+	fprintf(emitter.file, "	jl .label%u\n", done_label);
+
+	AST_Block* body = (AST_Block*) while_stmt->body;
+	for (u32 i = 0; i < body->num_statements - 1; i++) {
+		AST_Store* store = (AST_Store*) body->statements[i];
+		AST_Index* target = (AST_Index*) store->target;
+
+		emit_vector_expr(&loop, store->rhs, 0);
+		fprintf(emitter.file, "	mov rax, qword [rbp - %u]\n", ((AST_Var*) target->base)->decl->location);
+		fprintf(emitter.file, "	%s [rax + rcx * %u], %s0\n", avx ? "vmovdqu" : "movdqu", loop.element_size, reg_prefix(&loop));
+	}
+
+	fprintf(emitter.file, "	add rcx, %u\n", loop.lanes);
+	fprintf(emitter.file, "	jmp .label%u\n", loop_label);
+	fprintf(emitter.file, ".label%u:\n", done_label);
+	emit_store_value("rcx", loop.index->data_type, "[rbp - %u]", loop.index->location);
+	if (avx) {
+		fprintf(emitter.file, "	vzeroupper\n");
+	}
+	fprintf(emitter.file, ".label%u:\n", skip_label);
+	return true;
+}
@@ -0,0 +1,1549 @@
+#include "all.h"
+
+#include <time.h>
+
+// --interpret: runs a program without nasm or a linker.
+//
+// Every function is compiled to bytecode for a register machine. Each call gets a window of 64 bit registers:
+// the arguments come first, then the variables and temporaries. Scalar variables live in registers, arrays and
+// variables whose address is taken live in a block of memory per call, which the frame register points to.
+// Values are held like in the emitted code, truncated to their type and sign or zero extended to 64 bits.
+//
+// The interpreter is direct threaded: every instruction holds the address of the code running it and each one
+// ends by jumping straight to the next one's, there is no central dispatch switch. This needs gcc's labels as
+// values. There are superinstructions for the common cases of comparing and branching on the result, and of
+// adding a constant (which covers incrementing a local).
+//
+// Calls to printf, alloc, free and exit are passed on to the host, other external functions can't be called.
+//
+// A generator keeps its registers and frame memory in a block from malloc, after a header of the value yielded last,
+// the index of the instruction to resume at and the function. next runs it like a call with its frame in the block,
+// the functions it calls get theirs on the stacks after the caller of next.
+
+#define VM_MAX_REGS 0xffff
+#define VM_STACK_REGS (1 << 20)
+#define VM_STACK_MEMORY (8 << 20)
+#define VM_MAX_DEPTH (1 << 16)
+#define VM_MAX_PRINTF_ARGS 16 // the format and up to 15 values
+#define NO_REG UINT32_MAX
+
+typedef struct {
+	VM_Func* func;
+	u64* regs;
+	u8* memory;
+	u64* regs_end; // where the registers and memory of the functions it calls start
+	u8* memory_end;
+	u64* generator; // the block of a generator, NULL for a call
+	const VM_Instr* return_ip; // in the caller
+	u32 result; // caller's register for the return value
+} VM_Frame;
+
+// the header of a generator's block in u64s, followed by the registers and then the frame memory
+#define GENERATOR_HEADER 4
+
+static VM_State vm = {0};
+
+static const char* op_names[NUM_VM_OPS] = {
+	[VM_LOADI] = "loadi",
+	[VM_MOV] = "mov",
+	[VM_ADD] = "add",
+	[VM_SUB] = "sub",
+	[VM_MUL] = "mul",
+	[VM_DIVS] = "divs",
+	[VM_DIVU] = "divu",
+	[VM_MINS] = "mins",
+	[VM_MINU] = "minu",
+	[VM_MAXS] = "maxs",
+	[VM_MAXU] = "maxu",
+	[VM_ABS] = "abs",
+	[VM_POPCNT] = "popcnt",
+	[VM_LZCNT] = "lzcnt",
+	[VM_TZCNT] = "tzcnt",
+	[VM_BSWAP] = "bswap",
+	[VM_ROTL] = "rotl",
+	[VM_ROTR] = "rotr",
+	[VM_RDTSC] = "rdtsc",
+	[VM_ADDI] = "addi",
+	[VM_SEXT8] = "sext8",
+	[VM_SEXT16] = "sext16",
+	[VM_SEXT32] = "sext32",
+	[VM_ZEXT8] = "zext8",
+	[VM_ZEXT16] = "zext16",
+	[VM_ZEXT32] = "zext32",
+	[VM_EQ] = "eq",
+	[VM_NE] = "ne",
+	[VM_LTS] = "lts",
+	[VM_LES] = "les",
+	[VM_GTS] = "gts",
+	[VM_GES] = "ges",
+	[VM_LTU] = "ltu",
+	[VM_LEU] = "leu",
+	[VM_GTU] = "gtu",
+	[VM_GEU] = "geu",
+	[VM_JMP] = "jmp",
+	[VM_JZ] = "jz",
+	[VM_JNZ] = "jnz",
+	[VM_JEQ] = "jeq",
+	[VM_JNE] = "jne",
+	[VM_JLTS] = "jlts",
+	[VM_JLES] = "jles",
+	[VM_JGTS] = "jgts",
+	[VM_JGES] = "jges",
+	[VM_JLTU] = "jltu",
+	[VM_JLEU] = "jleu",
+	[VM_JGTU] = "jgtu",
+	[VM_JGEU] = "jgeu",
+	[VM_LOAD8S] = "load8s",
+	[VM_LOAD8U] = "load8u",
+	[VM_LOAD16S] = "load16s",
+	[VM_LOAD16U] = "load16u",
+	[VM_LOAD32S] = "load32s",
+	[VM_LOAD32U] = "load32u",
+	[VM_LOAD64] = "load64",
+	[VM_STORE8] = "store8",
+	[VM_STORE16] = "store16",
+	[VM_STORE32] = "store32",
+	[VM_STORE64] = "store64",
+	[VM_LEA] = "lea",
+	[VM_PTRDIFF] = "ptrdiff",
+	[VM_FRAME] = "frame",
+	[VM_CALL] = "call",
+	[VM_PRINTF] = "printf",
+	[VM_ALLOC] = "alloc",
+	[VM_FREE] = "free",
+	[VM_REGION] = "region",
+	[VM_REGION_ALLOC] = "regionalloc",
+	[VM_REGION_RESET] = "regionreset",
+	[VM_REGION_FREE] = "regionfree",
+	[VM_GEN_NEW] = "gennew",
+	[VM_GEN_NEXT] = "gennext",
+	[VM_YIELD] = "yield",
+	[VM_GEN_DONE] = "gendone",
+	[VM_EXIT] = "exit",
+	[VM_RET] = "ret",
+};
+
+static void vm_error(const char* what, Token* name) {
+	printf("interpreter error in '%.*s': %s", vm.func->decl->name.len, vm.func->decl->name.str, what);
+	if (name != NULL)
+		printf(" '%.*s'", name->len, name->str);
+	printf("\n");
+	error();
+}
+
+static u32 add_instr(VM_Op op, u32 a, u32 b, u32 c, u64 imm) {
+	VM_Func* func = vm.func;
+	if (func->num_code >= func->code_capacity) {
+		func->code_capacity = func->code_capacity == 0 ? 64 : func->code_capacity * 2;
+		func->code = realloc(func->code, func->code_capacity * sizeof(VM_Instr));
+	}
+
+	func->code[func->num_code] = (VM_Instr) {
+		.op = op,
+		.a = a,
+		.b = b,
+		.c = c,
+		.imm = imm,
+	};
+	return func->num_code++;
+}
+
+// points the jump at index to the next instruction added
+static void patch_jump(u32 index) {
+	vm.func->code[index].imm = vm.func->num_code;
+}
+
+static u32 new_reg() {
+	if (vm.next_reg >= VM_MAX_REGS)
+		vm_error("too many registers needed", NULL);
+
+	u32 reg = vm.next_reg++;
+	if (vm.next_reg > vm.func->num_regs)
+		vm.func->num_regs = vm.next_reg;
+	return reg;
+}
+
+// align has to be a power of two
+static u32 allocate_memory(u32 size, u32 align) {
+	u32 offset = (vm.func->frame_size + align - 1) & ~(align - 1);
+	vm.func->frame_size = offset + size;
+	return offset;
+}
+
+static VM_Var* find_var(AST_Var_Decl* decl) {
+	for (u32 i = vm.num_vars; i > 0; i--) {
+		if (vm.vars[i - 1].decl == decl)
+			return &vm.vars[i - 1];
+	}
+
+	vm_error("unknown variable", &decl->name);
+	return NULL;
+}
+
+static bool is_address_taken(AST_Var_Decl* decl) {
+	for (u32 i = 0; i < vm.num_address_taken; i++) {
+		if (vm.address_taken[i] == decl)
+			return true;
+	}
+	return false;
+}
+
+// variables that need to be in memory, and whether the function needs frame memory at all
+static bool find_memory_vars(AST_Node* node) {
+	if (node == NULL)
+		return false;
+
+	switch (node->type) {
+		case AST_BIN_OP: {
+			AST_Binary_Op* op = (AST_Binary_Op*) node;
+			bool left = find_memory_vars(op->left);
+			return find_memory_vars(op->right) || left;
+		}
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			bool found = false;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				found = find_memory_vars(block->statements[i]) || found;
+			}
+			return found;
+		}
+		case AST_VAR_DECL: {
+			AST_Var_Decl* decl = (AST_Var_Decl*) node;
+			return find_memory_vars(decl->assign) || decl->array_length > 0;
+		}
+		case AST_ASSIGN:
+			return find_memory_vars(((AST_Assign*) node)->rhs);
+		case AST_FUNC_CALL: {
+			AST_Func_Call* call = (AST_Func_Call*) node;
+			bool found = false;
+			for (u32 i = 0; i < call->num_args; i++) {
+				found = find_memory_vars(call->args[i]) || found;
+			}
+			return found;
+		}
+		case AST_IF:
+		case AST_WHILE: {
+			AST_Conditional* cond = (AST_Conditional*) node;
+			bool condition = find_memory_vars(cond->condition);
+			return find_memory_vars(cond->body) || condition;
+		}
+		case AST_SWITCH: {
+			AST_Switch* switch_stmt = (AST_Switch*) node;
+			bool found = find_memory_vars(switch_stmt->value);
+			for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+				found = find_memory_vars(switch_stmt->bodies[i]) || found;
+			}
+			return find_memory_vars(switch_stmt->default_body) || found;
+		}
+		case AST_PARALLEL: {
+			AST_Parallel* parallel = (AST_Parallel*) node;
+			bool found = find_memory_vars((AST_Node*) parallel->index);
+			found = find_memory_vars(parallel->end) || found;
+			found = find_memory_vars(parallel->chunk) || found;
+			return find_memory_vars(parallel->body) || found;
+		}
+		case AST_RETURN:
+		case AST_YIELD:
+			return find_memory_vars(((AST_Return*) node)->expr);
+		case AST_INDEX: {
+			AST_Index* index = (AST_Index*) node;
+			bool base = find_memory_vars(index->base);
+			return find_memory_vars(index->index) || base;
+		}
+		case AST_DEREF:
+			return find_memory_vars(((AST_Unary*) node)->expr);
+		case AST_ADDR_OF: {
+			AST_Unary* addr = (AST_Unary*) node;
+			if (addr->expr->type != AST_VAR)
+				return find_memory_vars(addr->expr);
+
+			AST_Var_Decl* decl = ((AST_Var*) addr->expr)->decl;
+			if (!is_address_taken(decl)) {
+				if (vm.num_address_taken >= vm.address_taken_capacity) {
+					vm.address_taken_capacity = vm.address_taken_capacity == 0 ? 16 : vm.address_taken_capacity * 2;
+					vm.address_taken = realloc(vm.address_taken, vm.address_taken_capacity * sizeof(AST_Var_Decl*));
+				}
+				vm.address_taken[vm.num_address_taken++] = decl;
+			}
+			return true;
+		}
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			bool target = find_memory_vars(store->target);
+			return find_memory_vars(store->rhs) || target;
+		}
+		default:
+			return false;
+	}
+}
+
+// reg is where it's kept if it isn't in memory, or NO_REG for a new one
+static VM_Var* add_var(AST_Var_Decl* decl, u32 reg) {
+	if (vm.num_vars >= vm.vars_capacity) {
+		vm.vars_capacity = vm.vars_capacity == 0 ? 64 : vm.vars_capacity * 2;
+		vm.vars = realloc(vm.vars, vm.vars_capacity * sizeof(VM_Var));
+	}
+
+	VM_Var* var = &vm.vars[vm.num_vars++];
+	var->decl = decl;
+	var->in_memory = is_address_taken(decl);
+	var->reg = var->in_memory ? vm.frame_reg : reg != NO_REG ? reg : new_reg();
+
+	// arrays are typed as the pointer to their first element that's stored here
+	u32 size = type_size(decl->data_type);
+	var->offset = var->in_memory ? allocate_memory(size, size) : 0;
+	return var;
+}
+
+// the instruction that sign or zero extends a value to type, or NUM_VM_OPS if it's 64 bits anyway
+static VM_Op extend_op(Data_Type type) {
+	bool is_signed = type_is_signed(type);
+	switch (type_size(type)) {
+		case 1:
+			return is_signed ? VM_SEXT8 : VM_ZEXT8;
+		case 2:
+			return is_signed ? VM_SEXT16 : VM_ZEXT16;
+		case 4:
+			return is_signed ? VM_SEXT32 : VM_ZEXT32;
+		default:
+			return NUM_VM_OPS;
+	}
+}
+
+static VM_Op load_op(Data_Type type) {
+	bool is_signed = type_is_signed(type);
+	switch (type_size(type)) {
+		case 1:
+			return is_signed ? VM_LOAD8S : VM_LOAD8U;
+		case 2:
+			return is_signed ? VM_LOAD16S : VM_LOAD16U;
+		case 4:
+			return is_signed ? VM_LOAD32S : VM_LOAD32U;
+		default:
+			return VM_LOAD64;
+	}
+}
+
+static VM_Op store_op(Data_Type type) {
+	switch (type_size(type)) {
+		case 1:
+			return VM_STORE8;
+		case 2:
+			return VM_STORE16;
+		case 4:
+			return VM_STORE32;
+		default:
+			return VM_STORE64;
+	}
+}
+
+// whether a value held as from is already held right as to
+static bool same_representation(Data_Type from, Data_Type to) {
+	u32 from_size = type_size(from);
+	u32 to_size = type_size(to);
+	if (to_size == 8)
+		return true;
+	if (to_size > from_size && !type_is_signed(from))
+		return true;
+	return to_size >= from_size && type_is_signed(from) == type_is_signed(to);
+}
+
+// copies reg, a value of type from, to dest as a value of type to
+static void convert_to(u32 dest, u32 reg, Data_Type from, Data_Type to) {
+	if (same_representation(from, to)) {
+		if (dest != reg)
+			add_instr(VM_MOV, dest, reg, 0, 0);
+		return;
+	}
+	add_instr(extend_op(to), dest, reg, 0, 0);
+}
+
+static u32 convert(u32 reg, Data_Type from, Data_Type to) {
+	if (same_representation(from, to))
+		return reg;
+
+	u32 result = new_reg();
+	add_instr(extend_op(to), result, reg, 0, 0);
+	return result;
+}
+
+static void normalize_reg(u32 reg, Data_Type type) {
+	VM_Op op = extend_op(type);
+	if (op != NUM_VM_OPS)
+		add_instr(op, reg, reg, 0, 0);
+}
+
+static bool is_comparison(AST_Node* node) {
+	if (node->type != AST_BIN_OP)
+		return false;
+
+	Binary_Operation op = ((AST_Binary_Op*) node)->op;
+	return op == OP_EQUALS || op == OP_NOT_EQUALS || op == OP_LESS_THAN || op == OP_LESS_THAN_EQUAL ||
+		op == OP_GREATER_THAN || op == OP_GREATER_THAN_EQUAL;
+}
+
+// the setting comparison for op, the jump is the same distance further into the enum
+static VM_Op comparison_op(Binary_Operation op, bool is_signed, bool negate) {
+	if (negate) {
+		switch (op) {
+			case OP_EQUALS: op = OP_NOT_EQUALS; break;
+			case OP_NOT_EQUALS: op = OP_EQUALS; break;
+			case OP_LESS_THAN: op = OP_GREATER_THAN_EQUAL; break;
+			case OP_LESS_THAN_EQUAL: op = OP_GREATER_THAN; break;
+			case OP_GREATER_THAN: op = OP_LESS_THAN_EQUAL; break;
+			case OP_GREATER_THAN_EQUAL: op = OP_LESS_THAN; break;
+			default: break;
+		}
+	}
+
+	switch (op) {
+		case OP_EQUALS:
+			return VM_EQ;
+		case OP_NOT_EQUALS:
+			return VM_NE;
+		case OP_LESS_THAN:
+			return is_signed ? VM_LTS : VM_LTU;
+		case OP_LESS_THAN_EQUAL:
+			return is_signed ? VM_LES : VM_LEU;
+		case OP_GREATER_THAN:
+			return is_signed ? VM_GTS : VM_GTU;
+		default:
+			return is_signed ? VM_GES : VM_GEU;
+	}
+}
+
+static const char* string_literal(u32 symbol) {
+	if (symbol >= vm.strings_capacity) {
+		u32 capacity = num_symbols();
+		vm.strings = realloc(vm.strings, capacity * sizeof(char*));
+		memset(vm.strings + vm.strings_capacity, 0, (capacity - vm.strings_capacity) * sizeof(char*));
+		vm.strings_capacity = capacity;
+	}
+
+	if (vm.strings[symbol] != NULL)
+		return vm.strings[symbol];
+
+	// same escapes as emit_string_literals
+	const Symbol* text = get_symbol(symbol);
+	char* str = malloc(text->len);
+	u32 length = 0;
+	for (u32 pos = 1; pos < text->len - 1; pos++) {
+		if (text->str[pos] == '\\') {
+			if (pos + 1 >= text->len - 1 || text->str[pos + 1] != 'n')
+				vm_error("invalid escape character in string literal", NULL);
+			str[length++] = '\n';
+			pos++;
+			continue;
+		}
+		str[length++] = text->str[pos];
+	}
+	str[length] = 0;
+
+	vm.strings[symbol] = str;
+	return str;
+}
+
+static u32 find_func(AST_Func_Decl* decl) {
+	for (u32 i = 0; i < vm.num_funcs; i++) {
+		if (vm.funcs[i].decl == decl)
+			return i;
+	}
+	return UINT32_MAX;
+}
+
+static u32 compile_expr(AST_Node* node);
+static void compile_statement(AST_Node* node);
+
+// the address an AST_INDEX refers to
+static u32 compile_element_address(AST_Index* index) {
+	u32 base = compile_expr(index->base);
+	u32 offset = compile_expr(index->index);
+	u32 result = new_reg();
+	add_instr(VM_LEA, result, base, offset, type_size(index->data_type));
+	return result;
+}
+
+static u32 compile_binary_op(AST_Binary_Op* op) {
+	Data_Type left_type = op->left->data_type;
+	Data_Type right_type = op->right->data_type;
+
+	if (is_comparison((AST_Node*) op)) {
+		Data_Type common = arithmetic_type(left_type, right_type);
+		u32 left = convert(compile_expr(op->left), left_type, common);
+		u32 right = convert(compile_expr(op->right), right_type, common);
+		u32 result = new_reg();
+		add_instr(comparison_op(op->op, type_is_signed(common), false), result, left, right, 0);
+		return result;
+	}
+
+	// pointer arithmetic, scaled by the element size
+	bool left_pointer = type_is_pointer(left_type);
+	bool right_pointer = type_is_pointer(right_type);
+	if (left_pointer && right_pointer) {
+		u32 left = compile_expr(op->left);
+		u32 right = compile_expr(op->right);
+		u32 result = new_reg();
+		add_instr(VM_PTRDIFF, result, left, right, __builtin_ctz(element_size(left_type)));
+		return result;
+	} else if (left_pointer || right_pointer) {
+		u32 left = compile_expr(op->left);
+		u32 right = compile_expr(op->right);
+		u32 result = new_reg();
+		s64 scale = element_size(op->data_type);
+		add_instr(VM_LEA, result, left_pointer ? left : right, left_pointer ? right : left, op->op == OP_ADD ? scale : -scale);
+		return result;
+	}
+
+	// adding or subtracting a constant
+	if ((op->op == OP_ADD || op->op == OP_SUB) && op->right->type == AST_INT_LITERAL) {
+		u64 value = normalize_value(((AST_Number*) op->right)->value, right_type);
+		u32 left = compile_expr(op->left);
+		u32 result = new_reg();
+		add_instr(VM_ADDI, result, left, 0, op->op == OP_ADD ? value : -value);
+		normalize_reg(result, op->data_type);
+		return result;
+	}
+
+	u32 left = compile_expr(op->left);
+	u32 right = compile_expr(op->right);
+	u32 result = new_reg();
+	switch (op->op) {
+		case OP_ADD:
+			add_instr(VM_ADD, result, left, right, 0);
+			break;
+		case OP_SUB:
+			add_instr(VM_SUB, result, left, right, 0);
+			break;
+		case OP_MUL:
+			add_instr(VM_MUL, result, left, right, 0);
+			break;
+		case OP_DIV:
+			// unlike the other operations the result depends on more than the low bits of the operands
+			left = convert(left, left_type, op->data_type);
+			right = convert(right, right_type, op->data_type);
+			add_instr(type_is_signed(op->data_type) ? VM_DIVS : VM_DIVU, result, left, right, 0);
+			break;
+		default:
+			vm_error("unhandled operator", NULL);
+	}
+	normalize_reg(result, op->data_type);
+	return result;
+}
+
+// the interpreter has a single thread, so atomics are plain loads and stores
+static u32 compile_atomic(AST_Func_Call* call, u32 result) {
+	Data_Type type = call->args[0]->data_type;
+	type.pointers--;
+	u32 symbol = call->name.symbol;
+
+	u32 address = compile_expr(call->args[0]);
+	if (symbol != SYM_ATOMICSTORE) {
+		add_instr(load_op(type), result, address, 0, 0);
+	}
+	if (symbol == SYM_ATOMICLOAD)
+		return result;
+
+	u32 value = compile_expr(call->args[1]);
+	if (symbol == SYM_ATOMICADD) {
+		u32 sum = new_reg();
+		add_instr(VM_ADD, sum, result, value, 0);
+		value = sum;
+	}
+
+	u32 skip = 0;
+	if (symbol == SYM_ATOMICCAS) {
+		u32 expected = convert(value, call->args[1]->data_type, type);
+		value = compile_expr(call->args[2]);
+		skip = add_instr(VM_JNE, result, expected, 0, 0);
+	}
+
+	add_instr(store_op(type), address, value, 0, 0);
+	if (symbol == SYM_ATOMICCAS) {
+		patch_jump(skip);
+	}
+	return result;
+}
+
+static u32 compile_builtin(AST_Func_Call* call) {
+	Data_Type type = call->data_type;
+	u32 symbol = call->name.symbol;
+	u32 result = new_reg();
+
+	switch (symbol) {
+		case SYM_RDTSC:
+			add_instr(VM_RDTSC, result, 0, 0, 0);
+			return result;
+		case SYM_PREFETCH:
+			// only hints, the address is still evaluated
+			compile_expr(call->args[0]);
+			add_instr(VM_LOADI, result, 0, 0, 0);
+			return result;
+		case SYM_PAUSE:
+		case SYM_FENCE:
+			add_instr(VM_LOADI, result, 0, 0, 0);
+			return result;
+		case SYM_ATOMICLOAD:
+		case SYM_ATOMICSTORE:
+		case SYM_ATOMICADD:
+		case SYM_ATOMICXCHG:
+		case SYM_ATOMICCAS:
+			return compile_atomic(call, result);
+		case SYM_REGION:
+			add_instr(VM_REGION, result, 0, 0, 0);
+			return result;
+		case SYM_REGIONALLOC: {
+			u32 region = compile_expr(call->args[0]);
+			u32 size = compile_expr(call->args[1]);
+			add_instr(VM_REGION_ALLOC, result, region, size, 0);
+			return result;
+		}
+		case SYM_REGIONRESET:
+		case SYM_REGIONFREE:
+			add_instr(symbol == SYM_REGIONRESET ? VM_REGION_RESET : VM_REGION_FREE, result, compile_expr(call->args[0]), 0, 0);
+			return result;
+		case SYM_NEXT:
+			add_instr(VM_GEN_NEXT, result, compile_expr(call->args[0]), 0, 0);
+			return result;
+		case SYM_POPCNT:
+		case SYM_LZCNT:
+		case SYM_TZCNT:
+		case SYM_BSWAP:
+		case SYM_ROTL:
+		case SYM_ROTR: {
+			static const VM_Op ops[] = {
+				[SYM_POPCNT - SYM_POPCNT] = VM_POPCNT,
+				[SYM_LZCNT - SYM_POPCNT] = VM_LZCNT,
+				[SYM_TZCNT - SYM_POPCNT] = VM_TZCNT,
+				[SYM_BSWAP - SYM_POPCNT] = VM_BSWAP,
+				[SYM_ROTL - SYM_POPCNT] = VM_ROTL,
+				[SYM_ROTR - SYM_POPCNT] = VM_ROTR,
+			};
+			u32 value = compile_expr(call->args[0]);
+			u32 amount = call->num_args > 1 ? compile_expr(call->args[1]) : 0;
+			add_instr(ops[symbol - SYM_POPCNT], result, value, amount, type_size(call->args[0]->data_type) * 8);
+			normalize_reg(result, type);
+			return result;
+		}
+		default:
+			break;
+	}
+
+	bool is_signed = type_is_signed(type);
+	u32 value = convert(compile_expr(call->args[0]), call->args[0]->data_type, type);
+
+	if (symbol == SYM_ABS) {
+		add_instr(is_signed ? VM_ABS : VM_MOV, result, value, 0, 0);
+		normalize_reg(result, type);
+		return result;
+	}
+
+	u32 other = convert(compile_expr(call->args[1]), call->args[1]->data_type, type);
+	if (symbol == SYM_MIN) {
+		add_instr(is_signed ? VM_MINS : VM_MINU, result, value, other, 0);
+	} else {
+		add_instr(is_signed ? VM_MAXS : VM_MAXU, result, value, other, 0);
+	}
+	return result;
+}
+
+static u32 compile_call(AST_Func_Call* call) {
+	if (call->num_args > MAX_ARGS)
+		vm_error("too many arguments to", &call->name);
+	if (is_builtin(call))
+		return compile_builtin(call);
+
+	// the arguments go into consecutive registers
+	u32 first = vm.next_reg;
+	for (u32 i = 0; i < call->num_args; i++) {
+		new_reg();
+	}
+	for (u32 i = 0; i < call->num_args; i++) {
+		u32 reg = compile_expr(call->args[i]);
+		if (reg != first + i)
+			add_instr(VM_MOV, first + i, reg, 0, 0);
+	}
+
+	u32 result = new_reg();
+	if (call->decl != NULL && call->decl->is_generator) {
+		add_instr(VM_GEN_NEW, result, first, call->num_args, find_func(call->decl));
+		return result;
+	}
+	if (call->decl != NULL && call->decl->body != NULL) {
+		add_instr(VM_CALL, result, first, call->num_args, find_func(call->decl));
+		return result;
+	}
+
+	// functions of the host
+	u32 symbol = call->name.symbol;
+	if (symbol == SYM_ALLOC) {
+		add_instr(VM_ALLOC, result, first, 0, 0);
+	} else if (symbol == vm.printf_symbol && call->num_args > 0) {
+		if (call->num_args > VM_MAX_PRINTF_ARGS)
+			vm_error("too many arguments to", &call->name);
+		add_instr(VM_PRINTF, result, first, call->num_args, 0);
+	} else if (symbol == vm.free_symbol && call->num_args == 1) {
+		add_instr(VM_FREE, result, first, 0, 0);
+	} else if (symbol == vm.exit_symbol && call->num_args == 1) {
+		add_instr(VM_EXIT, result, first, 0, 0);
+	} else {
+		vm_error("can't call external function", &call->name);
+	}
+	return result;
+}
+
+static u32 compile_expr(AST_Node* node) {
+	switch (node->type) {
+		case AST_INT_LITERAL: {
+			u32 result = new_reg();
+			add_instr(VM_LOADI, result, 0, 0, normalize_value(((AST_Number*) node)->value, node->data_type));
+			return result;
+		}
+		case AST_STR_LITERAL: {
+			u32 result = new_reg();
+			add_instr(VM_LOADI, result, 0, 0, (u64) string_literal(((AST_String*) node)->token.symbol));
+			return result;
+		}
+		case AST_BIN_OP:
+			return compile_binary_op((AST_Binary_Op*) node);
+		case AST_VAR: {
+			AST_Var* var_node = (AST_Var*) node;
+			VM_Var* var = find_var(var_node->decl);
+			if (!var->in_memory)
+				return var->reg;
+
+			u32 result = new_reg();
+			add_instr(load_op(var_node->decl->data_type), result, vm.frame_reg, 0, var->offset);
+			return result;
+		}
+		case AST_FUNC_CALL:
+			return compile_call((AST_Func_Call*) node);
+		case AST_INDEX: {
+			u32 address = compile_element_address((AST_Index*) node);
+			u32 result = new_reg();
+			add_instr(load_op(node->data_type), result, address, 0, 0);
+			return result;
+		}
+		case AST_DEREF: {
+			u32 pointer = compile_expr(((AST_Unary*) node)->expr);
+			u32 result = new_reg();
+			add_instr(load_op(node->data_type), result, pointer, 0, 0);
+			return result;
+		}
+		case AST_ADDR_OF: {
+			AST_Unary* addr = (AST_Unary*) node;
+			if (addr->expr->type == AST_INDEX)
+				return compile_element_address((AST_Index*) addr->expr);
+
+			VM_Var* var = find_var(((AST_Var*) addr->expr)->decl);
+			u32 result = new_reg();
+			add_instr(VM_FRAME, result, 0, 0, var->offset);
+			return result;
+		}
+		default:
+			compile_statement(node);
+			return 0;
+	}
+}
+
+// jumps if the condition is true (or false if negate), returns the jump to patch
+static u32 compile_branch(AST_Node* condition, bool negate) {
+	u32 top = vm.next_reg;
+	u32 jump;
+
+	if (is_comparison(condition)) {
+		// compare and branch in one instruction
+		AST_Binary_Op* op = (AST_Binary_Op*) condition;
+		Data_Type common = arithmetic_type(op->left->data_type, op->right->data_type);
+		u32 left = convert(compile_expr(op->left), op->left->data_type, common);
+		u32 right = convert(compile_expr(op->right), op->right->data_type, common);
+		VM_Op compare = comparison_op(op->op, type_is_signed(common), negate);
+		jump = add_instr(compare + (VM_JEQ - VM_EQ), left, right, 0, 0);
+	} else {
+		u32 value = compile_expr(condition);
+		jump = add_instr(negate ? VM_JZ : VM_JNZ, value, 0, 0, 0);
+	}
+
+	vm.next_reg = top;
+	return jump;
+}
+
+static void compile_assign(AST_Assign* assign) {
+	VM_Var* var = find_var(assign->decl);
+	Data_Type type = assign->decl->data_type;
+
+	if (var->in_memory) {
+		u32 value = compile_expr(assign->rhs);
+		add_instr(store_op(type), vm.frame_reg, value, 0, var->offset);
+		return;
+	}
+
+	// x = x + constant, adds to the register in place
+	AST_Binary_Op* op = (AST_Binary_Op*) assign->rhs;
+	if (op->type == AST_BIN_OP && (op->op == OP_ADD || op->op == OP_SUB) && !type_is_pointer(op->data_type) &&
+		op->left->type == AST_VAR && ((AST_Var*) op->left)->decl == assign->decl &&
+		op->right->type == AST_INT_LITERAL && type_size(op->data_type) >= type_size(type)) {
+		u64 value = normalize_value(((AST_Number*) op->right)->value, op->right->data_type);
+		add_instr(VM_ADDI, var->reg, var->reg, 0, op->op == OP_ADD ? value : -value);
+		normalize_reg(var->reg, type);
+		return;
+	}
+
+	u32 value = compile_expr(assign->rhs);
+	convert_to(var->reg, value, assign->rhs->data_type, type);
+}
+
+static void compile_var_decl(AST_Var_Decl* decl) {
+	VM_Var* var = add_var(decl, NO_REG);
+	u32 top = vm.next_reg;
+
+	if (decl->array_length > 0) {
+		u32 first = allocate_memory(decl->array_length * element_size(decl->data_type), 16);
+		if (!var->in_memory) {
+			add_instr(VM_FRAME, var->reg, 0, 0, first);
+			return;
+		}
+
+		u32 pointer = new_reg();
+		add_instr(VM_FRAME, pointer, 0, 0, first);
+		add_instr(VM_STORE64, vm.frame_reg, pointer, 0, var->offset);
+		vm.next_reg = top;
+		return;
+	}
+
+	if (decl->assign == NULL) {
+		if (!var->in_memory)
+			add_instr(VM_LOADI, var->reg, 0, 0, 0);
+		return;
+	}
+
+	u32 value = compile_expr(decl->assign);
+	if (var->in_memory) {
+		add_instr(store_op(decl->data_type), vm.frame_reg, value, 0, var->offset);
+	} else {
+		convert_to(var->reg, value, decl->assign->data_type, decl->data_type);
+	}
+	vm.next_reg = top;
+}
+
+// compares against every case in turn, the jumps to the bodies are patched once they're placed
+static void compile_switch(AST_Switch* switch_stmt) {
+	u32 value = compile_expr(switch_stmt->value);
+	u32* case_jumps = malloc(switch_stmt->num_cases * sizeof(u32));
+	for (u32 i = 0; i < switch_stmt->num_cases; i++) {
+		u32 constant = new_reg();
+		add_instr(VM_LOADI, constant, 0, 0, switch_stmt->cases[i].value);
+		case_jumps[i] = add_instr(VM_JEQ, value, constant, 0, 0);
+	}
+
+	u32 to_default = add_instr(VM_JMP, 0, 0, 0, 0);
+	u32* body_starts = malloc(switch_stmt->num_bodies * sizeof(u32));
+	u32* body_exits = malloc(switch_stmt->num_bodies * sizeof(u32));
+	for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+		body_starts[i] = vm.func->num_code;
+		compile_statement(switch_stmt->bodies[i]);
+		body_exits[i] = add_instr(VM_JMP, 0, 0, 0, 0);
+	}
+
+	patch_jump(to_default);
+	if (switch_stmt->default_body != NULL) {
+		compile_statement(switch_stmt->default_body);
+	}
+
+	for (u32 i = 0; i < switch_stmt->num_cases; i++) {
+		vm.func->code[case_jumps[i]].imm = body_starts[switch_stmt->cases[i].body];
+	}
+	for (u32 i = 0; i < switch_stmt->num_bodies; i++) {
+		patch_jump(body_exits[i]);
+	}
+
+	free(case_jumps);
+	free(body_starts);
+	free(body_exits);
+}
+
+// the interpreter has a single thread, the iterations run one after the other
+static void compile_parallel(AST_Parallel* parallel) {
+	AST_Var_Decl* index = parallel->index;
+	u32 num_vars = vm.num_vars;
+	compile_var_decl(index);
+	u32 end = convert(compile_expr(parallel->end), parallel->end->data_type, index->data_type);
+	if (parallel->chunk != NULL) {
+		compile_expr(parallel->chunk);
+	}
+
+	u32 reg = find_var(index)->reg;
+	u32 enter = add_instr(VM_JMP, 0, 0, 0, 0);
+	u32 body = vm.func->num_code;
+	compile_statement(parallel->body);
+	add_instr(VM_ADDI, reg, reg, 0, 1);
+	normalize_reg(reg, index->data_type);
+	patch_jump(enter);
+
+	VM_Op compare = comparison_op(OP_LESS_THAN, type_is_signed(index->data_type), false);
+	u32 loop = add_instr(compare + (VM_JEQ - VM_EQ), reg, end, 0, 0);
+	vm.func->code[loop].imm = body;
+	vm.num_vars = num_vars;
+}
+
+static void compile_statement(AST_Node* node) {
+	u32 top = vm.next_reg;
+
+	switch (node->type) {
+		case AST_BLOCK: {
+			AST_Block* block = (AST_Block*) node;
+			u32 num_vars = vm.num_vars;
+			for (u32 i = 0; i < block->num_statements; i++) {
+				compile_statement(block->statements[i]);
+			}
+			vm.num_vars = num_vars;
+			break;
+		}
+		case AST_VAR_DECL:
+			// keeps its register until the end of the block
+			compile_var_decl((AST_Var_Decl*) node);
+			return;
+		case AST_ASSIGN:
+			compile_assign((AST_Assign*) node);
+			break;
+		case AST_IF: {
+			AST_Conditional* if_stmt = (AST_Conditional*) node;
+			u32 skip = compile_branch(if_stmt->condition, true);
+			compile_statement(if_stmt->body);
+			patch_jump(skip);
+			break;
+		}
+		case AST_WHILE: {
+			// the condition is checked at the bottom, one jump per iteration
+			AST_Conditional* while_stmt = (AST_Conditional*) node;
+			u32 enter = add_instr(VM_JMP, 0, 0, 0, 0);
+			u32 body = vm.func->num_code;
+			compile_statement(while_stmt->body);
+			patch_jump(enter);
+			u32 loop = compile_branch(while_stmt->condition, false);
+			vm.func->code[loop].imm = body;
+			break;
+		}
+		case AST_SWITCH:
+			compile_switch((AST_Switch*) node);
+			break;
+		case AST_PARALLEL:
+			compile_parallel((AST_Parallel*) node);
+			break;
+		case AST_RETURN: {
+			AST_Node* expr = ((AST_Return*) node)->expr;
+			if (expr == NULL) {
+				// a generator finishes
+				u32 zero = new_reg();
+				add_instr(VM_LOADI, zero, 0, 0, 0);
+				add_instr(VM_GEN_DONE, 0, zero, 0, 0);
+				break;
+			}
+			u32 value = convert(compile_expr(expr), expr->data_type, vm.func->decl->return_type);
+			add_instr(VM_RET, 0, value, 0, 0);
+			break;
+		}
+		case AST_YIELD: {
+			// returns 1 from next, the value goes into the block
+			AST_Node* expr = ((AST_Return*) node)->expr;
+			u32 value = convert(compile_expr(expr), expr->data_type, vm.func->decl->return_type);
+			u32 one = new_reg();
+			add_instr(VM_LOADI, one, 0, 0, 1);
+			add_instr(VM_YIELD, 0, one, value, 0);
+			break;
+		}
+		case AST_STORE: {
+			AST_Store* store = (AST_Store*) node;
+			u32 address;
+			if (store->target->type == AST_INDEX) {
+				address = compile_element_address((AST_Index*) store->target);
+			} else {
+				address = compile_expr(((AST_Unary*) store->target)->expr);
+			}
+			u32 value = compile_expr(store->rhs);
+			add_instr(store_op(store->target->data_type), address, value, 0, 0);
+			break;
+		}
+		default:
+			compile_expr(node);
+			break;
+	}
+
+	vm.next_reg = top;
+}
+
+static void compile_func(VM_Func* func) {
+	AST_Func_Decl* decl = func->decl;
+	vm.func = func;
+	vm.num_vars = 0;
+	vm.num_address_taken = 0;
+	vm.next_reg = 0;
+
+	bool needs_memory = find_memory_vars(decl->body);
+
+	// arguments arrive in the first registers
+	for (u32 i = 0; i < decl->num_args; i++) {
+		new_reg();
+	}
+	vm.frame_reg = new_reg();
+	if (needs_memory) {
+		add_instr(VM_FRAME, vm.frame_reg, 0, 0, 0);
+	}
+
+	for (u32 i = 0; i < decl->num_args; i++) {
+		AST_Var_Decl* arg = decl->args[i];
+		VM_Var* var = add_var(arg, i);
+		if (var->in_memory) {
+			add_instr(store_op(arg->data_type), vm.frame_reg, i, 0, var->offset);
+		} else {
+			// the caller passes all 64 bits
+			normalize_reg(i, arg->data_type);
+		}
+	}
+
+	compile_statement(decl->body);
+
+	// falling off the end returns 0, or finishes a generator
+	u32 zero = new_reg();
+	add_instr(VM_LOADI, zero, 0, 0, 0);
+	add_instr(decl->is_generator ? VM_GEN_DONE : VM_RET, 0, zero, 0, 0);
+
+	// keep the memory of the next call aligned
+	func->frame_size = (func->frame_size + 15) & ~15;
+}
+
+static u64 now_ns() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (u64) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// the time stamp counter where there is one, to time code the same way as the emitted rdtsc
+static u64 read_cycles() {
+#ifdef __x86_64__
+	return __builtin_ia32_rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+static u64 low_bits(u64 value, u64 bits) {
+	return bits == 64 ? value : value & ((1ull << bits) - 1);
+}
+
+static u64 rotate_left(u64 value, u64 amount, u64 bits) {
+	value = low_bits(value, bits);
+	if (amount == 0)
+		return value;
+	return low_bits(value << amount | value >> (bits - amount), bits);
+}
+
+// regions like the ones of the emitted runtime: the next free byte, the end of the chunk being filled, and the list
+// of chunks, newest first. every chunk starts with the next one and the size of its data
+static u64 region_alloc(u64* region, u64 size) {
+	// like in the emitted code, sizes too big to round up without wrapping around fail and 0 takes 16 bytes, so it
+	// never returns NULL from an empty region
+	if (size >> REGION_MAX_BITS != 0)
+		return 0;
+	size = size == 0 ? 16 : (size + 15) & ~(u64) 15;
+	if (size <= region[1] - region[0]) {
+		u64 pointer = region[0];
+		region[0] += size;
+		return pointer;
+	}
+
+	// bigger allocations get a chunk of their own
+	u64 data_size = size > REGION_CHUNK_SIZE ? size : REGION_CHUNK_SIZE;
+	u64* chunk = malloc(data_size + 16);
+	if (chunk == NULL)
+		return 0;
+
+	chunk[0] = region[2];
+	chunk[1] = data_size;
+	region[2] = (u64) chunk;
+	u64 data = (u64) (chunk + 2);
+	if (size <= REGION_CHUNK_SIZE) {
+		region[0] = data + size;
+		region[1] = data + data_size;
+	}
+	return data;
+}
+
+static void free_chunks(u64* chunk) {
+	while (chunk != NULL) {
+		u64* next = (u64*) chunk[0];
+		free(chunk);
+		chunk = next;
+	}
+}
+
+// keeps the newest chunk and starts over in it
+static void region_reset(u64* region) {
+	u64* chunk = (u64*) region[2];
+	if (chunk == NULL)
+		return;
+
+	free_chunks((u64*) chunk[0]);
+	chunk[0] = 0;
+	region[0] = (u64) (chunk + 2);
+	region[1] = region[0] + chunk[1];
+}
+
+static void region_free(u64* region) {
+	free_chunks((u64*) region[2]);
+	free(region);
+}
+
+static void division_error(VM_Func* func) {
+	fflush(stdout);
+	fprintf(stderr, "interpreter error in '%.*s': division by zero\n", func->decl->name.len, func->decl->name.str);
+	error();
+}
+
+// runs entry until it returns or the program calls exit, returns the exit status
+static u64 run(VM_Func* entry) {
+	static const void* handlers[NUM_VM_OPS] = {
+		[VM_LOADI] = &&op_loadi,
+		[VM_MOV] = &&op_mov,
+		[VM_ADD] = &&op_add,
+		[VM_SUB] = &&op_sub,
+		[VM_MUL] = &&op_mul,
+		[VM_DIVS] = &&op_divs,
+		[VM_DIVU] = &&op_divu,
+		[VM_MINS] = &&op_mins,
+		[VM_MINU] = &&op_minu,
+		[VM_MAXS] = &&op_maxs,
+		[VM_MAXU] = &&op_maxu,
+		[VM_ABS] = &&op_abs,
+		[VM_POPCNT] = &&op_popcnt,
+		[VM_LZCNT] = &&op_lzcnt,
+		[VM_TZCNT] = &&op_tzcnt,
+		[VM_BSWAP] = &&op_bswap,
+		[VM_ROTL] = &&op_rotl,
+		[VM_ROTR] = &&op_rotr,
+		[VM_RDTSC] = &&op_rdtsc,
+		[VM_ADDI] = &&op_addi,
+		[VM_SEXT8] = &&op_sext8,
+		[VM_SEXT16] = &&op_sext16,
+		[VM_SEXT32] = &&op_sext32,
+		[VM_ZEXT8] = &&op_zext8,
+		[VM_ZEXT16] = &&op_zext16,
+		[VM_ZEXT32] = &&op_zext32,
+		[VM_EQ] = &&op_eq,
+		[VM_NE] = &&op_ne,
+		[VM_LTS] = &&op_lts,
+		[VM_LES] = &&op_les,
+		[VM_GTS] = &&op_gts,
+		[VM_GES] = &&op_ges,
+		[VM_LTU] = &&op_ltu,
+		[VM_LEU] = &&op_leu,
+		[VM_GTU] = &&op_gtu,
+		[VM_GEU] = &&op_geu,
+		[VM_JMP] = &&op_jmp,
+		[VM_JZ] = &&op_jz,
+		[VM_JNZ] = &&op_jnz,
+		[VM_JEQ] = &&op_jeq,
+		[VM_JNE] = &&op_jne,
+		[VM_JLTS] = &&op_jlts,
+		[VM_JLES] = &&op_jles,
+		[VM_JGTS] = &&op_jgts,
+		[VM_JGES] = &&op_jges,
+		[VM_JLTU] = &&op_jltu,
+		[VM_JLEU] = &&op_jleu,
+		[VM_JGTU] = &&op_jgtu,
+		[VM_JGEU] = &&op_jgeu,
+		[VM_LOAD8S] = &&op_load8s,
+		[VM_LOAD8U] = &&op_load8u,
+		[VM_LOAD16S] = &&op_load16s,
+		[VM_LOAD16U] = &&op_load16u,
+		[VM_LOAD32S] = &&op_load32s,
+		[VM_LOAD32U] = &&op_load32u,
+		[VM_LOAD64] = &&op_load64,
+		[VM_STORE8] = &&op_store8,
+		[VM_STORE16] = &&op_store16,
+		[VM_STORE32] = &&op_store32,
+		[VM_STORE64] = &&op_store64,
+		[VM_LEA] = &&op_lea,
+		[VM_PTRDIFF] = &&op_ptrdiff,
+		[VM_FRAME] = &&op_frame,
+		[VM_CALL] = &&op_call,
+		[VM_PRINTF] = &&op_printf,
+		[VM_ALLOC] = &&op_alloc,
+		[VM_FREE] = &&op_free,
+		[VM_REGION] = &&op_region,
+		[VM_REGION_ALLOC] = &&op_region_alloc,
+		[VM_REGION_RESET] = &&op_region_reset,
+		[VM_REGION_FREE] = &&op_region_free,
+		[VM_GEN_NEW] = &&op_gen_new,
+		[VM_GEN_NEXT] = &&op_gen_next,
+		[VM_YIELD] = &&op_yield,
+		[VM_GEN_DONE] = &&op_gen_done,
+		[VM_EXIT] = &&op_exit,
+		[VM_RET] = &&op_ret,
+	};
+
+	// thread the code, jump targets stay indices
+	for (u32 i = 0; i < vm.num_funcs; i++) {
+		VM_Func* func = &vm.funcs[i];
+		for (u32 j = 0; j < func->num_code; j++) {
+			func->code[j].handler = handlers[func->code[j].op];
+		}
+	}
+
+	u64* reg_stack = malloc(VM_STACK_REGS * sizeof(u64));
+	u8* memory_stack = aligned_alloc(16, VM_STACK_MEMORY);
+	VM_Frame* frames = malloc(VM_MAX_DEPTH * sizeof(VM_Frame));
+
+	bool profiling = options.interpret_profile;
+	u64 last_time = now_ns();
+	u64 status = 0;
+
+	VM_Frame* frame = frames;
+	frame->func = entry;
+	frame->regs = reg_stack;
+	frame->memory = memory_stack;
+	frame->regs_end = reg_stack + entry->num_regs;
+	frame->memory_end = memory_stack + entry->frame_size;
+	frame->generator = NULL;
+	entry->calls++;
+	if (entry->num_regs > VM_STACK_REGS || entry->frame_size > VM_STACK_MEMORY)
+		goto overflow;
+
+	u64* r = frame->regs;
+	const VM_Instr* ip = entry->code;
+
+#define DISPATCH() \
+	do { \
+		if (profiling) { \
+			vm.op_counts[ip->op]++; \
+			frame->func->instructions++; \
+		} \
+		goto *ip->handler; \
+	} while (0)
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#define JUMP_IF(condition) do { ip = (condition) ? frame->func->code + ip->imm : ip + 1; DISPATCH(); } while (0)
+
+	DISPATCH();
+
+op_loadi: r[ip->a] = ip->imm; NEXT();
+op_mov: r[ip->a] = r[ip->b]; NEXT();
+op_add: r[ip->a] = r[ip->b] + r[ip->c]; NEXT();
+op_sub: r[ip->a] = r[ip->b] - r[ip->c]; NEXT();
+op_mul: r[ip->a] = r[ip->b] * r[ip->c]; NEXT();
+op_divs:
+	if (r[ip->c] == 0 || ((s64) r[ip->b] == INT64_MIN && (s64) r[ip->c] == -1))
+		division_error(frame->func);
+	r[ip->a] = (s64) r[ip->b] / (s64) r[ip->c];
+	NEXT();
+op_divu:
+	if (r[ip->c] == 0)
+		division_error(frame->func);
+	r[ip->a] = r[ip->b] / r[ip->c];
+	NEXT();
+op_mins: r[ip->a] = (s64) r[ip->c] < (s64) r[ip->b] ? r[ip->c] : r[ip->b]; NEXT();
+op_minu: r[ip->a] = r[ip->c] < r[ip->b] ? r[ip->c] : r[ip->b]; NEXT();
+op_maxs: r[ip->a] = (s64) r[ip->b] < (s64) r[ip->c] ? r[ip->c] : r[ip->b]; NEXT();
+op_maxu: r[ip->a] = r[ip->b] < r[ip->c] ? r[ip->c] : r[ip->b]; NEXT();
+op_abs: r[ip->a] = (s64) r[ip->b] < 0 ? -r[ip->b] : r[ip->b]; NEXT();
+op_popcnt: r[ip->a] = __builtin_popcountll(low_bits(r[ip->b], ip->imm)); NEXT();
+op_lzcnt: {
+	u64 value = low_bits(r[ip->b], ip->imm);
+	r[ip->a] = value == 0 ? ip->imm : (u64) __builtin_clzll(value) - (64 - ip->imm);
+	NEXT();
+}
+op_tzcnt: {
+	u64 value = low_bits(r[ip->b], ip->imm);
+	r[ip->a] = value == 0 ? ip->imm : (u64) __builtin_ctzll(value);
+	NEXT();
+}
+op_bswap: r[ip->a] = __builtin_bswap64(r[ip->b]) >> (64 - ip->imm); NEXT();
+op_rotl: r[ip->a] = rotate_left(r[ip->b], r[ip->c] % ip->imm, ip->imm); NEXT();
+op_rotr: r[ip->a] = rotate_left(r[ip->b], (ip->imm - r[ip->c] % ip->imm) % ip->imm, ip->imm); NEXT();
+op_rdtsc: r[ip->a] = read_cycles(); NEXT();
+op_addi: r[ip->a] = r[ip->b] + ip->imm; NEXT();
+op_sext8: r[ip->a] = (s64) (s8) r[ip->b]; NEXT();
+op_sext16: r[ip->a] = (s64) (s16) r[ip->b]; NEXT();
+op_sext32: r[ip->a] = (s64) (s32) r[ip->b]; NEXT();
+op_zext8: r[ip->a] = (u8) r[ip->b]; NEXT();
+op_zext16: r[ip->a] = (u16) r[ip->b]; NEXT();
+op_zext32: r[ip->a] = (u32) r[ip->b]; NEXT();
+op_eq: r[ip->a] = r[ip->b] == r[ip->c]; NEXT();
+op_ne: r[ip->a] = r[ip->b] != r[ip->c]; NEXT();
+op_lts: r[ip->a] = (s64) r[ip->b] < (s64) r[ip->c]; NEXT();
+op_les: r[ip->a] = (s64) r[ip->b] <= (s64) r[ip->c]; NEXT();
+op_gts: r[ip->a] = (s64) r[ip->b] > (s64) r[ip->c]; NEXT();
+op_ges: r[ip->a] = (s64) r[ip->b] >= (s64) r[ip->c]; NEXT();
+op_ltu: r[ip->a] = r[ip->b] < r[ip->c]; NEXT();
+op_leu: r[ip->a] = r[ip->b] <= r[ip->c]; NEXT();
+op_gtu: r[ip->a] = r[ip->b] > r[ip->c]; NEXT();
+op_geu: r[ip->a] = r[ip->b] >= r[ip->c]; NEXT();
+op_jmp: JUMP_IF(true);
+op_jz: JUMP_IF(r[ip->a] == 0);
+op_jnz: JUMP_IF(r[ip->a] != 0);
+op_jeq: JUMP_IF(r[ip->a] == r[ip->b]);
+op_jne: JUMP_IF(r[ip->a] != r[ip->b]);
+op_jlts: JUMP_IF((s64) r[ip->a] < (s64) r[ip->b]);
+op_jles: JUMP_IF((s64) r[ip->a] <= (s64) r[ip->b]);
+op_jgts: JUMP_IF((s64) r[ip->a] > (s64) r[ip->b]);
+op_jges: JUMP_IF((s64) r[ip->a] >= (s64) r[ip->b]);
+op_jltu: JUMP_IF(r[ip->a] < r[ip->b]);
+op_jleu: JUMP_IF(r[ip->a] <= r[ip->b]);
+op_jgtu: JUMP_IF(r[ip->a] > r[ip->b]);
+op_jgeu: JUMP_IF(r[ip->a] >= r[ip->b]);
+op_load8s: r[ip->a] = *(s8*) (r[ip->b] + ip->imm); NEXT();
+op_load8u: r[ip->a] = *(u8*) (r[ip->b] + ip->imm); NEXT();
+op_load16s: r[ip->a] = *(s16*) (r[ip->b] + ip->imm); NEXT();
+op_load16u: r[ip->a] = *(u16*) (r[ip->b] + ip->imm); NEXT();
+op_load32s: r[ip->a] = *(s32*) (r[ip->b] + ip->imm); NEXT();
+op_load32u: r[ip->a] = *(u32*) (r[ip->b] + ip->imm); NEXT();
+op_load64: r[ip->a] = *(u64*) (r[ip->b] + ip->imm); NEXT();
+op_store8: *(u8*) (r[ip->a] + ip->imm) = r[ip->b]; NEXT();
+op_store16: *(u16*) (r[ip->a] + ip->imm) = r[ip->b]; NEXT();
+op_store32: *(u32*) (r[ip->a] + ip->imm) = r[ip->b]; NEXT();
+op_store64: *(u64*) (r[ip->a] + ip->imm) = r[ip->b]; NEXT();
+op_lea: r[ip->a] = r[ip->b] + r[ip->c] * ip->imm; NEXT();
+op_ptrdiff: r[ip->a] = (s64) (r[ip->b] - r[ip->c]) >> ip->imm; NEXT();
+op_frame: r[ip->a] = (u64) (frame->memory + ip->imm); NEXT();
+
+op_call: {
+	VM_Func* callee = &vm.funcs[ip->imm];
+	VM_Frame* caller = frame;
+	if (frame + 1 == frames + VM_MAX_DEPTH)
+		goto overflow;
+
+	frame++;
+	frame->func = callee;
+	frame->regs = caller->regs_end;
+	frame->memory = caller->memory_end;
+	frame->regs_end = frame->regs + callee->num_regs;
+	frame->memory_end = frame->memory + callee->frame_size;
+	frame->generator = NULL;
+	frame->return_ip = ip + 1;
+	frame->result = ip->a;
+	if (frame->regs_end > reg_stack + VM_STACK_REGS || frame->memory_end > memory_stack + VM_STACK_MEMORY)
+		goto overflow;
+
+	for (u32 i = 0; i < ip->c; i++) {
+		frame->regs[i] = r[ip->b + i];
+	}
+
+	if (profiling) {
+		u64 time = now_ns();
+		caller->func->nanoseconds += time - last_time;
+		last_time = time;
+		callee->calls++;
+	}
+
+	r = frame->regs;
+	ip = callee->code;
+	DISPATCH();
+}
+
+op_gen_new: {
+	VM_Func* func = &vm.funcs[ip->imm];
+	u32 regs_size = (func->num_regs + 1) & ~1; // keeps the memory aligned
+	u64* block = malloc((GENERATOR_HEADER + regs_size) * sizeof(u64) + func->frame_size);
+	block[0] = 0;
+	block[1] = 0;
+	block[2] = (u64) func;
+	for (u32 i = 0; i < ip->c; i++) {
+		block[GENERATOR_HEADER + i] = r[ip->b + i];
+	}
+	r[ip->a] = (u64) block;
+	NEXT();
+}
+
+op_gen_next: {
+	// like a call, except the frame is in the block and it continues where it stopped
+	u64* block = (u64*) r[ip->b];
+	VM_Func* callee = (VM_Func*) block[2];
+	VM_Frame* caller = frame;
+	if (frame + 1 == frames + VM_MAX_DEPTH)
+		goto overflow;
+
+	frame++;
+	frame->func = callee;
+	frame->regs = block + GENERATOR_HEADER;
+	frame->memory = (u8*) (frame->regs + ((callee->num_regs + 1) & ~1));
+	frame->regs_end = caller->regs_end;
+	frame->memory_end = caller->memory_end;
+	frame->generator = block;
+	frame->return_ip = ip + 1;
+	frame->result = ip->a;
+
+	if (profiling) {
+		u64 time = now_ns();
+		caller->func->nanoseconds += time - last_time;
+		last_time = time;
+		callee->calls++;
+	}
+
+	r = frame->regs;
+	ip = callee->code + block[1];
+	DISPATCH();
+}
+
+// yield and gendone return the 1 or 0 in b like ret, after saving where to go on
+op_yield:
+	frame->generator[0] = r[ip->c];
+	frame->generator[1] = ip + 1 - frame->func->code;
+	goto op_ret;
+op_gen_done:
+	frame->generator[1] = ip - frame->func->code;
+	goto op_ret;
+
+op_ret: {
+	u64 value = r[ip->b];
+	if (profiling) {
+		u64 time = now_ns();
+		frame->func->nanoseconds += time - last_time;
+		last_time = time;
+	}
+
+	if (frame == frames) {
+		status = value;
+		goto done;
+	}
+
+	VM_Frame* callee = frame--;
+	r = frame->regs;
+	r[callee->result] = value;
+	ip = callee->return_ip;
+	DISPATCH();
+}
+
+op_printf: {
+	// printf only reads the values its format asks for, the others are 0
+	u64 v[VM_MAX_PRINTF_ARGS - 1] = {0};
+	for (u32 i = 1; i < ip->c; i++) {
+		v[i - 1] = r[ip->b + i];
+	}
+	r[ip->a] = (s64) printf((const char*) r[ip->b], v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10],
+		v[11], v[12], v[13], v[14]);
+	NEXT();
+}
+op_alloc: r[ip->a] = (u64) malloc(r[ip->b]); NEXT();
+op_free: free((void*) r[ip->b]); r[ip->a] = 0; NEXT();
+op_region: r[ip->a] = (u64) calloc(3, sizeof(u64)); NEXT();
+op_region_alloc: r[ip->a] = region_alloc((u64*) r[ip->b], r[ip->c]); NEXT();
+op_region_reset: region_reset((u64*) r[ip->b]); r[ip->a] = 0; NEXT();
+op_region_free: region_free((u64*) r[ip->b]); r[ip->a] = 0; NEXT();
+op_exit:
+	status = r[ip->b];
+	if (profiling) {
+		frame->func->nanoseconds += now_ns() - last_time;
+	}
+	goto done;
+
+overflow:
+	fflush(stdout);
+	fprintf(stderr, "interpreter error in '%.*s': stack overflow\n", frame->func->decl->name.len, frame->func->decl->name.str);
+	error();
+
+done:
+#undef DISPATCH
+#undef NEXT
+#undef JUMP_IF
+	free(reg_stack);
+	free(memory_stack);
+	free(frames);
+	return status;
+}
+
+static int compare_funcs(const void* a, const void* b) {
+	const VM_Func* left = *(VM_Func**) a;
+	const VM_Func* right = *(VM_Func**) b;
+	return left->instructions < right->instructions ? 1 : left->instructions > right->instructions ? -1 : 0;
+}
+
+static int compare_ops(const void* a, const void* b) {
+	u64 left = vm.op_counts[*(u32*) a];
+	u64 right = vm.op_counts[*(u32*) b];
+	return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static void print_profile(u64 total_ns) {
+	u64 total = 0;
+	for (u32 i = 0; i < NUM_VM_OPS; i++) {
+		total += vm.op_counts[i];
+	}
+
+	fprintf(stderr, "interpreter profile: %" PRIu64 " instructions in %.3f ms\n", total, total_ns / 1e6);
+
+	VM_Func** funcs = malloc(vm.num_funcs * sizeof(VM_Func*));
+	for (u32 i = 0; i < vm.num_funcs; i++) {
+		funcs[i] = &vm.funcs[i];
+	}
+	qsort(funcs, vm.num_funcs, sizeof(VM_Func*), compare_funcs);
+
+	fprintf(stderr, "%-24s %12s %16s %12s\n", "function", "calls", "instructions", "self ms");
+	for (u32 i = 0; i < vm.num_funcs; i++) {
+		VM_Func* func = funcs[i];
+		if (func->calls == 0)
+			continue;
+		fprintf(stderr, "%-24.*s %12" PRIu64 " %16" PRIu64 " %12.3f\n", func->decl->name.len, func->decl->name.str,
+			func->calls, func->instructions, func->nanoseconds / 1e6);
+	}
+	free(funcs);
+
+	u32 ops[NUM_VM_OPS];
+	for (u32 i = 0; i < NUM_VM_OPS; i++) {
+		ops[i] = i;
+	}
+	qsort(ops, NUM_VM_OPS, sizeof(u32), compare_ops);
+
+	fprintf(stderr, "%-24s %12s %8s\n", "opcode", "count", "%");
+	for (u32 i = 0; i < NUM_VM_OPS && vm.op_counts[ops[i]] > 0; i++) {
+		u64 count = vm.op_counts[ops[i]];
+		fprintf(stderr, "%-24s %12" PRIu64 " %8.2f\n", op_names[ops[i]], count, 100.0 * count / total);
+	}
+}
+
+// compiles the program and runs main, returns its exit status
+int interpret(AST_Node* root) {
+	AST_Program* program = (AST_Program*) root;
+	vm.printf_symbol = intern("printf", 6);
+	vm.exit_symbol = intern("exit", 4);
+	vm.free_symbol = intern("free", 4);
+
+	vm.funcs = calloc(program->num_defs, sizeof(VM_Func));
+	VM_Func* entry = NULL;
+	for (u32 i = 0; i < program->num_defs; i++) {
+		AST_Func_Decl* decl = (AST_Func_Decl*) program->defs[i];
+		if (decl->body == NULL)
+			continue;
+
+		VM_Func* func = &vm.funcs[vm.num_funcs++];
+		func->decl = decl;
+		if (decl->name.symbol == SYM_MAIN)
+			entry = func;
+	}
+
+	if (entry == NULL) {
+		printf("interpreter error: there's no main function to run\n");
+		error();
+	}
+
+	for (u32 i = 0; i < vm.num_funcs; i++) {
+		compile_func(&vm.funcs[i]);
+	}
+
+	u64 start = now_ns();
+	u64 status = run(entry);
+	fflush(stdout);
+
+	if (options.interpret_profile) {
+		print_profile(now_ns() - start);
+	}
+
+	for (u32 i = 0; i < vm.num_funcs; i++) {
+		free(vm.funcs[i].code);
+	}
+	for (u32 i = 0; i < vm.strings_capacity; i++) {
+		free(vm.strings[i]);
+	}
+	free(vm.funcs);
+	free(vm.vars);
+	free(vm.address_taken);
+	free(vm.strings);
+	return (int) status;
+}
@@ -0,0 +1,175 @@
+#include "all.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Watch mode, --watch.
+//
+// The source files are compiled once, then every file is compiled again whenever it's saved. Each build runs in a
+// forked child like a request to the compile server (see server.c), so a compile error only ends the child, and
+// the child sends the functions it emitted back through a pipe. Later builds take every function that's unchanged,
+// along with what it inlines, from that cache (see cache.c) and only emit the edited ones again.
+//
+// inotify watches the directories of the files rather than the files themselves, since editors often save by
+// writing a new file and renaming it over the old one.
+
+// how long to wait for more changes after one comes in, saving several files at once builds them together
+#define WATCH_SETTLE_MS 20
+
+typedef struct {
+	const char* source_path;
+	const char* output_path;
+	const char* name; // the file name within its directory
+	int watch; // inotify watch descriptor of the directory
+	bool changed;
+} Watched_File;
+
+static u64 now_ms() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (u64) time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+// compiles the file in a child and adds the functions it emitted to the cache, returns whether it succeeded
+static bool build_file(Watched_File* file) {
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		return false;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		cache_set_pipe(fds[1]);
+		compile_file(file->source_path, file->output_path);
+		exit(0);
+	}
+
+	close(fds[1]);
+
+	u32 capacity = 65536;
+	u32 length = 0;
+	char* data = malloc(capacity);
+	for (;;) {
+		if (capacity - length < 4096) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+
+		ssize_t result = read(fds[0], data + length, capacity - length);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+		length += result;
+
+		u32 used = cache_receive(data, length);
+		memmove(data, data + used, length - used);
+		length -= used;
+	}
+	close(fds[0]);
+	free(data);
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void build_changed(Watched_File* files, u32 num_files) {
+	for (u32 i = 0; i < num_files; i++) {
+		Watched_File* file = &files[i];
+		if (!file->changed)
+			continue;
+
+		file->changed = false;
+		u64 start = now_ms();
+		if (build_file(file)) {
+			printf("watch: built %s in %" PRIu64 " ms\n", file->output_path, now_ms() - start);
+		} else {
+			printf("watch: %s failed, waiting for changes\n", file->source_path);
+		}
+		fflush(stdout);
+	}
+}
+
+// marks the files the events are about, returns whether there were any
+static bool read_events(int inotify, Watched_File* files, u32 num_files) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length = read(inotify, buffer, sizeof(buffer));
+	if (length < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return false;
+		perror("inotify");
+		error();
+	}
+
+	bool any = false;
+	for (char* pos = buffer; pos < buffer + length;) {
+		struct inotify_event* event = (struct inotify_event*) pos;
+		for (u32 i = 0; i < num_files; i++) {
+			if (event->len > 0 && event->wd == files[i].watch && strcmp(event->name, files[i].name) == 0) {
+				files[i].changed = true;
+				any = true;
+			}
+		}
+		pos += sizeof(struct inotify_event) + event->len;
+	}
+	return any;
+}
+
+// builds the files, then again on every change until the process is killed
+int watch(const char** source_paths, const char** output_paths, u32 num_sources) {
+	int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify < 0) {
+		perror("inotify");
+		error();
+	}
+
+	Watched_File* files = calloc(num_sources, sizeof(Watched_File));
+	for (u32 i = 0; i < num_sources; i++) {
+		Watched_File* file = &files[i];
+		file->source_path = source_paths[i];
+		file->output_path = output_paths[i];
+		file->changed = true;
+
+		const char* slash = strrchr(file->source_path, '/');
+		char* dir = slash == NULL ? strdup(".") : strndup(file->source_path, slash - file->source_path + 1);
+		file->name = slash == NULL ? file->source_path : slash + 1;
+		file->watch = inotify_add_watch(inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (file->watch < 0) {
+			perror(dir);
+			error();
+		}
+		free(dir);
+	}
+
+	cache_init();
+	struct pollfd fd = { .fd = inotify, .events = POLLIN };
+	for (;;) {
+		build_changed(files, num_sources);
+
+		bool changed = false;
+		while (!changed) {
+			if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+				perror("poll");
+				error();
+			}
+			changed = read_events(inotify, files, num_sources);
+		}
+		while (poll(&fd, 1, WATCH_SETTLE_MS) > 0) {
+			read_events(inotify, files, num_sources);
+		}
+	}
+}